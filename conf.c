@@ -32,6 +32,7 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #if HAVE_SYS_CDEFS_H
 #include <sys/cdefs.h>
 #endif
@@ -47,9 +48,277 @@ static DB_conf_item_t *conf_items;
 static int changed = 0;
 static uintptr_t mutex;
 
+// Hash index over conf_items, for lookups by key.
+// Readers don't take the mutex: writers only publish fully initialized
+// nodes and values, and old ones are put on the retired list instead of
+// being freed. Retired data is tagged with the epoch in which it was
+// unpublished, and freed once every thread in conf_get_* has entered
+// in a later epoch. Each thread announces its epoch in its own reader slot,
+// so readers never write to a shared cache line.
+#define CONF_HASH_MIN_SIZE 256
+
+typedef struct conf_hnode_s {
+    uint32_t hash;
+    DB_conf_item_t *item;
+    struct conf_hnode_s *next;
+} conf_hnode_t;
+
+typedef struct conf_hash_s {
+    uint32_t size; // power of 2
+    uint32_t count;
+    struct conf_hash_s *retired_next;
+    uint64_t retired_epoch;
+    conf_hnode_t *buckets[];
+} conf_hash_t;
+
+typedef struct conf_retired_s {
+    void *ptr;
+    uint64_t epoch;
+    struct conf_retired_s *next;
+} conf_retired_t;
+
+#define CONF_CACHELINE_SIZE 64
+
+// slots are never freed, a slot of an exited thread is reused by a new one
+typedef struct conf_reader_s {
+    uint64_t epoch; // 0 when the thread is not reading
+    int depth; // only accessed by the owner thread
+    int owned;
+    struct conf_reader_s *next;
+} conf_reader_t;
+
+static conf_hash_t *conf_hash;
+static conf_retired_t *conf_retired;
+static conf_hash_t *conf_retired_hashes;
+static uint64_t conf_epoch = 1;
+static conf_reader_t *conf_readers;
+static __thread conf_reader_t *conf_reader;
+static pthread_key_t conf_reader_key;
+
+static uint32_t
+conf_hash_key (const char *key) {
+    // FNV-1a over lowercased ascii, keys are case insensitive
+    uint32_t h = 2166136261u;
+    for (const uint8_t *p = (const uint8_t *)key; *p; p++) {
+        uint8_t c = *p;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+static conf_hash_t *
+conf_hash_alloc (uint32_t size) {
+    conf_hash_t *h = calloc (1, sizeof (conf_hash_t) + size * sizeof (conf_hnode_t *));
+    h->size = size;
+    return h;
+}
+
+static void
+conf_hash_free (conf_hash_t *h) {
+    for (uint32_t i = 0; i < h->size; i++) {
+        conf_hnode_t *next;
+        for (conf_hnode_t *n = h->buckets[i]; n; n = next) {
+            next = n->next;
+            free (n);
+        }
+    }
+    free (h);
+}
+
+// must be called with the mutex held, ptr is freed when it's safe
+static void
+conf_retire (void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    conf_retired_t *r = malloc (sizeof (conf_retired_t));
+    r->ptr = ptr;
+    r->epoch = conf_epoch;
+    r->next = conf_retired;
+    conf_retired = r;
+}
+
+// free the retired data which no reader can see anymore;
+// must be called with the mutex held
+static void
+conf_reclaim (void) {
+    if (!conf_retired && !conf_retired_hashes) {
+        return;
+    }
+    // readers which enter after this point get the new epoch, and see only
+    // the published data
+    uint64_t epoch = __atomic_add_fetch (&conf_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    uint64_t oldest = epoch;
+    for (conf_reader_t *r = __atomic_load_n (&conf_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t e = __atomic_load_n (&r->epoch, __ATOMIC_SEQ_CST);
+        if (e && e < oldest) {
+            oldest = e;
+        }
+    }
+
+    conf_retired_t **pr = &conf_retired;
+    while (*pr) {
+        conf_retired_t *r = *pr;
+        if (r->epoch < oldest) {
+            *pr = r->next;
+            free (r->ptr);
+            free (r);
+        }
+        else {
+            pr = &r->next;
+        }
+    }
+    conf_hash_t **ph = &conf_retired_hashes;
+    while (*ph) {
+        conf_hash_t *h = *ph;
+        if (h->retired_epoch < oldest) {
+            *ph = h->retired_next;
+            conf_hash_free (h);
+        }
+        else {
+            ph = &h->retired_next;
+        }
+    }
+}
+
+static void
+conf_hash_insert (DB_conf_item_t *it) {
+    conf_hash_t *h = conf_hash;
+    if (h->count >= h->size) {
+        // rebuild into a new table, the old one may still be in use
+        conf_hash_t *nh = conf_hash_alloc (h->size * 2);
+        for (DB_conf_item_t *i = conf_items; i; i = i->next) {
+            if (i == it) {
+                continue;
+            }
+            conf_hnode_t *n = malloc (sizeof (conf_hnode_t));
+            n->hash = conf_hash_key (i->key);
+            n->item = i;
+            n->next = nh->buckets[n->hash & (nh->size-1)];
+            nh->buckets[n->hash & (nh->size-1)] = n;
+            nh->count++;
+        }
+        __atomic_store_n (&conf_hash, nh, __ATOMIC_RELEASE);
+        h->retired_next = conf_retired_hashes;
+        h->retired_epoch = conf_epoch;
+        conf_retired_hashes = h;
+        h = nh;
+    }
+    conf_hnode_t *n = malloc (sizeof (conf_hnode_t));
+    n->hash = conf_hash_key (it->key);
+    n->item = it;
+    n->next = h->buckets[n->hash & (h->size-1)];
+    __atomic_store_n (&h->buckets[n->hash & (h->size-1)], n, __ATOMIC_RELEASE);
+    h->count++;
+}
+
+static void
+conf_hash_remove (DB_conf_item_t *it) {
+    conf_hash_t *h = conf_hash;
+    uint32_t idx = conf_hash_key (it->key) & (h->size-1);
+    conf_hnode_t **pn = &h->buckets[idx];
+    for (conf_hnode_t *n = *pn; n; pn = &n->next, n = n->next) {
+        if (n->item == it) {
+            // readers which are on this node can still follow its next
+            __atomic_store_n (pn, n->next, __ATOMIC_RELEASE);
+            conf_retire (n);
+            h->count--;
+            return;
+        }
+    }
+}
+
+// must be called between conf_read_begin and conf_read_end, or with the mutex held
+static DB_conf_item_t *
+conf_hash_find (const char *key) {
+    conf_hash_t *h = __atomic_load_n (&conf_hash, __ATOMIC_ACQUIRE);
+    if (!h) {
+        return NULL;
+    }
+    uint32_t hash = conf_hash_key (key);
+    conf_hnode_t *n = __atomic_load_n (&h->buckets[hash & (h->size-1)], __ATOMIC_ACQUIRE);
+    for (; n; n = __atomic_load_n (&n->next, __ATOMIC_ACQUIRE)) {
+        if (n->hash == hash && !strcasecmp (key, n->item->key)) {
+            return n->item;
+        }
+    }
+    return NULL;
+}
+
+// called on thread exit, lets another thread take the slot
+static void
+conf_reader_release (void *ptr) {
+    conf_reader_t *r = ptr;
+    __atomic_store_n (&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static conf_reader_t *
+conf_reader_get (void) {
+    if (conf_reader) {
+        return conf_reader;
+    }
+    conf_reader_t *r;
+    for (r = __atomic_load_n (&conf_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int owned = 0;
+        if (!__atomic_load_n (&r->owned, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n (&r->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!r) {
+        // a cache line per slot, to avoid false sharing between readers
+        void *mem;
+        if (posix_memalign (&mem, CONF_CACHELINE_SIZE, CONF_CACHELINE_SIZE)) {
+            return NULL;
+        }
+        r = mem;
+        memset (r, 0, sizeof (conf_reader_t));
+        r->owned = 1;
+        r->next = __atomic_load_n (&conf_readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (&conf_readers, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific (conf_reader_key, r);
+    conf_reader = r;
+    return r;
+}
+
+static inline void
+conf_read_begin (void) {
+    conf_reader_t *r = conf_reader_get ();
+    if (!r) {
+        // no slot: hold the writers off instead
+        mutex_lock (mutex);
+        return;
+    }
+    if (r->depth++) {
+        return;
+    }
+    __atomic_store_n (&r->epoch, __atomic_load_n (&conf_epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+static inline void
+conf_read_end (void) {
+    conf_reader_t *r = conf_reader;
+    if (!r) {
+        mutex_unlock (mutex);
+        return;
+    }
+    if (--r->depth) {
+        return;
+    }
+    __atomic_store_n (&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
 void
 conf_init (void) {
     mutex = mutex_create ();
+    conf_hash = conf_hash_alloc (CONF_HASH_MIN_SIZE);
+    pthread_key_create (&conf_reader_key, conf_reader_release);
 }
 
 void
@@ -71,6 +340,9 @@ conf_free (void) {
         conf_item_free (it);
     }
     conf_items = NULL;
+    conf_reclaim ();
+    conf_hash_free (conf_hash);
+    conf_hash = NULL;
     changed = 0;
     mutex_free (mutex);
     mutex = 0;
@@ -158,6 +430,7 @@ conf_save (void) {
     if (err != 0) {
         fprintf (stderr, "config rename %s -> %s failed: %s\n", tempfile, str, strerror (errno));
     }
+    conf_reclaim ();
     conf_unlock ();
     return 0;
 }
@@ -177,20 +450,18 @@ conf_item_free (DB_conf_item_t *it) {
     conf_unlock ();
 }
 
+// the returned pointer is valid only while conf_lock is held
 const char *
 conf_get_str_fast (const char *key, const char *def) {
-    for (DB_conf_item_t *it = conf_items; it; it = it->next) {
-        if (!strcasecmp (key, it->key)) {
-            return it->value;
-        }
-    }
-    return def;
+    DB_conf_item_t *it = conf_hash_find (key);
+    return it ? it->value : def;
 }
 
 void
 conf_get_str (const char *key, const char *def, char *buffer, int buffer_size) {
-    conf_lock ();
-    const char *out = conf_get_str_fast (key, def);
+    conf_read_begin ();
+    DB_conf_item_t *it = conf_hash_find (key);
+    const char *out = it ? __atomic_load_n (&it->value, __ATOMIC_ACQUIRE) : def;
     if (out) {
         int n = strlen (out)+1;
         n = min (n, buffer_size);
@@ -200,31 +471,34 @@ conf_get_str (const char *key, const char *def, char *buffer, int buffer_size) {
     else {
         *buffer = 0;
     }
-    conf_unlock ();
+    conf_read_end ();
 }
 
 float
 conf_get_float (const char *key, float def) {
-    conf_lock ();
-    const char *v = conf_get_str_fast (key, NULL);
-    conf_unlock ();
-    return v ? atof (v) : def;
+    conf_read_begin ();
+    DB_conf_item_t *it = conf_hash_find (key);
+    float res = it ? atof (__atomic_load_n (&it->value, __ATOMIC_ACQUIRE)) : def;
+    conf_read_end ();
+    return res;
 }
 
 int
 conf_get_int (const char *key, int def) {
-    conf_lock ();
-    const char *v = conf_get_str_fast (key, NULL);
-    conf_unlock ();
-    return v ? atoi (v) : def;
+    conf_read_begin ();
+    DB_conf_item_t *it = conf_hash_find (key);
+    int res = it ? atoi (__atomic_load_n (&it->value, __ATOMIC_ACQUIRE)) : def;
+    conf_read_end ();
+    return res;
 }
 
 int64_t
 conf_get_int64 (const char *key, int64_t def) {
-    conf_lock ();
-    const char *v = conf_get_str_fast (key, NULL);
-    conf_unlock ();
-    return v ? atoll (v) : def;
+    conf_read_begin ();
+    DB_conf_item_t *it = conf_hash_find (key);
+    int64_t res = it ? atoll (__atomic_load_n (&it->value, __ATOMIC_ACQUIRE)) : def;
+    conf_read_end ();
+    return res;
 }
 
 DB_conf_item_t *
@@ -241,30 +515,33 @@ conf_find (const char *group, DB_conf_item_t *prev) {
 void
 conf_set_str (const char *key, const char *val) {
     conf_lock ();
-    DB_conf_item_t *prev = NULL;
-    for (DB_conf_item_t *it = conf_items; it; it = it->next) {
-        int cmp = strcasecmp (key, it->key);
-        if (!cmp) {
-            if (!strcmp (it->value, val)) {
-                conf_unlock ();
-                return;
-            }
-            free (it->value);
-            it->value = strdup (val);
+    DB_conf_item_t *it = conf_hash_find (key);
+    if (it) {
+        if (!val || !strcmp (it->value, val)) {
             conf_unlock ();
-            changed = 1;
             return;
         }
-        else if (cmp < 0) {
-            break;
-        }
-        prev = it;
+        char *old = it->value;
+        __atomic_store_n (&it->value, strdup (val), __ATOMIC_RELEASE);
+        conf_retire (old);
+        changed = 1;
+        conf_reclaim ();
+        conf_unlock ();
+        return;
     }
     if (!val) {
         conf_unlock ();
         return;
     }
-    DB_conf_item_t *it = malloc (sizeof (DB_conf_item_t));
+    // new items are kept sorted, for conf_find and conf_save
+    DB_conf_item_t *prev = NULL;
+    for (DB_conf_item_t *i = conf_items; i; i = i->next) {
+        if (strcasecmp (key, i->key) < 0) {
+            break;
+        }
+        prev = i;
+    }
+    it = malloc (sizeof (DB_conf_item_t));
     memset (it, 0, sizeof (DB_conf_item_t));
     it->key = strdup (key);
     it->value = strdup (val);
@@ -278,6 +555,8 @@ conf_set_str (const char *key, const char *val) {
         it->next = conf_items;
         conf_items = it;
     }
+    conf_hash_insert (it);
+    conf_reclaim ();
     conf_unlock ();
 }
 
@@ -326,7 +605,10 @@ conf_remove_items (const char *key) {
     DB_conf_item_t *next = NULL;
     while (it) {
         next = it->next;
-        conf_item_free (it);
+        conf_hash_remove (it);
+        conf_retire (it->key);
+        conf_retire (it->value);
+        conf_retire (it);
         it = next;
         if (!it || strncasecmp (key, it->key, l)) {
             break;
@@ -338,5 +620,6 @@ conf_remove_items (const char *key) {
     else {
         conf_items = next;
     }
+    conf_reclaim ();
     conf_unlock ();
 }
@@ -71,6 +71,7 @@ extern "C" {
 
 // api version history:
 // 9.9 -- devel
+// 1.8 -- deadbeef-0.6.3
 // 1.7 -- deadbeef-0.6.2
 // 1.6 -- deadbeef-0.6.1
 // 1.5 -- deadbeef-0.6
@@ -92,7 +93,7 @@ extern "C" {
 // 0.1 -- deadbeef-0.2.0
 
 #define DB_API_VERSION_MAJOR 1
-#define DB_API_VERSION_MINOR 7
+#define DB_API_VERSION_MINOR 8
 
 #define DDB_DEPRECATED(x)
 
@@ -449,6 +450,19 @@ typedef struct ddb_fileadd_data_s {
 } ddb_fileadd_data_t;
 #endif
 
+// since 1.8
+#if (DDB_API_LEVEL >= 8)
+// pull based access to the output samples, see vis_tap_open
+typedef struct ddb_vis_tap_s ddb_vis_tap_t;
+
+enum {
+    DDB_VIS_TAP_RAW, // interleaved output samples
+    DDB_VIS_TAP_MONO, // one frame of the channels average per N frames
+    DDB_VIS_TAP_PEAK, // peak of each channel over N frames
+    DDB_VIS_TAP_RMS, // rms of each channel over N frames
+};
+#endif
+
 // forward decl for plugin struct
 struct DB_plugin_s;
 
@@ -1032,6 +1046,41 @@ typedef struct {
 #if (DDB_API_LEVEL >= 6)
     void (*plt_set_scroll) (ddb_playlist_t *plt, int scroll);
     int (*plt_get_scroll) (ddb_playlist_t *plt);
+#endif
+    // since 1.8
+#if (DDB_API_LEVEL >= 8)
+    // compiled title formatting:
+    // tf_compile converts a pl_format_title format string into code, which
+    // can be evaluated for many tracks without parsing the string again.
+    // returns NULL if fmt is NULL. the code must be freed using tf_free
+    char *(*tf_compile) (const char *fmt);
+    void (*tf_free) (char *code);
+
+    // same as pl_format_title, or pl_format_title_escaped if escape is 1
+    int (*tf_eval) (const char *code, DB_playItem_t *it, int idx, char *s, int size, int id, int escape);
+
+    // formats up to count tracks of the iter list, starting with first,
+    // into out[i], each of size bytes, with a single playlist lock.
+    // returns the number of formatted tracks
+    int (*tf_eval_range) (const char *code, DB_playItem_t *first, int iter, int count, char **out, int size, int id);
+
+    // pull based alternative to vis_waveform_listen.
+    // the output samples are written once into a shared ring, and each tap
+    // reads them at its own rate; a tap which falls behind by more than the
+    // ring size (at least 8192 frames) skips the oldest ones.
+    // mode is one of DDB_VIS_TAP_*, decimate is the number of output frames
+    // per returned frame, ignored for DDB_VIS_TAP_RAW.
+    // returns NULL if mode is unknown
+    ddb_vis_tap_t *(*vis_tap_open) (int mode, int decimate);
+    void (*vis_tap_close) (ddb_vis_tap_t *tap);
+
+    // reads up to maxframes frames of the same format, never blocks.
+    // data must have room for maxframes * DDB_FREQ_MAX_CHANNELS samples,
+    // fmt receives the format of the returned frames, with the samplerate
+    // divided by decimate.
+    // returns the number of frames, 0 if there's nothing new.
+    // one tap must not be read from several threads at once
+    int (*vis_tap_read) (ddb_vis_tap_t *tap, float *data, int maxframes, ddb_waveformat_t *fmt);
 #endif
 } DB_functions_t;
 
@@ -1106,6 +1155,15 @@ typedef struct DB_plugin_action_s {
 } DB_plugin_action_t;
 
 // base plugin interface
+#if (DDB_API_LEVEL >= 8)
+// plugin flags, since 1.8
+enum {
+    // decoder's insert can be called from several threads at once,
+    // which allows to read tags in parallel when adding folders
+    DDB_PLUGIN_FLAG_PARALLEL_INSERT = 1,
+};
+#endif
+
 typedef struct DB_plugin_s {
     // type must be one of DB_PLUGIN_ types
     int32_t type;
@@ -1116,7 +1174,7 @@ typedef struct DB_plugin_s {
     int16_t version_major;
     int16_t version_minor;
 
-    uint32_t flags; // currently unused
+    uint32_t flags; // DDB_PLUGIN_FLAG_*
     uint32_t reserved1;
     uint32_t reserved2;
     uint32_t reserved3;
@@ -17,100 +17,267 @@
  * the use of this software.
  */
 
-// this version has few changes compared to the original audacious fft.c
-// please find the original file in audacious
+// originally based on audacious fft.c; now computes the spectrum of real
+// input with a half size complex fft, done in radix-4 stages with sse/neon
+// butterflies, and supports different sizes and windows
 
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
-#include "deadbeef.h"
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
-#include <complex.h>
+#include "fft.h"
 
-#define N (DDB_FREQ_BANDS * 2)
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define FFT_SIMD 1
+typedef __m128 v4sf;
+#define v4_load(p) _mm_load_ps(p)
+#define v4_store(p,v) _mm_store_ps(p,v)
+#define v4_add(a,b) _mm_add_ps(a,b)
+#define v4_sub(a,b) _mm_sub_ps(a,b)
+#define v4_mul(a,b) _mm_mul_ps(a,b)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FFT_SIMD 1
+typedef float32x4_t v4sf;
+#define v4_load(p) vld1q_f32(p)
+#define v4_store(p,v) vst1q_f32(p,v)
+#define v4_add(a,b) vaddq_f32(a,b)
+#define v4_sub(a,b) vsubq_f32(a,b)
+#define v4_mul(a,b) vmulq_f32(a,b)
+#endif
 
-static float hamming[N];              /* hamming window, scaled to sum to 1 */
-static int reversed[N];               /* bit-reversal table */
-static float complex roots[N / 2];    /* N-th roots of unity */
-static int generated = 0;
-static float LOGN; /* log N (base 2) */
+struct fft_s {
+    int size; // real input samples
+    int half; // complex fft points
+    float *window; // size
+    float *twiddles; // per stage of the complex fft
+    int *order; // natural order index of each fft output
+    float *split_cos, *split_sin; // half, for splitting the real spectrum
+    float *re, *im; // half, work buffers
+};
 
-/* Reverse the order of the lowest LOGN bits in an integer. */
+static void *
+fft_malloc (size_t size) {
+    void *mem;
+    if (posix_memalign (&mem, 16, size)) {
+        return NULL;
+    }
+    return mem;
+}
 
-static int bit_reverse (int x)
-{
-    int y = 0;
+// twiddles of the stage with quarter length q: w^1, w^2, w^3 for each of q
+// butterflies, where w = exp(-2*pi*i*j/(4*q)), stored as 6 arrays of q values
+static int
+fft_twiddles_size (int n) {
+    int size = 0;
+    for (int q = n/4; q >= 1; q /= 4) {
+        size += 6*q;
+    }
+    return size;
+}
 
-    for (int n = LOGN; n --; )
-    {
-        y = (y << 1) | (x & 1);
-        x >>= 1;
+// the decimation in frequency stages leave the output in mixed radix
+// digit-reversed order, this returns the frequency stored at position p
+static int
+fft_output_index (int p, int n) {
+    int f = 0, mul = 1;
+    while (n > 1) {
+        int r = n >= 4 ? 4 : 2;
+        int q = n / r;
+        f += (p / q) * mul;
+        p %= q;
+        mul *= r;
+        n = q;
     }
+    return f;
+}
 
-    return y;
+static float
+fft_window_value (int type, int n, int size) {
+    double x = 2 * M_PI * n / size;
+    switch (type) {
+    case FFT_WINDOW_HANN:
+        return 0.5 - 0.5 * cos (x);
+    case FFT_WINDOW_BLACKMAN_HARRIS:
+        return 0.35875 - 0.48829 * cos (x) + 0.14128 * cos (2*x) - 0.01168 * cos (3*x);
+    case FFT_WINDOW_RECT:
+        return 1;
+    default:
+        return 1 - 0.85 * cos (x);
+    }
 }
 
-#ifndef HAVE_LOG2
-static inline float log2(float x) {return (float)log(x)/M_LN2;}
-#endif
+fft_t *
+fft_alloc (int size, int window) {
+    if (size < 16 || (size & (size-1))) {
+        return NULL;
+    }
+    fft_t *fft = calloc (1, sizeof (fft_t));
+    fft->size = size;
+    fft->half = size / 2;
+    int n = fft->half;
+    fft->window = fft_malloc (sizeof (float) * size);
+    fft->twiddles = fft_malloc (sizeof (float) * fft_twiddles_size (n));
+    fft->order = malloc (sizeof (int) * n);
+    fft->split_cos = fft_malloc (sizeof (float) * n);
+    fft->split_sin = fft_malloc (sizeof (float) * n);
+    fft->re = fft_malloc (sizeof (float) * n);
+    fft->im = fft_malloc (sizeof (float) * n);
 
-/* Generate lookup tables. */
+    for (int i = 0; i < size; i++) {
+        fft->window[i] = fft_window_value (window, i, size);
+    }
+    float *tw = fft->twiddles;
+    for (int q = n/4; q >= 1; q /= 4) {
+        for (int r = 1; r <= 3; r++) {
+            for (int j = 0; j < q; j++) {
+                double a = -2 * M_PI * r * j / (4*q);
+                tw[(r-1)*2*q+j] = cos (a);
+                tw[(r-1)*2*q+q+j] = sin (a);
+            }
+        }
+        tw += 6*q;
+    }
+    for (int p = 0; p < n; p++) {
+        fft->order[fft_output_index (p, n)] = p;
+    }
+    for (int k = 0; k < n; k++) {
+        fft->split_cos[k] = cos (2 * M_PI * k / size);
+        fft->split_sin[k] = sin (2 * M_PI * k / size);
+    }
+    return fft;
+}
 
-static void generate_tables (void)
-{
-    if (generated)
-        return;
+void
+fft_free (fft_t *fft) {
+    free (fft->window);
+    free (fft->twiddles);
+    free (fft->order);
+    free (fft->split_cos);
+    free (fft->split_sin);
+    free (fft->re);
+    free (fft->im);
+    free (fft);
+}
 
-    LOGN = log2(N);
-    for (int n = 0; n < N; n ++)
-        hamming[n] = 1 - 0.85 * cosf (2 * M_PI * n / N);
-    for (int n = 0; n < N; n ++)
-        reversed[n] = bit_reverse (n);
-    for (int n = 0; n < N / 2; n ++)
-        roots[n] = cexpf (2 * M_PI * I * n / N);
+int
+fft_get_size (fft_t *fft) {
+    return fft->size;
+}
 
-    generated = 1;
+static inline void
+fft_dif4 (float *re, float *im, int j, int q, const float *tw) {
+    float ar = re[j], ai = im[j];
+    float br = re[j+q], bi = im[j+q];
+    float cr = re[j+2*q], ci = im[j+2*q];
+    float dr = re[j+3*q], di = im[j+3*q];
+    float t0r = ar+cr, t0i = ai+ci;
+    float t1r = ar-cr, t1i = ai-ci;
+    float t2r = br+dr, t2i = bi+di;
+    float t3r = br-dr, t3i = bi-di;
+    float y1r = t1r+t3i, y1i = t1i-t3r;
+    float y2r = t0r-t2r, y2i = t0i-t2i;
+    float y3r = t1r-t3i, y3i = t1i+t3r;
+    re[j] = t0r+t2r;
+    im[j] = t0i+t2i;
+    float w1r = tw[j], w1i = tw[q+j], w2r = tw[2*q+j], w2i = tw[3*q+j], w3r = tw[4*q+j], w3i = tw[5*q+j];
+    re[j+q] = y1r*w1r - y1i*w1i;
+    im[j+q] = y1r*w1i + y1i*w1r;
+    re[j+2*q] = y2r*w2r - y2i*w2i;
+    im[j+2*q] = y2r*w2i + y2i*w2r;
+    re[j+3*q] = y3r*w3r - y3i*w3i;
+    im[j+3*q] = y3r*w3i + y3i*w3r;
 }
 
-static void do_fft (float complex a[N])
-{
-    int half = 1;       /* (2^s)/2 */
-    int inv = N / 2;    /* N/(2^s) */
-
-    /* loop through steps */
-    while (inv)
-    {
-        /* loop through groups */
-        for (int g = 0; g < N; g += half << 1)
-        {
-            /* loop through butterflies */
-            for (int b = 0, r = 0; b < half; b ++, r += inv)
-            {
-                float complex even = a[g + b];
-                float complex odd = roots[r] * a[g + half + b];
-                a[g + b] = even + odd;
-                a[g + half + b] = even - odd;
+#ifdef FFT_SIMD
+// same as above, for 4 consecutive butterflies
+static inline void
+fft_dif4_simd (float *re, float *im, int j, int q, const float *tw) {
+    v4sf ar = v4_load (re+j), ai = v4_load (im+j);
+    v4sf br = v4_load (re+j+q), bi = v4_load (im+j+q);
+    v4sf cr = v4_load (re+j+2*q), ci = v4_load (im+j+2*q);
+    v4sf dr = v4_load (re+j+3*q), di = v4_load (im+j+3*q);
+    v4sf t0r = v4_add (ar, cr), t0i = v4_add (ai, ci);
+    v4sf t1r = v4_sub (ar, cr), t1i = v4_sub (ai, ci);
+    v4sf t2r = v4_add (br, dr), t2i = v4_add (bi, di);
+    v4sf t3r = v4_sub (br, dr), t3i = v4_sub (bi, di);
+    v4sf y1r = v4_add (t1r, t3i), y1i = v4_sub (t1i, t3r);
+    v4sf y2r = v4_sub (t0r, t2r), y2i = v4_sub (t0i, t2i);
+    v4sf y3r = v4_sub (t1r, t3i), y3i = v4_add (t1i, t3r);
+    v4_store (re+j, v4_add (t0r, t2r));
+    v4_store (im+j, v4_add (t0i, t2i));
+    v4sf w1r = v4_load (tw+j), w1i = v4_load (tw+q+j);
+    v4sf w2r = v4_load (tw+2*q+j), w2i = v4_load (tw+3*q+j);
+    v4sf w3r = v4_load (tw+4*q+j), w3i = v4_load (tw+5*q+j);
+    v4_store (re+j+q, v4_sub (v4_mul (y1r, w1r), v4_mul (y1i, w1i)));
+    v4_store (im+j+q, v4_add (v4_mul (y1r, w1i), v4_mul (y1i, w1r)));
+    v4_store (re+j+2*q, v4_sub (v4_mul (y2r, w2r), v4_mul (y2i, w2i)));
+    v4_store (im+j+2*q, v4_add (v4_mul (y2r, w2i), v4_mul (y2i, w2r)));
+    v4_store (re+j+3*q, v4_sub (v4_mul (y3r, w3r), v4_mul (y3i, w3i)));
+    v4_store (im+j+3*q, v4_add (v4_mul (y3r, w3i), v4_mul (y3i, w3r)));
+}
+#endif
+
+static void
+fft_complex (fft_t *fft) {
+    float *re = fft->re, *im = fft->im;
+    const float *tw = fft->twiddles;
+    int n = fft->half;
+    for (int q = n/4; q >= 1; q /= 4) {
+        for (int g = 0; g < n; g += 4*q) {
+            int j = 0;
+#ifdef FFT_SIMD
+            for (; j + 4 <= q; j += 4) {
+                fft_dif4_simd (re+g, im+g, j, q, tw);
+            }
+#endif
+            for (; j < q; j++) {
+                fft_dif4 (re+g, im+g, j, q, tw);
             }
         }
-
-        half <<= 1;
-        inv >>= 1;
+        tw += 6*q;
+    }
+    // odd number of bits, finish with radix-2
+    if ((n & 0x55555555) == 0) {
+        for (int g = 0; g < n; g += 2) {
+            float ar = re[g], ai = im[g];
+            re[g] = ar + re[g+1];
+            im[g] = ai + im[g+1];
+            re[g+1] = ar - re[g+1];
+            im[g+1] = ai - im[g+1];
+        }
     }
 }
 
 void
-calc_freq (float *data, float *freq) {
-    generate_tables ();
-
-    // fft code shamelessly stolen from audacious
-    // thanks, John
-    float complex a[N];
-    for (int n = 0; n < N; n ++) {
-        a[reversed[n]] = data[n] * hamming[n];
+fft_calc_freq (fft_t *fft, const float *data, float *freq) {
+    int n = fft->half;
+    const float *w = fft->window;
+
+    // even samples go to real part, odd ones to imaginary
+    for (int i = 0; i < n; i++) {
+        fft->re[i] = data[i*2] * w[i*2];
+        fft->im[i] = data[i*2+1] * w[i*2+1];
     }
-    do_fft(a);
+    fft_complex (fft);
 
-    for (int n = 0; n < N / 2 - 1; n ++)
-        freq[n] = 2 * cabsf (a[1 + n]) / N;
-    freq[N / 2 - 1] = cabsf(a[N / 2]) / N;
+    // separate spectra of even and odd samples, and combine them into
+    // the spectrum of the real input:
+    // X[k] = (Z[k] + conj(Z[n-k]))/2 - i*exp(-2*pi*i*k/size)*(Z[k] - conj(Z[n-k]))/2
+    const int *order = fft->order;
+    for (int k = 1; k < n; k++) {
+        int a = order[k], b = order[n-k];
+        float er = (fft->re[a] + fft->re[b]) * 0.5f;
+        float ei = (fft->im[a] - fft->im[b]) * 0.5f;
+        float or = (fft->im[a] + fft->im[b]) * 0.5f;
+        float oi = (fft->re[b] - fft->re[a]) * 0.5f;
+        float c = fft->split_cos[k], s = fft->split_sin[k];
+        float xr = er + or * c + oi * s;
+        float xi = ei + oi * c - or * s;
+        freq[k-1] = 2 * sqrtf (xr * xr + xi * xi) / fft->size;
+    }
+    freq[n-1] = fabsf (fft->re[order[0]] - fft->im[order[0]]) / fft->size;
 }
@@ -20,6 +20,29 @@
 #ifndef AUDACIOUS_FFT_H
 #define AUDACIOUS_FFT_H
 
-void calc_freq (const float data[512], float freq[256]);
+enum {
+    FFT_WINDOW_DEFAULT, // 1-0.85*cos, what the spectrum always used
+    FFT_WINDOW_HANN,
+    FFT_WINDOW_BLACKMAN_HARRIS,
+    FFT_WINDOW_RECT,
+};
+
+typedef struct fft_s fft_t;
+
+// size is the number of input samples, must be a power of 2, at least 16.
+// the tables are only built here, so the same fft should be reused for all
+// blocks; it's not thread safe
+fft_t *
+fft_alloc (int size, int window);
+
+void
+fft_free (fft_t *fft);
+
+int
+fft_get_size (fft_t *fft);
+
+// data: size samples of one channel; freq: size/2 magnitudes
+void
+fft_calc_freq (fft_t *fft, const float *data, float *freq);
 
 #endif
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "handler.h"
 #include "threading.h"
 
@@ -47,6 +48,7 @@ typedef struct handler_s {
     message_t *mqtail;
     uintptr_t mutex;
     uintptr_t cond;
+    volatile int wakeup;
     message_t pool[1];
 } handler_t;
 
@@ -119,6 +121,37 @@ handler_wait (handler_t *h) {
     mutex_unlock (h->mutex);
 }
 
+// handler_wakeup doesn't wait for the mutex, so its signal is lost if it
+// comes between the check and the wait below. the flag is re-checked at
+// least this often
+#define HANDLER_WAKEUP_POLL_MS 50
+
+void
+handler_wait_timeout (handler_t *h, int timeout_ms) {
+    mutex_lock (h->mutex);
+    while (!h->mqueue && !__atomic_load_n (&h->wakeup, __ATOMIC_SEQ_CST) && timeout_ms != 0) {
+        int ms = timeout_ms < 0 || timeout_ms > HANDLER_WAKEUP_POLL_MS ? HANDLER_WAKEUP_POLL_MS : timeout_ms;
+        if (cond_timedwait (h->cond, h->mutex, ms) == ETIMEDOUT && timeout_ms > 0) {
+            timeout_ms -= ms;
+        }
+    }
+    __atomic_store_n (&h->wakeup, 0, __ATOMIC_SEQ_CST);
+    mutex_unlock (h->mutex);
+}
+
+void
+handler_wakeup (handler_t *h) {
+    if (!h) {
+        return;
+    }
+    __atomic_store_n (&h->wakeup, 1, __ATOMIC_SEQ_CST);
+    // if the mutex is busy, the waiter sees the flag on its next check
+    if (!mutex_trylock (h->mutex)) {
+        cond_signal (h->cond);
+        mutex_unlock (h->mutex);
+    }
+}
+
 int
 handler_pop (handler_t *h, uint32_t *id, uintptr_t *ctx, uint32_t *p1, uint32_t *p2) {
     mutex_lock (h->mutex);
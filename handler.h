@@ -47,6 +47,17 @@ handler_pop (struct handler_s *h, uint32_t *id, uintptr_t *ctx, uint32_t *p1, ui
 void
 handler_wait (struct handler_s *h);
 
+// blocks until a message is pushed, handler_wakeup is called,
+// or timeout_ms milliseconds pass (timeout_ms < 0 means no timeout)
+void
+handler_wait_timeout (struct handler_s *h, int timeout_ms);
+
+// interrupts handler_wait_timeout without pushing a message.
+// never blocks: it only signals if the mutex is free, otherwise the waiter
+// picks the wakeup up within 50ms. safe to call from realtime threads
+void
+handler_wakeup (struct handler_s *h);
+
 int
 handler_hasmessages (struct handler_s *h);
 
@@ -830,11 +830,10 @@ convstr_id3v2 (int version, uint8_t encoding, const unsigned char* str, int sz)
 }
 
 static const char *
-convstr_id3v1 (const char* str, int sz, const char *charset) {
+convstr_id3v1 (const char* str, int sz, const char *charset, char *out, int outsize) {
     if (!charset) {
         return str;
     }
-    static char out[2048];
     int i;
     for (i = 0; i < sz; i++) {
         if (str[i] != ' ') {
@@ -846,7 +845,7 @@ convstr_id3v1 (const char* str, int sz, const char *charset) {
         return out;
     }
 
-    int len = junk_iconv (str, sz, out, sizeof (out), charset, UTF8_STR);
+    int len = junk_iconv (str, sz, out, outsize, charset, UTF8_STR);
     if (len >= 0) {
         return out;
     }
@@ -893,6 +892,7 @@ junk_id3v1_read_int (playItem_t *it, char *buffer, const char **charset) {
     uint8_t genreid;
     uint8_t tracknum;
     const char *genre = NULL;
+    char out[2048];
     memset (title, 0, 31);
     memset (artist, 0, 31);
     memset (album, 0, 31);
@@ -945,22 +945,22 @@ junk_id3v1_read_int (playItem_t *it, char *buffer, const char **charset) {
     }
 
     if (*title) {
-        pl_add_meta (it, "title", convstr_id3v1 (title, strlen (title), *charset));
+        pl_add_meta (it, "title", convstr_id3v1 (title, strlen (title), *charset, out, sizeof (out)));
     }
     if (*artist) {
-        pl_add_meta (it, "artist", convstr_id3v1 (artist, strlen (artist), *charset));
+        pl_add_meta (it, "artist", convstr_id3v1 (artist, strlen (artist), *charset, out, sizeof (out)));
     }
     if (*album) {
-        pl_add_meta (it, "album", convstr_id3v1 (album, strlen (album), *charset));
+        pl_add_meta (it, "album", convstr_id3v1 (album, strlen (album), *charset, out, sizeof (out)));
     }
     if (*year) {
         pl_add_meta (it, "year", year);
     }
     if (*comment) {
-        pl_add_meta (it, "comment", convstr_id3v1 (comment, strlen (comment), *charset));
+        pl_add_meta (it, "comment", convstr_id3v1 (comment, strlen (comment), *charset, out, sizeof (out)));
     }
     if (genre && *genre) {
-        pl_add_meta (it, "genre", convstr_id3v1 (genre, strlen (genre), *charset));
+        pl_add_meta (it, "genre", convstr_id3v1 (genre, strlen (genre), *charset, out, sizeof (out)));
     }
     if (tracknum != 0) {
         char s[4];
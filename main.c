@@ -65,6 +65,7 @@
 #include "plugins.h"
 #include "common.h"
 #include "junklib.h"
+#include "premix.h"
 
 #ifndef PREFIX
 #error PREFIX must be defined
@@ -612,6 +613,8 @@ player_mainloop (void) {
                     conf_save ();
                     streamer_configchanged ();
                     junk_configchanged ();
+                    plug_rebuild_decoder_exts ();
+                    pl_configchanged ();
                     break;
                 case DB_EV_SEEK:
                     streamer_set_seek (p1 / 1000.f);
@@ -945,6 +948,7 @@ main (int argc, char *argv[]) {
     pl_init ();
     conf_init ();
     conf_load (); // required by some plugins at startup
+    pl_configchanged ();
 
     if (use_gui_plugin[0]) {
         conf_set_str ("gui_plugin", use_gui_plugin);
@@ -954,6 +958,8 @@ main (int argc, char *argv[]) {
 
     volume_set_db (conf_get_float ("playback.volume", 0)); // volume need to be initialized before plugins start
 
+    pcm_init ();
+
     messagepump_init (); // required to push messages while handling commandline
     if (plug_load_all ()) { // required to add files to playlist from commandline
         exit (-1);
@@ -984,7 +990,9 @@ main (int argc, char *argv[]) {
     atexit (atexit_handler); // helps to save in simple cases
 #endif
 
-    streamer_init ();
+    if (streamer_init ()) {
+        exit (-1);
+    }
 
     plug_connect_all ();
     messagepump_push (DB_EV_PLUGINSLOADED, 0, 0, 0);
@@ -28,109 +28,305 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include "threading.h"
+#include "metacache.h"
 
+// Strings are interned in one of METACACHE_STRIPES independent tables,
+// picked by the top bits of the hash, each with its own lock, so that
+// threads adding metadata at the same time rarely wait for each other.
+// Tables use open addressing with linear probing, and grow when 3/4 full.
+// Strings up to METACACHE_MAX_CLASS_SIZE are stored in per-stripe arena
+// blocks, with freelists per size class; longer ones are malloc'ed.
+
+#define METACACHE_STRIPES 16 // power of 2
+#define METACACHE_STRIPE_BITS 4
+#define METACACHE_MIN_SLOTS 256
+#define METACACHE_BLOCK_SIZE 0x10000
+#define METACACHE_MIN_CLASS_SIZE 16
+#define METACACHE_NUM_CLASSES 8
+#define METACACHE_MAX_CLASS_SIZE (METACACHE_MIN_CLASS_SIZE << (METACACHE_NUM_CLASSES-1))
+
+// metacache_ref finds the entry by offset from the string
 typedef struct metacache_str_s {
-    struct metacache_str_s *next;
+    uint32_t hash;
     uint32_t refcount;
-    char cmpidx; // positive means "equals", negative means "notequals"
     char str[1];
 } metacache_str_t;
 
+typedef struct metacache_block_s {
+    struct metacache_block_s *next;
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+} metacache_block_t;
+
+typedef struct metacache_free_s {
+    struct metacache_free_s *next;
+} metacache_free_t;
+
 typedef struct {
-//    uint32_t hash;
-    metacache_str_t *chain;
-} metacache_hash_t;
+    uintptr_t mutex;
+    metacache_str_t **slots;
+    uint32_t size; // power of 2
+    uint32_t count;
+    metacache_block_t *blocks;
+    metacache_free_t *freelist[METACACHE_NUM_CLASSES];
+    uint64_t hits;
+    uint64_t misses;
+    size_t bytes;
+    size_t allocated;
+} metacache_stripe_t;
 
-#define HASH_SIZE 4096
+static metacache_stripe_t stripes[METACACHE_STRIPES];
+
+static uint32_t
+metacache_get_hash (const char *str) {
+    // FNV-1a, with murmur3 finalizer to spread the bits for the stripe index
+    uint32_t h = 2166136261u;
+    for (const uint8_t *p = (const uint8_t *)str; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline metacache_stripe_t *
+metacache_get_stripe (uint32_t hash) {
+    return &stripes[hash >> (32 - METACACHE_STRIPE_BITS)];
+}
+
+static inline metacache_str_t *
+metacache_get_entry (const char *str) {
+    return (metacache_str_t *)(str - offsetof (metacache_str_t, str));
+}
+
+// returns size class for the entry, or -1 if it's too big for the arena
+static int
+metacache_get_class (size_t size) {
+    int c = 0;
+    size_t csize = METACACHE_MIN_CLASS_SIZE;
+    while (csize < size) {
+        if (++c == METACACHE_NUM_CLASSES) {
+            return -1;
+        }
+        csize <<= 1;
+    }
+    return c;
+}
 
-static metacache_hash_t hash[HASH_SIZE];
+static metacache_str_t *
+metacache_alloc_entry (metacache_stripe_t *s, size_t size) {
+    int c = metacache_get_class (size);
+    if (c < 0) {
+        s->allocated += size;
+        return malloc (size);
+    }
+    if (s->freelist[c]) {
+        metacache_free_t *f = s->freelist[c];
+        s->freelist[c] = f->next;
+        return (metacache_str_t *)f;
+    }
+    size_t csize = METACACHE_MIN_CLASS_SIZE << c;
+    if (!s->blocks || s->blocks->used + csize > METACACHE_BLOCK_SIZE) {
+        metacache_block_t *b = malloc (sizeof (metacache_block_t) + METACACHE_BLOCK_SIZE);
+        b->used = 0;
+        b->next = s->blocks;
+        s->blocks = b;
+        s->allocated += METACACHE_BLOCK_SIZE;
+    }
+    metacache_str_t *e = (metacache_str_t *)(s->blocks->data + s->blocks->used);
+    s->blocks->used += csize;
+    return e;
+}
 
-uint32_t
-metacache_get_hash_sdbm (const char *str) {
-    uint32_t hash = 0;
-    int c;
+static void
+metacache_free_entry (metacache_stripe_t *s, metacache_str_t *e, size_t size) {
+    int c = metacache_get_class (size);
+    if (c < 0) {
+        s->allocated -= size;
+        free (e);
+        return;
+    }
+    metacache_free_t *f = (metacache_free_t *)e;
+    f->next = s->freelist[c];
+    s->freelist[c] = f;
+}
 
-    while (c = *str++)
-        hash = c + (hash << 6) + (hash << 16) - hash;
+static void
+metacache_grow (metacache_stripe_t *s) {
+    uint32_t size = s->size ? s->size * 2 : METACACHE_MIN_SLOTS;
+    metacache_str_t **slots = calloc (size, sizeof (metacache_str_t *));
+    for (uint32_t i = 0; i < s->size; i++) {
+        metacache_str_t *e = s->slots[i];
+        if (e) {
+            uint32_t idx = e->hash & (size-1);
+            while (slots[idx]) {
+                idx = (idx + 1) & (size-1);
+            }
+            slots[idx] = e;
+        }
+    }
+    free (s->slots);
+    s->slots = slots;
+    s->size = size;
+}
 
-    return hash;
+// returns slot index of the string, or of the empty slot where it belongs
+static uint32_t
+metacache_find_slot (metacache_stripe_t *s, uint32_t h, const char *str) {
+    uint32_t mask = s->size - 1;
+    uint32_t idx = h & mask;
+    for (metacache_str_t *e; (e = s->slots[idx]); idx = (idx + 1) & mask) {
+        if (e->hash == h && !strcmp (e->str, str)) {
+            break;
+        }
+    }
+    return idx;
 }
 
-metacache_str_t *
-metacache_find_in_bucket (uint32_t h, const char *str) {
-    metacache_hash_t *bucket = &hash[h];
-    metacache_str_t *chain = bucket->chain;
-    while (chain) {
-        if (!strcmp (chain->str, str)) {
-            return chain;
+static void
+metacache_remove_slot (metacache_stripe_t *s, uint32_t idx) {
+    // backward shift deletion, keeps probe sequences intact without tombstones
+    uint32_t mask = s->size - 1;
+    s->slots[idx] = NULL;
+    s->count--;
+    for (uint32_t j = (idx + 1) & mask; s->slots[j]; j = (j + 1) & mask) {
+        uint32_t home = s->slots[j]->hash & mask;
+        // move the entry unless its home slot is cyclically in (idx, j]
+        if (((j - home) & mask) >= ((j - idx) & mask)) {
+            s->slots[idx] = s->slots[j];
+            s->slots[j] = NULL;
+            idx = j;
         }
-        chain = chain->next;
     }
-    return NULL;
 }
 
-static int n_strings = 0;
-static int n_inserts = 0;
-static int n_buckets = 0;
+static void
+metacache_release (metacache_stripe_t *s, metacache_str_t *e) {
+    if (--e->refcount) {
+        return;
+    }
+    size_t len = strlen (e->str);
+    uint32_t idx = metacache_find_slot (s, e->hash, e->str);
+    if (s->slots[idx] == e) {
+        metacache_remove_slot (s, idx);
+    }
+    s->bytes -= len + 1;
+    metacache_free_entry (s, e, offsetof (metacache_str_t, str) + len + 1);
+}
+
+void
+metacache_init (void) {
+    for (int i = 0; i < METACACHE_STRIPES; i++) {
+        stripes[i].mutex = mutex_create ();
+        metacache_grow (&stripes[i]);
+    }
+}
+
+void
+metacache_free (void) {
+    for (int i = 0; i < METACACHE_STRIPES; i++) {
+        metacache_stripe_t *s = &stripes[i];
+        mutex_lock (s->mutex);
+        for (uint32_t j = 0; j < s->size; j++) {
+            metacache_str_t *e = s->slots[j];
+            if (e && metacache_get_class (offsetof (metacache_str_t, str) + strlen (e->str) + 1) < 0) {
+                free (e);
+            }
+        }
+        free (s->slots);
+        metacache_block_t *next;
+        for (metacache_block_t *b = s->blocks; b; b = next) {
+            next = b->next;
+            free (b);
+        }
+        mutex_unlock (s->mutex);
+        mutex_free (s->mutex);
+        memset (s, 0, sizeof (metacache_stripe_t));
+    }
+}
 
 const char *
 metacache_add_string (const char *str) {
-//    printf ("n_strings=%d, n_inserts=%d, n_buckets=%d\n", n_strings, n_inserts, n_buckets);
-    uint32_t h = metacache_get_hash_sdbm (str);
-    metacache_str_t *data = metacache_find_in_bucket (h % HASH_SIZE, str);
-    n_inserts++;
-    if (data) {
-        data->refcount++;
-        return data->str;
-    }
-    metacache_hash_t *bucket = &hash[h % HASH_SIZE];
-    if (!bucket->chain) {
-        n_buckets++;
+    uint32_t h = metacache_get_hash (str);
+    metacache_stripe_t *s = metacache_get_stripe (h);
+    mutex_lock (s->mutex);
+    uint32_t idx = metacache_find_slot (s, h, str);
+    metacache_str_t *e = s->slots[idx];
+    if (e) {
+        e->refcount++;
+        s->hits++;
+        mutex_unlock (s->mutex);
+        return e->str;
+    }
+    s->misses++;
+    if ((s->count + 1) * 4 > s->size * 3) {
+        metacache_grow (s);
+        idx = metacache_find_slot (s, h, str);
     }
     size_t len = strlen (str);
-    data = malloc (sizeof (metacache_str_t) + len);
-    memset (data, 0, sizeof (metacache_str_t) + len);
-    data->refcount = 1;
-    memcpy (data->str, str, len+1);
-    data->next = bucket->chain;
-    bucket->chain = data;
-    n_strings++;
-    return data->str;
+    e = metacache_alloc_entry (s, offsetof (metacache_str_t, str) + len + 1);
+    e->hash = h;
+    e->refcount = 1;
+    memcpy (e->str, str, len+1);
+    s->slots[idx] = e;
+    s->count++;
+    s->bytes += len + 1;
+    mutex_unlock (s->mutex);
+    return e->str;
 }
 
 void
 metacache_remove_string (const char *str) {
-    uint32_t h = metacache_get_hash_sdbm (str);
-    metacache_hash_t *bucket = &hash[h % HASH_SIZE];
-    metacache_str_t *chain = bucket->chain;
-    metacache_str_t *prev = NULL;
-    while (chain) {
-        if (!strcmp (chain->str, str)) {
-            chain->refcount--;
-            if (chain->refcount == 0) {
-                if (prev) {
-                    prev->next = chain->next;
-                }
-                else {
-                    bucket->chain = chain->next;
-                }
-                free (chain);
-            }
-            break;
-        }
-        prev = chain;
-        chain = chain->next;
+    uint32_t h = metacache_get_hash (str);
+    metacache_stripe_t *s = metacache_get_stripe (h);
+    mutex_lock (s->mutex);
+    metacache_str_t *e = s->slots[metacache_find_slot (s, h, str)];
+    if (e) {
+        metacache_release (s, e);
     }
+    mutex_unlock (s->mutex);
 }
 
 void
 metacache_ref (const char *str) {
-    uint32_t *refc = (uint32_t *)(str-5);
-    *refc++;
+    if (!str) {
+        return;
+    }
+    metacache_str_t *e = metacache_get_entry (str);
+    metacache_stripe_t *s = metacache_get_stripe (e->hash);
+    mutex_lock (s->mutex);
+    e->refcount++;
+    mutex_unlock (s->mutex);
 }
 
 void
 metacache_unref (const char *str) {
-    uint32_t *refc = (uint32_t *)(str-5);
-    *refc--;
+    if (!str) {
+        return;
+    }
+    metacache_str_t *e = metacache_get_entry (str);
+    metacache_stripe_t *s = metacache_get_stripe (e->hash);
+    mutex_lock (s->mutex);
+    metacache_release (s, e);
+    mutex_unlock (s->mutex);
+}
+
+void
+metacache_get_stats (metacache_stats_t *stats) {
+    memset (stats, 0, sizeof (metacache_stats_t));
+    for (int i = 0; i < METACACHE_STRIPES; i++) {
+        metacache_stripe_t *s = &stripes[i];
+        mutex_lock (s->mutex);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->strings += s->count;
+        stats->bytes += s->bytes;
+        stats->allocated += s->allocated + s->size * sizeof (metacache_str_t *);
+        mutex_unlock (s->mutex);
+    }
 }
@@ -27,6 +27,23 @@
 #ifndef __METACACHE_H
 #define __METACACHE_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint64_t hits; // metacache_add_string calls which found the string
+    uint64_t misses; // calls which had to add a new string
+    size_t strings; // number of strings currently stored
+    size_t bytes; // size of the strings, including terminators
+    size_t allocated; // memory reserved for strings and hash tables
+} metacache_stats_t;
+
+void
+metacache_init (void);
+
+void
+metacache_free (void);
+
 const char *
 metacache_add_string (const char *str);
 
@@ -39,4 +56,7 @@ metacache_ref (const char *str);
 void
 metacache_unref (const char *str);
 
+void
+metacache_get_stats (metacache_stats_t *stats);
+
 #endif
@@ -27,10 +27,14 @@
 #ifdef HAVE_CONFIG_H
 #  include "config.h"
 #endif
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE 1 // dladdr
+#endif
 #ifdef HAVE_ALLOCA_H
 #  include <alloca.h>
 #endif
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <dirent.h>
 #include <fnmatch.h>
@@ -42,6 +46,9 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dlfcn.h>
 #ifndef __linux__
 #define _POSIX_C_SOURCE 1
 #endif
@@ -82,18 +89,22 @@
 //    removed legacy data used for compat with 0.4.4
 //    note: ddb-0.5.0 should keep using 1.2 playlist format
 //    1.3 support is designed for transition to ddb-0.6.0
+// 1.3->1.4 changelog:
+//    new layout which can be mapped into memory: fixed size item records,
+//    metadata as pairs of offsets into a deduplicated string table,
+//    see dbpl_header_t
+//    item metadata is copied from the file on first access
 #define PLAYLIST_MAJOR_VER 1
-#define PLAYLIST_MINOR_VER 2
+#define PLAYLIST_MINOR_VER 4
 
-#if (PLAYLIST_MINOR_VER<2)
-#error writing playlists in format <1.2 is not supported
+#if (PLAYLIST_MINOR_VER<4)
+#error writing playlists in format <1.4 is not supported
 #endif
 
 //#define trace(...) { fprintf(stderr, __VA_ARGS__); }
 #define trace(fmt,...)
 
 #define SKIP_BLANK_CUE_TRACKS 0
-#define MAX_CUE_TRACKS 99
 
 #define min(x,y) ((x)<(y)?(x):(y))
 
@@ -106,6 +117,28 @@ static playlist_t *playlists_head = NULL;
 static playlist_t *playlist = NULL; // current playlist
 static int plt_loading = 0; // disable sending event about playlist switch, config regen, etc
 
+// background rewrite of playlist files with long journals, see dbpl_compact_schedule
+static intptr_t dbpl_compact_tid;
+static int dbpl_compact_running;
+
+static void
+plt_search_index_free (playlist_t *plt);
+
+static void
+plt_shuffle_free (playlist_t *plt);
+
+static void
+plt_shuffle_insert (playlist_t *plt, playItem_t *it);
+
+static void
+plt_shuffle_remove (playlist_t *plt, playItem_t *it);
+
+// parsed cue sheets, see pl_cue_get_sheet
+static uintptr_t cue_cache_mutex;
+
+static void
+pl_cue_cache_free (void);
+
 #if !DISABLE_LOCKING
 static uintptr_t mutex;
 #endif
@@ -113,6 +146,281 @@ static uintptr_t mutex;
 #define LOCK {pl_lock();}
 #define UNLOCK {pl_unlock();}
 
+#if DEBUG_LOCKING
+volatile int pl_lock_cnt = 0;
+#endif
+#if DETECT_PL_LOCK_RC
+static pthread_t tids[1000];
+static int ntids = 0;
+pthread_t pl_lock_tid = 0;
+#endif
+
+// The playlist lock is a recursive reader/writer lock, with writers
+// preferred. pl_lock takes it for writing, pl_lock_read for reading.
+// A thread holding it for writing may take it for reading, which only nests
+// the write lock. A thread holding it only for reading must not take it for
+// writing: two such upgrades would wait for each other forever, so read
+// sections must not call anything that modifies playlists or items.
+#if !DISABLE_LOCKING
+static uintptr_t lock_cond;
+static int lock_writer; // a thread holds the write lock
+static int lock_readers; // number of threads holding the read lock
+static int lock_writers_waiting;
+static __thread int lock_write_depth;
+static __thread int lock_read_depth;
+#endif
+
+// Lock statistics, per call site of the outermost pl_lock/pl_lock_read,
+// enabled by the "playlist.lock_stats" config option and printed to stderr
+// when it gets disabled, or on exit, together with the metacache stats.
+#define LOCK_STATS_SIZE 1024
+
+typedef struct {
+    void *site;
+    uint32_t write;
+    uint64_t count;
+    uint64_t wait_us;
+    uint64_t max_wait_us;
+    uint64_t hold_us;
+    uint64_t max_hold_us;
+} pl_lock_site_t;
+
+static int lock_stats_enabled;
+static pl_lock_site_t lock_stats[LOCK_STATS_SIZE];
+static __thread pl_lock_site_t *lock_site;
+static __thread uint64_t lock_acquired_us;
+
+static uint64_t
+lock_stats_now (void) {
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+lock_stats_max (uint64_t *max, uint64_t value) {
+    uint64_t prev = __atomic_load_n (max, __ATOMIC_RELAXED);
+    while (value > prev && !__atomic_compare_exchange_n (max, &prev, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static pl_lock_site_t *
+lock_stats_site (void *site, int write) {
+    uintptr_t h = ((uintptr_t)site >> 2) * 2654435761u + write;
+    for (int n = 0; n < LOCK_STATS_SIZE; n++) {
+        pl_lock_site_t *s = &lock_stats[(h + n) & (LOCK_STATS_SIZE-1)];
+        void *cur = __atomic_load_n (&s->site, __ATOMIC_ACQUIRE);
+        if (!cur) {
+            if (__atomic_compare_exchange_n (&s->site, &cur, site, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                s->write = write;
+                return s;
+            }
+        }
+        if (cur == site && s->write == write) {
+            return s;
+        }
+    }
+    return NULL; // full
+}
+
+static void
+lock_stats_acquired (void *site, int write, uint64_t start) {
+    lock_site = lock_stats_site (site, write);
+    if (!lock_site) {
+        return;
+    }
+    lock_acquired_us = lock_stats_now ();
+    uint64_t wait = lock_acquired_us - start;
+    __atomic_add_fetch (&lock_site->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&lock_site->wait_us, wait, __ATOMIC_RELAXED);
+    lock_stats_max (&lock_site->max_wait_us, wait);
+}
+
+static void
+lock_stats_released (void) {
+    if (!lock_site) {
+        return;
+    }
+    uint64_t hold = lock_stats_now () - lock_acquired_us;
+    __atomic_add_fetch (&lock_site->hold_us, hold, __ATOMIC_RELAXED);
+    lock_stats_max (&lock_site->max_hold_us, hold);
+    lock_site = NULL;
+}
+
+static int
+lock_stats_cmp (const void *a, const void *b) {
+    const pl_lock_site_t *x = a;
+    const pl_lock_site_t *y = b;
+    uint64_t wx = x->wait_us + x->hold_us;
+    uint64_t wy = y->wait_us + y->hold_us;
+    return wx < wy ? 1 : wx > wy ? -1 : 0;
+}
+
+static void
+lock_stats_dump (void) {
+    int n = 0;
+    pl_lock_site_t *sites = malloc (sizeof (lock_stats));
+    for (int i = 0; i < LOCK_STATS_SIZE; i++) {
+        if (lock_stats[i].site) {
+            sites[n++] = lock_stats[i];
+        }
+    }
+    qsort (sites, n, sizeof (pl_lock_site_t), lock_stats_cmp);
+    fprintf (stderr, "playlist lock statistics (times in microseconds):\n");
+    fprintf (stderr, "%-48s %5s %10s %12s %10s %12s %10s\n", "call site", "mode", "count", "wait", "max wait", "hold", "max hold");
+    for (int i = 0; i < n; i++) {
+        pl_lock_site_t *s = &sites[i];
+        char name[100];
+        Dl_info info;
+        if (dladdr (s->site, &info) && info.dli_fname) {
+            const char *lib = strrchr (info.dli_fname, '/');
+            lib = lib ? lib+1 : info.dli_fname;
+            if (info.dli_sname) {
+                snprintf (name, sizeof (name), "%s+0x%lx (%s)", info.dli_sname, (unsigned long)((char *)s->site - (char *)info.dli_saddr), lib);
+            }
+            else {
+                // static function, can be resolved with addr2line
+                snprintf (name, sizeof (name), "%s+0x%lx", lib, (unsigned long)((char *)s->site - (char *)info.dli_fbase));
+            }
+        }
+        else {
+            snprintf (name, sizeof (name), "%p", s->site);
+        }
+        fprintf (stderr, "%-48s %5s %10llu %12llu %10llu %12llu %10llu\n", name, s->write ? "write" : "read", (unsigned long long)s->count, (unsigned long long)s->wait_us, (unsigned long long)s->max_wait_us, (unsigned long long)s->hold_us, (unsigned long long)s->max_hold_us);
+    }
+    free (sites);
+    memset (lock_stats, 0, sizeof (lock_stats));
+
+    metacache_stats_t mc;
+    metacache_get_stats (&mc);
+    fprintf (stderr, "metacache: %llu strings, %llu bytes, %llu bytes allocated, %llu hits, %llu misses\n", (unsigned long long)mc.strings, (unsigned long long)mc.bytes, (unsigned long long)mc.allocated, (unsigned long long)mc.hits, (unsigned long long)mc.misses);
+}
+
+void
+pl_configchanged (void) {
+    int enable = conf_get_int ("playlist.lock_stats", 0);
+    if (enable == lock_stats_enabled) {
+        return;
+    }
+    LOCK;
+    lock_stats_enabled = enable;
+    if (!enable) {
+        lock_stats_dump ();
+        lock_site = NULL;
+    }
+    UNLOCK;
+}
+
+static void
+pl_lock_write_int (void *site) {
+#if !DISABLE_LOCKING
+#if DETECT_PL_LOCK_RC
+    tids[ntids++] = pthread_self ();
+    pl_lock_tid = tids[ntids-1];
+#endif
+#if DEBUG_LOCKING
+    pl_lock_cnt++;
+    printf ("pcnt: %d\n", pl_lock_cnt);
+#endif
+    if (lock_write_depth++) {
+        return;
+    }
+    assert (lock_read_depth == 0);
+    uint64_t start = lock_stats_enabled ? lock_stats_now () : 0;
+    mutex_lock (mutex);
+    lock_writers_waiting++;
+    while (lock_writer || lock_readers) {
+        cond_timedwait (lock_cond, mutex, -1);
+    }
+    lock_writers_waiting--;
+    lock_writer = 1;
+    mutex_unlock (mutex);
+    if (start) {
+        lock_stats_acquired (site, 1, start);
+    }
+#endif
+}
+
+static void
+pl_unlock_write_int (void) {
+#if !DISABLE_LOCKING
+#if DETECT_PL_LOCK_RC
+    if (ntids > 0) {
+        ntids--;
+    }
+    if (ntids > 0) {
+        pl_lock_tid = tids[ntids-1];
+    }
+    else {
+        pl_lock_tid = 0;
+    }
+#endif
+#if DEBUG_LOCKING
+    pl_lock_cnt--;
+    printf ("pcnt: %d\n", pl_lock_cnt);
+#endif
+    if (--lock_write_depth) {
+        return;
+    }
+    lock_stats_released ();
+    mutex_lock (mutex);
+    lock_writer = 0;
+    cond_broadcast (lock_cond);
+    mutex_unlock (mutex);
+#endif
+}
+
+void
+pl_lock (void) {
+    pl_lock_write_int (__builtin_return_address (0));
+}
+
+void
+pl_unlock (void) {
+    pl_unlock_write_int ();
+}
+
+void
+pl_lock_read (void) {
+#if !DISABLE_LOCKING
+    if (lock_write_depth) {
+        pl_lock_write_int (NULL);
+        return;
+    }
+    if (lock_read_depth++) {
+        return;
+    }
+    uint64_t start = lock_stats_enabled ? lock_stats_now () : 0;
+    mutex_lock (mutex);
+    while (lock_writer || lock_writers_waiting) {
+        cond_timedwait (lock_cond, mutex, -1);
+    }
+    lock_readers++;
+    mutex_unlock (mutex);
+    if (start) {
+        lock_stats_acquired (__builtin_return_address (0), 0, start);
+    }
+#endif
+}
+
+void
+pl_unlock_read (void) {
+#if !DISABLE_LOCKING
+    if (lock_write_depth) {
+        pl_unlock_write_int ();
+        return;
+    }
+    if (--lock_read_depth) {
+        return;
+    }
+    lock_stats_released ();
+    mutex_lock (mutex);
+    if (!--lock_readers) {
+        cond_broadcast (lock_cond);
+    }
+    mutex_unlock (mutex);
+#endif
+}
+
 // used at startup to prevent crashes
 static playlist_t dummy_playlist = {
     .refc = 1
@@ -166,14 +474,22 @@ int
 pl_init (void) {
     playlist = &dummy_playlist;
 #if !DISABLE_LOCKING
-    mutex = mutex_create ();
+    mutex = mutex_create_nonrecursive ();
+    lock_cond = cond_create ();
 #endif
+    plmeta_init ();
+    cue_cache_mutex = mutex_create_nonrecursive ();
+    metacache_init ();
     return 0;
 }
 
 void
 pl_free (void) {
     trace ("pl_free\n");
+    if (dbpl_compact_tid) {
+        thread_join (dbpl_compact_tid);
+        dbpl_compact_tid = 0;
+    }
     LOCK;
     pl_playqueue_clear ();
     plt_loading = 1;
@@ -191,59 +507,28 @@ pl_free (void) {
     }
     plt_loading = 0;
     UNLOCK;
+    if (lock_stats_enabled) {
+        lock_stats_dump ();
+        lock_stats_enabled = 0;
+    }
 #if !DISABLE_LOCKING
     if (mutex) {
         mutex_free (mutex);
         mutex = 0;
     }
+    if (lock_cond) {
+        cond_free (lock_cond);
+        lock_cond = 0;
+    }
 #endif
     playlist = NULL;
-}
-
-#if DEBUG_LOCKING
-volatile int pl_lock_cnt = 0;
-#endif
-#if DETECT_PL_LOCK_RC
-static pthread_t tids[1000];
-static int ntids = 0;
-pthread_t pl_lock_tid = 0;
-#endif
-void
-pl_lock (void) {
-#if !DISABLE_LOCKING
-    mutex_lock (mutex);
-#if DETECT_PL_LOCK_RC
-    pl_lock_tid = pthread_self ();
-    tids[ntids++] = pl_lock_tid;
-#endif
-
-#if DEBUG_LOCKING
-    pl_lock_cnt++;
-    printf ("pcnt: %d\n", pl_lock_cnt);
-#endif
-#endif
-}
-
-void
-pl_unlock (void) {
-#if !DISABLE_LOCKING
-#if DETECT_PL_LOCK_RC
-    if (ntids > 0) {
-        ntids--;
-    }
-    if (ntids > 0) {
-        pl_lock_tid = tids[ntids-1];
+    pl_cue_cache_free ();
+    if (cue_cache_mutex) {
+        mutex_free (cue_cache_mutex);
+        cue_cache_mutex = 0;
     }
-    else {
-        pl_lock_tid = 0;
-    }
-#endif
-    mutex_unlock (mutex);
-#if DEBUG_LOCKING
-    pl_lock_cnt--;
-    printf ("pcnt: %d\n", pl_lock_cnt);
-#endif
-#endif
+    plmeta_free ();
+    metacache_free ();
 }
 
 static void
@@ -644,11 +929,57 @@ plt_get_modification_idx (playlist_t *plt) {
     return idx;
 }
 
+static void
+plt_index_reserve (playlist_t *plt, int iter, int size) {
+    if (size > plt->index_size[iter]) {
+        int newsize = plt->index_size[iter] ? plt->index_size[iter] : 256;
+        while (newsize < size) {
+            newsize *= 2;
+        }
+        plt->index[iter] = realloc (plt->index[iter], newsize * sizeof (playItem_t *));
+        plt->index_size[iter] = newsize;
+    }
+}
+
+// make sure plt->index[iter] matches the linked list
+static void
+plt_index_update (playlist_t *plt, int iter) {
+    if (plt->index_valid[iter]) {
+        return;
+    }
+    plt_index_reserve (plt, iter, plt->count[iter]);
+    int idx = 0;
+    for (playItem_t *it = plt->head[iter]; it; it = it->next[iter], idx++) {
+        if (idx >= plt->index_size[iter]) {
+            plt_index_reserve (plt, iter, idx+1);
+        }
+        plt->index[iter][idx] = it;
+        it->_idx[iter] = idx;
+    }
+    plt->index_count[iter] = idx;
+    plt->index_valid[iter] = 1;
+}
+
+static void
+plt_index_free (playlist_t *plt) {
+    for (int iter = 0; iter < PL_MAX_ITERATORS; iter++) {
+        free (plt->index[iter]);
+        plt->index[iter] = NULL;
+        plt->index_count[iter] = plt->index_size[iter] = plt->index_valid[iter] = 0;
+    }
+}
+
 void
 plt_free (playlist_t *plt) {
     LOCK;
     plt_clear (plt);
+    plt_index_free (plt);
+    plt_search_index_free (plt);
+    plt_shuffle_free (plt);
     free (plt->title);
+    if (plt->saved_map) {
+        pl_meta_map_unref (plt->saved_map);
+    }
 
     while (plt->meta) {
         DB_metaInfo_t *m = plt->meta;
@@ -830,78 +1161,6 @@ pl_str_skipspaces (const uint8_t *p, const uint8_t *end) {
     }
     return p;
 }
-static const uint8_t *
-pl_cue_skipspaces (const uint8_t *p) {
-    while (*p && *p <= ' ') {
-        p++;
-    }
-    return p;
-}
-
-static void
-pl_get_qvalue_from_cue (const uint8_t *p, int sz, char *out, const char *charset) {
-    char *str = out;
-    if (*p == 0) {
-        *out = 0;
-        return;
-    }
-    p = pl_cue_skipspaces (p);
-    if (*p == 0) {
-        *out = 0;
-        return;
-    }
-
-    if (*p == '"') {
-        p++;
-        p = pl_cue_skipspaces (p);
-        while (*p && *p != '"' && sz > 1) {
-            sz--;
-            *out++ = *p++;
-        }
-        *out = 0;
-    }
-    else {
-        while (*p && *p >= 0x20) {
-            sz--;
-            *out++ = *p++;
-        }
-        out--;
-        while (out > str && *out == 0x20) {
-            out--;
-        }
-        out++;
-        *out = 0;
-    }
-
-    if (!charset) {
-        return;
-    }
-
-    // recode
-    int l = strlen (str);
-    char recbuf[l*10];
-    int res = junk_recode (str, l, recbuf, sizeof (recbuf)-1, charset);
-    if (res > 0) {
-        strcpy (str, recbuf);
-    }
-    else
-    {
-        strcpy (str, "<UNRECOGNIZED CHARSET>");
-    }
-}
-
-static void
-pl_get_value_from_cue (const char *p, int sz, char *out) {
-    while (*p >= ' ' && sz > 1) {
-        sz--;
-        *out++ = *p++;
-    }
-    while (out > p && (*(out-1) == 0x20 || *(out-1) == 0x8)) {
-        out--;
-    }
-    *out = 0;
-}
-
 static float
 pl_cue_parse_time (const char *p) {
     char *endptr;
@@ -922,28 +1181,353 @@ pl_cue_parse_time (const char *p) {
     return mins * 60.f + sec + frm / 75.f;
 }
 
-static playItem_t *
-plt_process_cue_track (playlist_t *playlist, const char *fname, const int startsample, playItem_t **prev, char *track, char *index00, char *index01, char *pregap, char *title, char *albumperformer, char *performer, char *albumtitle, char *genre, char *date, char *replaygain_album_gain, char *replaygain_album_peak, char *replaygain_track_gain, char *replaygain_track_peak, const char *decoder_id, const char *ftype, int samplerate) {
-    if (!track[0]) {
-        trace ("pl_process_cue_track: invalid track (file=%s, title=%s)\n", fname, title);
-        return NULL;
+// a parsed cue sheet: the fields of each track are snapshots of the parser
+// state when the track ended, stored as offsets into strings, where 0 is ""
+enum {
+    CUE_TRACK,
+    CUE_TITLE,
+    CUE_PERFORMER,
+    CUE_ALBUMPERFORMER,
+    CUE_ALBUMTITLE,
+    CUE_GENRE,
+    CUE_DATE,
+    CUE_PREGAP,
+    CUE_INDEX00,
+    CUE_INDEX01,
+    CUE_ALBUM_GAIN,
+    CUE_ALBUM_PEAK,
+    CUE_TRACK_GAIN,
+    CUE_TRACK_PEAK,
+    CUE_NUM_FIELDS
+};
+
+typedef struct {
+    uint32_t fields[CUE_NUM_FIELDS];
+} pl_cue_track_t;
+
+typedef struct pl_cue_sheet_s {
+    int refc;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_alloc;
+    pl_cue_track_t *tracks;
+    int ntracks;
+    int ends_at_eof; // the last track was closed by the end of the sheet
+    // cache key, see pl_cue_get_sheet
+    struct pl_cue_sheet_s *next;
+    char *path;
+    time_t mtime;
+    off_t filesize;
+    int buffersize;
+} pl_cue_sheet_t;
+
+#define CUE_FIELD(sheet,t,f) ((sheet)->strings + (t)->fields[f])
+#define CUE_MAX_VALUE 255
+#define CUE_CACHE_SIZE 16
+
+// most recently used first
+static pl_cue_sheet_t *cue_cache;
+
+static uint32_t
+pl_cue_add_string (pl_cue_sheet_t *sheet, const char *str, int len) {
+    if (!len) {
+        return 0;
     }
-    if (!index00[0] && !index01[0]) {
-        trace ("pl_process_cue_track: invalid index (file=%s, title=%s, track=%s)\n", fname, title, track);
-        return NULL;
+    if (sheet->strings_size + len + 1 > sheet->strings_alloc) {
+        while (sheet->strings_size + len + 1 > sheet->strings_alloc) {
+            sheet->strings_alloc *= 2;
+        }
+        sheet->strings = realloc (sheet->strings, sheet->strings_alloc);
     }
-#if SKIP_BLANK_CUE_TRACKS
-    if (!title[0]) {
-        trace ("pl_process_cue_track: invalid title (file=%s, title=%s, track=%s)\n", fname, title, track);
-        return NULL;
+    uint32_t offs = sheet->strings_size;
+    memcpy (sheet->strings + offs, str, len);
+    sheet->strings[offs + len] = 0;
+    sheet->strings_size += len + 1;
+    return offs;
+}
+
+// unquoted value up to the end of line
+static uint32_t
+pl_cue_get_value (pl_cue_sheet_t *sheet, const uint8_t *p, const uint8_t *eol) {
+    const uint8_t *end = p;
+    while (end < eol && *end >= ' ' && end - p < CUE_MAX_VALUE) {
+        end++;
     }
-#endif
-    // fix track number
-    char *p = track;
-    while (*p && isdigit (*p)) {
-        p++;
+    while (end > p && (end[-1] == 0x20 || end[-1] == 0x8)) {
+        end--;
+    }
+    return pl_cue_add_string (sheet, (const char *)p, (int)(end - p));
+}
+
+// possibly quoted value, recoded to utf8
+static uint32_t
+pl_cue_get_qvalue (pl_cue_sheet_t *sheet, const uint8_t *p, const uint8_t *eol, const char *charset) {
+    p = pl_str_skipspaces (p, eol);
+    const uint8_t *end;
+    if (p < eol && *p == '"') {
+        p = pl_str_skipspaces (p + 1, eol);
+        end = p;
+        while (end < eol && *end != '"' && end - p < CUE_MAX_VALUE) {
+            end++;
+        }
+    }
+    else {
+        end = p;
+        while (end < eol && *end >= 0x20 && end - p < CUE_MAX_VALUE) {
+            end++;
+        }
+        while (end > p && end[-1] == 0x20) {
+            end--;
+        }
+    }
+    int l = (int)(end - p);
+    if (!charset || !l) {
+        return pl_cue_add_string (sheet, (const char *)p, l);
+    }
+
+    char recbuf[l*10];
+    int res = junk_recode ((const char *)p, l, recbuf, sizeof (recbuf)-1, charset);
+    if (res > 0) {
+        return pl_cue_add_string (sheet, recbuf, (int)strlen (recbuf));
+    }
+    return pl_cue_add_string (sheet, "<UNRECOGNIZED CHARSET>", 22);
+}
+
+static void
+pl_cue_add_track (pl_cue_sheet_t *sheet, const uint32_t *fields, int *alloc) {
+    if (sheet->ntracks == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 32;
+        sheet->tracks = realloc (sheet->tracks, *alloc * sizeof (pl_cue_track_t));
+    }
+    pl_cue_track_t *t = &sheet->tracks[sheet->ntracks++];
+    memcpy (t->fields, fields, sizeof (t->fields));
+}
+
+// parses the whole sheet in one pass; returns a sheet without tracks if it's
+// for multiple files
+static pl_cue_sheet_t *
+pl_cue_parse (const uint8_t *buffer, int buffersize) {
+    pl_cue_sheet_t *sheet = calloc (1, sizeof (pl_cue_sheet_t));
+    sheet->refc = 1;
+    sheet->strings_alloc = 4096;
+    sheet->strings = malloc (sheet->strings_alloc);
+    sheet->strings[0] = 0;
+    sheet->strings_size = 1;
+    int tracks_alloc = 0;
+
+    if (buffersize >= 3 && buffer[0] == 0xef && buffer[1] == 0xbb && buffer[2] == 0xbf) {
+        buffer += 3;
+        buffersize -= 3;
+    }
+    const char *charset = junk_detect_charset_len ((const char *)buffer, buffersize);
+
+    uint32_t cur[CUE_NUM_FIELDS] = {0};
+    int nfiles = 0;
+    const uint8_t *end = buffer + buffersize;
+    const uint8_t *line = buffer;
+    while (line < end) {
+        // find end of line; tabs are whitespace, other control chars break lines
+        const uint8_t *eol = line;
+        while (eol < end && (*eol >= 0x20 || *eol == '\t')) {
+            eol++;
+        }
+        const uint8_t *next = eol;
+        while (next < end && *next < 0x20 && *next != '\t') {
+            next++;
+        }
+        const uint8_t *l = line;
+        int indented = *l <= ' ';
+        line = next;
+        if (eol - l > 2048) { // huge string, ignore
+            continue;
+        }
+        const uint8_t *p = pl_str_skipspaces (l, eol);
+        size_t n = eol - p;
+#define CUE_KEYWORD(kw) (n >= sizeof (kw)-1 && !memcmp (p, kw, sizeof (kw)-1))
+        if (CUE_KEYWORD ("FILE ")) {
+            if (++nfiles > 1) {
+                sheet->ntracks = 0;
+                sheet->ends_at_eof = 0;
+                return sheet;
+            }
+        }
+        else if (CUE_KEYWORD ("PERFORMER ")) {
+            cur[cur[CUE_TRACK] ? CUE_PERFORMER : CUE_ALBUMPERFORMER] = pl_cue_get_qvalue (sheet, p + 10, eol, charset);
+        }
+        else if (CUE_KEYWORD ("TITLE ")) {
+            if (!indented && !cur[CUE_ALBUMTITLE]) {
+                cur[CUE_ALBUMTITLE] = pl_cue_get_qvalue (sheet, p + 6, eol, charset);
+            }
+            else {
+                cur[CUE_TITLE] = pl_cue_get_qvalue (sheet, p + 6, eol, charset);
+            }
+        }
+        else if (CUE_KEYWORD ("REM GENRE ")) {
+            cur[CUE_GENRE] = pl_cue_get_qvalue (sheet, p + 10, eol, charset);
+        }
+        else if (CUE_KEYWORD ("REM DATE ")) {
+            cur[CUE_DATE] = pl_cue_get_value (sheet, p + 9, eol);
+        }
+        else if (CUE_KEYWORD ("TRACK ")) {
+            if (cur[CUE_TITLE]) {
+                pl_cue_add_track (sheet, cur, &tracks_alloc);
+            }
+            cur[CUE_TRACK] = 0;
+            cur[CUE_TITLE] = 0;
+            cur[CUE_PREGAP] = 0;
+            cur[CUE_INDEX00] = 0;
+            cur[CUE_INDEX01] = 0;
+            cur[CUE_TRACK_GAIN] = 0;
+            cur[CUE_TRACK_PEAK] = 0;
+            cur[CUE_PERFORMER] = 0;
+            cur[CUE_TRACK] = pl_cue_get_value (sheet, p + 6, eol);
+        }
+        else if (CUE_KEYWORD ("REM REPLAYGAIN_ALBUM_GAIN ")) {
+            cur[CUE_ALBUM_GAIN] = pl_cue_get_value (sheet, p + 26, eol);
+        }
+        else if (CUE_KEYWORD ("REM REPLAYGAIN_ALBUM_PEAK ")) {
+            cur[CUE_ALBUM_PEAK] = pl_cue_get_value (sheet, p + 26, eol);
+        }
+        else if (CUE_KEYWORD ("REM REPLAYGAIN_TRACK_GAIN ")) {
+            cur[CUE_TRACK_GAIN] = pl_cue_get_value (sheet, p + 26, eol);
+        }
+        else if (CUE_KEYWORD ("REM REPLAYGAIN_TRACK_PEAK ")) {
+            cur[CUE_TRACK_PEAK] = pl_cue_get_value (sheet, p + 26, eol);
+        }
+        else if (CUE_KEYWORD ("PREGAP ")) {
+            cur[CUE_PREGAP] = pl_cue_get_value (sheet, p + 7, eol);
+        }
+        else if (CUE_KEYWORD ("INDEX 00 ")) {
+            cur[CUE_INDEX00] = pl_cue_get_value (sheet, p + 9, eol);
+        }
+        else if (CUE_KEYWORD ("INDEX 01 ")) {
+            cur[CUE_INDEX01] = pl_cue_get_value (sheet, p + 9, eol);
+        }
+#undef CUE_KEYWORD
+    }
+    if (cur[CUE_TITLE]) {
+        pl_cue_add_track (sheet, cur, &tracks_alloc);
+        sheet->ends_at_eof = 1;
+    }
+    return sheet;
+}
+
+static void
+pl_cue_sheet_free (pl_cue_sheet_t *sheet) {
+    free (sheet->strings);
+    free (sheet->tracks);
+    free (sheet->path);
+    free (sheet);
+}
+
+static void
+pl_cue_sheet_unref (pl_cue_sheet_t *sheet) {
+    mutex_lock (cue_cache_mutex);
+    int refc = --sheet->refc;
+    mutex_unlock (cue_cache_mutex);
+    if (!refc) {
+        pl_cue_sheet_free (sheet);
+    }
+}
+
+// returns the parsed sheet from buffer, which is the contents of a cue file,
+// or an embedded cuesheet of an audio file; the sheet is cached while the
+// file at path keeps its mtime and size
+static pl_cue_sheet_t *
+pl_cue_get_sheet (const uint8_t *buffer, int buffersize, const char *path) {
+    struct stat st;
+    int cacheable = path && path[0] == '/' && !stat (path, &st);
+    if (cacheable) {
+        mutex_lock (cue_cache_mutex);
+        pl_cue_sheet_t *prev = NULL;
+        for (pl_cue_sheet_t *s = cue_cache; s; prev = s, s = s->next) {
+            if (s->mtime == st.st_mtime && s->filesize == st.st_size && s->buffersize == buffersize && !strcmp (s->path, path)) {
+                if (prev) {
+                    prev->next = s->next;
+                    s->next = cue_cache;
+                    cue_cache = s;
+                }
+                s->refc++;
+                mutex_unlock (cue_cache_mutex);
+                return s;
+            }
+        }
+        mutex_unlock (cue_cache_mutex);
+    }
+
+    pl_cue_sheet_t *sheet = pl_cue_parse (buffer, buffersize);
+    if (!cacheable) {
+        return sheet;
+    }
+    sheet->path = strdup (path);
+    sheet->mtime = st.st_mtime;
+    sheet->filesize = st.st_size;
+    sheet->buffersize = buffersize;
+
+    mutex_lock (cue_cache_mutex);
+    sheet->refc++;
+    sheet->next = cue_cache;
+    cue_cache = sheet;
+    // drop stale sheets of the same file, and the least recently used ones
+    pl_cue_sheet_t *drop = NULL;
+    pl_cue_sheet_t *prev = sheet;
+    int count = 1;
+    for (pl_cue_sheet_t *s = sheet->next; s; ) {
+        pl_cue_sheet_t *next = s->next;
+        if (count >= CUE_CACHE_SIZE || !strcmp (s->path, path)) {
+            prev->next = next;
+            if (!--s->refc) {
+                s->next = drop;
+                drop = s;
+            }
+        }
+        else {
+            prev = s;
+            count++;
+        }
+        s = next;
     }
-    *p = 0;
+    mutex_unlock (cue_cache_mutex);
+    while (drop) {
+        pl_cue_sheet_t *next = drop->next;
+        pl_cue_sheet_free (drop);
+        drop = next;
+    }
+    return sheet;
+}
+
+static void
+pl_cue_cache_free (void) {
+    while (cue_cache) {
+        pl_cue_sheet_t *next = cue_cache->next;
+        if (!--cue_cache->refc) {
+            pl_cue_sheet_free (cue_cache);
+        }
+        cue_cache = next;
+    }
+}
+
+static playItem_t *
+plt_process_cue_track (playlist_t *playlist, const pl_cue_sheet_t *sheet, const pl_cue_track_t *t, const char *fname, const int startsample, playItem_t **prev, const char *decoder_id, const char *ftype, int samplerate) {
+    const char *track = CUE_FIELD (sheet, t, CUE_TRACK);
+    const char *pregap = CUE_FIELD (sheet, t, CUE_PREGAP);
+    const char *index00 = CUE_FIELD (sheet, t, CUE_INDEX00);
+    const char *index01 = CUE_FIELD (sheet, t, CUE_INDEX01);
+    if (!track[0]) {
+        trace ("pl_process_cue_track: invalid track (file=%s, title=%s)\n", fname, CUE_FIELD (sheet, t, CUE_TITLE));
+        return NULL;
+    }
+    if (!index00[0] && !index01[0]) {
+        trace ("pl_process_cue_track: invalid index (file=%s, title=%s, track=%s)\n", fname, CUE_FIELD (sheet, t, CUE_TITLE), track);
+        return NULL;
+    }
+#if SKIP_BLANK_CUE_TRACKS
+    const char *title = CUE_FIELD (sheet, t, CUE_TITLE);
+    if (!title[0]) {
+        trace ("pl_process_cue_track: invalid title (file=%s, title=%s, track=%s)\n", fname, title, track);
+        return NULL;
+    }
+#endif
     // check that indexes have valid timestamps
     //float f_index00 = index00[0] ? pl_cue_parse_time (index00) : 0;
     float f_index01 = index01[0] ? pl_cue_parse_time (index01) : 0;
@@ -996,6 +1580,8 @@ plt_process_cue_track (playlist_t *playlist, const char *fname, const int starts
     it->startsample = index01[0] ? startsample + f_index01 * samplerate : startsample;
     it->endsample = -1; // will be filled by next read, or by decoder
     pl_replace_meta (it, ":FILETYPE", ftype);
+    const char *performer = CUE_FIELD (sheet, t, CUE_PERFORMER);
+    const char *albumperformer = CUE_FIELD (sheet, t, CUE_ALBUMPERFORMER);
     if (performer[0]) {
         pl_add_meta (it, "artist", performer);
         if (albumperformer[0]) {
@@ -1005,215 +1591,90 @@ plt_process_cue_track (playlist_t *playlist, const char *fname, const int starts
     else if (albumperformer[0]) {
         pl_add_meta (it, "artist", albumperformer);
     }
-    if (albumtitle[0]) {
-        pl_add_meta (it, "album", albumtitle);
-    }
-    if (track[0]) {
-        pl_add_meta (it, "track", track);
-    }
-    if (title[0]) {
-        pl_add_meta (it, "title", title);
-    }
-    if (genre[0]) {
-        pl_add_meta (it, "genre", genre);
-    }
-    if (date[0]) {
-        pl_add_meta (it, "year", date);
-    }
-    if (replaygain_album_gain[0]) {
-        pl_set_item_replaygain (it, DDB_REPLAYGAIN_ALBUMGAIN, atof (replaygain_album_gain));
-    }
-    if (replaygain_album_peak[0]) {
-        pl_set_item_replaygain (it, DDB_REPLAYGAIN_ALBUMPEAK, atof (replaygain_album_peak));
-    }
-    if (replaygain_track_gain[0]) {
-        pl_set_item_replaygain (it, DDB_REPLAYGAIN_TRACKGAIN, atof (replaygain_track_gain));
-    }
-    if (replaygain_track_peak[0]) {
-        pl_set_item_replaygain (it, DDB_REPLAYGAIN_TRACKPEAK, atof (replaygain_track_peak));
+    static const struct {
+        int field;
+        const char *key;
+    } tags[] = {
+        { CUE_ALBUMTITLE, "album" },
+        { CUE_TRACK, "track" },
+        { CUE_TITLE, "title" },
+        { CUE_GENRE, "genre" },
+        { CUE_DATE, "year" },
+    };
+    for (int i = 0; i < sizeof (tags) / sizeof (tags[0]); i++) {
+        if (t->fields[tags[i].field]) {
+            pl_add_meta (it, tags[i].key, CUE_FIELD (sheet, t, tags[i].field));
+        }
+    }
+    static const struct {
+        int field;
+        int type;
+    } rg[] = {
+        { CUE_ALBUM_GAIN, DDB_REPLAYGAIN_ALBUMGAIN },
+        { CUE_ALBUM_PEAK, DDB_REPLAYGAIN_ALBUMPEAK },
+        { CUE_TRACK_GAIN, DDB_REPLAYGAIN_TRACKGAIN },
+        { CUE_TRACK_PEAK, DDB_REPLAYGAIN_TRACKPEAK },
+    };
+    for (int i = 0; i < sizeof (rg) / sizeof (rg[0]); i++) {
+        if (t->fields[rg[i].field]) {
+            pl_set_item_replaygain (it, rg[i].type, atof (CUE_FIELD (sheet, t, rg[i].field)));
+        }
     }
     it->_flags |= DDB_IS_SUBTRACK | DDB_TAG_CUESHEET;
     *prev = it;
     return it;
 }
 
-playItem_t *
-plt_insert_cue_from_buffer (playlist_t *playlist, playItem_t *after, playItem_t *origin, const uint8_t *buffer, int buffersize, int numsamples, int samplerate) {
-    if (buffersize >= 3 && buffer[0] == 0xef && buffer[1] == 0xbb && buffer[2] == 0xbf) {
-        buffer += 3;
-        buffersize -= 3;
-    }
-
-    // go through the file, and verify that it's not for multiple tracks
-    int fcount = 0;
-    uint8_t *p = (uint8_t *)buffer;
-    uint8_t *e = (uint8_t *)(buffer + buffersize);
-    while (*p) {
-        while (*p <= 0x20 && *p) {
-            p++;
-        }
-        if (e-p > 4 && !memcmp ((char *)p, "FILE", 4) && p[4] == 0x20) {
-            fcount++;
-            if (fcount > 1) {
-                return NULL;
-            }
-        }
-        while (*p >= 0x20 && *p) {
-            p++;
-        }
+// creates the items of the sheet, and inserts them all at once
+static playItem_t *
+plt_insert_cue_sheet (playlist_t *playlist, playItem_t *after, playItem_t *origin, const pl_cue_sheet_t *sheet, int numsamples, int samplerate) {
+    if (!sheet->ntracks) {
+        return NULL;
     }
 
-    const char *charset = junk_detect_charset_len (buffer, buffersize);
-
     LOCK;
     playItem_t *ins = after;
-    trace ("plt_insert_cue_from_buffer numsamples=%d, samplerate=%d\n", numsamples, samplerate);
-    char albumperformer[256] = "";
-    char performer[256] = "";
-    char albumtitle[256] = "";
-    char genre[256] = "";
-    char date[256] = "";
-    char track[256] = "";
-    char title[256] = "";
-    char pregap[256] = "";
-    char index00[256] = "";
-    char index01[256] = "";
-    char replaygain_album_gain[256] = "";
-    char replaygain_album_peak[256] = "";
-    char replaygain_track_gain[256] = "";
-    char replaygain_track_peak[256] = "";
+    trace ("plt_insert_cue_sheet numsamples=%d, samplerate=%d\n", numsamples, samplerate);
     const char *uri = pl_find_meta_raw (origin, ":URI");
     const char *dec = pl_find_meta_raw (origin, ":DECODER");
     const char *filetype = pl_find_meta_raw (origin, ":FILETYPE");
 
-    playItem_t *cuetracks[MAX_CUE_TRACKS];
+    playItem_t **cuetracks = malloc (sheet->ntracks * sizeof (playItem_t *));
     int ncuetracks = 0;
 
     playItem_t *prev = NULL;
-    while (buffersize > 0) {
-        const uint8_t *p = buffer;
-        // find end of line
-        while (p - buffer < buffersize && *p >= 0x20) {
-            p++;
-        }
-        // skip linebreak(s)
-        while (p - buffer < buffersize && *p < 0x20) {
-            p++;
-        }
-        if (p-buffer > 2048) { // huge string, ignore
-            buffersize -= p-buffer;
-            buffer = p;
+    for (int i = 0; i < sheet->ntracks; i++) {
+        const pl_cue_track_t *t = &sheet->tracks[i];
+        playItem_t *it = plt_process_cue_track (playlist, sheet, t, uri, origin->startsample, &prev, dec, filetype, samplerate);
+        if (!it) {
             continue;
         }
-        char str[p-buffer+1];
-        strncpy (str, buffer, p-buffer);
-        str[p-buffer] = 0;
-        buffersize -= p-buffer;
-        buffer = p;
-        p = pl_cue_skipspaces (str);
-//        trace ("cue line: %s\n", p);
-        if (!strncmp (p, "PERFORMER ", 10)) {
-            if (!track[0]) {
-                pl_get_qvalue_from_cue (p + 10, sizeof (albumperformer), albumperformer, charset);
-            }
-            else {
-                pl_get_qvalue_from_cue (p + 10, sizeof (performer), performer, charset);
-            }
-            trace ("cue: got performer: %s\n", performer);
-        }
-        else if (!strncmp (p, "TITLE ", 6)) {
-            if (str[0] > ' ' && !albumtitle[0]) {
-                pl_get_qvalue_from_cue (p + 6, sizeof (albumtitle), albumtitle, charset);
-                trace ("cue: got albumtitle: %s\n", albumtitle);
-            }
-            else {
-                pl_get_qvalue_from_cue (p + 6, sizeof (title), title, charset);
-                trace ("cue: got title: %s\n", title);
-            }
-        }
-        else if (!strncmp (p, "REM GENRE ", 10)) {
-            pl_get_qvalue_from_cue (p + 10, sizeof (genre), genre, charset);
-        }
-        else if (!strncmp (p, "REM DATE ", 9)) {
-            pl_get_value_from_cue (p + 9, sizeof (date), date);
-        }
-        else if (!strncmp (p, "TRACK ", 6)) {
-            trace ("cue: adding track: %s %s %s\n", uri, title, track);
-            if (title[0]) {
-                // add previous track
-                playItem_t *it = plt_process_cue_track (playlist, uri, origin->startsample, &prev, track, index00, index01, pregap, title, albumperformer, performer, albumtitle, genre, date, replaygain_album_gain, replaygain_album_peak, replaygain_track_gain, replaygain_track_peak, dec, filetype, samplerate);
-                trace ("cue: added %p\n", it);
-                if (it) {
-                    if ((it->startsample-origin->startsample) >= numsamples || (it->endsample-origin->startsample) >= numsamples) {
-                        trace ("cue: the track is shorter than cue timeline\n");
-                        goto error;
-                    }
-                    cuetracks[ncuetracks++] = it;
-                }
-            }
-
-            track[0] = 0;
-            title[0] = 0;
-            pregap[0] = 0;
-            index00[0] = 0;
-            index01[0] = 0;
-            replaygain_track_gain[0] = 0;
-            replaygain_track_peak[0] = 0;
-            performer[0] = 0;
-            pl_get_value_from_cue (p + 6, sizeof (track), track);
-            trace ("cue: got track: %s\n", track);
-        }
-        else if (!strncmp (p, "REM REPLAYGAIN_ALBUM_GAIN ", 26)) {
-            pl_get_value_from_cue (p + 26, sizeof (replaygain_album_gain), replaygain_album_gain);
-        }
-        else if (!strncmp (p, "REM REPLAYGAIN_ALBUM_PEAK ", 26)) {
-            pl_get_value_from_cue (p + 26, sizeof (replaygain_album_peak), replaygain_album_peak);
-        }
-        else if (!strncmp (p, "REM REPLAYGAIN_TRACK_GAIN ", 26)) {
-            pl_get_value_from_cue (p + 26, sizeof (replaygain_track_gain), replaygain_track_gain);
-        }
-        else if (!strncmp (p, "REM REPLAYGAIN_TRACK_PEAK ", 26)) {
-            pl_get_value_from_cue (p + 26, sizeof (replaygain_track_peak), replaygain_track_peak);
-        }
-        else if (!strncmp (p, "PREGAP ", 7)) {
-            pl_get_value_from_cue (p + 7, sizeof (pregap), pregap);
-        }
-        else if (!strncmp (p, "INDEX 00 ", 9)) {
-            pl_get_value_from_cue (p + 9, sizeof (index00), index00);
-        }
-        else if (!strncmp (p, "INDEX 01 ", 9)) {
-            pl_get_value_from_cue (p + 9, sizeof (index01), index01);
-        }
-        else {
-//            fprintf (stderr, "got unknown line:\n%s\n", p);
-        }
-    }
-    if (title[0]) {
-        // handle last track
-        playItem_t *it = plt_process_cue_track (playlist, uri, origin->startsample, &prev, track, index00, index01, pregap, title, albumperformer, performer, albumtitle, genre, date, replaygain_album_gain, replaygain_album_peak, replaygain_track_gain, replaygain_track_peak, dec, filetype, samplerate);
-        if (it) {
+        cuetracks[ncuetracks++] = it;
+        if (i == sheet->ntracks-1 && sheet->ends_at_eof) {
             trace ("last track endsample: %d\n", origin->startsample+numsamples-1);
             it->endsample = origin->startsample + numsamples - 1;
             if ((it->endsample-origin->startsample) >= numsamples || (it->startsample-origin->startsample) >= numsamples) {
                 goto error;
             }
             plt_set_item_duration (playlist, it, (float)(it->endsample - it->startsample + 1) / samplerate);
-            cuetracks[ncuetracks++] = it;
+        }
+        else if ((it->startsample-origin->startsample) >= numsamples || (it->endsample-origin->startsample) >= numsamples) {
+            trace ("cue: the track is shorter than cue timeline\n");
+            goto error;
         }
     }
 
     if (!ncuetracks) {
+        free (cuetracks);
         UNLOCK;
         return NULL;
     }
 
-    playItem_t *last = cuetracks[ncuetracks-1];
-    pl_item_ref (last);
-
     for (int i = 0; i < ncuetracks; i++) {
         after = plt_insert_item (playlist, after, cuetracks[i]);
         pl_item_unref (cuetracks[i]);
     }
+    free (cuetracks);
     playItem_t *first = ins ? ins->next[PL_MAIN] : playlist->head[PL_MAIN];
     if (!first) {
         UNLOCK;
@@ -1234,10 +1695,24 @@ error:
     for (int i = 0; i < ncuetracks; i++) {
         pl_item_unref (cuetracks[i]);
     }
+    free (cuetracks);
     UNLOCK;
     return NULL;
 }
 
+playItem_t *
+plt_insert_cue_from_buffer (playlist_t *playlist, playItem_t *after, playItem_t *origin, const uint8_t *buffer, int buffersize, int numsamples, int samplerate) {
+    // embedded cuesheets are cached by the audio file
+    pl_lock ();
+    const char *uri = pl_find_meta_raw (origin, ":URI");
+    char *path = uri ? strdupa (uri) : NULL;
+    pl_unlock ();
+    pl_cue_sheet_t *sheet = pl_cue_get_sheet (buffer, buffersize, path);
+    playItem_t *res = plt_insert_cue_sheet (playlist, after, origin, sheet, numsamples, samplerate);
+    pl_cue_sheet_unref (sheet);
+    return res;
+}
+
 playItem_t *
 plt_insert_cue (playlist_t *plt, playItem_t *after, playItem_t *origin, int numsamples, int samplerate) {
     trace ("pl_insert_cue numsamples=%d, samplerate=%d\n", numsamples, samplerate);
@@ -1276,17 +1751,22 @@ plt_insert_cue (playlist_t *plt, playItem_t *after, playItem_t *origin, int nums
         vfs_fclose (fp);
         return NULL;
     }
-    uint8_t *buf = alloca(sz);
+    uint8_t *buf = malloc (sz);
     if (!buf) {
         vfs_fclose (fp);
         return NULL;
     }
     if (vfs_fread (buf, 1, sz, fp) != sz) {
         vfs_fclose (fp);
+        free (buf);
         return NULL;
     }
     vfs_fclose (fp);
-    return plt_insert_cue_from_buffer (plt, after, origin, buf, sz, numsamples, samplerate);
+    pl_cue_sheet_t *sheet = pl_cue_get_sheet (buf, (int)sz, cuename);
+    free (buf);
+    playItem_t *res = plt_insert_cue_sheet (plt, after, origin, sheet, numsamples, samplerate);
+    pl_cue_sheet_unref (sheet);
+    return res;
 }
 
 static int follow_symlinks = 0;
@@ -1298,6 +1778,105 @@ plt_insert_dir_int (int visibility, playlist_t *playlist, DB_vfs_t *vfs, playIte
 static playItem_t *
 plt_load_int (int visibility, playlist_t *plt, playItem_t *after, const char *fname, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data);
 
+// runs the insert callback and file add listeners for a newly added file
+static void
+plt_file_added (int visibility, playlist_t *playlist, playItem_t *inserted, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
+    if (cb && cb (inserted, user_data) < 0) {
+        *pabort = 1;
+    }
+    if (file_add_listeners) {
+        ddb_fileadd_data_t d;
+        memset (&d, 0, sizeof (d));
+        d.visibility = visibility;
+        d.plt = (ddb_playlist_t *)playlist;
+        d.track = (ddb_playItem_t *)inserted;
+        for (ddb_fileadd_listener_t *l = file_add_listeners; l; l = l->next) {
+            if (l->callback (&d, l->user_data) < 0) {
+                *pabort = 1;
+                break;
+            }
+        }
+    }
+}
+
+// tries the decoders in order, until one of them inserts the file
+static playItem_t *
+plt_insert_file_with_decoders (playlist_t *playlist, playItem_t *after, const char *fname, DB_decoder_t **decoders, int n, int parallel, int *serial) {
+    for (int i = 0; i < n; i++) {
+        trace ("trying decoder %s...\n", decoders[i]->plugin.id);
+        if (parallel && !(decoders[i]->plugin.flags & DDB_PLUGIN_FLAG_PARALLEL_INSERT)) {
+            *serial = 1;
+            return NULL;
+        }
+        playItem_t *inserted = (playItem_t *)decoders[i]->insert ((ddb_playlist_t *)playlist, DB_PLAYITEM (after), fname);
+        if (inserted != NULL) {
+            trace ("file has been added by decoder: %s\n", decoders[i]->plugin.id);
+            return inserted;
+        }
+    }
+    return NULL;
+}
+
+#define SNIFF_SIZE 4096
+
+// finds a decoder for fname, and lets it insert the file
+// if parallel is set, stops before trying a decoder which doesn't support
+// parallel insert, and sets *serial
+static playItem_t *
+plt_insert_file_decoder (playlist_t *playlist, playItem_t *after, const char *fname, int parallel, int *serial) {
+    DB_decoder_t *decoders[MAX_DECODER_PLUGINS];
+
+    // match by extension and prefix
+    int n = plug_get_decoders_for_file (fname, decoders, MAX_DECODER_PLUGINS);
+    playItem_t *inserted = plt_insert_file_with_decoders (playlist, after, fname, decoders, n, parallel, serial);
+    if (inserted || (serial && *serial)) {
+        return inserted;
+    }
+
+    // unknown or misleading extension: match by content
+    if (!conf_get_int ("add_files_detect_by_content", 0)) {
+        trace ("no decoder found for %s\n", fname);
+        return NULL;
+    }
+    DB_FILE *fp = vfs_fopen (fname);
+    if (!fp) {
+        return NULL;
+    }
+    if (fp->vfs->is_streaming && fp->vfs->is_streaming ()) {
+        vfs_fclose (fp);
+        return NULL;
+    }
+    uint8_t buf[SNIFF_SIZE];
+    int size = (int)vfs_fread (buf, 1, sizeof (buf), fp);
+    vfs_fclose (fp);
+    if (size <= 0) {
+        return NULL;
+    }
+
+    DB_decoder_t *tried[MAX_DECODER_PLUGINS];
+    memcpy (tried, decoders, n * sizeof (DB_decoder_t *));
+    int ntried = n;
+    int nc = plug_get_decoders_for_content (buf, size, decoders, MAX_DECODER_PLUGINS);
+    // skip the ones which already failed
+    n = 0;
+    for (int i = 0; i < nc; i++) {
+        int t;
+        for (t = 0; t < ntried; t++) {
+            if (tried[t] == decoders[i]) {
+                break;
+            }
+        }
+        if (t == ntried) {
+            decoders[n++] = decoders[i];
+        }
+    }
+    inserted = plt_insert_file_with_decoders (playlist, after, fname, decoders, n, parallel, serial);
+    if (!inserted) {
+        trace ("no decoder found for %s\n", fname);
+    }
+    return inserted;
+}
+
 static playItem_t *
 plt_insert_file_int (int visibility, playlist_t *playlist, playItem_t *after, const char *fname, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
     trace ("count: %d\n", playlist->count[PL_MAIN]);
@@ -1322,14 +1901,6 @@ plt_insert_file_int (int visibility, playlist_t *playlist, playItem_t *after, co
         }
     }
 
-    const char *fn = strrchr (fname, '/');
-    if (!fn) {
-        fn = fname;
-    }
-    else {
-        fn++;
-    }
-
     // add all posible streams as special-case:
     // set decoder to NULL, and filetype to "content"
     // streamer is responsible to determine content type on 1st access and
@@ -1398,81 +1969,278 @@ plt_insert_file_int (int visibility, playlist_t *playlist, playItem_t *after, co
         fname += 7;
     }
 
-    // detect decoder
-    const char *eol = strrchr (fname, '.');
-    if (!eol) {
-        return NULL;
+    playItem_t *inserted = plt_insert_file_decoder (playlist, after, fname, 0, NULL);
+    if (inserted) {
+        plt_file_added (visibility, playlist, inserted, pabort, cb, user_data);
     }
-    eol++;
+    return inserted;
+}
 
-    ddb_fileadd_data_t d;
-    memset (&d, 0, sizeof (d));
-    d.visibility = visibility;
-    d.plt = (ddb_playlist_t *)playlist;
-
-    DB_decoder_t **decoders = plug_get_decoder_list ();
-    // match by decoder
-    for (int i = 0; decoders[i]; i++) {
-        trace ("matching decoder %d(%s)...\n", i, decoders[i]->plugin.id);
-        if (decoders[i]->exts && decoders[i]->insert) {
-            const char **exts = decoders[i]->exts;
-            for (int e = 0; exts[e]; e++) {
-                if (!strcasecmp (exts[e], eol)) {
-                    playItem_t *inserted = (playItem_t *)decoders[i]->insert ((ddb_playlist_t *)playlist, DB_PLAYITEM (after), fname);
-                    if (inserted != NULL) {
-                        if (cb && cb (inserted, user_data) < 0) {
-                            *pabort = 1;
-                        }
-                        if (file_add_listeners) {
-                            d.track = (ddb_playItem_t *)inserted;
-                            for (ddb_fileadd_listener_t *l = file_add_listeners; l; l = l->next) {
-                                if (l->callback (&d, l->user_data) < 0) {
-                                    *pabort = 1;
-                                    break;
-                                }
-                            }
-                        }
-                        trace ("file has been added by decoder: %s\n", decoders[i]->plugin.id);
-                        return inserted;
-                    }
-                }
+playItem_t *
+plt_insert_file (playlist_t *playlist, playItem_t *after, const char *fname, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
+    return plt_insert_file_int (0, playlist, after, fname, pabort, cb, user_data);
+}
+
+static int dirent_alphasort (const struct dirent **a, const struct dirent **b) {
+    return strcmp ((*a)->d_name, (*b)->d_name);
+}
+
+// Parallel folder import.
+// The calling thread scans the folders, and queues the files in the same order
+// as the serial scan would add them. Worker threads let the decoders insert the
+// queued files into private playlists, one per file. The calling thread then
+// moves the finished files into the target playlist in queue order, and runs
+// the callbacks and file add listeners, same as plt_insert_file_int.
+#define IMPORT_MAX_THREADS 16
+
+enum {
+    IMPORT_JOB_QUEUED,
+    IMPORT_JOB_DONE,
+    IMPORT_JOB_SERIAL, // has to be inserted on the calling thread
+};
+
+typedef struct {
+    char *fname;
+    playlist_t *plt;
+    playItem_t *inserted;
+    int state;
+} pl_import_job_t;
+
+typedef struct {
+    pl_import_job_t *jobs;
+    int count;
+    int size;
+    int next; // next job to be picked by a worker
+    int merged; // number of jobs moved to the target playlist
+    int scan_done;
+    int abort;
+    uintptr_t mutex;
+    uintptr_t cond; // signaled when jobs are queued or done
+    intptr_t tids[IMPORT_MAX_THREADS];
+    int nthreads;
+
+    int visibility;
+    playlist_t *playlist;
+    playItem_t *after;
+    int *pabort;
+    int (*cb)(playItem_t *it, void *data);
+    void *user_data;
+} pl_import_t;
+
+static void
+pl_import_worker (void *ctx) {
+    pl_import_t *imp = ctx;
+    mutex_lock (imp->mutex);
+    for (;;) {
+        while (!imp->abort && imp->next >= imp->count && !imp->scan_done) {
+            cond_timedwait (imp->cond, imp->mutex, -1);
+        }
+        if (imp->abort || imp->next >= imp->count) {
+            break;
+        }
+        int idx = imp->next++;
+        if (imp->jobs[idx].state != IMPORT_JOB_QUEUED) {
+            continue;
+        }
+        const char *fname = imp->jobs[idx].fname;
+        mutex_unlock (imp->mutex);
+
+        int serial = 0;
+        playlist_t *plt = plt_alloc ("");
+        playItem_t *inserted = plt_insert_file_decoder (plt, NULL, fname, 1, &serial);
+
+        mutex_lock (imp->mutex);
+        pl_import_job_t *job = &imp->jobs[idx];
+        job->plt = plt;
+        job->inserted = inserted;
+        job->state = serial ? IMPORT_JOB_SERIAL : IMPORT_JOB_DONE;
+        cond_broadcast (imp->cond);
+    }
+    mutex_unlock (imp->mutex);
+}
+
+static void
+pl_import_queue (pl_import_t *imp, const char *fname) {
+    mutex_lock (imp->mutex);
+    if (imp->count == imp->size) {
+        imp->size = imp->size ? imp->size * 2 : 256;
+        imp->jobs = realloc (imp->jobs, imp->size * sizeof (pl_import_job_t));
+    }
+    pl_import_job_t *job = &imp->jobs[imp->count];
+    memset (job, 0, sizeof (pl_import_job_t));
+    job->fname = strdup (fname);
+    // only plain paths go to the workers, see plt_insert_file_int
+    job->state = fname[0] == '/' ? IMPORT_JOB_QUEUED : IMPORT_JOB_SERIAL;
+    imp->count++;
+    cond_signal (imp->cond);
+    mutex_unlock (imp->mutex);
+}
+
+// moves all items of a private playlist after imp->after
+static playItem_t *
+pl_import_move_items (pl_import_t *imp, playlist_t *from) {
+    LOCK;
+    playItem_t *last = NULL;
+    playItem_t *it = from->head[PL_MAIN];
+    while (it) {
+        playItem_t *next = it->next[PL_MAIN];
+        plt_insert_item (imp->playlist, last ? last : imp->after, it);
+        pl_item_unref (it); // reference held by the private playlist
+        last = it;
+        it = next;
+    }
+    from->head[PL_MAIN] = from->tail[PL_MAIN] = NULL;
+    from->count[PL_MAIN] = 0;
+    from->totaltime = 0;
+    UNLOCK;
+    return last;
+}
+
+// moves finished jobs to the target playlist, in queue order
+static void
+pl_import_merge (pl_import_t *imp, int wait) {
+    mutex_lock (imp->mutex);
+    while (imp->merged < imp->count && !*imp->pabort) {
+        pl_import_job_t *job = &imp->jobs[imp->merged];
+        if (job->state == IMPORT_JOB_QUEUED) {
+            if (!wait) {
+                break;
             }
+            cond_timedwait (imp->cond, imp->mutex, -1);
+            continue;
         }
-        if (decoders[i]->prefixes && decoders[i]->insert) {
-            const char **prefixes = decoders[i]->prefixes;
-            for (int e = 0; prefixes[e]; e++) {
-                if (!strncasecmp (prefixes[e], fn, strlen(prefixes[e])) && *(fn + strlen (prefixes[e])) == '.') {
-                    playItem_t *inserted = (playItem_t *)decoders[i]->insert ((ddb_playlist_t *)playlist, DB_PLAYITEM (after), fname);
-                    if (inserted != NULL) {
-                        if (cb && cb (inserted, user_data) < 0) {
-                            *pabort = 1;
-                        }
-                        if (file_add_listeners) {
-                            d.track = (ddb_playItem_t *)inserted;
-                            for (ddb_fileadd_listener_t *l = file_add_listeners; l; l = l->next) {
-                                if (l->callback (&d, l->user_data) < 0) {
-                                    *pabort = 1;
-                                    break;
-                                }
-                            }
-                        }
-                        return inserted;
-                    }
-                }
+        pl_import_job_t j = *job;
+        imp->merged++;
+        mutex_unlock (imp->mutex);
+
+        playItem_t *inserted = NULL;
+        if (j.state == IMPORT_JOB_SERIAL) {
+            inserted = plt_insert_file_int (imp->visibility, imp->playlist, imp->after, j.fname, imp->pabort, imp->cb, imp->user_data);
+            if (inserted) {
+                imp->after = inserted;
             }
         }
+        else if (j.inserted) {
+            playItem_t *last = pl_import_move_items (imp, j.plt);
+            if (last) {
+                imp->after = last;
+            }
+            plt_file_added (imp->visibility, imp->playlist, j.inserted, imp->pabort, imp->cb, imp->user_data);
+        }
+        if (j.plt) {
+            plt_unref (j.plt);
+        }
+        free (j.fname);
+
+        mutex_lock (imp->mutex);
     }
-    trace ("no decoder found for %s\n", fname);
-    return NULL;
+    if (*imp->pabort) {
+        imp->abort = 1;
+        cond_broadcast (imp->cond);
+    }
+    mutex_unlock (imp->mutex);
 }
 
-playItem_t *
-plt_insert_file (playlist_t *playlist, playItem_t *after, const char *fname, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
-    return plt_insert_file_int (0, playlist, after, fname, pabort, cb, user_data);
+static int
+pl_import_scan (pl_import_t *imp, const char *dirname) {
+    struct dirent **namelist = NULL;
+    int n = scandir (dirname, &namelist, NULL, dirent_alphasort);
+    if (n < 0) {
+        if (namelist) {
+            free (namelist);
+        }
+        return -1; // not a dir or no read access
+    }
+    for (int i = 0; i < n; i++) {
+        // no hidden files
+        if (namelist[i]->d_name[0] != '.' && !*imp->pabort) {
+            char fullname[PATH_MAX];
+            snprintf (fullname, sizeof (fullname), "%s/%s", dirname, namelist[i]->d_name);
+            // same as plt_insert_dir_int: anything that can't be scanned as
+            // a folder is tried as a file, including skipped symlinks
+            struct stat buf;
+            int is_dir = 0;
+            if (follow_symlinks || (!lstat (fullname, &buf) && !S_ISLNK(buf.st_mode))) {
+                is_dir = !stat (fullname, &buf) && S_ISDIR(buf.st_mode);
+            }
+            if (is_dir) {
+                pl_import_scan (imp, fullname);
+            }
+            else {
+                pl_import_queue (imp, fullname);
+            }
+        }
+        free (namelist[i]);
+    }
+    free (namelist);
+    pl_import_merge (imp, 0);
+    return 0;
 }
 
-static int dirent_alphasort (const struct dirent **a, const struct dirent **b) {
-    return strcmp ((*a)->d_name, (*b)->d_name);
+static int
+pl_import_get_threads (void) {
+    int n = conf_get_int ("add_folders_threads", 0);
+    if (n <= 0) {
+        n = sysconf (_SC_NPROCESSORS_ONLN);
+        // tag reading is mostly waiting for i/o
+        n = max (n, 4);
+    }
+    return min (n, IMPORT_MAX_THREADS);
+}
+
+static playItem_t *
+plt_insert_dir_parallel (int visibility, playlist_t *playlist, playItem_t *after, const char *dirname, int nthreads, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
+    pl_import_t imp;
+    memset (&imp, 0, sizeof (imp));
+    imp.mutex = mutex_create ();
+    imp.cond = cond_create ();
+    imp.visibility = visibility;
+    imp.playlist = playlist;
+    imp.after = after;
+    imp.pabort = pabort;
+    imp.cb = cb;
+    imp.user_data = user_data;
+
+    for (int i = 0; i < nthreads; i++) {
+        imp.tids[i] = thread_start (pl_import_worker, &imp);
+        if (!imp.tids[i]) {
+            break;
+        }
+        imp.nthreads++;
+    }
+
+    int res = pl_import_scan (&imp, dirname);
+
+    mutex_lock (imp.mutex);
+    imp.scan_done = 1;
+    cond_broadcast (imp.cond);
+    mutex_unlock (imp.mutex);
+
+    pl_import_merge (&imp, 1);
+
+    mutex_lock (imp.mutex);
+    imp.abort = 1;
+    cond_broadcast (imp.cond);
+    mutex_unlock (imp.mutex);
+    for (int i = 0; i < imp.nthreads; i++) {
+        thread_join (imp.tids[i]);
+    }
+
+    // free the jobs left after abort
+    for (int i = imp.merged; i < imp.count; i++) {
+        if (imp.jobs[i].plt) {
+            plt_unref (imp.jobs[i].plt);
+        }
+        free (imp.jobs[i].fname);
+    }
+    free (imp.jobs);
+    cond_free (imp.cond);
+    mutex_free (imp.mutex);
+    // like the serial path, NULL tells the callers to try it as a file
+    if (res < 0 || !imp.count) {
+        return NULL;
+    }
+    return imp.after;
 }
 
 static playItem_t *
@@ -1487,6 +2255,13 @@ plt_insert_dir_int (int visibility, playlist_t *playlist, DB_vfs_t *vfs, playIte
             return NULL;
         }
     }
+    if (!vfs && ignore_archives) {
+        // archives would be scanned as folders, which is only done serially
+        int nthreads = pl_import_get_threads ();
+        if (nthreads > 1) {
+            return plt_insert_dir_parallel (visibility, playlist, after, dirname, nthreads, pabort, cb, user_data);
+        }
+    }
     struct dirent **namelist = NULL;
     int n;
 
@@ -1615,9 +2390,18 @@ plt_remove_item (playlist_t *playlist, playItem_t *it) {
 
     // remove from both lists
     LOCK;
+    plt_search_index_free (playlist);
+    plt_shuffle_remove (playlist, it);
     for (int iter = PL_MAIN; iter <= PL_SEARCH; iter++) {
         if (it->prev[iter] || it->next[iter] || playlist->head[iter] == it || playlist->tail[iter] == it) {
             playlist->count[iter]--;
+            // removing the last item keeps the index valid
+            if (playlist->index_valid[iter] && !it->next[iter] && it->_idx[iter] == playlist->index_count[iter]-1 && playlist->index[iter][it->_idx[iter]] == it) {
+                playlist->index_count[iter]--;
+            }
+            else {
+                playlist->index_valid[iter] = 0;
+            }
         }
         if (it->prev[iter]) {
             it->prev[iter]->next[iter] = it->next[iter];
@@ -1688,17 +2472,13 @@ pl_getselcount (void) {
 playItem_t *
 plt_get_item_for_idx (playlist_t *playlist, int idx, int iter) {
     LOCK;
-    playItem_t *it = playlist->head[iter];
-    while (idx--) {
-        if (!it) {
-            UNLOCK;
-            return NULL;
-        }
-        it = it->next[iter];
-    }
-    if (it) {
-        pl_item_ref (it);
+    plt_index_update (playlist, iter);
+    if (idx < 0 || idx >= playlist->index_count[iter]) {
+        UNLOCK;
+        return NULL;
     }
+    playItem_t *it = playlist->index[iter][idx];
+    pl_item_ref (it);
     UNLOCK;
     return it;
 }
@@ -1719,13 +2499,9 @@ pl_get_for_idx (int idx) {
 int
 plt_get_item_idx (playlist_t *playlist, playItem_t *it, int iter) {
     LOCK;
-    playItem_t *c = playlist->head[iter];
-    int idx = 0;
-    while (c && c != it) {
-        c = c->next[iter];
-        idx++;
-    }
-    if (!c) {
+    plt_index_update (playlist, iter);
+    int idx = it ? it->_idx[iter] : -1;
+    if (idx < 0 || idx >= playlist->index_count[iter] || playlist->index[iter][idx] != it) {
         UNLOCK;
         return -1;
     }
@@ -1749,6 +2525,7 @@ pl_get_idx_of_iter (playItem_t *it, int iter) {
 playItem_t *
 plt_insert_item (playlist_t *playlist, playItem_t *after, playItem_t *it) {
     LOCK;
+    plt_search_index_free (playlist);
     pl_item_ref (it);
     if (!after) {
         it->next[PL_MAIN] = playlist->head[PL_MAIN];
@@ -1776,6 +2553,17 @@ plt_insert_item (playlist_t *playlist, playItem_t *after, playItem_t *it) {
 
     playlist->count[PL_MAIN]++;
 
+    // appending keeps the index valid
+    if (playlist->index_valid[PL_MAIN] && !it->next[PL_MAIN]) {
+        int idx = playlist->index_count[PL_MAIN]++;
+        plt_index_reserve (playlist, PL_MAIN, idx+1);
+        playlist->index[PL_MAIN][idx] = it;
+        it->_idx[PL_MAIN] = idx;
+    }
+    else {
+        playlist->index_valid[PL_MAIN] = 0;
+    }
+
     // shuffle
     playItem_t *prev = it->prev[PL_MAIN];
     const char *aa = NULL, *prev_aa = NULL;
@@ -1802,6 +2590,7 @@ plt_insert_item (playlist_t *playlist, playItem_t *after, playItem_t *it) {
         it->shufflerating = rand ();
     }
     it->played = 0;
+    plt_shuffle_insert (playlist, it);
 
     // totaltime
     float dur = pl_get_item_duration (it);
@@ -1832,24 +2621,7 @@ pl_item_copy (playItem_t *out, playItem_t *it) {
     out->next[PL_SEARCH] = it->next[PL_SEARCH];
     out->prev[PL_SEARCH] = it->prev[PL_SEARCH];
     out->_refc = 1;
-    // copy metainfo
-    DB_metaInfo_t *prev = NULL;
-    DB_metaInfo_t *meta = it->meta;
-    while (meta) {
-        DB_metaInfo_t *m = malloc (sizeof (DB_metaInfo_t));
-        memset (m, 0, sizeof (DB_metaInfo_t));
-        m->key = metacache_add_string (meta->key);
-        m->value = metacache_add_string (meta->value);
-        m->next = NULL;
-        if (prev) {
-            prev->next = m;
-        }
-        else {
-            out->meta = m;
-        }
-        prev = m;
-        meta = meta->next;
-    }
+    pl_copy_meta (out, it);
     UNLOCK;
 }
 
@@ -1859,6 +2631,7 @@ pl_item_alloc (void) {
     memset (it, 0, sizeof (playItem_t));
     it->_duration = -1;
     it->_refc = 1;
+    it->_shuffle_idx = -1;
     return it;
 }
 
@@ -1882,13 +2655,7 @@ static void
 pl_item_free (playItem_t *it) {
     LOCK;
     if (it) {
-        while (it->meta) {
-            DB_metaInfo_t *m = it->meta;
-            it->meta = m->next;
-            metacache_remove_string (m->key);
-            metacache_remove_string (m->value);
-            free (m);
-        }
+        pl_free_meta (it);
         free (it);
     }
     UNLOCK;
@@ -1962,6 +2729,534 @@ pl_crop_selected (void) {
     UNLOCK;
 }
 
+// 1.4 file layout; offsets are from the start of the file, all sections
+// are 4-byte aligned, and the string table ends with a NUL.
+// metadata pairs hold file offsets of their strings.
+// the file may be followed by journal records, see plt_save_journal
+typedef struct {
+    char magic[4];
+    uint8_t majorver;
+    uint8_t minorver;
+    uint16_t reserved;
+    uint32_t id; // changes with every full save, journal records only apply to the same id
+    uint32_t count;
+    uint32_t items; // offset of dbpl_item_t[count]
+    uint32_t pairs; // offset of pl_meta_map_pair_t[npairs]
+    uint32_t npairs;
+    uint32_t strings; // offset of the string table
+    uint32_t strings_size;
+    uint32_t plt_meta; // index of the first playlist metadata pair
+    uint32_t plt_nmeta;
+} dbpl_header_t;
+
+typedef struct {
+    int32_t startsample;
+    int32_t endsample;
+    float duration;
+    uint32_t flags;
+    uint32_t meta; // index of the first metadata pair
+    uint32_t nmeta;
+} dbpl_item_t;
+
+// journal record: the whole playlist, as runs of items from the start of
+// the file, and items stored in the record; offsets are from the start of
+// the record. only the last complete record is used.
+typedef struct {
+    char magic[4];
+    uint32_t size; // including this header and padding
+    uint32_t checksum; // of the record, with this field set to 0
+    uint32_t count;
+    uint32_t runs; // offset of dbpl_run_t[nruns]
+    uint32_t nruns;
+    uint32_t items; // offset of dbpl_item_t[nitems]
+    uint32_t nitems;
+    uint32_t pairs; // offset of pl_meta_map_pair_t[npairs]
+    uint32_t npairs;
+    uint32_t strings;
+    uint32_t strings_size;
+    uint32_t plt_meta;
+    uint32_t plt_nmeta;
+} dbpl_journal_t;
+
+#define DBPL_RUN_JOURNAL 0x80000000u
+
+typedef struct {
+    uint32_t start; // item index in the file, or in the record with DBPL_RUN_JOURNAL
+    uint32_t count;
+} dbpl_run_t;
+
+// compact when the journal grows past this fraction of the file
+#define DBPL_JOURNAL_MAX_RATIO 2
+#define DBPL_JOURNAL_MIN_COMPACT 65536
+
+#define DBPL_ALIGN(x) (((x) + 3) & ~3u)
+
+static uint32_t
+dbpl_checksum (uint32_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t
+dbpl_gen_id (void) {
+    static uint32_t counter;
+    uint32_t id = ((uint32_t)time (NULL) ^ (++counter * 2654435761u)) | 1;
+    return id;
+}
+
+// strings are deduplicated by address, since metadata is interned
+// in metacache, and lazy metadata points into a deduplicated table
+typedef struct {
+    char *buf;
+    uint32_t size;
+    uint32_t alloc;
+    const char **hash_str;
+    uint32_t *hash_offs;
+    uint32_t hash_size;
+    uint32_t hash_count;
+    pl_meta_map_pair_t *pairs;
+    uint32_t npairs;
+    uint32_t pairs_alloc;
+    dbpl_item_t *items;
+    uint32_t nitems;
+    uint32_t items_alloc;
+    dbpl_run_t *runs;
+    uint32_t nruns;
+    uint32_t runs_alloc;
+} dbpl_writer_t;
+
+static uint32_t
+dbpl_hash_ptr (const char *s) {
+    return (uint32_t)(((uintptr_t)s >> 2) * 2654435761u);
+}
+
+static void
+dbpl_hash_insert (dbpl_writer_t *w, const char *s, uint32_t offs) {
+    uint32_t mask = w->hash_size - 1;
+    uint32_t i = dbpl_hash_ptr (s) & mask;
+    while (w->hash_str[i]) {
+        i = (i + 1) & mask;
+    }
+    w->hash_str[i] = s;
+    w->hash_offs[i] = offs;
+    w->hash_count++;
+}
+
+static uint32_t
+dbpl_add_string (dbpl_writer_t *w, const char *s) {
+    if (w->hash_size) {
+        uint32_t mask = w->hash_size - 1;
+        for (uint32_t i = dbpl_hash_ptr (s) & mask; w->hash_str[i]; i = (i + 1) & mask) {
+            if (w->hash_str[i] == s) {
+                return w->hash_offs[i];
+            }
+        }
+    }
+    if ((w->hash_count + 1) * 2 > w->hash_size) {
+        const char **str = w->hash_str;
+        uint32_t *offs = w->hash_offs;
+        uint32_t size = w->hash_size;
+        w->hash_size = size ? size * 2 : 1024;
+        w->hash_str = calloc (w->hash_size, sizeof (const char *));
+        w->hash_offs = malloc (w->hash_size * sizeof (uint32_t));
+        w->hash_count = 0;
+        for (uint32_t i = 0; i < size; i++) {
+            if (str[i]) {
+                dbpl_hash_insert (w, str[i], offs[i]);
+            }
+        }
+        free (str);
+        free (offs);
+    }
+
+    size_t l = strlen (s) + 1;
+    if (w->size + l > w->alloc) {
+        while (w->size + l > w->alloc) {
+            w->alloc = w->alloc ? w->alloc * 2 : 65536;
+        }
+        w->buf = realloc (w->buf, w->alloc);
+    }
+    uint32_t offs = w->size;
+    memcpy (w->buf + offs, s, l);
+    w->size += l;
+    dbpl_hash_insert (w, s, offs);
+    return offs;
+}
+
+static void
+dbpl_add_pair (dbpl_writer_t *w, const char *key, const char *value) {
+    if (w->npairs == w->pairs_alloc) {
+        w->pairs_alloc = w->pairs_alloc ? w->pairs_alloc * 2 : 1024;
+        w->pairs = realloc (w->pairs, w->pairs_alloc * sizeof (pl_meta_map_pair_t));
+    }
+    pl_meta_map_pair_t *p = &w->pairs[w->npairs++];
+    p->key = dbpl_add_string (w, key);
+    p->value = dbpl_add_string (w, value);
+}
+
+static void
+dbpl_add_run (dbpl_writer_t *w, uint32_t start) {
+    if (w->nruns) {
+        dbpl_run_t *r = &w->runs[w->nruns-1];
+        if (r->start + r->count == start && (r->start & DBPL_RUN_JOURNAL) == (start & DBPL_RUN_JOURNAL)) {
+            r->count++;
+            return;
+        }
+    }
+    if (w->nruns == w->runs_alloc) {
+        w->runs_alloc = w->runs_alloc ? w->runs_alloc * 2 : 64;
+        w->runs = realloc (w->runs, w->runs_alloc * sizeof (dbpl_run_t));
+    }
+    w->runs[w->nruns].start = start;
+    w->runs[w->nruns].count = 1;
+    w->nruns++;
+}
+
+// adds the record and metadata of an item
+static void
+dbpl_add_item (dbpl_writer_t *w, playItem_t *it) {
+    if (w->nitems == w->items_alloc) {
+        w->items_alloc = w->items_alloc ? w->items_alloc * 2 : 1024;
+        w->items = realloc (w->items, w->items_alloc * sizeof (dbpl_item_t));
+    }
+    dbpl_item_t *rec = &w->items[w->nitems++];
+    rec->startsample = it->startsample;
+    rec->endsample = it->endsample;
+    rec->duration = it->_duration;
+    rec->flags = it->_flags;
+    rec->meta = w->npairs;
+    pl_meta_map_t *map = it->_meta_map;
+    if (map) {
+        // not accessed since loading, copy without creating the nodes
+        for (uint32_t p = 0; p < it->_meta_npairs; p++) {
+            uint32_t k = it->_meta_pairs[p].key;
+            uint32_t v = it->_meta_pairs[p].value;
+            if (k < map->strings_size && v < map->strings_size) {
+                dbpl_add_pair (w, map->strings + k, map->strings + v);
+            }
+        }
+    }
+    else {
+        for (DB_metaInfo_t *m = it->meta; m; m = m->next) {
+            if (m->key[0] == '_' || m->key[0] == '!') {
+                continue; // skip reserved names
+            }
+            dbpl_add_pair (w, m->key, m->value);
+        }
+    }
+    rec->nmeta = w->npairs - rec->meta;
+}
+
+// makes the pairs point at the strings, once their file offset is known
+static void
+dbpl_relocate_pairs (dbpl_writer_t *w, uint32_t strings) {
+    for (uint32_t i = 0; i < w->npairs; i++) {
+        w->pairs[i].key += strings;
+        w->pairs[i].value += strings;
+    }
+}
+
+static void
+dbpl_writer_free (dbpl_writer_t *w) {
+    free (w->buf);
+    free (w->hash_str);
+    free (w->hash_offs);
+    free (w->pairs);
+    free (w->items);
+    free (w->runs);
+}
+
+// returns the index of the item in the last fully saved file of the playlist,
+// or -1 if it's not there, or has been changed
+static int
+dbpl_saved_idx (playlist_t *plt, playItem_t *it) {
+    const dbpl_header_t *h = plt->saved_map->base;
+    if (it->_saved_id != h->id || it->_saved_idx >= h->count) {
+        return -1;
+    }
+    const dbpl_item_t *rec = (const dbpl_item_t *)((const uint8_t *)plt->saved_map->base + h->items) + it->_saved_idx;
+    if (rec->startsample != it->startsample || rec->endsample != it->endsample
+        || rec->duration != it->_duration || rec->flags != it->_flags) {
+        return -1;
+    }
+    return it->_saved_idx;
+}
+
+// describes the current state of the playlist as a journal record;
+// returns a checksum of the content, which doesn't depend on where the record is written
+static uint32_t
+dbpl_build_journal (playlist_t *plt, dbpl_writer_t *w, uint32_t *plt_meta) {
+    dbpl_add_string (w, "");
+    for (playItem_t *it = plt->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
+        int idx = dbpl_saved_idx (plt, it);
+        if (idx >= 0) {
+            dbpl_add_run (w, idx);
+        }
+        else {
+            dbpl_add_run (w, w->nitems | DBPL_RUN_JOURNAL);
+            dbpl_add_item (w, it);
+        }
+    }
+    *plt_meta = w->npairs;
+    for (DB_metaInfo_t *m = plt->meta; m; m = m->next) {
+        dbpl_add_pair (w, m->key, m->value);
+    }
+    uint32_t h = 2166136261u;
+    h = dbpl_checksum (h, w->runs, w->nruns * sizeof (dbpl_run_t));
+    h = dbpl_checksum (h, w->items, w->nitems * sizeof (dbpl_item_t));
+    h = dbpl_checksum (h, w->pairs, w->npairs * sizeof (pl_meta_map_pair_t));
+    h = dbpl_checksum (h, w->buf, w->size);
+    return h;
+}
+
+static void
+dbpl_set_saved (playlist_t *plt, pl_meta_map_t *map, uint32_t journal_end) {
+    if (plt->saved_map) {
+        pl_meta_map_unref (plt->saved_map);
+    }
+    plt->saved_map = map;
+    plt->journal_end = journal_end;
+    if (map) {
+        dbpl_writer_t w;
+        memset (&w, 0, sizeof (w));
+        uint32_t plt_meta;
+        plt->journal_hash = dbpl_build_journal (plt, &w, &plt_meta);
+        dbpl_writer_free (&w);
+    }
+}
+
+static void
+dbpl_compact_schedule (playlist_t *plt);
+
+// appends the changes since the last full save to the end of the playlist
+// file, if it's still the one which was saved; must be called under pl_lock
+static int
+plt_save_journal (playlist_t *plt, const char *fname) {
+    if (!plt->saved_map) {
+        return -1;
+    }
+    const dbpl_header_t *h = plt->saved_map->base;
+    uint32_t saved_size = DBPL_ALIGN (h->strings + h->strings_size);
+
+    dbpl_writer_t w;
+    memset (&w, 0, sizeof (w));
+    uint32_t plt_meta;
+    uint32_t hash = dbpl_build_journal (plt, &w, &plt_meta);
+    if (hash == plt->journal_hash) {
+        // nothing changed since the last save
+        dbpl_writer_free (&w);
+        return 0;
+    }
+
+    dbpl_journal_t j;
+    memset (&j, 0, sizeof (j));
+    memcpy (j.magic, "DBPJ", 4);
+    j.count = plt->count[PL_MAIN];
+    j.runs = sizeof (j);
+    j.nruns = w.nruns;
+    j.items = j.runs + w.nruns * sizeof (dbpl_run_t);
+    j.nitems = w.nitems;
+    j.pairs = j.items + w.nitems * sizeof (dbpl_item_t);
+    j.npairs = w.npairs;
+    j.strings = j.pairs + w.npairs * sizeof (pl_meta_map_pair_t);
+    j.strings_size = w.size;
+    j.plt_meta = plt_meta;
+    j.plt_nmeta = w.npairs - plt_meta;
+    j.size = DBPL_ALIGN (j.strings + j.strings_size);
+
+    int res = -1;
+    int fd = -1;
+    uint8_t *rec = NULL;
+    if ((uint64_t)plt->journal_end + j.size > UINT32_MAX) {
+        goto out;
+    }
+
+    // the file might have been replaced or truncated
+    fd = open (fname, O_RDWR);
+    if (fd == -1) {
+        goto out;
+    }
+    struct stat st;
+    dbpl_header_t fh;
+    if (fstat (fd, &st) || st.st_size != plt->journal_end
+        || pread (fd, &fh, sizeof (fh), 0) != sizeof (fh)
+        || memcmp (fh.magic, "DBPL", 4) || fh.id != h->id) {
+        goto out;
+    }
+
+    dbpl_relocate_pairs (&w, plt->journal_end + j.strings);
+    rec = calloc (1, j.size);
+    memcpy (rec, &j, sizeof (j));
+    memcpy (rec + j.runs, w.runs, w.nruns * sizeof (dbpl_run_t));
+    memcpy (rec + j.items, w.items, w.nitems * sizeof (dbpl_item_t));
+    memcpy (rec + j.pairs, w.pairs, w.npairs * sizeof (pl_meta_map_pair_t));
+    memcpy (rec + j.strings, w.buf, w.size);
+    j.checksum = dbpl_checksum (2166136261u, rec, j.size);
+    memcpy (rec + offsetof (dbpl_journal_t, checksum), &j.checksum, sizeof (j.checksum));
+
+    if (pwrite (fd, rec, j.size, plt->journal_end) != j.size) {
+        // don't leave a partial record behind
+        if (ftruncate (fd, plt->journal_end)) {
+            fprintf (stderr, "playlist journal truncate failed: %s\n", strerror (errno));
+        }
+        goto out;
+    }
+    plt->journal_end += j.size;
+    plt->journal_hash = hash;
+    res = 0;
+    if (plt->journal_end - saved_size > DBPL_JOURNAL_MIN_COMPACT
+        && (plt->journal_end - saved_size) * DBPL_JOURNAL_MAX_RATIO > saved_size) {
+        dbpl_compact_schedule (plt);
+    }
+out:
+    if (fd != -1) {
+        close (fd);
+    }
+    free (rec);
+    dbpl_writer_free (&w);
+    return res;
+}
+
+// collects the items and metadata of the whole playlist into w, and fills
+// the file header; must be called under pl_lock.
+// returns the size of the file, or 0 if the playlist is too large to save
+static uint32_t
+dbpl_build_full (playlist_t *plt, dbpl_writer_t *w, dbpl_header_t *h, int (*cb)(playItem_t *it, void *data), void *user_data) {
+    uint32_t cnt = plt->count[PL_MAIN];
+    memset (w, 0, sizeof (dbpl_writer_t));
+    // offset 0 is the empty string
+    dbpl_add_string (w, "");
+
+    uint32_t i = 0;
+    for (playItem_t *it = plt->head[PL_MAIN]; it && i < cnt; it = it->next[PL_MAIN], i++) {
+        if (cb) {
+            cb(it, user_data);
+        }
+        dbpl_add_item (w, it);
+    }
+    cnt = i;
+
+    // playlist metadata
+    uint32_t plt_meta = w->npairs;
+    for (DB_metaInfo_t *m = plt->meta; m; m = m->next) {
+        dbpl_add_pair (w, m->key, m->value);
+    }
+
+    memset (h, 0, sizeof (dbpl_header_t));
+    memcpy (h->magic, "DBPL", 4);
+    h->majorver = PLAYLIST_MAJOR_VER;
+    h->minorver = PLAYLIST_MINOR_VER;
+    h->id = dbpl_gen_id ();
+    h->count = cnt;
+    h->items = sizeof (dbpl_header_t);
+    h->pairs = h->items + cnt * sizeof (dbpl_item_t);
+    h->npairs = w->npairs;
+    h->strings = h->pairs + w->npairs * sizeof (pl_meta_map_pair_t);
+    h->strings_size = w->size;
+    h->plt_meta = plt_meta;
+    h->plt_nmeta = w->npairs - plt_meta;
+    if ((uint64_t)h->strings + DBPL_ALIGN ((uint64_t)w->size) > UINT32_MAX) {
+        return 0;
+    }
+    dbpl_relocate_pairs (w, h->strings);
+    return h->strings + DBPL_ALIGN (w->size);
+}
+
+// writes the file built by dbpl_build_full into tempfile, and frees w;
+// doesn't access the playlist, so it can be called without pl_lock
+static int
+dbpl_write_full (const char *tempfile, dbpl_writer_t *w, const dbpl_header_t *h) {
+    uint32_t pad = DBPL_ALIGN (w->size) - w->size;
+    static const uint8_t zeros[4];
+    FILE *fp = fopen (tempfile, "w+b");
+    if (!fp) {
+        goto save_fail;
+    }
+    if (fwrite (h, sizeof (dbpl_header_t), 1, fp) != 1) {
+        goto save_fail;
+    }
+    if (h->count && fwrite (w->items, sizeof (dbpl_item_t), h->count, fp) != h->count) {
+        goto save_fail;
+    }
+    if (w->npairs && fwrite (w->pairs, sizeof (pl_meta_map_pair_t), w->npairs, fp) != w->npairs) {
+        goto save_fail;
+    }
+    if (fwrite (w->buf, 1, w->size, fp) != w->size) {
+        goto save_fail;
+    }
+    if (pad && fwrite (zeros, 1, pad, fp) != pad) {
+        goto save_fail;
+    }
+    dbpl_writer_free (w);
+    if (fclose (fp)) {
+        unlink (tempfile);
+        return -1;
+    }
+    return 0;
+save_fail:
+    dbpl_writer_free (w);
+    if (fp) {
+        fclose (fp);
+        unlink (tempfile);
+    }
+    return -1;
+}
+
+// maps a file written by dbpl_write_full, to check which items are unchanged
+// on the next save; returns NULL on failure
+static pl_meta_map_t *
+dbpl_map_saved (const char *fname, uint32_t size) {
+    int fd = open (fname, O_RDONLY);
+    void *base = fd != -1 ? mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fd != -1) {
+        close (fd);
+    }
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    return pl_meta_map_alloc (base, size, base, size);
+}
+
+// writes the whole playlist into a new file;
+// with rebase set, later saves of the playlist append the changes to it
+static int
+plt_save_full (playlist_t *plt, const char *fname, int (*cb)(playItem_t *it, void *data), void *user_data, int rebase) {
+    dbpl_writer_t w;
+    dbpl_header_t h;
+    uint32_t size = dbpl_build_full (plt, &w, &h, cb, user_data);
+    if (!size) {
+        fprintf (stderr, "playlist %s is too large to save\n", fname);
+        dbpl_writer_free (&w);
+        return -1;
+    }
+
+    char tempfile[PATH_MAX];
+    snprintf (tempfile, sizeof (tempfile), "%s.tmp", fname);
+    if (dbpl_write_full (tempfile, &w, &h) < 0) {
+        return -1;
+    }
+    if (rename (tempfile, fname) != 0) {
+        fprintf (stderr, "playlist rename %s -> %s failed: %s\n", tempfile, fname, strerror (errno));
+        return -1;
+    }
+
+    if (rebase) {
+        pl_meta_map_t *map = dbpl_map_saved (fname, size);
+        if (map) {
+            uint32_t i = 0;
+            for (playItem_t *it = plt->head[PL_MAIN]; it && i < h.count; it = it->next[PL_MAIN], i++) {
+                it->_saved_id = h.id;
+                it->_saved_idx = i;
+            }
+        }
+        dbpl_set_saved (plt, map, map ? size : 0);
+    }
+    return 0;
+}
+
 int
 plt_save (playlist_t *plt, playItem_t *first, playItem_t *last, const char *fname, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
     LOCK;
@@ -1985,191 +3280,135 @@ plt_save (playlist_t *plt, playItem_t *first, playItem_t *last, const char *fnam
         }
     }
 
-    char tempfile[PATH_MAX];
-    snprintf (tempfile, sizeof (tempfile), "%s.tmp", fname);
-    const char magic[] = "DBPL";
-    uint8_t majorver = PLAYLIST_MAJOR_VER;
-    uint8_t minorver = PLAYLIST_MINOR_VER;
-    FILE *fp = fopen (tempfile, "w+b");
-    if (!fp) {
-        UNLOCK;
-        return -1;
-    }
-    if (fwrite (magic, 1, 4, fp) != 4) {
-        goto save_fail;
-    }
-    if (fwrite (&majorver, 1, 1, fp) != 1) {
-        goto save_fail;
-    }
-    if (fwrite (&minorver, 1, 1, fp) != 1) {
-        goto save_fail;
-    }
-    uint32_t cnt = plt->count[PL_MAIN];
-    if (fwrite (&cnt, 1, 4, fp) != 4) {
-        goto save_fail;
+    int res = plt_save_full (plt, fname, cb, user_data, 0);
+    UNLOCK;
+    return res;
+}
+
+// saves a playlist into its file in the config folder; small changes are
+// appended to the file, which is rewritten in the background once they add up
+static int
+plt_save_dbpl (playlist_t *plt, const char *path) {
+    LOCK;
+    int res = plt_save_journal (plt, path);
+    if (res < 0) {
+        res = plt_save_full (plt, path, NULL, NULL, 1);
     }
-    for (playItem_t *it = plt->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
-        uint16_t l;
-        uint8_t ll;
-        if (cb) {
-            cb(it, user_data);
-        }
-#if (PLAYLIST_MINOR_VER==2)
-        const char *fname = pl_find_meta_raw (it, ":URI");
-        l = strlen (fname);
-        if (fwrite (&l, 1, 2, fp) != 2) {
-            goto save_fail;
-        }
-        if (fwrite (fname, 1, l, fp) != l) {
-            goto save_fail;
-        }
-        const char *decoder_id = pl_find_meta_raw (it, ":DECODER");
-        if (decoder_id) {
-            ll = strlen (decoder_id);
-            if (fwrite (&ll, 1, 1, fp) != 1) {
-                goto save_fail;
-            }
-            if (fwrite (decoder_id, 1, ll, fp) != ll) {
-                goto save_fail;
-            }
-        }
-        else
-        {
-            ll = 0;
-            if (fwrite (&ll, 1, 1, fp) != 1) {
-                goto save_fail;
-            }
-        }
-        l = pl_find_meta_int (it, ":TRACKNUM", 0);
-        if (fwrite (&l, 1, 2, fp) != 2) {
-            goto save_fail;
-        }
-#endif
-        if (fwrite (&it->startsample, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-        if (fwrite (&it->endsample, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-        if (fwrite (&it->_duration, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-#if (PLAYLIST_MINOR_VER==2)
-        const char *filetype = pl_find_meta_raw (it, ":FILETYPE");
-        if (!filetype) {
-            filetype = "";
-        }
-        uint8_t ft = strlen (filetype);
-        if (fwrite (&ft, 1, 1, fp) != 1) {
-            goto save_fail;
-        }
-        if (ft) {
-            if (fwrite (filetype, 1, ft, fp) != ft) {
-                goto save_fail;
-            }
-        }
-        float rg_albumgain = pl_get_item_replaygain (it, DDB_REPLAYGAIN_ALBUMGAIN);
-        float rg_albumpeak = pl_get_item_replaygain (it, DDB_REPLAYGAIN_ALBUMPEAK);
-        float rg_trackgain = pl_get_item_replaygain (it, DDB_REPLAYGAIN_TRACKGAIN);
-        float rg_trackpeak = pl_get_item_replaygain (it, DDB_REPLAYGAIN_TRACKPEAK);
-        if (fwrite (&rg_albumgain, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-        if (fwrite (&rg_albumpeak, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-        if (fwrite (&rg_trackgain, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-        if (fwrite (&rg_trackpeak, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
-#endif
-        if (fwrite (&it->_flags, 1, 4, fp) != 4) {
-            goto save_fail;
-        }
+    UNLOCK;
+    return res;
+}
 
-        int16_t nm = 0;
-        DB_metaInfo_t *m;
-        for (m = it->meta; m; m = m->next) {
-            if (m->key[0] == '_' || m->key[0] == '!') {
-                continue; // skip reserved names
-            }
-            nm++;
+// rewrites the playlists flagged by dbpl_compact_schedule.
+// the file contents are collected under pl_lock, and written without it;
+// the new file replaces the old one under the lock again, since playlist
+// files get renamed under it when playlists are moved or removed
+static void
+dbpl_compact_thread (void *ctx) {
+    LOCK;
+    for (;;) {
+        int idx = 0;
+        playlist_t *p;
+        for (p = playlists_head; p && !p->compact_pending; p = p->next, idx++);
+        if (!p) {
+            break;
         }
-        if (fwrite (&nm, 1, 2, fp) != 2) {
-            goto save_fail;
+        p->compact_pending = 0;
+        char path[PATH_MAX];
+        char tempfile[PATH_MAX];
+        if (snprintf (path, sizeof (path), "%s/playlists/%d.dbpl", dbconfdir, idx) > sizeof (path)
+            || snprintf (tempfile, sizeof (tempfile), "%s.compact", path) > sizeof (tempfile)) {
+            continue;
         }
-        for (m = it->meta; m; m = m->next) {
-            if (m->key[0] == '_' || m->key[0] == '!') {
-                continue; // skip reserved names
-            }
+        trace ("compacting %s\n", path);
 
-            l = strlen (m->key);
-            if (fwrite (&l, 1, 2, fp) != 2) {
-                goto save_fail;
-            }
-            if (l) {
-                if (fwrite (m->key, 1, l, fp) != l) {
-                    goto save_fail;
-                }
-            }
-            l = strlen (m->value);
-            if (fwrite (&l, 1, 2, fp) != 2) {
-                goto save_fail;
-            }
-            if (l) {
-                if (fwrite (m->value, 1, l, fp) != l) {
-                    goto save_fail;
-                }
-            }
+        dbpl_writer_t w;
+        dbpl_header_t h;
+        uint32_t size = dbpl_build_full (p, &w, &h, NULL, NULL);
+        if (!size) {
+            dbpl_writer_free (&w);
+            continue;
         }
-    }
-
-    // write playlist metadata
-    int16_t nm = 0;
-    DB_metaInfo_t *m;
-    for (m = plt->meta; m; m = m->next) {
-        nm++;
-    }
-    if (fwrite (&nm, 1, 2, fp) != 2) {
-        goto save_fail;
-    }
+        // the items are marked as saved in the new file right away: metadata
+        // changes while it's being written reset _saved_id, so they get
+        // into the next journal record
+        playItem_t **items = malloc (h.count * sizeof (playItem_t *));
+        uint32_t *saved = malloc (h.count * 2 * sizeof (uint32_t));
+        uint32_t cnt = 0;
+        for (playItem_t *it = p->head[PL_MAIN]; it && cnt < h.count; it = it->next[PL_MAIN], cnt++) {
+            pl_item_ref (it);
+            items[cnt] = it;
+            saved[cnt*2] = it->_saved_id;
+            saved[cnt*2+1] = it->_saved_idx;
+            it->_saved_id = h.id;
+            it->_saved_idx = cnt;
+        }
+        pl_meta_map_t *saved_map = p->saved_map;
+        uint32_t journal_end = p->journal_end;
+        p->refc++;
+        UNLOCK;
 
-    for (m = plt->meta; m; m = m->next) {
-        uint16_t l;
-        l = strlen (m->key);
-        if (fwrite (&l, 1, 2, fp) != 2) {
-            goto save_fail;
-        }
-        if (l) {
-            if (fwrite (m->key, 1, l, fp) != l) {
-                goto save_fail;
+        int res = dbpl_write_full (tempfile, &w, &h);
+
+        LOCK;
+        int i = 0;
+        playlist_t *pp;
+        for (pp = playlists_head; pp && pp != p; pp = pp->next, i++);
+        if (!pp) {
+            i = -1;
+        }
+        if (res == 0 && i == idx && rename (tempfile, path) != 0) {
+            fprintf (stderr, "playlist rename %s -> %s failed: %s\n", tempfile, path, strerror (errno));
+            res = -1;
+        }
+        if (res < 0 || i != idx) {
+            // failed, or the playlist was moved or removed meanwhile
+            unlink (tempfile);
+            for (uint32_t k = 0; k < cnt; k++) {
+                if (items[k]->_saved_id == h.id) {
+                    items[k]->_saved_id = saved[k*2];
+                    items[k]->_saved_idx = saved[k*2+1];
+                }
             }
         }
-        l = strlen (m->value);
-        if (fwrite (&l, 1, 2, fp) != 2) {
-            goto save_fail;
-        }
-        if (l) {
-            if (fwrite (m->value, 1, l, fp) != l) {
-                goto save_fail;
+        else {
+            int changed = p->saved_map != saved_map || p->journal_end != journal_end;
+            pl_meta_map_t *map = dbpl_map_saved (path, size);
+            dbpl_set_saved (p, map, map ? size : 0);
+            // the playlist might have changed since the snapshot, so the
+            // next save must compare it against the new file
+            p->journal_hash = 0;
+            if (changed && plt_save_journal (p, path) < 0) {
+                // the changes saved meanwhile went into the replaced file
+                plt_save_full (p, path, NULL, NULL, 1);
             }
         }
+        for (uint32_t k = 0; k < cnt; k++) {
+            pl_item_unref (items[k]);
+        }
+        free (items);
+        free (saved);
+        plt_unref (p);
     }
-
+    dbpl_compact_running = 0;
     UNLOCK;
-    fclose (fp);
-    if (rename (tempfile, fname) != 0) {
-        fprintf (stderr, "playlist rename %s -> %s failed: %s\n", tempfile, fname, strerror (errno));
-        return -1;
+}
+
+// must be called under pl_lock
+// a playlist flagged while the thread is finishing is compacted after its next save
+static void
+dbpl_compact_schedule (playlist_t *plt) {
+    plt->compact_pending = 1;
+    if (dbpl_compact_running) {
+        return;
+    }
+    if (dbpl_compact_tid) {
+        thread_join (dbpl_compact_tid);
+    }
+    dbpl_compact_running = 1;
+    dbpl_compact_tid = thread_start_low_priority (dbpl_compact_thread, NULL);
+    if (!dbpl_compact_tid) {
+        dbpl_compact_running = 0;
     }
-    return 0;
-save_fail:
-    UNLOCK;
-    fclose (fp);
-    unlink (tempfile);
-    return -1;
 }
 
 int
@@ -2195,7 +3434,7 @@ plt_save_n (int n) {
     int i;
     playlist_t *plt;
     for (i = 0, plt = playlists_head; plt && i < n; i++, plt = plt->next);
-    err = plt_save (plt, NULL, NULL, path, NULL, NULL, NULL);
+    err = plt_save_dbpl (plt, path);
     plt_loading = 0;
     UNLOCK;
     return err;
@@ -2235,7 +3474,7 @@ pl_save_all (void) {
         if (p->last_save_modification_idx == p->modification_idx) {
             continue;
         }
-        err = plt_save (p, NULL, NULL, path, NULL, NULL, NULL);
+        err = plt_save_dbpl (p, path);
         if (err < 0) {
             break;
         }
@@ -2245,6 +3484,191 @@ pl_save_all (void) {
     return err;
 }
 
+// checks that the journal record at offs fits in the file, and is complete
+static const dbpl_journal_t *
+dbpl_journal_check (const uint8_t *base, size_t size, uint32_t offs, const dbpl_header_t *h) {
+    if ((uint64_t)offs + sizeof (dbpl_journal_t) > size) {
+        return NULL;
+    }
+    const dbpl_journal_t *j = (const dbpl_journal_t *)(base + offs);
+    if (memcmp (j->magic, "DBPJ", 4) || (j->size & 3) || j->size < sizeof (dbpl_journal_t)
+        || (uint64_t)offs + j->size > size
+        || (j->runs & 3) || (j->items & 3) || (j->pairs & 3)
+        || (uint64_t)j->runs + (uint64_t)j->nruns * sizeof (dbpl_run_t) > j->size
+        || (uint64_t)j->items + (uint64_t)j->nitems * sizeof (dbpl_item_t) > j->size
+        || (uint64_t)j->pairs + (uint64_t)j->npairs * sizeof (pl_meta_map_pair_t) > j->size
+        || !j->strings_size || (uint64_t)j->strings + j->strings_size > j->size
+        || base[offs + j->size - 1]
+        || (uint64_t)j->plt_meta + j->plt_nmeta > j->npairs) {
+        return NULL;
+    }
+    uint32_t checksum = dbpl_checksum (2166136261u, j, offsetof (dbpl_journal_t, checksum));
+    static const uint32_t zero;
+    checksum = dbpl_checksum (checksum, &zero, sizeof (zero));
+    checksum = dbpl_checksum (checksum, (const uint8_t *)j + offsetof (dbpl_journal_t, checksum) + sizeof (zero), j->size - offsetof (dbpl_journal_t, checksum) - sizeof (zero));
+    if (checksum != j->checksum) {
+        return NULL;
+    }
+    const dbpl_run_t *runs = (const dbpl_run_t *)((const uint8_t *)j + j->runs);
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < j->nruns; i++) {
+        uint32_t start = runs[i].start & ~DBPL_RUN_JOURNAL;
+        uint32_t n = (runs[i].start & DBPL_RUN_JOURNAL) ? j->nitems : h->count;
+        if ((uint64_t)start + runs[i].count > n) {
+            return NULL;
+        }
+        count += runs[i].count;
+    }
+    if (count != j->count) {
+        return NULL;
+    }
+    return j;
+}
+
+static playItem_t *
+dbpl_load_item (playlist_t *plt, pl_meta_map_t *map, const dbpl_item_t *rec, const pl_meta_map_pair_t *pairs, uint32_t npairs) {
+    if ((uint64_t)rec->meta + rec->nmeta > npairs) {
+        return NULL;
+    }
+    playItem_t *it = pl_item_alloc ();
+    it->startsample = rec->startsample;
+    it->endsample = rec->endsample;
+    it->_duration = rec->duration;
+    // :TAGS and other properties derived from flags are in the metadata
+    it->_flags = rec->flags;
+    pl_set_lazy_meta (it, map, pairs + rec->meta, rec->nmeta);
+    plt_insert_item (plt, plt->tail[PL_MAIN], it);
+    pl_item_unref (it);
+    return it;
+}
+
+// loads a 1.4 playlist, with the last complete journal record applied;
+// items reference the mapped file for their metadata until it's accessed,
+// so the cost doesn't depend on the amount of tags
+static playItem_t *
+plt_load_mapped (playlist_t *plt, const char *fname) {
+    int fd = open (fname, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat (fd, &st) || st.st_size < sizeof (dbpl_header_t) || st.st_size > UINT32_MAX) {
+        close (fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    uint8_t *base = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    const dbpl_header_t *h = (const dbpl_header_t *)base;
+    if ((h->items & 3) || (h->pairs & 3)
+        || (uint64_t)h->items + (uint64_t)h->count * sizeof (dbpl_item_t) > size
+        || (uint64_t)h->pairs + (uint64_t)h->npairs * sizeof (pl_meta_map_pair_t) > size
+        || !h->strings_size || (uint64_t)h->strings + h->strings_size > size
+        || base[h->strings + h->strings_size - 1]
+        || (uint64_t)h->plt_meta + h->plt_nmeta > h->npairs) {
+        trace ("plt_load: bad 1.4 header\n");
+        munmap (base, size);
+        fprintf (stderr, "playlist load fail (%s)!\n", fname);
+        return NULL;
+    }
+
+    // find the last complete journal record; a partially written one
+    // is overwritten by the next save
+    uint32_t end = DBPL_ALIGN (h->strings + h->strings_size);
+    if (end > size) {
+        end = size;
+    }
+    const dbpl_journal_t *j = NULL;
+    uint32_t offs = end;
+    for (;;) {
+        const dbpl_journal_t *next = dbpl_journal_check (base, size, offs, h);
+        if (!next) {
+            break;
+        }
+        j = next;
+        offs += j->size;
+        end = offs;
+    }
+
+    LOCK;
+    int was_empty = !plt->count[PL_MAIN];
+    pl_meta_map_t *map = pl_meta_map_alloc (base, size, (const char *)base, end);
+    const dbpl_item_t *items = (const dbpl_item_t *)(base + h->items);
+    const pl_meta_map_pair_t *pairs = (const pl_meta_map_pair_t *)(base + h->pairs);
+    const pl_meta_map_pair_t *plt_pairs = pairs + h->plt_meta;
+    uint32_t plt_nmeta = h->plt_nmeta;
+    playItem_t *last_added = NULL;
+    int fail = 0;
+    if (j) {
+        const uint8_t *jbase = (const uint8_t *)j;
+        const dbpl_run_t *runs = (const dbpl_run_t *)(jbase + j->runs);
+        const dbpl_item_t *jitems = (const dbpl_item_t *)(jbase + j->items);
+        const pl_meta_map_pair_t *jpairs = (const pl_meta_map_pair_t *)(jbase + j->pairs);
+        for (uint32_t r = 0; r < j->nruns && !fail; r++) {
+            uint32_t start = runs[r].start & ~DBPL_RUN_JOURNAL;
+            for (uint32_t i = start; i < start + runs[r].count; i++) {
+                playItem_t *it;
+                if (runs[r].start & DBPL_RUN_JOURNAL) {
+                    it = dbpl_load_item (plt, map, &jitems[i], jpairs, j->npairs);
+                }
+                else {
+                    it = dbpl_load_item (plt, map, &items[i], pairs, h->npairs);
+                    if (it) {
+                        it->_saved_id = h->id;
+                        it->_saved_idx = i;
+                    }
+                }
+                if (!it) {
+                    fail = 1;
+                    break;
+                }
+                last_added = it;
+            }
+        }
+        plt_pairs = jpairs + j->plt_meta;
+        plt_nmeta = j->plt_nmeta;
+    }
+    else {
+        for (uint32_t i = 0; i < h->count; i++) {
+            playItem_t *it = dbpl_load_item (plt, map, &items[i], pairs, h->npairs);
+            if (!it) {
+                fail = 1;
+                break;
+            }
+            it->_saved_id = h->id;
+            it->_saved_idx = i;
+            last_added = it;
+        }
+    }
+
+    if (fail) {
+        plt_clear (plt);
+        fprintf (stderr, "playlist load fail (%s)!\n", fname);
+        last_added = NULL;
+    }
+    else {
+        for (uint32_t i = 0; i < plt_nmeta; i++) {
+            const pl_meta_map_pair_t *p = &plt_pairs[i];
+            if (p->key < map->strings_size && p->value < map->strings_size) {
+                plt_add_meta (plt, map->strings + p->key, map->strings + p->value);
+            }
+        }
+        if (was_empty) {
+            // next save can append to this file
+            pl_meta_map_ref (map);
+            dbpl_set_saved (plt, map, end);
+        }
+    }
+    pl_meta_map_unref (map);
+    UNLOCK;
+    trace ("plt_load: success\n");
+    return last_added;
+}
+
 static playItem_t *
 plt_load_int (int visibility, playlist_t *plt, playItem_t *after, const char *fname, int *pabort, int (*cb)(playItem_t *it, void *data), void *user_data) {
     // try plugins 1st
@@ -2300,10 +3724,14 @@ plt_load_int (int visibility, playlist_t *plt, playItem_t *after, const char *fn
     if (fread (&minorver, 1, 1, fp) != 1) {
         goto load_fail;
     }
-    if (minorver < 1) {
+    if (minorver < 1 || minorver > PLAYLIST_MINOR_VER) {
         trace ("bad minorver=%d\n", minorver);
         goto load_fail;
     }
+    if (minorver >= 4) {
+        fclose (fp);
+        return plt_load_mapped (plt, fname);
+    }
     trace ("playlist version=%d.%d\n", majorver, minorver);
     uint32_t cnt;
     if (fread (&cnt, 1, 4, fp) != 4) {
@@ -2626,16 +4054,246 @@ pl_select_all (void) {
     UNLOCK;
 }
 
+// Shuffle order: the items of a playlist sorted by shufflerating, with items
+// of the same album, which share the rating, in list order. The order of
+// unplayed items is the order they will be played in, so next and previous
+// tracks are found by looking at the neighbours of the current one.
+static int
+plt_shuffle_cmp (const void *a, const void *b) {
+    const playItem_t *x = *(playItem_t * const *)a;
+    const playItem_t *y = *(playItem_t * const *)b;
+    if (x->shufflerating != y->shufflerating) {
+        return x->shufflerating < y->shufflerating ? -1 : 1;
+    }
+    return x->_idx[PL_MAIN] - y->_idx[PL_MAIN];
+}
+
+static void
+plt_shuffle_free (playlist_t *plt) {
+    free (plt->shuffle);
+    free (plt->shuffle_pending);
+    plt->shuffle = plt->shuffle_pending = NULL;
+    plt->shuffle_count = plt->shuffle_size = plt->shuffle_removed = plt->shuffle_next = 0;
+    plt->shuffle_npending = plt->shuffle_pending_size = 0;
+    plt->shuffle_valid = 0;
+}
+
+static void
+plt_shuffle_pending_add (playlist_t *plt, playItem_t *it) {
+    if (plt->shuffle_npending == plt->shuffle_pending_size) {
+        plt->shuffle_pending_size = plt->shuffle_pending_size ? plt->shuffle_pending_size * 2 : 64;
+        plt->shuffle_pending = realloc (plt->shuffle_pending, plt->shuffle_pending_size * sizeof (playItem_t *));
+    }
+    it->_shuffle_idx = -2 - plt->shuffle_npending;
+    plt->shuffle_pending[plt->shuffle_npending++] = it;
+}
+
+static void
+plt_shuffle_insert (playlist_t *plt, playItem_t *it) {
+    it->_shuffle_idx = -1;
+    if (plt->shuffle_valid) {
+        plt_shuffle_pending_add (plt, it);
+    }
+}
+
+static void
+plt_shuffle_remove (playlist_t *plt, playItem_t *it) {
+    int idx = it->_shuffle_idx;
+    it->_shuffle_idx = -1;
+    if (!plt->shuffle_valid) {
+        return;
+    }
+    if (idx >= 0 && idx < plt->shuffle_count && plt->shuffle[idx] == it) {
+        plt->shuffle[idx] = NULL;
+        plt->shuffle_removed++;
+    }
+    else if (idx <= -2 && -2 - idx < plt->shuffle_npending && plt->shuffle_pending[-2 - idx] == it) {
+        playItem_t *last = plt->shuffle_pending[--plt->shuffle_npending];
+        plt->shuffle_pending[-2 - idx] = last;
+        last->_shuffle_idx = idx;
+    }
+}
+
+// merges pending insertions into the shuffle order and drops the slots of
+// removed items, or rebuilds the order from the list after sorting
+static void
+plt_shuffle_update (playlist_t *plt) {
+    if (!plt->shuffle_valid) {
+        plt->shuffle_count = plt->shuffle_removed = plt->shuffle_next = plt->shuffle_npending = 0;
+        for (playItem_t *it = plt->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
+            plt_shuffle_pending_add (plt, it);
+        }
+        plt->shuffle_valid = 1;
+    }
+    else if (!plt->shuffle_npending && plt->shuffle_removed * 2 <= plt->shuffle_count) {
+        return;
+    }
+
+    if (plt->shuffle_npending) {
+        // ties are broken by list order
+        plt_index_update (plt, PL_MAIN);
+        qsort (plt->shuffle_pending, plt->shuffle_npending, sizeof (playItem_t *), plt_shuffle_cmp);
+    }
+    int size = plt->shuffle_count - plt->shuffle_removed + plt->shuffle_npending;
+    playItem_t **merged = malloc ((size ? size : 1) * sizeof (playItem_t *));
+    int i = 0;
+    int k = 0;
+    int out = 0;
+    int next = -1;
+    for (;;) {
+        while (i < plt->shuffle_count && !plt->shuffle[i]) {
+            i++;
+        }
+        playItem_t *a = i < plt->shuffle_count ? plt->shuffle[i] : NULL;
+        playItem_t *b = k < plt->shuffle_npending ? plt->shuffle_pending[k] : NULL;
+        if (!a && !b) {
+            break;
+        }
+        playItem_t *it;
+        if (a && (!b || plt_shuffle_cmp (&a, &b) <= 0)) {
+            if (next < 0 && i >= plt->shuffle_next) {
+                next = out;
+            }
+            it = a;
+            i++;
+        }
+        else {
+            // inserted items are unplayed
+            if (next < 0) {
+                next = out;
+            }
+            it = b;
+            k++;
+        }
+        it->_shuffle_idx = out;
+        merged[out++] = it;
+    }
+    free (plt->shuffle);
+    plt->shuffle = merged;
+    plt->shuffle_count = out;
+    plt->shuffle_size = size;
+    plt->shuffle_removed = 0;
+    plt->shuffle_npending = 0;
+    plt->shuffle_next = next < 0 ? out : next;
+}
+
+// returns the first slot with rating >= r, or > r if upper is set;
+// the slot may be empty
+static int
+plt_shuffle_bound (playlist_t *plt, int rating, int upper) {
+    int lo = 0;
+    int hi = plt->shuffle_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int m = mid;
+        while (m < hi && !plt->shuffle[m]) {
+            m++;
+        }
+        if (m == hi) {
+            hi = mid;
+            continue;
+        }
+        int r = plt->shuffle[m]->shufflerating;
+        if (r < rating || (upper && r == rating)) {
+            lo = m + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// returns the last played item in the slots below end, other than skip;
+// of the played items with the same rating, the first one in list order
+static playItem_t *
+plt_shuffle_last_played (playlist_t *plt, int end, playItem_t *skip) {
+    for (int i = end - 1; i >= 0; i--) {
+        playItem_t *it = plt->shuffle[i];
+        if (!it || it == skip || !it->played) {
+            continue;
+        }
+        for (int j = i - 1; j >= 0; j--) {
+            playItem_t *p = plt->shuffle[j];
+            if (!p || p == skip) {
+                continue;
+            }
+            if (p->shufflerating != it->shufflerating) {
+                break;
+            }
+            if (p->played) {
+                i = j;
+            }
+        }
+        return plt->shuffle[i];
+    }
+    return NULL;
+}
+
+playItem_t *
+plt_shuffle_next (playlist_t *plt, playItem_t *curr) {
+    LOCK;
+    plt_shuffle_update (plt);
+    int start = plt->shuffle_next;
+    if (curr) {
+        int slot = plt_shuffle_bound (plt, curr->shufflerating, 0);
+        if (slot > start) {
+            start = slot;
+        }
+    }
+    playItem_t *res = NULL;
+    int i;
+    for (i = start; i < plt->shuffle_count; i++) {
+        playItem_t *it = plt->shuffle[i];
+        if (it && !it->played) {
+            res = it;
+            break;
+        }
+    }
+    if (start == plt->shuffle_next) {
+        plt->shuffle_next = i;
+    }
+    UNLOCK;
+    return res;
+}
+
+playItem_t *
+plt_shuffle_prev (playlist_t *plt, playItem_t *curr, playItem_t **pamax) {
+    LOCK;
+    plt_shuffle_update (plt);
+    playItem_t *res = plt_shuffle_last_played (plt, plt_shuffle_bound (plt, curr->shufflerating, 1), curr);
+    if (pamax) {
+        *pamax = res ? NULL : plt_shuffle_last_played (plt, plt->shuffle_count, curr);
+    }
+    UNLOCK;
+    return res;
+}
+
+void
+plt_shuffle_unplayed (playlist_t *plt, playItem_t *it) {
+    LOCK;
+    it->played = 0;
+    int idx = it->_shuffle_idx;
+    if (plt->shuffle_valid && idx >= 0 && idx < plt->shuffle_next && plt->shuffle[idx] == it) {
+        plt->shuffle_next = idx;
+    }
+    UNLOCK;
+}
+
 void
 plt_reshuffle (playlist_t *playlist, playItem_t **ppmin, playItem_t **ppmax) {
     LOCK;
-    playItem_t *pmin = NULL;
-    playItem_t *pmax = NULL;
+    int count = playlist->count[PL_MAIN];
+    playItem_t **items = malloc ((count ? count : 1) * sizeof (playItem_t *));
+    // in album shuffle mode, consecutive tracks of an album make a group
+    int *groups = malloc ((count + 1) * sizeof (int));
+    int ngroups = 0;
+    int n = 0;
     playItem_t *prev = NULL;
     const char *alb = NULL;
     const char *art = NULL;
     const char *aa = NULL;
-    for (playItem_t *it = playlist->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
+    for (playItem_t *it = playlist->head[PL_MAIN]; it && n < count; it = it->next[PL_MAIN]) {
         const char *new_aa = NULL;
         new_aa = pl_find_meta_raw (it, "band");
         if (!new_aa) {
@@ -2644,30 +4302,56 @@ plt_reshuffle (playlist_t *playlist, playItem_t **ppmin, playItem_t **ppmax) {
         if (!new_aa) {
             new_aa = pl_find_meta_raw (it, "albumartist");
         }
-        if (pl_order == PLAYBACK_ORDER_SHUFFLE_ALBUMS && prev && alb == pl_find_meta_raw (it, "album") && ((aa && new_aa && aa == new_aa) || art == pl_find_meta_raw (it, "artist"))) {
-            it->shufflerating = prev->shufflerating;
-        }
-        else {
+        int same_album = pl_order == PLAYBACK_ORDER_SHUFFLE_ALBUMS && prev && alb == pl_find_meta_raw (it, "album") && ((aa && new_aa && aa == new_aa) || art == pl_find_meta_raw (it, "artist"));
+        if (!same_album) {
             prev = it;
-            it->shufflerating = rand ();
+            groups[ngroups++] = n;
             alb = pl_find_meta_raw (it, "album");
             art = pl_find_meta_raw (it, "artist");
             aa = new_aa;
         }
-        if (!pmin || it->shufflerating < pmin->shufflerating) {
-            pmin = it;
-        }
-        if (!pmax || it->shufflerating > pmax->shufflerating) {
-            pmax = it;
-        }
         it->played = 0;
+        items[n++] = it;
+    }
+    groups[ngroups] = n;
+
+    // Fisher-Yates shuffle of the groups
+    int *order = malloc ((ngroups ? ngroups : 1) * sizeof (int));
+    for (int g = 0; g < ngroups; g++) {
+        order[g] = g;
+    }
+    for (int g = ngroups - 1; g > 0; g--) {
+        int j = (int)(rand () / ((double)RAND_MAX + 1) * (g + 1));
+        int tmp = order[g];
+        order[g] = order[j];
+        order[j] = tmp;
     }
+
+    // ratings are spread over the range of rand (), like those of the
+    // items inserted later, so that these get mixed in
+    plt_shuffle_free (playlist);
+    playlist->shuffle = malloc ((n ? n : 1) * sizeof (playItem_t *));
+    playlist->shuffle_size = n;
+    for (int r = 0; r < ngroups; r++) {
+        int g = order[r];
+        int rating = (int)((int64_t)r * RAND_MAX / ngroups);
+        for (int k = groups[g]; k < groups[g+1]; k++) {
+            items[k]->shufflerating = rating;
+            items[k]->_shuffle_idx = playlist->shuffle_count;
+            playlist->shuffle[playlist->shuffle_count++] = items[k];
+        }
+    }
+    playlist->shuffle_valid = 1;
+
     if (ppmin) {
-        *ppmin = pmin;
+        *ppmin = n ? playlist->shuffle[0] : NULL;
     }
     if (ppmax) {
-        *ppmax = pmax;
+        *ppmax = ngroups ? items[groups[order[ngroups-1]]] : NULL;
     }
+    free (order);
+    free (groups);
+    free (items);
     UNLOCK;
 }
 
@@ -2741,7 +4425,7 @@ pl_get_item_replaygain (playItem_t *it, int idx) {
 
 int
 pl_format_item_queue (playItem_t *it, char *s, int size) {
-    LOCK;
+    pl_lock_read ();
     *s = 0;
     int initsize = size;
     const char *val = pl_find_meta_raw (it, "_playing");
@@ -2789,7 +4473,7 @@ pl_format_item_queue (playItem_t *it, char *s, int size) {
     }
 
     if (!playqueue_count) {
-        UNLOCK;
+        pl_unlock_read ();
         return 0;
     }
 
@@ -2820,7 +4504,7 @@ pl_format_item_queue (playItem_t *it, char *s, int size) {
         s += len;
         size -= len;
     }
-    UNLOCK;
+    pl_unlock_read ();
     return initsize-size;
 }
 
@@ -2848,24 +4532,131 @@ pl_format_duration (playItem_t *it, const char *ret, char *dur, int size) {
     if (ret) {
         return ret;
     }
-    pl_format_time (pl_get_item_duration (it), dur, size);
-    return dur;
+    pl_format_time (pl_get_item_duration (it), dur, size);
+    return dur;
+}
+
+static const char *
+pl_format_elapsed (const char *ret, char *elapsed, int size) {
+    if (ret) {
+        return ret;
+    }
+    float playpos = streamer_get_playpos ();
+    pl_format_time (playpos, elapsed, size);
+    return elapsed;
+}
+
+// Title formatting is done in two steps: the format string is compiled into
+// a list of instructions once, which is then evaluated for every item.
+// The compiled code is a byte string:
+//   TF_TEXT, uint16 length, text
+//   TF_FIELD, conversion character
+//   TF_META, uint32 metadata key id (%@key@)
+//   TF_ESCAPE_SLASH (%/)
+//   TF_END
+enum {
+    TF_END,
+    TF_TEXT,
+    TF_FIELD,
+    TF_META,
+    TF_ESCAPE_SLASH,
+};
+
+#define TF_MAX_TEXT 0xffff
+
+// upper bound of the compiled size of fmt
+static size_t
+pl_tf_code_size (const char *fmt) {
+    size_t l = strlen (fmt);
+    return l * 3 + (l / TF_MAX_TEXT + 1) * 3 + 1;
+}
+
+static char *
+pl_tf_emit_text (char *c, const char *text, size_t len) {
+    while (len > 0) {
+        uint16_t l = len > TF_MAX_TEXT ? TF_MAX_TEXT : len;
+        *c++ = TF_TEXT;
+        memcpy (c, &l, sizeof (l));
+        c += sizeof (l);
+        memcpy (c, text, l);
+        c += l;
+        text += l;
+        len -= l;
+    }
+    return c;
+}
+
+// compiles fmt into code, which must hold pl_tf_code_size(fmt) bytes
+static void
+pl_tf_compile_int (const char *fmt, char *code) {
+    char *c = code;
+    const char *text = fmt;
+    while (*fmt) {
+        if (*fmt != '%') {
+            fmt++;
+            continue;
+        }
+        c = pl_tf_emit_text (c, text, fmt - text);
+        fmt++;
+        text = fmt;
+        if (*fmt == 0) {
+            break;
+        }
+        if (*fmt == '@') {
+            const char *e = fmt+1;
+            while (*e && *e != '@') {
+                e++;
+            }
+            if (*e == '@') {
+                char nm[100];
+                int l = e-fmt-1;
+                l = min (l, sizeof (nm)-1);
+                strncpy (nm, fmt+1, l);
+                nm[l] = 0;
+                uint32_t keyid = pl_meta_keyid (nm);
+                *c++ = TF_META;
+                memcpy (c, &keyid, sizeof (keyid));
+                c += sizeof (keyid);
+                fmt = e;
+            }
+        }
+        else if (*fmt == '/') {
+            *c++ = TF_ESCAPE_SLASH;
+        }
+        else if (strchr ("atbBCnNygcrleTfFdDLXZV", *fmt)) {
+            *c++ = TF_FIELD;
+            *c++ = *fmt;
+        }
+        else {
+            // unknown conversions are printed as is
+            c = pl_tf_emit_text (c, fmt, 1);
+        }
+        fmt++;
+        text = fmt;
+    }
+    c = pl_tf_emit_text (c, text, fmt - text);
+    *c = TF_END;
 }
 
-static const char *
-pl_format_elapsed (const char *ret, char *elapsed, int size) {
-    if (ret) {
-        return ret;
+char *
+pl_tf_compile (const char *fmt) {
+    if (!fmt) {
+        return NULL;
     }
-    float playpos = streamer_get_playpos ();
-    pl_format_time (playpos, elapsed, size);
-    return elapsed;
+    char *code = malloc (pl_tf_code_size (fmt));
+    pl_tf_compile_int (fmt, code);
+    return code;
+}
+
+void
+pl_tf_free (char *code) {
+    free (code);
 }
 
 // this function allows to escape special chars substituted for conversions
 // @escape_chars: list of escapable characters terminated with 0, or NULL if none
 static int
-pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s, int size, int id, const char *fmt) {
+pl_tf_eval_int (const char *escape_chars, const char *code, playItem_t *it, int idx, char *s, int size, int id) {
     char tmp[50];
     char tags[200];
     char dirname[PATH_MAX];
@@ -2875,24 +4666,26 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
 
     char *ss = s;
 
-    LOCK;
     if (id != -1 && it) {
+        // the playlist index is rebuilt under the write lock, so look it up
+        // before taking the read lock
+        if (id == DB_COLUMN_FILENUMBER && idx == -1) {
+            idx = pl_get_idx_of (it);
+        }
+        pl_lock_read ();
         const char *text = NULL;
         switch (id) {
         case DB_COLUMN_FILENUMBER:
-            if (idx == -1) {
-                idx = pl_get_idx_of (it);
-            }
             snprintf (tmp, sizeof (tmp), "%d", idx+1);
             text = tmp;
             break;
         case DB_COLUMN_PLAYING:
-            UNLOCK;
+            pl_unlock_read ();
             return pl_format_item_queue (it, s, size);
         }
         if (text) {
             strncpy (s, text, size);
-            UNLOCK;
+            pl_unlock_read ();
             for (ss = s; *ss; ss++) {
                 if (*ss == '\n') {
                     *ss = ';';
@@ -2903,48 +4696,48 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
         else {
             s[0] = 0;
         }
-        UNLOCK;
+        pl_unlock_read ();
         return 0;
     }
+    // formatting only reads the item
+    pl_lock_read ();
     int n = size-1;
-    while (*fmt && n > 0) {
-        if (*fmt != '%') {
-            *s++ = *fmt;
-            n--;
+    while (code && *code != TF_END && n > 0) {
+        if (*code == TF_TEXT) {
+            uint16_t l;
+            memcpy (&l, code+1, sizeof (l));
+            code += 1 + sizeof (l);
+            int len = min (l, n);
+            memcpy (s, code, len);
+            s += len;
+            n -= len;
+            code += l;
+            continue;
         }
-        else {
-            fmt++;
-            const char *meta = NULL;
-            if (*fmt == 0) {
-                break;
-            }
-            else if (!it && *fmt != 'V') {
-                // only %V (version) works without track pointer
-            }
-            else if (*fmt == '@') {
-                const char *e = fmt;
-                e++;
-                while (*e && *e != '@') {
-                    e++;
-                }
-                if (*e == '@') {
-                    char nm[100];
-                    int l = e-fmt-1;
-                    l = min (l, sizeof (nm)-1);
-                    strncpy (nm, fmt+1, l);
-                    nm[l] = 0;
-                    meta = pl_find_meta_raw (it, nm);
-                    if (!meta) {
-                        meta = "";
-                    }
-                    fmt = e;
+        const char *meta = NULL;
+        if (*code == TF_ESCAPE_SLASH) {
+            // this means all '/' in the ongoing fields must be replaced with '\'
+            escape_slash = 1;
+            code++;
+        }
+        else if (*code == TF_META) {
+            uint32_t keyid;
+            memcpy (&keyid, code+1, sizeof (keyid));
+            code += 1 + sizeof (keyid);
+            if (it) {
+                meta = pl_find_meta_id (it, keyid);
+                if (!meta) {
+                    meta = "";
                 }
             }
-            else if (*fmt == '/') {
-                // this means all '/' in the ongoing fields must be replaced with '\'
-                escape_slash = 1;
+        }
+        else {
+            char f = code[1];
+            code += 2;
+            if (!it && f != 'V') {
+                // only %V (version) works without track pointer
             }
-            else if (*fmt == 'a') {
+            else if (f == 'a') {
                 meta = pl_find_meta_raw (it, "artist");
 #ifndef DISABLE_CUSTOM_TITLE
                 const char *custom = pl_find_meta_raw (it, ":CUSTOM_TITLE");
@@ -2971,7 +4764,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                 }
 #endif
             }
-            else if (*fmt == 't') {
+            else if (f == 't') {
                 meta = pl_find_meta_raw (it, "title");
                 if (!meta) {
                     const char *f = pl_find_meta_raw (it, ":URI");
@@ -3000,13 +4793,13 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     }
                 }
             }
-            else if (*fmt == 'b') {
+            else if (f == 'b') {
                 meta = pl_find_meta_raw (it, "album");
                 if (!meta) {
                     meta = "Unknown album";
                 }
             }
-            else if (*fmt == 'B') {
+            else if (f == 'B') {
                 meta = pl_find_meta_raw (it, "band");
                 if (!meta) {
                     meta = pl_find_meta_raw (it, "album artist");
@@ -3033,10 +4826,10 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                 }
 #endif
             }
-            else if (*fmt == 'C') {
+            else if (f == 'C') {
                 meta = pl_find_meta_raw (it, "composer");
             }
-            else if (*fmt == 'n') {
+            else if (f == 'n') {
                 meta = pl_find_meta_raw (it, "track");
                 if (meta) {
                     // check if it's numbers only
@@ -3053,29 +4846,29 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     }
                 }
             }
-            else if (*fmt == 'N') {
+            else if (f == 'N') {
                 meta = pl_find_meta_raw (it, "numtracks");
             }
-            else if (*fmt == 'y') {
+            else if (f == 'y') {
                 meta = pl_find_meta_raw (it, "year");
             }
-            else if (*fmt == 'g') {
+            else if (f == 'g') {
                 meta = pl_find_meta_raw (it, "genre");
             }
-            else if (*fmt == 'c') {
+            else if (f == 'c') {
                 meta = pl_find_meta_raw (it, "comment");
             }
-            else if (*fmt == 'r') {
+            else if (f == 'r') {
                 meta = pl_find_meta_raw (it, "copyright");
             }
-            else if (*fmt == 'l') {
+            else if (f == 'l') {
                 const char *value = (duration = pl_format_duration (it, duration, tmp, sizeof (tmp)));
                 while (n > 0 && *value) {
                     *s++ = *value++;
                     n--;
                 }
             }
-            else if (*fmt == 'e') {
+            else if (f == 'e') {
                 // what a hack..
                 const char *value = (elapsed = pl_format_elapsed (elapsed, tmp, sizeof (tmp)));
                 while (n > 0 && *value) {
@@ -3083,7 +4876,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     n--;
                 }
             }
-            else if (*fmt == 'f') {
+            else if (f == 'f') {
                 const char *f = pl_find_meta_raw (it, ":URI");
                 meta = strrchr (f, '/');
                 if (meta) {
@@ -3093,10 +4886,10 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     meta = f;
                 }
             }
-            else if (*fmt == 'F') {
+            else if (f == 'F') {
                 meta = pl_find_meta_raw (it, ":URI");
             }
-            else if (*fmt == 'T') {
+            else if (f == 'T') {
                 char *t = tags;
                 char *e = tags + sizeof (tags);
                 int c;
@@ -3143,7 +4936,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                 }
                 meta = tags;
             }
-            else if (*fmt == 'd') {
+            else if (f == 'd') {
                 // directory
                 const char *f = pl_find_meta_raw (it, ":URI");
                 const char *end = strrchr (f, '/');
@@ -3169,7 +4962,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     meta = dirname;
                 }
             }
-            else if (*fmt == 'D') {
+            else if (f == 'D') {
                 const char *f = pl_find_meta_raw (it, ":URI");
                 // directory with path
                 const char *end = strrchr (f, '/');
@@ -3185,7 +4978,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     meta = dirname;
                 }
             }
-            else if (*fmt == 'L') {
+            else if (f == 'L') {
                 float l = 0;
                 for (playItem_t *it = playlist->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
                     if (it->selected) {
@@ -3195,7 +4988,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                 pl_format_time (l, tmp, sizeof(tmp));
                 meta = tmp;
             }
-            else if (*fmt == 'X') {
+            else if (f == 'X') {
                 int n = 0;
                 for (playItem_t *it = playlist->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
                     if (it->selected) {
@@ -3205,7 +4998,7 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                 snprintf (tmp, sizeof (tmp), "%d", n);
                 meta = tmp;
             }
-            else if (*fmt == 'Z') {
+            else if (f == 'Z') {
                 DB_fileinfo_t *c = deadbeef->streamer_get_current_fileinfo (); // FIXME: might crash streamer
                 if (c) {
                     if (c->fmt.channels <= 2) {
@@ -3217,70 +5010,66 @@ pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s,
                     }
                 }
             }
-            else if (*fmt == 'V') {
+            else if (f == 'V') {
                 meta = VERSION;
             }
-            else {
-                *s++ = *fmt;
-                n--;
-            }
+        }
 
-            if (meta) {
-                const char *value = meta;
-                if (escape_chars) {
-                    // need space for at least 2 single-quotes
-                    if (n < 2) {
-                        goto error;
+        if (meta) {
+            const char *value = meta;
+            if (escape_chars) {
+                // need space for at least 2 single-quotes
+                if (n < 2) {
+                    goto error;
+                }
+                *s++ = '\'';
+                n--;
+                while (n > 2 && *value) {
+                    const char *e = escape_chars;
+                    if (strchr (escape_chars, *value)) {
+                        *s++ = '\\';
+                        n--;
+                        *s++ = *value++;
+                        n--;
                     }
-                    *s++ = '\'';
-                    n--;
-                    while (n > 2 && *value) {
-                        const char *e = escape_chars;
-                        if (strchr (escape_chars, *value)) {
-                            *s++ = '\\';
-                            n--;
-                            *s++ = *value++;
-                            n--;
-                        }
-                        else if (escape_slash && *value == '/') {
-                            *s++ = '\\';
-                            n--;
-                            *s++ = '\\';
-                            n--;
-                            break;
-                        }
-                        else {
-                            *s++ = *value++;
-                        }
+                    else if (escape_slash && *value == '/') {
+                        *s++ = '\\';
+                        n--;
+                        *s++ = '\\';
+                        n--;
+                        break;
                     }
-                    if (n < 1) {
-                        fprintf (stderr, "pl_format_title_int: got unpredicted state while formatting escaped string. please report a bug.\n");
-                        *ss = 0; // should never happen
-                        return -1; 
+                    else {
+                        *s++ = *value++;
                     }
-                    *s++ = '\'';
-                    n--;
                 }
-                else {
-                    while (n > 0 && *value) {
-                        if (escape_slash && *value == '/') {
-                            *s++ = '\\';
-                            n--;
-                            value++;
-                        }
-                        else {
-                            *s++ = *value++;
-                            n--;
-                        }
+                if (n < 1) {
+                    fprintf (stderr, "pl_format_title_int: got unpredicted state while formatting escaped string. please report a bug.\n");
+                    *ss = 0; // should never happen
+                    pl_unlock_read ();
+                    return -1;
+                }
+                *s++ = '\'';
+                n--;
+            }
+            else {
+                while (n > 0 && *value) {
+                    if (escape_slash && *value == '/') {
+                        *s++ = '\\';
+                        n--;
+                        value++;
+                    }
+                    else {
+                        *s++ = *value++;
+                        n--;
                     }
                 }
             }
         }
-        fmt++;
     }
 error:
     *s = 0;
-    UNLOCK;
+    pl_unlock_read ();
 
     // replace all \n with ;
     while (*ss) {
@@ -3293,6 +5082,91 @@ error:
     return size - n - 1;
 }
 
+int
+pl_tf_eval (const char *code, playItem_t *it, int idx, char *s, int size, int id, int escape) {
+    return pl_tf_eval_int (escape ? "'" : NULL, code, it, idx, s, size, id);
+}
+
+int
+pl_tf_eval_range (const char *code, playItem_t *first, int iter, int count, char **out, int size, int id) {
+    // file numbers need the playlist index, which is only updated under the
+    // write lock
+    int numbers = id == DB_COLUMN_FILENUMBER;
+    if (numbers) {
+        LOCK;
+    }
+    else {
+        pl_lock_read ();
+    }
+    int idx = first && numbers ? pl_get_idx_of_iter (first, iter) : -1;
+    int i;
+    playItem_t *it = first;
+    for (i = 0; it && i < count; i++, it = it->next[iter]) {
+        pl_tf_eval_int (NULL, code, it, idx == -1 ? -1 : idx + i, out[i], size, id);
+    }
+    if (numbers) {
+        UNLOCK;
+    }
+    else {
+        pl_unlock_read ();
+    }
+    return i;
+}
+
+// recently used pl_format_title formats, compiled once per thread.
+// keyids never change once assigned, so the cached code stays valid
+#define TF_CACHE_SIZE 4
+#define TF_CACHE_FMT_SIZE 128
+#define TF_CACHE_CODE_SIZE (TF_CACHE_FMT_SIZE * 4)
+
+typedef struct {
+    char fmt[TF_CACHE_FMT_SIZE];
+    char code[TF_CACHE_CODE_SIZE];
+    int used;
+} pl_tf_cache_t;
+
+static __thread pl_tf_cache_t tf_cache[TF_CACHE_SIZE];
+static __thread int tf_cache_next;
+
+// returns NULL if fmt is too long to be cached
+static const char *
+pl_tf_cache_get (const char *fmt) {
+    size_t l = strlen (fmt);
+    if (l >= TF_CACHE_FMT_SIZE || pl_tf_code_size (fmt) > TF_CACHE_CODE_SIZE) {
+        return NULL;
+    }
+    for (int i = 0; i < TF_CACHE_SIZE; i++) {
+        if (tf_cache[i].used && !strcmp (tf_cache[i].fmt, fmt)) {
+            return tf_cache[i].code;
+        }
+    }
+    pl_tf_cache_t *c = &tf_cache[tf_cache_next];
+    tf_cache_next = (tf_cache_next + 1) % TF_CACHE_SIZE;
+    memcpy (c->fmt, fmt, l + 1);
+    pl_tf_compile_int (fmt, c->code);
+    c->used = 1;
+    return c->code;
+}
+
+static int
+pl_format_title_int (const char *escape_chars, playItem_t *it, int idx, char *s, int size, int id, const char *fmt) {
+    if (id != -1 || !fmt) {
+        return pl_tf_eval_int (escape_chars, NULL, it, idx, s, size, id);
+    }
+    const char *code = pl_tf_cache_get (fmt);
+    char *buf = NULL;
+    if (!code) {
+        buf = malloc (pl_tf_code_size (fmt));
+        pl_tf_compile_int (fmt, buf);
+        code = buf;
+    }
+    int res = pl_tf_eval_int (escape_chars, code, it, idx, s, size, id);
+    if (buf) {
+        free (buf);
+    }
+    return res;
+}
+
 int
 pl_format_title (playItem_t *it, int idx, char *s, int size, int id, const char *fmt) {
     return pl_format_title_int (NULL, it, idx, s, size, id, fmt);
@@ -3306,8 +5180,10 @@ pl_format_title_escaped (playItem_t *it, int idx, char *s, int size, int id, con
 static int pl_sort_is_duration;
 static int pl_sort_is_track;
 static int pl_sort_ascending;
-static int pl_sort_id;
-static const char *pl_sort_format;
+
+// sort keys are formatted this many items at a time, see pl_tf_eval_range
+#define PL_SORT_CHUNK 64
+#define PL_SORT_KEY_SIZE 1024
 
 int
 strcasecmp_numeric (const char *a, const char *b) {
@@ -3334,51 +5210,125 @@ strcasecmp_numeric (const char *a, const char *b) {
     return u8_strcasecmp (a,b);
 }
 
+// sort key of one item, computed once per sort
+typedef struct {
+    playItem_t *it;
+    float duration;
+    int num; // track number, or leading number of the title if has_num
+    int has_num;
+    int key; // offset of the case-folded title in the key buffer
+    int rest; // offset of the text after the leading number
+} pl_sort_entry_t;
+
+// case-folds title into the key buffer, returns the offset of the result
+// plain strcmp on the folded keys orders like u8_strcasecmp
 static int
-pl_sort_compare_str (playItem_t *a, playItem_t *b) {
+pl_sort_add_key (char **keys, int *size, int *len, const char *title) {
+    int offs = *len;
+    const char *p = title;
+    for (;;) {
+        if (*len + 10 > *size) {
+            *size = *size ? *size * 2 : 65536;
+            *keys = realloc (*keys, *size);
+        }
+        if (!*p) {
+            break;
+        }
+        int32_t i = 0;
+        u8_nextchar (p, &i);
+        *len += u8_tolower ((const signed char *)p, i, *keys + *len);
+        p += i;
+    }
+    (*keys)[(*len)++] = 0;
+    return offs;
+}
+
+static void
+pl_sort_make_entry (pl_sort_entry_t *e, playItem_t *it, const char *text, char **keys, int *size, int *len) {
+    memset (e, 0, sizeof (pl_sort_entry_t));
+    e->it = it;
     if (pl_sort_is_duration) {
-        float dur_a = a->_duration * 100000;
-        float dur_b = b->_duration * 100000;
-        return !pl_sort_ascending ? dur_b - dur_a : dur_a - dur_b;
+        e->duration = it->_duration;
     }
     else if (pl_sort_is_track) {
-        int t1;
-        int t2;
-        const char *t;
-        t = pl_find_meta_raw (a, "track");
-        if (t && !isdigit (*t)) {
-            t1 = 999999;
-        }
-        else {
-            t1 = t ? atoi (t) : -1;
-        }
-        t = pl_find_meta_raw (b, "track");
+        const char *t = pl_find_meta_raw (it, "track");
         if (t && !isdigit (*t)) {
-            t2 = 999999;
+            e->num = 999999;
         }
         else {
-            t2 = t ? atoi (t) : -1;
+            e->num = t ? atoi (t) : -1;
         }
-        return !pl_sort_ascending ? t2 - t1 : t1 - t2;
     }
     else {
-        char tmp1[1024];
-        char tmp2[1024];
-        pl_format_title (a, -1, tmp1, sizeof (tmp1), pl_sort_id, pl_sort_format);
-        pl_format_title (b, -1, tmp2, sizeof (tmp2), pl_sort_id, pl_sort_format);
-        int res = strcasecmp_numeric (tmp1, tmp2);
-        if (!pl_sort_ascending) {
-            res = -res;
+        e->key = pl_sort_add_key (keys, size, len, text);
+        // leading number, compared numerically, see strcasecmp_numeric
+        const char *p = text;
+        if (isdigit (*p)) {
+            e->has_num = 1;
+            while (isdigit (*p)) {
+                e->num = e->num * 10 + (*p - '0');
+                p++;
+            }
         }
-        return res;
+        e->rest = e->key + (int)(p - text);
     }
 }
 
 static int
-qsort_cmp_func (const void *a, const void *b) {
-    playItem_t *aa = *((playItem_t **)a);
-    playItem_t *bb = *((playItem_t **)b);
-    return pl_sort_compare_str (aa, bb);
+pl_sort_compare_entries (const pl_sort_entry_t *a, const pl_sort_entry_t *b, const char *keys) {
+    int res;
+    if (pl_sort_is_duration) {
+        res = (a->duration > b->duration) - (a->duration < b->duration);
+    }
+    else if (pl_sort_is_track) {
+        res = (a->num > b->num) - (a->num < b->num);
+    }
+    else if (a->has_num && b->has_num && a->num != b->num) {
+        res = a->num < b->num ? -1 : 1;
+    }
+    else if (a->has_num && b->has_num) {
+        res = strcmp (keys + a->rest, keys + b->rest);
+    }
+    else {
+        res = strcmp (keys + a->key, keys + b->key);
+    }
+    return pl_sort_ascending ? res : -res;
+}
+
+// stable merge sort of entries[0..n), tmp must hold n entries
+static void
+pl_sort_entries (pl_sort_entry_t *entries, pl_sort_entry_t *tmp, int n, const char *keys) {
+    if (n <= 16) {
+        for (int i = 1; i < n; i++) {
+            pl_sort_entry_t e = entries[i];
+            int j = i;
+            while (j > 0 && pl_sort_compare_entries (&entries[j-1], &e, keys) > 0) {
+                entries[j] = entries[j-1];
+                j--;
+            }
+            entries[j] = e;
+        }
+        return;
+    }
+    int half = n / 2;
+    pl_sort_entries (entries, tmp, half, keys);
+    pl_sort_entries (entries + half, tmp, n - half, keys);
+    if (pl_sort_compare_entries (&entries[half-1], &entries[half], keys) <= 0) {
+        return; // already in order
+    }
+    memcpy (tmp, entries, half * sizeof (pl_sort_entry_t));
+    int i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        if (pl_sort_compare_entries (&entries[j], &tmp[i], keys) < 0) {
+            entries[k++] = entries[j++];
+        }
+        else {
+            entries[k++] = tmp[i++];
+        }
+    }
+    while (i < half) {
+        entries[k++] = tmp[i++];
+    }
 }
 
 void
@@ -3397,8 +5347,6 @@ plt_sort (playlist_t *playlist, int iter, int id, const char *format, int order)
     gettimeofday (&tm1, NULL);
     pl_sort_ascending = ascending;
     trace ("ascending: %d\n", ascending);
-    pl_sort_id = id;
-    pl_sort_format = format;
     if (format && id == -1 && !strcmp (format, "%l")) {
         pl_sort_is_duration = 1;
     }
@@ -3412,16 +5360,44 @@ plt_sort (playlist_t *playlist, int iter, int id, const char *format, int order)
         pl_sort_is_track = 0;
     }
 
-    playItem_t **array = malloc (playlist->count[iter] * sizeof (playItem_t *));
+    // format every sort key once, instead of twice per comparison
+    char *code = NULL;
+    if (!pl_sort_is_duration && !pl_sort_is_track && id == -1) {
+        code = pl_tf_compile (format);
+    }
+    int count = playlist->count[iter];
+    pl_sort_entry_t *entries = malloc (count * 2 * sizeof (pl_sort_entry_t));
+    char *keys = NULL;
+    int keys_size = 0;
+    int keys_len = 0;
+    char *texts = NULL;
+    char *out[PL_SORT_CHUNK];
+    if (!pl_sort_is_duration && !pl_sort_is_track) {
+        texts = malloc (PL_SORT_CHUNK * PL_SORT_KEY_SIZE);
+        for (int i = 0; i < PL_SORT_CHUNK; i++) {
+            out[i] = texts + i * PL_SORT_KEY_SIZE;
+        }
+    }
     int idx = 0;
-    for (playItem_t *it = playlist->head[iter]; it; it = it->next[iter], idx++) {
-        array[idx] = it;
+    playItem_t *it = playlist->head[iter];
+    while (it) {
+        int n = 1;
+        if (texts) {
+            n = pl_tf_eval_range (code, it, iter, PL_SORT_CHUNK, out, PL_SORT_KEY_SIZE, id);
+        }
+        for (int i = 0; i < n; i++, idx++, it = it->next[iter]) {
+            pl_sort_make_entry (&entries[idx], it, texts ? out[i] : NULL, &keys, &keys_size, &keys_len);
+        }
     }
-    qsort (array, playlist->count[iter], sizeof (playItem_t *), qsort_cmp_func);
+    free (texts);
+    pl_sort_entries (entries, entries + count, count, keys);
+    free (keys);
+    pl_tf_free (code);
+
     playItem_t *prev = NULL;
     playlist->head[iter] = 0;
-    for (idx = 0; idx < playlist->count[iter]; idx++) {
-        playItem_t *it = array[idx];
+    for (idx = 0; idx < count; idx++) {
+        playItem_t *it = entries[idx].it;
         it->prev[iter] = prev;
         it->next[iter] = NULL;
         if (!prev) {
@@ -3433,9 +5409,13 @@ plt_sort (playlist_t *playlist, int iter, int id, const char *format, int order)
         prev = it;
     }
 
-    playlist->tail[iter] = array[playlist->count[iter]-1];
+    playlist->tail[iter] = prev;
+    playlist->index_valid[iter] = 0;
+    if (iter == PL_MAIN) {
+        playlist->shuffle_valid = 0; // ties are in list order
+    }
 
-    free (array);
+    free (entries);
 
     struct timeval tm2;
     gettimeofday (&tm2, NULL);
@@ -3489,6 +5469,10 @@ plt_sort_random (playlist_t *playlist, int iter) {
         prev = it;
     }
     playlist->tail[iter] = array[playlist->count[iter]-1];
+    playlist->index_valid[iter] = 0;
+    if (iter == PL_MAIN) {
+        playlist->shuffle_valid = 0; // ties are in list order
+    }
 
     free (array);
 
@@ -3709,6 +5693,325 @@ plt_copy_items (playlist_t *to, int iter, playlist_t *from, playItem_t *before,
     pl_unlock ();
 }
 
+// search index: the distinct searchable values of a playlist, lowercased,
+// with the items each of them belongs to, and trigrams of the values.
+// values are deduplicated by address, since they are interned in metacache.
+// the index is dropped when items are added or removed, and rebuilt on the
+// next search if searchable metadata has changed since, see pl_meta_search_gen
+typedef struct {
+    uint32_t key; // 3 bytes of lowercased text, 0 for empty slots
+    uint32_t start; // into trigram_values
+    uint32_t count;
+} pl_search_trigram_t;
+
+typedef struct pl_search_index_s {
+    uint32_t meta_gen;
+    char *text; // lowercased values, NUL-terminated
+    uint32_t nvalues;
+    uint32_t *value_text; // offset in text, or UINT32_MAX for invalid utf8
+    uint32_t *value_items; // start of the value's items, nvalues+1 entries
+    playItem_t **items;
+    pl_search_trigram_t *trigrams;
+    uint32_t trigram_size; // power of 2
+    uint32_t *trigram_values;
+    // the last query and its matching values, to refine while the query grows
+    char *last_query;
+    uint32_t *last_matches;
+    uint32_t nlast_matches;
+} pl_search_index_t;
+
+#define SEARCH_TRIGRAM(p) (((uint32_t)(uint8_t)(p)[0] << 16) | ((uint32_t)(uint8_t)(p)[1] << 8) | (uint8_t)(p)[2])
+
+static uint32_t
+search_hash (uint32_t key) {
+    return key * 2654435761u;
+}
+
+static pl_search_trigram_t *
+search_trigram_find (pl_search_index_t *idx, uint32_t key) {
+    uint32_t mask = idx->trigram_size - 1;
+    for (uint32_t i = search_hash (key) & mask; ; i = (i + 1) & mask) {
+        pl_search_trigram_t *t = &idx->trigrams[i];
+        if (t->key == key || !t->key) {
+            return t;
+        }
+    }
+}
+
+// appends lowercased utf8 to a growing buffer; returns the new size
+static uint32_t
+search_lowercase (const char *str, char **buf, uint32_t size, uint32_t *alloc) {
+    while (*str) {
+        int32_t i = 0;
+        char s[10];
+        u8_nextchar (str, &i);
+        int l = u8_tolower ((const signed char *)str, i, s);
+        if (size + l + 1 > *alloc) {
+            *alloc = *alloc ? *alloc * 2 : 65536;
+            *buf = realloc (*buf, *alloc);
+        }
+        memcpy (*buf + size, s, l);
+        size += l;
+        str += i;
+    }
+    if (size + 1 > *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 65536;
+        *buf = realloc (*buf, *alloc);
+    }
+    (*buf)[size++] = 0;
+    return size;
+}
+
+static void
+plt_search_index_free (playlist_t *plt) {
+    pl_search_index_t *idx = plt->search_index;
+    if (!idx) {
+        return;
+    }
+    free (idx->text);
+    free (idx->value_text);
+    free (idx->value_items);
+    free (idx->items);
+    free (idx->trigrams);
+    free (idx->trigram_values);
+    free (idx->last_query);
+    free (idx->last_matches);
+    free (idx);
+    plt->search_index = NULL;
+}
+
+static int
+search_cmp_u32 (const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static pl_search_index_t *
+plt_search_index_build (playlist_t *plt) {
+    pl_search_index_t *idx = calloc (1, sizeof (pl_search_index_t));
+    idx->meta_gen = pl_meta_search_gen ();
+
+    // collect (value, item) pairs, numbering the distinct values
+    uint32_t npairs = 0, pairs_alloc = 0;
+    uint32_t *pair_value = NULL;
+    playItem_t **pair_item = NULL;
+    const char **hash_str = NULL;
+    uint32_t *hash_id = NULL;
+    uint32_t hash_size = 0;
+    uint32_t values_alloc = 0;
+    uint32_t text_size = 0, text_alloc = 0;
+
+    for (playItem_t *it = plt->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
+        for (DB_metaInfo_t *m = pl_get_metadata_head (it); m; m = m->next) {
+            int is_uri = !strcmp (m->key, ":URI");
+            if ((m->key[0] == ':' && !is_uri) || m->key[0] == '_' || m->key[0] == '!') {
+                break;
+            }
+            if (!strcasecmp (m->key, "cuesheet") || !strcasecmp (m->key, "log")) {
+                continue;
+            }
+            const char *value = m->value;
+            if (is_uri) {
+                value = strrchr (value, '/');
+                value = value ? value + 1 : m->value;
+            }
+
+            if ((idx->nvalues + 1) * 2 > hash_size) {
+                const char **str = hash_str;
+                uint32_t *id = hash_id;
+                uint32_t size = hash_size;
+                hash_size = size ? size * 2 : 4096;
+                hash_str = calloc (hash_size, sizeof (const char *));
+                hash_id = malloc (hash_size * sizeof (uint32_t));
+                for (uint32_t i = 0; i < size; i++) {
+                    if (str[i]) {
+                        uint32_t h = search_hash ((uint32_t)((uintptr_t)str[i] >> 2)) & (hash_size-1);
+                        while (hash_str[h]) {
+                            h = (h + 1) & (hash_size-1);
+                        }
+                        hash_str[h] = str[i];
+                        hash_id[h] = id[i];
+                    }
+                }
+                free (str);
+                free (id);
+            }
+            uint32_t h = search_hash ((uint32_t)((uintptr_t)value >> 2)) & (hash_size-1);
+            while (hash_str[h] && hash_str[h] != value) {
+                h = (h + 1) & (hash_size-1);
+            }
+            if (!hash_str[h]) {
+                // new value
+                if (idx->nvalues == values_alloc) {
+                    values_alloc = values_alloc ? values_alloc * 2 : 4096;
+                    idx->value_text = realloc (idx->value_text, values_alloc * sizeof (uint32_t));
+                }
+                if (u8_valid (value, strlen (value), NULL)) {
+                    idx->value_text[idx->nvalues] = text_size;
+                    text_size = search_lowercase (value, &idx->text, text_size, &text_alloc);
+                }
+                else {
+                    idx->value_text[idx->nvalues] = UINT32_MAX;
+                }
+                hash_str[h] = value;
+                hash_id[h] = idx->nvalues++;
+            }
+
+            if (npairs == pairs_alloc) {
+                pairs_alloc = pairs_alloc ? pairs_alloc * 2 : 4096;
+                pair_value = realloc (pair_value, pairs_alloc * sizeof (uint32_t));
+                pair_item = realloc (pair_item, pairs_alloc * sizeof (playItem_t *));
+            }
+            pair_value[npairs] = hash_id[h];
+            pair_item[npairs] = it;
+            npairs++;
+        }
+    }
+    free (hash_str);
+    free (hash_id);
+
+    // group items by value
+    idx->value_items = calloc (idx->nvalues + 1, sizeof (uint32_t));
+    for (uint32_t i = 0; i < npairs; i++) {
+        idx->value_items[pair_value[i]+1]++;
+    }
+    for (uint32_t v = 0; v < idx->nvalues; v++) {
+        idx->value_items[v+1] += idx->value_items[v];
+    }
+    idx->items = malloc ((npairs ? npairs : 1) * sizeof (playItem_t *));
+    uint32_t *fill = malloc ((idx->nvalues + 1) * sizeof (uint32_t));
+    memcpy (fill, idx->value_items, (idx->nvalues + 1) * sizeof (uint32_t));
+    for (uint32_t i = 0; i < npairs; i++) {
+        idx->items[fill[pair_value[i]]++] = pair_item[i];
+    }
+    free (fill);
+    free (pair_value);
+    free (pair_item);
+
+    // distinct trigrams of each value
+    uint32_t *keys = NULL;
+    uint32_t nkeys = 0, keys_alloc = 0;
+    uint32_t *value_keys = malloc ((idx->nvalues + 1) * sizeof (uint32_t));
+    for (uint32_t v = 0; v < idx->nvalues; v++) {
+        value_keys[v] = nkeys;
+        if (idx->value_text[v] == UINT32_MAX) {
+            continue;
+        }
+        const char *s = idx->text + idx->value_text[v];
+        size_t l = strlen (s);
+        if (l < 3) {
+            continue;
+        }
+        if (nkeys + l > keys_alloc) {
+            while (nkeys + l > keys_alloc) {
+                keys_alloc = keys_alloc ? keys_alloc * 2 : 65536;
+            }
+            keys = realloc (keys, keys_alloc * sizeof (uint32_t));
+        }
+        uint32_t first = nkeys;
+        for (size_t i = 0; i + 2 < l; i++) {
+            keys[nkeys++] = SEARCH_TRIGRAM (s + i);
+        }
+        qsort (keys + first, nkeys - first, sizeof (uint32_t), search_cmp_u32);
+        uint32_t n = first;
+        for (uint32_t i = first; i < nkeys; i++) {
+            if (i == first || keys[i] != keys[n-1]) {
+                keys[n++] = keys[i];
+            }
+        }
+        nkeys = n;
+    }
+    value_keys[idx->nvalues] = nkeys;
+
+    // count values per trigram, then fill the lists
+    idx->trigram_size = 1024;
+    while (idx->trigram_size < nkeys) {
+        idx->trigram_size *= 2;
+    }
+    idx->trigrams = calloc (idx->trigram_size, sizeof (pl_search_trigram_t));
+    uint32_t ntrigrams = 0;
+    for (uint32_t i = 0; i < nkeys; i++) {
+        if ((ntrigrams + 1) * 2 > idx->trigram_size) {
+            pl_search_trigram_t *old = idx->trigrams;
+            uint32_t size = idx->trigram_size;
+            idx->trigram_size *= 2;
+            idx->trigrams = calloc (idx->trigram_size, sizeof (pl_search_trigram_t));
+            for (uint32_t j = 0; j < size; j++) {
+                if (old[j].key) {
+                    *search_trigram_find (idx, old[j].key) = old[j];
+                }
+            }
+            free (old);
+        }
+        pl_search_trigram_t *t = search_trigram_find (idx, keys[i]);
+        if (!t->key) {
+            t->key = keys[i];
+            ntrigrams++;
+        }
+        t->count++;
+    }
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < idx->trigram_size; i++) {
+        idx->trigrams[i].start = start;
+        start += idx->trigrams[i].count;
+        idx->trigrams[i].count = 0;
+    }
+    idx->trigram_values = malloc ((nkeys ? nkeys : 1) * sizeof (uint32_t));
+    for (uint32_t v = 0; v < idx->nvalues; v++) {
+        for (uint32_t i = value_keys[v]; i < value_keys[v+1]; i++) {
+            pl_search_trigram_t *t = search_trigram_find (idx, keys[i]);
+            idx->trigram_values[t->start + t->count++] = v;
+        }
+    }
+    free (keys);
+    free (value_keys);
+    return idx;
+}
+
+// returns the values of the index containing lc, in *matches
+static uint32_t
+plt_search_index_query (pl_search_index_t *idx, const char *lc, uint32_t **matches) {
+    const uint32_t *cand = NULL;
+    uint32_t ncand = idx->nvalues;
+    size_t l = strlen (lc);
+    if (idx->last_query && strstr (lc, idx->last_query)) {
+        // the query grew, only the last matches can still match
+        cand = idx->last_matches;
+        ncand = idx->nlast_matches;
+    }
+    else if (l >= 3) {
+        // values which have the rarest trigram of the query
+        pl_search_trigram_t *best = NULL;
+        for (size_t i = 0; i + 2 < l; i++) {
+            uint32_t key = SEARCH_TRIGRAM (lc + i);
+            pl_search_trigram_t *t = search_trigram_find (idx, key);
+            if (!t->key) {
+                ncand = 0;
+                break;
+            }
+            if (!best || t->count < best->count) {
+                best = t;
+            }
+        }
+        if (ncand && best) {
+            cand = idx->trigram_values + best->start;
+            ncand = best->count;
+        }
+    }
+
+    uint32_t *out = malloc ((ncand ? ncand : 1) * sizeof (uint32_t));
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ncand; i++) {
+        uint32_t v = cand ? cand[i] : i;
+        if (idx->value_text[v] != UINT32_MAX && strstr (idx->text + idx->value_text[v], lc)) {
+            out[n++] = v;
+        }
+    }
+    *matches = out;
+    return n;
+}
+
 void
 plt_search_reset (playlist_t *playlist) {
     LOCK;
@@ -3721,6 +6024,7 @@ plt_search_reset (playlist_t *playlist) {
     }
     playlist->tail[PL_SEARCH] = NULL;
     playlist->count[PL_SEARCH] = 0;
+    playlist->index_valid[PL_SEARCH] = 0;
     UNLOCK;
 }
 
@@ -3737,7 +6041,6 @@ plt_search_process (playlist_t *playlist, const char *text) {
     while (*p) {
         int32_t i = 0;
         char s[10];
-        const char *next;
         u8_nextchar (p, &i);
         int l = u8_tolower (p, i, s);
         n -= l;
@@ -3750,73 +6053,52 @@ plt_search_process (playlist_t *playlist, const char *text) {
     }
     *out = 0;
 
-    static int cmpidx = 0;
-    cmpidx++;
-    if (cmpidx > 127) {
-        cmpidx = 1;
+    for (playItem_t *it = playlist->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
+        it->selected = 0;
+    }
+    if (!*text || !u8_valid (lc, strlen (lc), NULL)) {
+        UNLOCK;
+        return;
+    }
+
+    pl_search_index_t *idx = playlist->search_index;
+    if (idx && idx->meta_gen != pl_meta_search_gen ()) {
+        plt_search_index_free (playlist);
+        idx = NULL;
+    }
+    if (!idx) {
+        idx = playlist->search_index = plt_search_index_build (playlist);
+    }
+
+    uint32_t *matches;
+    uint32_t nmatches = plt_search_index_query (idx, lc, &matches);
+    for (uint32_t i = 0; i < nmatches; i++) {
+        uint32_t v = matches[i];
+        for (uint32_t k = idx->value_items[v]; k < idx->value_items[v+1]; k++) {
+            idx->items[k]->selected = 1;
+        }
     }
+    free (idx->last_query);
+    free (idx->last_matches);
+    idx->last_query = strdup (lc);
+    idx->last_matches = matches;
+    idx->nlast_matches = nmatches;
 
+    // add to list, in playlist order
     for (playItem_t *it = playlist->head[PL_MAIN]; it; it = it->next[PL_MAIN]) {
-        it->selected = 0;
-        if (*text) {
-            DB_metaInfo_t *m = NULL;
-            for (m = it->meta; m; m = m->next) {
-                int is_uri = !strcmp (m->key, ":URI");
-                if ((m->key[0] == ':' && !is_uri) || m->key[0] == '_' || m->key[0] == '!') {
-                    break;
-                }
-                const char *value = m->value;
-                if (is_uri) {
-                    value = strrchr (value, '/');
-                    if (value) {
-                        value++;
-                    }
-                    else {
-                        value = m->value;
-                    }
-                }
-                if (strcasecmp(m->key, "cuesheet") && strcasecmp (m->key, "log")) {
-                    char cmp = *(m->value-1);
-
-                    if (abs (cmp) == cmpidx) {
-                        if (cmp > 0) {
-                            it->next[PL_SEARCH] = NULL;
-                            it->prev[PL_SEARCH] = playlist->tail[PL_SEARCH];
-                            if (playlist->tail[PL_SEARCH]) {
-                                playlist->tail[PL_SEARCH]->next[PL_SEARCH] = it;
-                                playlist->tail[PL_SEARCH] = it;
-                            }
-                            else {
-                                playlist->head[PL_SEARCH] = playlist->tail[PL_SEARCH] = it;
-                            }
-                            it->selected = 1;
-                            playlist->count[PL_SEARCH]++;
-                            break;
-                        }
-                    }
-                    else if (u8_valid(value, strlen(value), NULL) && u8_valid(lc, strlen(lc), NULL) && utfcasestr_fast (value, lc)) {
-                        //fprintf (stderr, "%s -> %s match (%s.%s)\n", text, value, pl_find_meta_raw (it, ":URI"), m->key);
-                        // add to list
-                        it->next[PL_SEARCH] = NULL;
-                        it->prev[PL_SEARCH] = playlist->tail[PL_SEARCH];
-                        if (playlist->tail[PL_SEARCH]) {
-                            playlist->tail[PL_SEARCH]->next[PL_SEARCH] = it;
-                            playlist->tail[PL_SEARCH] = it;
-                        }
-                        else {
-                            playlist->head[PL_SEARCH] = playlist->tail[PL_SEARCH] = it;
-                        }
-                        it->selected = 1;
-                        playlist->count[PL_SEARCH]++;
-                        *((char *)m->value-1) = cmpidx;
-                        break;
-                    }
-                    else {
-                        *((char *)m->value-1) = -cmpidx;
-                    }
-                }
-            }
+        if (!it->selected) {
+            continue;
+        }
+        it->next[PL_SEARCH] = NULL;
+        it->prev[PL_SEARCH] = playlist->tail[PL_SEARCH];
+        if (playlist->tail[PL_SEARCH]) {
+            playlist->tail[PL_SEARCH]->next[PL_SEARCH] = it;
+            playlist->tail[PL_SEARCH] = it;
+        }
+        else {
+            playlist->head[PL_SEARCH] = playlist->tail[PL_SEARCH] = it;
         }
+        playlist->count[PL_SEARCH]++;
     }
     UNLOCK;
 }
@@ -3947,7 +6229,7 @@ pl_playqueue_getcount (void) {
 void
 pl_items_copy_junk (playItem_t *from, playItem_t *first, playItem_t *last) {
     LOCK;
-    DB_metaInfo_t *meta = from->meta;
+    DB_metaInfo_t *meta = pl_get_metadata_head (from);
     while (meta) {
         playItem_t *i;
         for (i = first; i; i = i->next[PL_MAIN]) {
@@ -40,6 +40,21 @@
 // :TRACKNUM - subsong index (sid, nsf, cue, etc)
 // :DURATION - length in seconds
 
+// a playlist file mapped into memory, which loaded items keep their metadata
+// in until it's first accessed, see plt_load_int
+typedef struct pl_meta_map_s {
+    void *base;
+    size_t size;
+    const char *strings; // NUL-terminated strings, referenced by offset
+    uint32_t strings_size;
+    int refc;
+} pl_meta_map_t;
+
+typedef struct {
+    uint32_t key; // offsets into pl_meta_map_t.strings
+    uint32_t value;
+} pl_meta_map_pair_t;
+
 typedef struct playItem_s {
     int startsample;
     int endsample;
@@ -50,7 +65,19 @@ typedef struct playItem_s {
     int _refc;
     struct playItem_s *next[PL_MAX_ITERATORS]; // next item in linked list
     struct playItem_s *prev[PL_MAX_ITERATORS]; // prev item in linked list
+    int _idx[PL_MAX_ITERATORS]; // position in playlist index, see plt_index_update
     struct DB_metaInfo_s *meta; // linked list storing metainfo
+    // metadata not yet copied from a mapped playlist file
+    pl_meta_map_t *_meta_map;
+    const pl_meta_map_pair_t *_meta_pairs;
+    uint32_t _meta_npairs;
+    // position in the last fully saved playlist file, valid while
+    // _saved_id matches it; reset when metadata changes
+    uint32_t _saved_id;
+    uint32_t _saved_idx;
+    // slot in playlist shuffle order, or -2-n for n-th pending insertion,
+    // see plt_shuffle_update
+    int _shuffle_idx;
     unsigned selected : 1;
     unsigned played : 1; // mark as played in shuffle mode
     unsigned in_playlist : 1; // 1 if item is in playlist
@@ -66,12 +93,37 @@ typedef struct playlist_s {
     playItem_t *head[PL_MAX_ITERATORS]; // head of linked list
     playItem_t *tail[PL_MAX_ITERATORS]; // tail of linked list
     int current_row[PL_MAX_ITERATORS]; // current row (cursor)
+    // arrays of items in list order, for access by index;
+    // rebuilt on demand after changes which can't be applied in place
+    playItem_t **index[PL_MAX_ITERATORS];
+    int index_count[PL_MAX_ITERATORS];
+    int index_size[PL_MAX_ITERATORS];
+    int index_valid[PL_MAX_ITERATORS];
     int scroll;
     struct DB_metaInfo_s *meta; // linked list storing metainfo
     int refc;
     int files_add_visibility;
+    // the last fully saved playlist file, which changes are appended to,
+    // see plt_save_journal
+    pl_meta_map_t *saved_map;
+    uint32_t journal_end;
+    uint32_t journal_hash;
+    // built on demand by plt_search_process
+    struct pl_search_index_s *search_index;
+    // items ordered by shufflerating, then list order; removed items leave
+    // NULL slots, inserted ones wait in shuffle_pending until the next lookup
+    playItem_t **shuffle;
+    int shuffle_count;
+    int shuffle_size;
+    int shuffle_removed;
+    int shuffle_next; // no unplayed items in the slots below
+    playItem_t **shuffle_pending;
+    int shuffle_npending;
+    int shuffle_pending_size;
+    unsigned shuffle_valid : 1;
     unsigned fast_mode : 1;
     unsigned files_adding : 1;
+    unsigned compact_pending : 1;
 } playlist_t;
 
 // global playlist control functions
@@ -87,6 +139,18 @@ pl_lock (void);
 void
 pl_unlock (void);
 
+// shared lock for sections which only read playlists and items,
+// see the comment in playlist.c
+void
+pl_lock_read (void);
+
+void
+pl_unlock_read (void);
+
+// rereads config options of the playlist module
+void
+pl_configchanged (void);
+
 //void
 //plt_lock (void);
 //
@@ -266,6 +330,14 @@ pl_find_meta (playItem_t *it, const char *key);
 const char *
 pl_find_meta_raw (playItem_t *it, const char *key);
 
+// returns the interned id of a metadata key, for use with pl_find_meta_id
+uint32_t
+pl_meta_keyid (const char *key);
+
+// same as pl_find_meta_raw, but takes a key id
+const char *
+pl_find_meta_id (playItem_t *it, uint32_t keyid);
+
 int
 pl_find_meta_int (playItem_t *it, const char *key, int def);
 
@@ -287,6 +359,39 @@ pl_delete_meta (playItem_t *it, const char *key);
 void
 pl_delete_all_meta (playItem_t *it);
 
+// copies all metadata and properties of `from` to `to`, which must have none
+void
+pl_copy_meta (playItem_t *to, playItem_t *from);
+
+// deletes all metadata and properties
+void
+pl_free_meta (playItem_t *it);
+
+void
+plmeta_init (void);
+
+void
+plmeta_free (void);
+
+// takes ownership of a mapping, which is unmapped with the last reference
+pl_meta_map_t *
+pl_meta_map_alloc (void *base, size_t size, const char *strings, uint32_t strings_size);
+
+void
+pl_meta_map_ref (pl_meta_map_t *map);
+
+void
+pl_meta_map_unref (pl_meta_map_t *map);
+
+// makes the item use the metadata pairs from the map, until it's accessed;
+// the item must have no metadata
+void
+pl_set_lazy_meta (playItem_t *it, pl_meta_map_t *map, const pl_meta_map_pair_t *pairs, uint32_t npairs);
+
+// changes whenever searchable metadata of any item changes
+uint32_t
+pl_meta_search_gen (void);
+
 // returns index of 1st deleted item
 int
 plt_delete_selected (playlist_t *plt);
@@ -327,6 +432,21 @@ pl_select_all (void);
 void
 plt_reshuffle (playlist_t *playlist, playItem_t **ppmin, playItem_t **ppmax);
 
+// returns the first unplayed item in shuffle order, or with curr, the first
+// unplayed item which is not before curr's album
+playItem_t *
+plt_shuffle_next (playlist_t *plt, playItem_t *curr);
+
+// returns the last played item before curr in shuffle order; with albums,
+// the first played item of its album. *pamax is set to the last played
+// item, if there's none before curr
+playItem_t *
+plt_shuffle_prev (playlist_t *plt, playItem_t *curr, playItem_t **pamax);
+
+// marks the item as not played, to be picked again by plt_shuffle_next
+void
+plt_shuffle_unplayed (playlist_t *plt, playItem_t *it);
+
 // required to calculate total playtime
 void
 plt_set_item_duration (playlist_t *playlist, playItem_t *it, float duration);
@@ -354,6 +474,22 @@ pl_format_title (playItem_t *it, int idx, char *s, int size, int id, const char
 int
 pl_format_title_escaped (playItem_t *it, int idx, char *s, int size, int id, const char *fmt);
 
+// compiled title formatting, see pl_format_title
+// the result must be freed with pl_tf_free
+char *
+pl_tf_compile (const char *fmt);
+
+void
+pl_tf_free (char *code);
+
+int
+pl_tf_eval (const char *code, playItem_t *it, int idx, char *s, int size, int id, int escape);
+
+// formats up to count items of iter starting with first into out[i],
+// each of size bytes, returns the number of formatted items
+int
+pl_tf_eval_range (const char *code, playItem_t *first, int iter, int count, char **out, int size, int id);
+
 void
 pl_format_time (float t, char *dur, int size);
 
@@ -27,35 +27,415 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "playlist.h"
 #include "deadbeef.h"
 #include "metacache.h"
+#include "threading.h"
 
 #define LOCK {pl_lock();}
 #define UNLOCK {pl_unlock();}
 
+// Metadata is still exposed to plugins as a DB_metaInfo_t list, but every
+// node carries an interned id of its key, so that lookups compare integers
+// instead of calling strcasecmp on each node.
+typedef struct {
+    DB_metaInfo_t meta;
+    uint32_t keyid;
+} pl_meta_node_t;
+
+#define META_NODE(m) ((pl_meta_node_t *)(m))
+#define IS_PROPERTY(key) ((key)[0] == ':' || (key)[0] == '_' || (key)[0] == '!')
+
+// Key registry: case-insensitive key -> id.
+// Written under pl_lock or meta_mutex, but readable without them, since some callers use
+// pl_find_meta without locking: entries are never freed, and replaced
+// tables are kept around until plmeta_free.
+typedef struct {
+    uint32_t hash;
+    uint32_t id;
+    char name[1];
+} pl_meta_key_t;
+
+typedef struct pl_meta_keytable_s {
+    uint32_t size;
+    struct pl_meta_keytable_s *prev;
+    pl_meta_key_t *slots[];
+} pl_meta_keytable_t;
+
+#define META_KEYTABLE_MIN_SIZE 256
+
+static pl_meta_keytable_t *meta_keys;
+static uint32_t meta_nkeys;
+
+// Nodes are carved from blocks to avoid a malloc per tag.
+#define META_BLOCK_SIZE 1024
+
+typedef struct pl_meta_block_s {
+    struct pl_meta_block_s *next;
+    pl_meta_node_t nodes[META_BLOCK_SIZE];
+} pl_meta_block_t;
+
+static pl_meta_block_t *meta_blocks;
+static pl_meta_node_t *meta_freelist;
+static int meta_nodes_used;
+
+// Serializes changes to the key registry, node allocator and metacache made
+// by readers, which only hold pl_lock_read: loading lazy metadata, and
+// registering keys. Writers have the playlist lock to themselves.
+static uintptr_t meta_mutex;
+
+// bumped when a value which can be searched for changes, see plt_search_process
+static uint32_t meta_search_gen;
+
+static inline void
+meta_search_changed (const char *key) {
+    if (!IS_PROPERTY (key) || !strcmp (key, ":URI")) {
+        meta_search_gen++;
+    }
+}
+
+static inline char
+meta_tolower (char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// hash of prefix+key, folded to lowercase; prefix 0 means none
+static uint32_t
+meta_key_hash (char prefix, const char *key) {
+    uint32_t h = 2166136261u;
+    if (prefix) {
+        h = (h ^ (uint8_t)meta_tolower (prefix)) * 16777619u;
+    }
+    for (const char *p = key; *p; p++) {
+        h = (h ^ (uint8_t)meta_tolower (*p)) * 16777619u;
+    }
+    return h;
+}
+
+static int
+meta_key_equal (const pl_meta_key_t *k, char prefix, const char *key) {
+    const char *name = k->name;
+    if (prefix) {
+        if (*name != meta_tolower (prefix)) {
+            return 0;
+        }
+        name++;
+    }
+    return !strcasecmp (name, key);
+}
+
+// returns 0 if the key was never added to any track
+static uint32_t
+meta_find_keyid (char prefix, const char *key) {
+    pl_meta_keytable_t *t = __atomic_load_n (&meta_keys, __ATOMIC_ACQUIRE);
+    if (!t) {
+        return 0;
+    }
+    uint32_t h = meta_key_hash (prefix, key);
+    uint32_t mask = t->size - 1;
+    for (uint32_t i = h & mask; ; i = (i + 1) & mask) {
+        pl_meta_key_t *k = __atomic_load_n (&t->slots[i], __ATOMIC_ACQUIRE);
+        if (!k) {
+            return 0;
+        }
+        if (k->hash == h && meta_key_equal (k, prefix, key)) {
+            return k->id;
+        }
+    }
+}
+
+static void
+meta_keys_insert (pl_meta_keytable_t *t, pl_meta_key_t *k) {
+    uint32_t mask = t->size - 1;
+    uint32_t i = k->hash & mask;
+    while (t->slots[i]) {
+        i = (i + 1) & mask;
+    }
+    __atomic_store_n (&t->slots[i], k, __ATOMIC_RELEASE);
+}
+
+static pl_meta_keytable_t *
+meta_keys_alloc (uint32_t size) {
+    pl_meta_keytable_t *t = calloc (1, sizeof (pl_meta_keytable_t) + size * sizeof (pl_meta_key_t *));
+    t->size = size;
+    return t;
+}
+
+// must be called under pl_lock, or under pl_lock_read and meta_mutex
+static uint32_t
+meta_get_keyid (const char *key) {
+    uint32_t id = meta_find_keyid (0, key);
+    if (id) {
+        return id;
+    }
+
+    pl_meta_keytable_t *t = meta_keys;
+    if (!t) {
+        t = meta_keys_alloc (META_KEYTABLE_MIN_SIZE);
+        __atomic_store_n (&meta_keys, t, __ATOMIC_RELEASE);
+    }
+    else if ((meta_nkeys + 1) * 2 > t->size) {
+        pl_meta_keytable_t *nt = meta_keys_alloc (t->size * 2);
+        for (uint32_t i = 0; i < t->size; i++) {
+            if (t->slots[i]) {
+                meta_keys_insert (nt, t->slots[i]);
+            }
+        }
+        nt->prev = t;
+        t = nt;
+        __atomic_store_n (&meta_keys, t, __ATOMIC_RELEASE);
+    }
+
+    size_t l = strlen (key);
+    pl_meta_key_t *k = malloc (sizeof (pl_meta_key_t) + l);
+    for (size_t i = 0; i <= l; i++) {
+        k->name[i] = meta_tolower (key[i]);
+    }
+    k->hash = meta_key_hash (0, key);
+    k->id = ++meta_nkeys;
+    meta_keys_insert (t, k);
+    return k->id;
+}
+
+// must be called under pl_lock, or under pl_lock_read and meta_mutex
+static DB_metaInfo_t *
+meta_node_alloc (uint32_t keyid, const char *key, const char *value) {
+    if (!meta_freelist) {
+        pl_meta_block_t *b = malloc (sizeof (pl_meta_block_t));
+        b->next = meta_blocks;
+        meta_blocks = b;
+        for (int i = META_BLOCK_SIZE-1; i >= 0; i--) {
+            b->nodes[i].meta.next = (DB_metaInfo_t *)meta_freelist;
+            meta_freelist = &b->nodes[i];
+        }
+    }
+    pl_meta_node_t *n = meta_freelist;
+    meta_freelist = (pl_meta_node_t *)n->meta.next;
+    meta_nodes_used++;
+
+    n->meta.next = NULL;
+    n->meta.key = metacache_add_string (key);
+    n->meta.value = metacache_add_string (value);
+    n->keyid = keyid;
+    return &n->meta;
+}
+
+// must be called under pl_lock
+static void
+meta_node_free (DB_metaInfo_t *m) {
+    metacache_remove_string (m->key);
+    metacache_remove_string (m->value);
+    m->next = (DB_metaInfo_t *)meta_freelist;
+    meta_freelist = META_NODE (m);
+    meta_nodes_used--;
+}
+
+void
+plmeta_init (void) {
+    meta_mutex = mutex_create_nonrecursive ();
+}
+
+void
+plmeta_free (void) {
+    // items leaked by plugins may still reference the nodes
+    if (!meta_nodes_used) {
+        while (meta_blocks) {
+            pl_meta_block_t *next = meta_blocks->next;
+            free (meta_blocks);
+            meta_blocks = next;
+        }
+        meta_freelist = NULL;
+    }
+
+    pl_meta_keytable_t *t = meta_keys;
+    if (t) {
+        for (uint32_t i = 0; i < t->size; i++) {
+            free (t->slots[i]);
+        }
+    }
+    while (t) {
+        pl_meta_keytable_t *prev = t->prev;
+        free (t);
+        t = prev;
+    }
+    meta_keys = NULL;
+    meta_nkeys = 0;
+
+    if (meta_mutex) {
+        mutex_free (meta_mutex);
+        meta_mutex = 0;
+    }
+}
+
+pl_meta_map_t *
+pl_meta_map_alloc (void *base, size_t size, const char *strings, uint32_t strings_size) {
+    pl_meta_map_t *map = malloc (sizeof (pl_meta_map_t));
+    map->base = base;
+    map->size = size;
+    map->strings = strings;
+    map->strings_size = strings_size;
+    map->refc = 1;
+    return map;
+}
+
+// the map is released from readers too (see meta_materialize), which can't
+// take pl_lock, so the refcount is atomic
+void
+pl_meta_map_ref (pl_meta_map_t *map) {
+    __atomic_add_fetch (&map->refc, 1, __ATOMIC_RELAXED);
+}
+
+void
+pl_meta_map_unref (pl_meta_map_t *map) {
+    if (__atomic_sub_fetch (&map->refc, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap (map->base, map->size);
+        free (map);
+    }
+}
+
+void
+pl_set_lazy_meta (playItem_t *it, pl_meta_map_t *map, const pl_meta_map_pair_t *pairs, uint32_t npairs) {
+    if (!npairs) {
+        return;
+    }
+    LOCK;
+    pl_meta_map_ref (map);
+    it->_meta_pairs = pairs;
+    it->_meta_npairs = npairs;
+    __atomic_store_n (&it->_meta_map, map, __ATOMIC_RELEASE);
+    UNLOCK;
+}
+
+// copies the metadata of an item from its playlist file into nodes;
+// the pairs are in the same order as they were saved in.
+// runs under pl_lock_read only, so other readers may be walking it->meta:
+// the new nodes are put in front of the existing ones, which are not
+// touched, and the new head is published with a release store, paired with
+// the acquire loads in meta_check_lazy and meta_find_id
+static void
+meta_materialize (playItem_t *it) {
+    pl_lock_read ();
+    mutex_lock (meta_mutex);
+    pl_meta_map_t *map = it->_meta_map;
+    if (map) {
+        DB_metaInfo_t *head = NULL;
+        DB_metaInfo_t *tail = NULL;
+        for (uint32_t i = 0; i < it->_meta_npairs; i++) {
+            uint32_t k = it->_meta_pairs[i].key;
+            uint32_t v = it->_meta_pairs[i].value;
+            if (k >= map->strings_size || v >= map->strings_size) {
+                continue; // corrupt
+            }
+            const char *key = map->strings + k;
+            const char *value = map->strings + v;
+            if (!*key || !*value) {
+                continue;
+            }
+            DB_metaInfo_t *m = meta_node_alloc (meta_get_keyid (key), key, value);
+            if (tail) {
+                tail->next = m;
+            }
+            else {
+                head = m;
+            }
+            tail = m;
+        }
+        if (tail) {
+            tail->next = it->meta;
+            __atomic_store_n (&it->meta, head, __ATOMIC_RELEASE);
+        }
+        it->_meta_pairs = NULL;
+        it->_meta_npairs = 0;
+        __atomic_store_n (&it->_meta_map, NULL, __ATOMIC_RELEASE);
+        pl_meta_map_unref (map);
+    }
+    mutex_unlock (meta_mutex);
+    pl_unlock_read ();
+}
+
+// must be called before accessing it->meta, or looking up key ids,
+// since the keys of lazy metadata may not be registered yet
+static inline void
+meta_check_lazy (playItem_t *it) {
+    if (__atomic_load_n (&it->_meta_map, __ATOMIC_ACQUIRE)) {
+        meta_materialize (it);
+    }
+}
+
+void
+pl_copy_meta (playItem_t *to, playItem_t *from) {
+    LOCK;
+    meta_check_lazy (from);
+    DB_metaInfo_t *tail = NULL;
+    for (DB_metaInfo_t *meta = from->meta; meta; meta = meta->next) {
+        DB_metaInfo_t *m = meta_node_alloc (META_NODE (meta)->keyid, meta->key, meta->value);
+        if (tail) {
+            tail->next = m;
+        }
+        else {
+            to->meta = m;
+        }
+        tail = m;
+    }
+    UNLOCK;
+}
+
+void
+pl_free_meta (playItem_t *it) {
+    LOCK;
+    if (it->_meta_map) {
+        pl_meta_map_unref (it->_meta_map);
+        it->_meta_map = NULL;
+        it->_meta_pairs = NULL;
+        it->_meta_npairs = 0;
+    }
+    while (it->meta) {
+        DB_metaInfo_t *m = it->meta;
+        it->meta = m->next;
+        meta_node_free (m);
+    }
+    UNLOCK;
+}
+
+static DB_metaInfo_t *
+meta_find_id (playItem_t *it, uint32_t keyid) {
+    if (!keyid) {
+        return NULL;
+    }
+    for (DB_metaInfo_t *m = __atomic_load_n (&it->meta, __ATOMIC_ACQUIRE); m; m = m->next) {
+        if (META_NODE (m)->keyid == keyid) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
 void
 pl_add_meta (playItem_t *it, const char *key, const char *value) {
     if (!value || !*value) {
         return;
     }
     LOCK;
+    meta_check_lazy (it);
+    uint32_t keyid = meta_get_keyid (key);
+    int isprop = IS_PROPERTY (key);
     // check if it's already set
     DB_metaInfo_t *normaltail = NULL;
     DB_metaInfo_t *propstart = NULL;
     DB_metaInfo_t *tail = NULL;
     DB_metaInfo_t *m = it->meta;
     while (m) {
-        if (!strcasecmp (key, m->key)) {
+        if (META_NODE (m)->keyid == keyid) {
             // duplicate key
             UNLOCK;
             return;
         }
         // find end of normal metadata
-        if (!normaltail && (!m->next || m->key[0] == ':' || m->key[0] == '_' || m->key[0] == '!')) {
+        if (!propstart && IS_PROPERTY (m->key)) {
             normaltail = tail;
             propstart = m;
-            if (key[0] != ':' && key[0] != '_' && key[0] != '!') {
+            if (!isprop) {
                 break;
             }
         }
@@ -64,13 +444,11 @@ pl_add_meta (playItem_t *it, const char *key, const char *value) {
         m = m->next;
     }
     // add
-    char str[256];
-    m = malloc (sizeof (DB_metaInfo_t));
-    memset (m, 0, sizeof (DB_metaInfo_t));
-    m->key = metacache_add_string (key);
-    m->value = metacache_add_string (value);
+    m = meta_node_alloc (keyid, key, value);
+    it->_saved_id = 0;
+    meta_search_changed (key);
 
-    if (key[0] == ':' || key[0] == '_' || key[0] == '!') {
+    if (isprop) {
         if (tail) {
             tail->next = m;
         }
@@ -78,7 +456,7 @@ pl_add_meta (playItem_t *it, const char *key, const char *value) {
             it->meta = m;
         }
     }
-    else {
+    else if (propstart) {
         m->next = propstart;
         if (normaltail) {
             normaltail->next = m;
@@ -87,6 +465,14 @@ pl_add_meta (playItem_t *it, const char *key, const char *value) {
             it->meta = m;
         }
     }
+    else {
+        if (tail) {
+            tail->next = m;
+        }
+        else {
+            it->meta = m;
+        }
+    }
     UNLOCK;
 }
 
@@ -137,17 +523,16 @@ pl_append_meta (playItem_t *it, const char *key, const char *value) {
 void
 pl_replace_meta (playItem_t *it, const char *key, const char *value) {
     LOCK;
+    meta_check_lazy (it);
     // check if it's already set
-    DB_metaInfo_t *m = it->meta;
-    while (m) {
-        if (!strcasecmp (key, m->key)) {
-            break;
-        }
-        m = m->next;
-    }
+    DB_metaInfo_t *m = meta_find_id (it, meta_find_keyid (0, key));
     if (m) {
-        metacache_remove_string (m->value);
-        m->value = metacache_add_string (value);
+        if (strcmp (m->value, value)) {
+            metacache_remove_string (m->value);
+            m->value = metacache_add_string (value);
+            it->_saved_id = 0;
+            meta_search_changed (m->key);
+        }
         UNLOCK;
         return;
     }
@@ -174,19 +559,21 @@ pl_set_meta_float (playItem_t *it, const char *key, float value) {
 void
 pl_delete_meta (playItem_t *it, const char *key) {
     pl_lock ();
+    meta_check_lazy (it);
+    uint32_t keyid = meta_find_keyid (0, key);
     DB_metaInfo_t *prev = NULL;
-    DB_metaInfo_t *m = it->meta;
+    DB_metaInfo_t *m = keyid ? it->meta : NULL;
     while (m) {
-        if (!strcasecmp (key, m->key)) {
+        if (META_NODE (m)->keyid == keyid) {
             if (prev) {
                 prev->next = m->next;
             }
             else {
                 it->meta = m->next;
             }
-            metacache_remove_string (m->key);
-            metacache_remove_string (m->value);
-            free (m);
+            meta_search_changed (m->key);
+            meta_node_free (m);
+            it->_saved_id = 0;
             break;
         }
         prev = m;
@@ -198,67 +585,85 @@ pl_delete_meta (playItem_t *it, const char *key) {
 const char *
 pl_find_meta (playItem_t *it, const char *key) {
     pl_ensure_lock ();
-    DB_metaInfo_t *m = it->meta;
+    meta_check_lazy (it);
+    DB_metaInfo_t *m;
 
     if (key && key[0] == ':') {
         // try to find an override
-        while (m) {
-            if (m->key[0] == '!' && !strcasecmp (key+1, m->key+1)) {
-                return m->value;
-            }
-            m = m->next;
-        }
-    }
-
-    m = it->meta;
-    while (m) {
-        if (!strcasecmp (key, m->key)) {
+        m = meta_find_id (it, meta_find_keyid ('!', key+1));
+        if (m) {
             return m->value;
         }
-        m = m->next;
     }
-    return NULL;
+
+    m = meta_find_id (it, meta_find_keyid (0, key));
+    return m ? m->value : NULL;
 }
 
 const char *
 pl_find_meta_raw (playItem_t *it, const char *key) {
     pl_ensure_lock ();
-    DB_metaInfo_t *m = it->meta;
-    while (m) {
-        if (!strcasecmp (key, m->key)) {
-            return m->value;
-        }
-        m = m->next;
+    meta_check_lazy (it);
+    DB_metaInfo_t *m = meta_find_id (it, meta_find_keyid (0, key));
+    return m ? m->value : NULL;
+}
+
+uint32_t
+pl_meta_keyid (const char *key) {
+    // known keys are found without locking, see meta_find_keyid
+    uint32_t keyid = meta_find_keyid (0, key);
+    if (keyid) {
+        return keyid;
     }
-    return NULL;
+    pl_lock_read ();
+    mutex_lock (meta_mutex);
+    keyid = meta_get_keyid (key);
+    mutex_unlock (meta_mutex);
+    pl_unlock_read ();
+    return keyid;
+}
+
+const char *
+pl_find_meta_id (playItem_t *it, uint32_t keyid) {
+    pl_ensure_lock ();
+    meta_check_lazy (it);
+    DB_metaInfo_t *m = meta_find_id (it, keyid);
+    return m ? m->value : NULL;
 }
 
 int
 pl_find_meta_int (playItem_t *it, const char *key, int def) {
-    pl_lock ();
+    pl_lock_read ();
     const char *val = pl_find_meta (it, key);
     int res = val ? atoi (val) : def;
-    pl_unlock ();
+    pl_unlock_read ();
     return res;
 }
 
 float
 pl_find_meta_float (playItem_t *it, const char *key, float def) {
-    pl_lock ();
+    pl_lock_read ();
     const char *val = pl_find_meta (it, key);
     float res = val ? atof (val) : def;
-    pl_unlock ();
+    pl_unlock_read ();
     return res;
 }
 
+uint32_t
+pl_meta_search_gen (void) {
+    return meta_search_gen;
+}
+
 DB_metaInfo_t *
 pl_get_metadata_head (playItem_t *it) {
-    return it->meta;
+    meta_check_lazy (it);
+    return __atomic_load_n (&it->meta, __ATOMIC_ACQUIRE);
 }
 
 void
 pl_delete_metadata (playItem_t *it, DB_metaInfo_t *meta) {
     pl_lock ();
+    meta_check_lazy (it);
     DB_metaInfo_t *prev = NULL;
     DB_metaInfo_t *m = it->meta;
     while (m) {
@@ -269,9 +674,9 @@ pl_delete_metadata (playItem_t *it, DB_metaInfo_t *meta) {
             else {
                 it->meta = m->next;
             }
-            metacache_remove_string (m->key);
-            metacache_remove_string (m->value);
-            free (m);
+            meta_search_changed (m->key);
+            meta_node_free (m);
+            it->_saved_id = 0;
             break;
         }
         prev = m;
@@ -283,11 +688,12 @@ pl_delete_metadata (playItem_t *it, DB_metaInfo_t *meta) {
 void
 pl_delete_all_meta (playItem_t *it) {
     LOCK;
+    meta_check_lazy (it);
     DB_metaInfo_t *m = it->meta;
     DB_metaInfo_t *prev = NULL;
     while (m) {
         DB_metaInfo_t *next = m->next;
-        if (m->key[0] == ':'  || m->key[0] == '_' || m->key[0] == '!') {
+        if (IS_PROPERTY (m->key)) {
             prev = m;
         }
         else {
@@ -297,9 +703,9 @@ pl_delete_all_meta (playItem_t *it) {
             else {
                 it->meta = next;
             }
-            metacache_remove_string (m->key);
-            metacache_remove_string (m->value);
-            free (m);
+            meta_search_gen++;
+            meta_node_free (m);
+            it->_saved_id = 0;
         }
         m = next;
     }
@@ -312,35 +718,35 @@ pl_delete_all_meta (playItem_t *it) {
 int
 pl_get_meta (playItem_t *it, const char *key, char *val, int size) {
     *val = 0;
-    pl_lock ();
+    pl_lock_read ();
     const char *v = pl_find_meta (it, key);
     if (!v) {
-        pl_unlock ();
+        pl_unlock_read ();
         return 0;
     }
     strncpy (val, v, size);
-    pl_unlock ();
+    pl_unlock_read ();
     return 1;
 }
 
 int
 pl_get_meta_raw (playItem_t *it, const char *key, char *val, int size) {
     *val = 0;
-    pl_lock ();
+    pl_lock_read ();
     const char *v = pl_find_meta_raw (it, key);
     if (!v) {
-        pl_unlock ();
+        pl_unlock_read ();
         return 0;
     }
     strncpy (val, v, size);
-    pl_unlock ();
+    pl_unlock_read ();
     return 1;
 }
 
 int
 pl_meta_exists (playItem_t *it, const char *key) {
-    pl_lock ();
+    pl_lock_read ();
     const char *v = pl_find_meta (it, key);
-    pl_unlock ();
+    pl_unlock_read ();
     return v ? 1 : 0;
 }
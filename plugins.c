@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #ifndef __linux__
 #define _POSIX_C_SOURCE 1
@@ -368,6 +369,14 @@ static DB_functions_t deadbeef_api = {
     // ******* new 1.6 APIs ********
     .plt_set_scroll = (void (*) (ddb_playlist_t *plt, int scroll))plt_set_scroll,
     .plt_get_scroll = (int (*) (ddb_playlist_t *plt))plt_get_scroll,
+    // ******* new 1.8 APIs ********
+    .tf_compile = pl_tf_compile,
+    .tf_free = pl_tf_free,
+    .tf_eval = (int (*) (const char *code, DB_playItem_t *it, int idx, char *s, int size, int id, int escape))pl_tf_eval,
+    .tf_eval_range = (int (*) (const char *code, DB_playItem_t *first, int iter, int count, char **out, int size, int id))pl_tf_eval_range,
+    .vis_tap_open = vis_tap_open,
+    .vis_tap_close = vis_tap_close,
+    .vis_tap_read = vis_tap_read,
 };
 
 DB_functions_t *deadbeef = &deadbeef_api;
@@ -416,9 +425,14 @@ DB_plugin_t *g_plugins[MAX_PLUGINS+1];
 char *g_gui_names[MAX_GUI_PLUGINS+1];
 int g_num_gui_names;
 
-#define MAX_DECODER_PLUGINS 50
 DB_decoder_t *g_decoder_plugins[MAX_DECODER_PLUGINS+1];
 
+// decoder by extension map, see plug_rebuild_decoder_exts
+static uintptr_t decoder_exts_mutex;
+
+static void
+decoder_exts_free (void);
+
 #define MAX_VFS_PLUGINS 10
 DB_vfs_t *g_vfs_plugins[MAX_VFS_PLUGINS+1];
 
@@ -576,6 +590,7 @@ plug_remove_plugin (void *p) {
     for (i = 0; g_decoder_plugins[i]; i++) {
         if (g_decoder_plugins[i] == p) {
             memmove (&g_decoder_plugins[i], &g_decoder_plugins[i+1], (MAX_DECODER_PLUGINS+1-i-1) * sizeof (void*));
+            plug_rebuild_decoder_exts ();
             break;
         }
     }
@@ -819,6 +834,7 @@ plug_load_all (void) {
 #endif
 
     background_jobs_mutex = mutex_create ();
+    decoder_exts_mutex = mutex_create_nonrecursive ();
 
     const char *dirname = deadbeef->get_plugin_dir ();
 
@@ -1015,6 +1031,8 @@ plug_load_all (void) {
     g_dsp_plugins[numdsp] = NULL;
     g_playlist_plugins[numplaylist] = NULL;
 
+    plug_rebuild_decoder_exts ();
+
     // select output plugin
     if (plug_select_output () < 0) {
         trace ("failed to find output plugin!\n");
@@ -1118,6 +1136,11 @@ plug_unload_all (void) {
         mutex_free (background_jobs_mutex);
         background_jobs_mutex = 0;
     }
+    if (decoder_exts_mutex) {
+        decoder_exts_free ();
+        mutex_free (decoder_exts_mutex);
+        decoder_exts_mutex = 0;
+    }
 }
 
 void
@@ -1291,6 +1314,232 @@ plug_get_decoder_for_id (const char *id) {
     return NULL;
 }
 
+// decoder lookup by file extension
+// the map is rebuilt when the decoder list changes, and on config changes,
+// since some decoders (sndfile, ffmpeg) update their extension lists at runtime
+#define DECODER_EXT_HASH_SIZE 256
+
+typedef struct decoder_ext_s {
+    struct decoder_ext_s *next;
+    int count;
+    uint8_t decoders[MAX_DECODER_PLUGINS]; // indexes into g_decoder_plugins, in priority order
+    char ext[]; // lowercase
+} decoder_ext_t;
+
+static decoder_ext_t *g_decoder_exts[DECODER_EXT_HASH_SIZE];
+static uint8_t g_prefix_decoders[MAX_DECODER_PLUGINS];
+static int g_num_prefix_decoders;
+
+static uint32_t
+decoder_ext_hash (const char *ext) {
+    uint32_t h = 5381;
+    for (; *ext; ext++) {
+        h = h * 33 + tolower ((uint8_t)*ext);
+    }
+    return h & (DECODER_EXT_HASH_SIZE-1);
+}
+
+static decoder_ext_t *
+decoder_ext_find (const char *ext) {
+    for (decoder_ext_t *e = g_decoder_exts[decoder_ext_hash (ext)]; e; e = e->next) {
+        if (!strcasecmp (e->ext, ext)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+decoder_exts_free (void) {
+    for (int i = 0; i < DECODER_EXT_HASH_SIZE; i++) {
+        while (g_decoder_exts[i]) {
+            decoder_ext_t *next = g_decoder_exts[i]->next;
+            free (g_decoder_exts[i]);
+            g_decoder_exts[i] = next;
+        }
+    }
+    g_num_prefix_decoders = 0;
+}
+
+void
+plug_rebuild_decoder_exts (void) {
+    if (!decoder_exts_mutex) {
+        return;
+    }
+    mutex_lock (decoder_exts_mutex);
+    decoder_exts_free ();
+    for (int i = 0; g_decoder_plugins[i]; i++) {
+        DB_decoder_t *dec = g_decoder_plugins[i];
+        if (!dec->insert) {
+            continue;
+        }
+        if (dec->exts) {
+            for (int e = 0; dec->exts[e]; e++) {
+                decoder_ext_t *ext = decoder_ext_find (dec->exts[e]);
+                if (!ext) {
+                    size_t l = strlen (dec->exts[e]);
+                    ext = malloc (sizeof (decoder_ext_t) + l + 1);
+                    ext->count = 0;
+                    for (size_t c = 0; c <= l; c++) {
+                        ext->ext[c] = tolower ((uint8_t)dec->exts[e][c]);
+                    }
+                    uint32_t h = decoder_ext_hash (ext->ext);
+                    ext->next = g_decoder_exts[h];
+                    g_decoder_exts[h] = ext;
+                }
+                if (!ext->count || ext->decoders[ext->count-1] != i) {
+                    ext->decoders[ext->count++] = i;
+                }
+            }
+        }
+        if (dec->prefixes && dec->prefixes[0]) {
+            g_prefix_decoders[g_num_prefix_decoders++] = i;
+        }
+    }
+    mutex_unlock (decoder_exts_mutex);
+}
+
+static int
+decoder_prefix_match (DB_decoder_t *dec, const char *fn) {
+    for (int e = 0; dec->prefixes[e]; e++) {
+        size_t l = strlen (dec->prefixes[e]);
+        if (!strncasecmp (dec->prefixes[e], fn, l) && fn[l] == '.') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// fills decoders with the ones which can handle fname by extension or prefix,
+// in priority order; returns the number of decoders found
+int
+plug_get_decoders_for_file (const char *fname, DB_decoder_t **decoders, int max) {
+    const char *fn = strrchr (fname, '/');
+    if (!fn) {
+        fn = fname;
+    }
+    else {
+        fn++;
+    }
+    const char *ext = strrchr (fname, '.');
+    if (!ext) {
+        return 0;
+    }
+    ext++;
+
+    int n = 0;
+    mutex_lock (decoder_exts_mutex);
+    decoder_ext_t *e = decoder_ext_find (ext);
+    int ne = e ? e->count : 0;
+    int ie = 0, ip = 0;
+    // merge extension and prefix matches by decoder priority
+    while (n < max && (ie < ne || ip < g_num_prefix_decoders)) {
+        int idx;
+        if (ip >= g_num_prefix_decoders || (ie < ne && e->decoders[ie] <= g_prefix_decoders[ip])) {
+            idx = e->decoders[ie++];
+            if (ip < g_num_prefix_decoders && g_prefix_decoders[ip] == idx) {
+                ip++;
+            }
+        }
+        else {
+            idx = g_prefix_decoders[ip++];
+            if (!decoder_prefix_match (g_decoder_plugins[idx], fn)) {
+                continue;
+            }
+        }
+        decoders[n++] = g_decoder_plugins[idx];
+    }
+    mutex_unlock (decoder_exts_mutex);
+    return n;
+}
+
+// content signatures, for files which can't be matched by name
+#define SIG(s) s, sizeof (s) - 1
+
+static const struct {
+    int offset;
+    const char *magic;
+    int size;
+    int offset2;
+    const char *magic2;
+    int size2;
+    const char *id;
+} decoder_magic[] = {
+    { 0, SIG ("fLaC"), 0, SIG (""), "stdflac" },
+    { 0, SIG ("OggS"), 28, SIG ("\x7f" "FLAC"), "stdflac" },
+    { 0, SIG ("OggS"), 28, SIG ("\x01vorbis"), "stdogg" },
+    { 0, SIG ("MAC "), 0, SIG (""), "ffap" },
+    { 0, SIG ("wvpk"), 0, SIG (""), "wv" },
+    { 0, SIG ("MPCK"), 0, SIG (""), "musepack" },
+    { 0, SIG ("MP+"), 0, SIG (""), "musepack" },
+    { 0, SIG ("TTA1"), 0, SIG (""), "tta" },
+    { 0, SIG ("ajkg"), 0, SIG (""), "shn" },
+    { 0, SIG ("RIFF"), 8, SIG ("WAVE"), "sndfile" },
+    { 0, SIG ("FORM"), 8, SIG ("AIFF"), "sndfile" },
+    { 0, SIG ("FORM"), 8, SIG ("AIFC"), "sndfile" },
+    { 4, SIG ("ftyp"), 0, SIG (""), "aac" },
+    { 4, SIG ("ftyp"), 0, SIG (""), "alac" },
+    { 0, SIG ("\x30\x26\xb2\x75\x8e\x66\xcf\x11"), 0, SIG (""), "wma" },
+    { 0, SIG ("MThd"), 0, SIG (""), "wmidi" },
+    { 0, SIG ("PSID"), 0, SIG (""), "stdsid" },
+    { 0, SIG ("RSID"), 0, SIG (""), "stdsid" },
+    { 0, NULL, 0, 0, NULL, 0, NULL }
+};
+
+#undef SIG
+
+static int
+decoder_add_id (const char *id, DB_decoder_t **decoders, int n, int max) {
+    if (n >= max) {
+        return n;
+    }
+    DB_decoder_t *dec = plug_get_decoder_for_id (id);
+    if (!dec || !dec->insert) {
+        return n;
+    }
+    for (int i = 0; i < n; i++) {
+        if (decoders[i] == dec) {
+            return n;
+        }
+    }
+    decoders[n++] = dec;
+    return n;
+}
+
+// fills decoders with the ones matching the magic bytes at the start of the file
+// returns the number of decoders found
+int
+plug_get_decoders_for_content (const uint8_t *buf, int size, DB_decoder_t **decoders, int max) {
+    int n = 0;
+    // skip id3v2 tags, if they fit in the buffer
+    while (size >= 10 && !memcmp (buf, "ID3", 3)) {
+        int tagsize = ((buf[6] & 0x7f) << 21) | ((buf[7] & 0x7f) << 14) | ((buf[8] & 0x7f) << 7) | (buf[9] & 0x7f);
+        tagsize += (buf[5] & 0x10) ? 20 : 10;
+        if (tagsize >= size) {
+            // can't see past the tag, assume mpeg
+            return decoder_add_id ("stdmpg", decoders, n, max);
+        }
+        buf += tagsize;
+        size -= tagsize;
+    }
+    for (int i = 0; decoder_magic[i].magic; i++) {
+        if (decoder_magic[i].offset + decoder_magic[i].size > size
+            || decoder_magic[i].offset2 + decoder_magic[i].size2 > size) {
+            continue;
+        }
+        if (memcmp (buf + decoder_magic[i].offset, decoder_magic[i].magic, decoder_magic[i].size)
+            || memcmp (buf + decoder_magic[i].offset2, decoder_magic[i].magic2, decoder_magic[i].size2)) {
+            continue;
+        }
+        n = decoder_add_id (decoder_magic[i].id, decoders, n, max);
+    }
+    // mpeg audio or adts frame sync
+    if (!n && size >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0) {
+        n = decoder_add_id ((buf[1] & 0x06) ? "stdmpg" : "aac", decoders, n, max);
+    }
+    return n;
+}
+
 DB_plugin_t *
 plug_get_for_id (const char *id) {
     DB_plugin_t **plugins = plug_get_list ();
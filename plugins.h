@@ -30,6 +30,8 @@
 
 extern DB_functions_t *deadbeef;
 
+#define MAX_DECODER_PLUGINS 50
+
 struct playItem_s;
 
 int
@@ -124,6 +126,15 @@ plug_free_decoder_ids (void);
 DB_decoder_t *
 plug_get_decoder_for_id (const char *id);
 
+void
+plug_rebuild_decoder_exts (void);
+
+int
+plug_get_decoders_for_file (const char *fname, DB_decoder_t **decoders, int max);
+
+int
+plug_get_decoders_for_content (const uint8_t *buf, int size, DB_decoder_t **decoders, int max);
+
 DB_plugin_t *
 plug_get_for_id (const char *id);
 
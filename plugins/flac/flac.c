@@ -1160,6 +1160,7 @@ static DB_decoder_t plugin = {
     .plugin.api_vminor = 0,
     .plugin.version_major = 1,
     .plugin.version_minor = 0,
+    .plugin.flags = DDB_PLUGIN_FLAG_PARALLEL_INSERT,
     .plugin.type = DB_PLUGIN_DECODER,
     .plugin.id = "stdflac",
     .plugin.name = "FLAC decoder",
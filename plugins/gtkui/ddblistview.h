@@ -41,6 +41,7 @@ G_BEGIN_DECLS
 typedef struct {
     int id;
     char *format;
+    char *bytecode; // compiled format, created on first use
 } col_info_t;
 
 typedef struct _DdbListview DdbListview;
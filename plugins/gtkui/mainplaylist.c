@@ -269,6 +269,9 @@ void main_col_free_user_data (void *data) {
         if (inf->format) {
             free (inf->format);
         }
+        if (inf->bytecode) {
+            deadbeef->tf_free (inf->bytecode);
+        }
         free (data);
     }
 }
@@ -308,7 +308,10 @@ void draw_column_data (DdbListview *listview, cairo_t *cr, DdbListviewIter it, D
             }
         }
         else {
-            deadbeef->pl_format_title (it, -1, text, sizeof (text), cinf->id, cinf->format);
+            if (!cinf->bytecode && cinf->format) {
+                cinf->bytecode = deadbeef->tf_compile (cinf->format);
+            }
+            deadbeef->tf_eval (cinf->bytecode, it, -1, text, sizeof (text), cinf->id, 0);
             char *lb = strchr (text, '\r');
             if (lb) {
                 *lb = 0;
@@ -1038,6 +1041,10 @@ init_column (col_info_t *inf, int id, const char *format) {
         free (inf->format);
         inf->format = NULL;
     }
+    if (inf->bytecode) {
+        deadbeef->tf_free (inf->bytecode);
+        inf->bytecode = NULL;
+    }
 
     inf->id = -1;
 
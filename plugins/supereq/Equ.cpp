@@ -19,57 +19,36 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 #include "paramlist.hpp"
 #include "Equ.h"
 
-#ifdef USE_OOURA
-extern "C" void rdft(int, int, REAL *, int *, REAL *);
-void rfft(int n,int isign,REAL *x)
-{
-    static int ipsize = 0,wsize=0;
-    static int *ip = NULL;
-    static REAL *w = NULL;
-    int newipsize,newwsize;
-    if (n == 0) {
-        free(ip); ip = NULL; ipsize = 0;
-        free(w);  w  = NULL; wsize  = 0;
-        return;
-    }
-
-    n = 1 << n;
-
-
-    newipsize = 2+sqrt(n/2);
-    if (newipsize > ipsize) {
-        ipsize = newipsize;
-        ip = (int *)realloc(ip,sizeof(int)*ipsize);
-        ip[0] = 0;
-    }
-
-    newwsize = n/2;
-    if (newwsize > wsize) {
-        wsize = newwsize;
-        w = (REAL *)realloc(w,sizeof(REAL)*wsize);
-    }
-
-    rdft(n,isign,x,ip,w);
-}
-#elif defined(USE_FFMPEG) || defined(USE_SHIBATCH)
-extern "C" void rfft(int n,int isign,REAL *x);
-#endif
-
-#if defined(USE_SHIBATCH)
-extern "C" {
-#include "SIMDBase.h"
-}
+#ifdef __SSE__
+#include <xmmintrin.h>
+#define EQU_SIMD 1
+typedef __m128 v4sf;
+#define v4_load(p) _mm_load_ps(p)
+#define v4_store(p,v) _mm_store_ps(p,v)
+#define v4_add(a,b) _mm_add_ps(a,b)
+#define v4_sub(a,b) _mm_sub_ps(a,b)
+#define v4_mul(a,b) _mm_mul_ps(a,b)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define EQU_SIMD 1
+typedef float32x4_t v4sf;
+#define v4_load(p) vld1q_f32(p)
+#define v4_store(p,v) vst1q_f32(p,v)
+#define v4_add(a,b) vaddq_f32(a,b)
+#define v4_sub(a,b) vsubq_f32(a,b)
+#define v4_mul(a,b) vmulq_f32(a,b)
 #endif
 
-
 #define PI 3.1415926535897932384626433832795
 
-#define DITHERLEN 65536
+// smallest partition, shorter blocks make the ffts too inefficient
+#define MIN_BLOCK_BITS 6
 
 #define M 15
 static REAL fact[M+1];
@@ -106,65 +85,283 @@ static REAL izero(REAL x)
 }
 
 void *equ_malloc (int size) {
-#ifdef USE_SHIBATCH
-    return SIMDBase_alignedMalloc (size);
-#else
-    return malloc (size);
-#endif
+    void *mem;
+    // 16 byte alignment is required by simd loads
+    if (posix_memalign (&mem, 16, size)) {
+        return NULL;
+    }
+    return mem;
 }
 
 void equ_free (void *mem) {
-#ifdef USE_SHIBATCH
-    SIMDBase_alignedFree (mem);
-#else
     free (mem);
+}
+
+// complex fft of fftlen points, on split real and imaginary arrays.
+// it's done in radix-4 stages, and a radix-2 one at the end if fft_bits is odd.
+// the forward transform is decimation in frequency, and leaves the spectrum in
+// digit-reversed order; the inverse one runs the same stages backwards, so
+// it takes the digit-reversed spectrum and produces samples in natural order.
+// spectra are only multiplied by each other, so the order never matters, and
+// no reordering pass is needed.
+// the inverse transform is not normalized, it scales the result by fftlen.
+
+// twiddles for the stage with quarter length q: w^1, w^2, w^3 for each of q
+// butterflies, where w = exp(-2*pi*i*j/(4*q)), stored as 6 arrays of q values
+static int
+fft_twiddles_size (int n) {
+    int size = 0;
+    for (int q = n/4; q >= 1; q /= 4) {
+        size += 6*q;
+    }
+    return size;
+}
+
+static void
+fft_init_twiddles (REAL *tw, int n) {
+    for (int q = n/4; q >= 1; q /= 4) {
+        for (int r = 1; r <= 3; r++) {
+            for (int j = 0; j < q; j++) {
+                double a = -2*PI*r*j/(4*q);
+                tw[(r-1)*2*q+j] = cos (a);
+                tw[(r-1)*2*q+q+j] = sin (a);
+            }
+        }
+        tw += 6*q;
+    }
+}
+
+static inline void
+fft_dif4 (REAL *re, REAL *im, int j, int q, const REAL *tw) {
+    REAL ar = re[j], ai = im[j];
+    REAL br = re[j+q], bi = im[j+q];
+    REAL cr = re[j+2*q], ci = im[j+2*q];
+    REAL dr = re[j+3*q], di = im[j+3*q];
+    REAL t0r = ar+cr, t0i = ai+ci;
+    REAL t1r = ar-cr, t1i = ai-ci;
+    REAL t2r = br+dr, t2i = bi+di;
+    REAL t3r = br-dr, t3i = bi-di;
+    REAL y1r = t1r+t3i, y1i = t1i-t3r;
+    REAL y2r = t0r-t2r, y2i = t0i-t2i;
+    REAL y3r = t1r-t3i, y3i = t1i+t3r;
+    re[j] = t0r+t2r;
+    im[j] = t0i+t2i;
+    REAL w1r = tw[j], w1i = tw[q+j], w2r = tw[2*q+j], w2i = tw[3*q+j], w3r = tw[4*q+j], w3i = tw[5*q+j];
+    re[j+q] = y1r*w1r - y1i*w1i;
+    im[j+q] = y1r*w1i + y1i*w1r;
+    re[j+2*q] = y2r*w2r - y2i*w2i;
+    im[j+2*q] = y2r*w2i + y2i*w2r;
+    re[j+3*q] = y3r*w3r - y3i*w3i;
+    im[j+3*q] = y3r*w3i + y3i*w3r;
+}
+
+static inline void
+fft_dit4 (REAL *re, REAL *im, int j, int q, const REAL *tw) {
+    REAL w1r = tw[j], w1i = tw[q+j], w2r = tw[2*q+j], w2i = tw[3*q+j], w3r = tw[4*q+j], w3i = tw[5*q+j];
+    // multiply by conjugate twiddles
+    REAL y0r = re[j], y0i = im[j];
+    REAL y1r = re[j+q]*w1r + im[j+q]*w1i, y1i = im[j+q]*w1r - re[j+q]*w1i;
+    REAL y2r = re[j+2*q]*w2r + im[j+2*q]*w2i, y2i = im[j+2*q]*w2r - re[j+2*q]*w2i;
+    REAL y3r = re[j+3*q]*w3r + im[j+3*q]*w3i, y3i = im[j+3*q]*w3r - re[j+3*q]*w3i;
+    REAL s0r = y0r+y2r, s0i = y0i+y2i;
+    REAL s1r = y0r-y2r, s1i = y0i-y2i;
+    REAL s2r = y1r+y3r, s2i = y1i+y3i;
+    REAL s3r = y1r-y3r, s3i = y1i-y3i;
+    re[j] = s0r+s2r;
+    im[j] = s0i+s2i;
+    re[j+q] = s1r-s3i;
+    im[j+q] = s1i+s3r;
+    re[j+2*q] = s0r-s2r;
+    im[j+2*q] = s0i-s2i;
+    re[j+3*q] = s1r+s3i;
+    im[j+3*q] = s1i-s3r;
+}
+
+#ifdef EQU_SIMD
+// same as above, for 4 consecutive butterflies
+static inline void
+fft_dif4_simd (REAL *re, REAL *im, int j, int q, const REAL *tw) {
+    v4sf ar = v4_load (re+j), ai = v4_load (im+j);
+    v4sf br = v4_load (re+j+q), bi = v4_load (im+j+q);
+    v4sf cr = v4_load (re+j+2*q), ci = v4_load (im+j+2*q);
+    v4sf dr = v4_load (re+j+3*q), di = v4_load (im+j+3*q);
+    v4sf t0r = v4_add (ar, cr), t0i = v4_add (ai, ci);
+    v4sf t1r = v4_sub (ar, cr), t1i = v4_sub (ai, ci);
+    v4sf t2r = v4_add (br, dr), t2i = v4_add (bi, di);
+    v4sf t3r = v4_sub (br, dr), t3i = v4_sub (bi, di);
+    v4sf y1r = v4_add (t1r, t3i), y1i = v4_sub (t1i, t3r);
+    v4sf y2r = v4_sub (t0r, t2r), y2i = v4_sub (t0i, t2i);
+    v4sf y3r = v4_sub (t1r, t3i), y3i = v4_add (t1i, t3r);
+    v4_store (re+j, v4_add (t0r, t2r));
+    v4_store (im+j, v4_add (t0i, t2i));
+    v4sf w1r = v4_load (tw+j), w1i = v4_load (tw+q+j);
+    v4sf w2r = v4_load (tw+2*q+j), w2i = v4_load (tw+3*q+j);
+    v4sf w3r = v4_load (tw+4*q+j), w3i = v4_load (tw+5*q+j);
+    v4_store (re+j+q, v4_sub (v4_mul (y1r, w1r), v4_mul (y1i, w1i)));
+    v4_store (im+j+q, v4_add (v4_mul (y1r, w1i), v4_mul (y1i, w1r)));
+    v4_store (re+j+2*q, v4_sub (v4_mul (y2r, w2r), v4_mul (y2i, w2i)));
+    v4_store (im+j+2*q, v4_add (v4_mul (y2r, w2i), v4_mul (y2i, w2r)));
+    v4_store (re+j+3*q, v4_sub (v4_mul (y3r, w3r), v4_mul (y3i, w3i)));
+    v4_store (im+j+3*q, v4_add (v4_mul (y3r, w3i), v4_mul (y3i, w3r)));
+}
+
+static inline void
+fft_dit4_simd (REAL *re, REAL *im, int j, int q, const REAL *tw) {
+    v4sf w1r = v4_load (tw+j), w1i = v4_load (tw+q+j);
+    v4sf w2r = v4_load (tw+2*q+j), w2i = v4_load (tw+3*q+j);
+    v4sf w3r = v4_load (tw+4*q+j), w3i = v4_load (tw+5*q+j);
+    v4sf y0r = v4_load (re+j), y0i = v4_load (im+j);
+    v4sf xr = v4_load (re+j+q), xi = v4_load (im+j+q);
+    v4sf y1r = v4_add (v4_mul (xr, w1r), v4_mul (xi, w1i)), y1i = v4_sub (v4_mul (xi, w1r), v4_mul (xr, w1i));
+    xr = v4_load (re+j+2*q); xi = v4_load (im+j+2*q);
+    v4sf y2r = v4_add (v4_mul (xr, w2r), v4_mul (xi, w2i)), y2i = v4_sub (v4_mul (xi, w2r), v4_mul (xr, w2i));
+    xr = v4_load (re+j+3*q); xi = v4_load (im+j+3*q);
+    v4sf y3r = v4_add (v4_mul (xr, w3r), v4_mul (xi, w3i)), y3i = v4_sub (v4_mul (xi, w3r), v4_mul (xr, w3i));
+    v4sf s0r = v4_add (y0r, y2r), s0i = v4_add (y0i, y2i);
+    v4sf s1r = v4_sub (y0r, y2r), s1i = v4_sub (y0i, y2i);
+    v4sf s2r = v4_add (y1r, y3r), s2i = v4_add (y1i, y3i);
+    v4sf s3r = v4_sub (y1r, y3r), s3i = v4_sub (y1i, y3i);
+    v4_store (re+j, v4_add (s0r, s2r));
+    v4_store (im+j, v4_add (s0i, s2i));
+    v4_store (re+j+q, v4_sub (s1r, s3i));
+    v4_store (im+j+q, v4_add (s1i, s3r));
+    v4_store (re+j+2*q, v4_sub (s0r, s2r));
+    v4_store (im+j+2*q, v4_sub (s0i, s2i));
+    v4_store (re+j+3*q, v4_add (s1r, s3i));
+    v4_store (im+j+3*q, v4_sub (s1i, s3r));
+}
+#endif
+
+static void
+fft_radix2 (REAL *re, REAL *im, int n) {
+    for (int g = 0; g < n; g += 2) {
+        REAL ar = re[g], ai = im[g];
+        re[g] = ar + re[g+1];
+        im[g] = ai + im[g+1];
+        re[g+1] = ar - re[g+1];
+        im[g+1] = ai - im[g+1];
+    }
+}
+
+static void
+fft_forward (REAL *re, REAL *im, int n, const REAL *tw) {
+    for (int q = n/4; q >= 1; q /= 4) {
+        for (int g = 0; g < n; g += 4*q) {
+            int j = 0;
+#ifdef EQU_SIMD
+            for (; j + 4 <= q; j += 4) {
+                fft_dif4_simd (re+g, im+g, j, q, tw);
+            }
 #endif
+            for (; j < q; j++) {
+                fft_dif4 (re+g, im+g, j, q, tw);
+            }
+        }
+        tw += 6*q;
+    }
+    // odd number of bits, finish with radix-2
+    if ((n & 0x55555555) == 0) {
+        fft_radix2 (re, im, n);
+    }
+}
+
+static void
+fft_inverse (REAL *re, REAL *im, int n, const REAL *tw) {
+    if ((n & 0x55555555) == 0) {
+        fft_radix2 (re, im, n);
+    }
+    int nstages = 0;
+    int stage_q[16];
+    const REAL *stage_tw[16];
+    for (int q = n/4; q >= 1; q /= 4) {
+        stage_q[nstages] = q;
+        stage_tw[nstages] = tw;
+        tw += 6*q;
+        nstages++;
+    }
+    for (int s = nstages-1; s >= 0; s--) {
+        int q = stage_q[s];
+        for (int g = 0; g < n; g += 4*q) {
+            int j = 0;
+#ifdef EQU_SIMD
+            for (; j + 4 <= q; j += 4) {
+                fft_dit4_simd (re+g, im+g, j, q, stage_tw[s]);
+            }
+#endif
+            for (; j < q; j++) {
+                fft_dit4 (re+g, im+g, j, q, stage_tw[s]);
+            }
+        }
+    }
+}
+
+extern "C" void equ_quit(SuperEqState *state)
+{
+  equ_free(state->ires1);
+  equ_free(state->ires2);
+  equ_free(state->irest);
+  equ_free(state->twiddles);
+  equ_free(state->window);
+  equ_free(state->fdl);
+  equ_free(state->work);
+  equ_free(state->finbuf);
+  equ_free(state->outbuf);
+
+  state->ires1    = NULL;
+  state->ires2    = NULL;
+  state->ires     = NULL;
+  state->irest    = NULL;
+  state->twiddles = NULL;
+  state->window   = NULL;
+  state->fdl      = NULL;
+  state->work     = NULL;
+  state->finbuf   = NULL;
+  state->outbuf   = NULL;
 }
 
 extern "C" void equ_init(SuperEqState *state, int wb, int channels)
 {
   int i,j;
 
-  if (state->lires1 != NULL)   free(state->lires1);
-  if (state->lires2 != NULL)   free(state->lires2);
-  if (state->irest != NULL)    free(state->irest);
-  if (state->fsamples != NULL) free(state->fsamples);
-  if (state->finbuf != NULL)    free(state->finbuf);
-  if (state->outbuf != NULL)   free(state->outbuf);
-  if (state->ditherbuf != NULL) free(state->ditherbuf);
-
+  equ_quit(state);
 
   memset (state, 0, sizeof (SuperEqState));
   state->channels = channels;
-  state->enable = 1;
-
-  state->winlen = (1 << (wb-1))-1;
-  state->winlenbit = wb;
-  state->tabsize  = 1 << wb;
-  state->fft_bits = wb;
-
-  state->lires1   = (REAL *)equ_malloc(sizeof(REAL)*state->tabsize * state->channels);
-  state->lires2   = (REAL *)equ_malloc(sizeof(REAL)*state->tabsize * state->channels);
-  state->irest    = (REAL *)equ_malloc(sizeof(REAL)*state->tabsize);
-  state->fsamples = (REAL *)equ_malloc(sizeof(REAL)*state->tabsize);
-  state->finbuf    = (REAL *)equ_malloc(state->winlen*state->channels*sizeof(REAL));
-  state->outbuf   = (REAL *)equ_malloc(state->tabsize*state->channels*sizeof(REAL));
-  state->ditherbuf = (REAL *)equ_malloc(sizeof(REAL)*DITHERLEN);
-
-  memset (state->lires1, 0, sizeof(REAL)*state->tabsize * state->channels);
-  memset (state->lires2, 0, sizeof(REAL)*state->tabsize * state->channels);
-  memset (state->irest, 0, sizeof(REAL)*state->tabsize);
-  memset (state->fsamples, 0, sizeof(REAL)*state->tabsize);
-  memset (state->finbuf, 0, state->winlen*state->channels*sizeof(REAL));
-  memset (state->outbuf, 0, state->tabsize*state->channels*sizeof(REAL));
-  memset (state->ditherbuf, 0, sizeof(REAL)*DITHERLEN);
-
-  state->lires = state->lires1;
+  state->npairs = (channels+1)/2;
+
+  // the partitions are 1/4 of the filter, that's where fft cost and
+  // spectrum multiplications are about even
+  int blockbits = wb-3;
+  if (blockbits < MIN_BLOCK_BITS) blockbits = MIN_BLOCK_BITS;
+
+  state->winlen   = (1 << (wb-1))-1;
+  state->blocklen = 1 << blockbits;
+  state->fft_bits = blockbits+1;
+  state->fftlen   = 1 << state->fft_bits;
+  state->nparts   = (state->winlen + state->blocklen - 1) / state->blocklen;
+
+  int speclen = 2*state->fftlen;
+  state->ires1    = (REAL *)equ_malloc(sizeof(REAL)*speclen*state->nparts);
+  state->ires2    = (REAL *)equ_malloc(sizeof(REAL)*speclen*state->nparts);
+  state->irest    = (REAL *)equ_malloc(sizeof(REAL)*state->nparts*state->blocklen);
+  state->twiddles = (REAL *)equ_malloc(sizeof(REAL)*fft_twiddles_size(state->fftlen));
+  state->window   = (REAL *)equ_malloc(sizeof(REAL)*speclen*state->npairs);
+  state->fdl      = (REAL *)equ_malloc(sizeof(REAL)*speclen*state->nparts*state->npairs);
+  state->work     = (REAL *)equ_malloc(sizeof(REAL)*speclen);
+  state->finbuf   = (REAL *)equ_malloc(sizeof(REAL)*state->blocklen*state->channels);
+  state->outbuf   = (REAL *)equ_malloc(sizeof(REAL)*state->blocklen*state->channels);
+
+  memset (state->ires1, 0, sizeof(REAL)*speclen*state->nparts);
+  memset (state->ires2, 0, sizeof(REAL)*speclen*state->nparts);
+  memset (state->irest, 0, sizeof(REAL)*state->nparts*state->blocklen);
+
+  fft_init_twiddles (state->twiddles, state->fftlen);
+
+  state->ires = state->ires1;
   state->cur_ires = 1;
-  state->chg_ires = 1;
+  state->chg_ires = 0;
 
-  for(i=0;i<DITHERLEN;i++)
-	state->ditherbuf[i] = (float(rand())/RAND_MAX-0.5);
+  equ_clearbuf(state);
 
   if (fact[0] < 1) {
       for(i=0;i<=M;i++)
@@ -231,7 +428,7 @@ void process_param(REAL *bc,paramlist *param,paramlist &param2,REAL fs,int ch)
   {
     (*pp) = new paramlistelm;
 	(*pp)->lower = i == 0        ?  0 : bands[i-1];
-	(*pp)->upper = i == NBANDS-1 ? fs : bands[i  ];
+	(*pp)->upper = i >= NBANDS-1 ? fs : bands[i  ];
 	(*pp)->gain  = bc[i];
   }
   
@@ -302,157 +499,188 @@ void process_param(REAL *bc,paramlist *param,paramlist &param2,REAL fs,int ch)
 extern "C" void equ_makeTable(SuperEqState *state, REAL *lbc,void *_param,REAL fs)
 {
   paramlist *param = (paramlist *)_param;
-  int i,cires = state->cur_ires;
+  int i,p,cires = state->cur_ires;
   REAL *nires;
 
   if (fs <= 0) return;
 
   paramlist param2;
 
-  for (int ch = 0; ch < state->channels; ch++) {
-      process_param(lbc,param,param2,fs,ch);
-
-      for(i=0;i<state->winlen;i++)
-          state->irest[i] = hn(i-state->winlen/2,param2,fs)*win(i-state->winlen/2,state->winlen);
+  // the filter is the same for all channels
+  process_param(lbc,param,param2,fs,0);
 
-      for(;i<state->tabsize;i++)
-          state->irest[i] = 0;
+  for(i=0;i<state->winlen;i++)
+      state->irest[i] = hn(i-state->winlen/2,param2,fs)*win(i-state->winlen/2,state->winlen);
 
-      rfft(state->fft_bits,1,state->irest);
+  for(;i<state->nparts*state->blocklen;i++)
+      state->irest[i] = 0;
 
-      nires = cires == 1 ? state->lires2 : state->lires1;
-      nires += ch * state->tabsize;
+  nires = cires == 1 ? state->ires2 : state->ires1;
 
-      for(i=0;i<state->tabsize;i++)
-          nires[i] = state->irest[i];
+  // transform each partition, zero padded to fftlen, and fold the scale of
+  // the inverse fft into it
+  REAL scale = 1.0/state->fftlen;
+  for (p = 0; p < state->nparts; p++) {
+      REAL *re = nires + p * 2 * state->fftlen;
+      REAL *im = re + state->fftlen;
+      for (i = 0; i < state->blocklen; i++) {
+          re[i] = state->irest[p*state->blocklen+i] * scale;
+      }
+      for (; i < state->fftlen; i++) {
+          re[i] = 0;
+      }
+      memset (im, 0, sizeof(REAL)*state->fftlen);
+      fft_forward (re, im, state->fftlen, state->twiddles);
   }
+
   state->chg_ires = cires == 1 ? 2 : 1;
 }
 
-extern "C" void equ_quit(SuperEqState *state)
+extern "C" void equ_clearbuf(SuperEqState *state)
 {
-  equ_free(state->lires1);
-  equ_free(state->lires2);
-  equ_free(state->irest);
-  equ_free(state->fsamples);
-  equ_free(state->finbuf);
-  equ_free(state->outbuf);
-  equ_free(state->ditherbuf);
-
-  state->lires1   = NULL;
-  state->lires2   = NULL;
-  state->irest    = NULL;
-  state->fsamples = NULL;
-  state->finbuf    = NULL;
-  state->outbuf   = NULL;
+	state->nbufsamples = 0;
+	state->fdlpos = 0;
+	memset (state->window, 0, sizeof(REAL)*2*state->fftlen*state->npairs);
+	memset (state->fdl, 0, sizeof(REAL)*2*state->fftlen*state->nparts*state->npairs);
+	memset (state->finbuf, 0, sizeof(REAL)*state->blocklen*state->channels);
+	memset (state->outbuf, 0, sizeof(REAL)*state->blocklen*state->channels);
+}
 
-  rfft(0,0,NULL);
+// acc = x*h, or acc += x*h, for n complex values in split arrays
+static void
+equ_spectrum_mul (REAL *acc, const REAL *x, const REAL *h, int n, int add)
+{
+  const REAL *xr = x, *xi = x + n, *hr = h, *hi = h + n;
+  REAL *ar = acc, *ai = acc + n;
+  int i = 0;
+#ifdef EQU_SIMD
+  for (; i + 4 <= n; i += 4) {
+      v4sf a = v4_load (xr+i), b = v4_load (xi+i);
+      v4sf c = v4_load (hr+i), d = v4_load (hi+i);
+      v4sf re = v4_sub (v4_mul (a, c), v4_mul (b, d));
+      v4sf im = v4_add (v4_mul (a, d), v4_mul (b, c));
+      if (add) {
+          re = v4_add (re, v4_load (ar+i));
+          im = v4_add (im, v4_load (ai+i));
+      }
+      v4_store (ar+i, re);
+      v4_store (ai+i, im);
+  }
+#endif
+  for (; i < n; i++) {
+      REAL re = xr[i]*hr[i] - xi[i]*hi[i];
+      REAL im = xr[i]*hi[i] + xi[i]*hr[i];
+      if (add) {
+          re += ar[i];
+          im += ai[i];
+      }
+      ar[i] = re;
+      ai[i] = im;
+  }
 }
 
-extern "C" void equ_clearbuf(SuperEqState *state)
+// filters the block in finbuf into outbuf
+static void
+equ_process_block (SuperEqState *state)
 {
-	int i;
+  int n = state->fftlen, b = state->blocklen, nch = state->channels;
+  int speclen = 2*n;
+
+  for (int pair = 0; pair < state->npairs; pair++) {
+      int ch = pair*2;
+      REAL *wre = state->window + pair*speclen;
+      REAL *wim = wre + n;
+
+      // the window holds previous block in the 1st half, and the new one in the 2nd
+      memcpy (wre, wre+b, sizeof(REAL)*b);
+      memcpy (wim, wim+b, sizeof(REAL)*b);
+      if (ch+1 < nch) {
+          for (int i = 0; i < b; i++) {
+              wre[b+i] = state->finbuf[i*nch+ch];
+              wim[b+i] = state->finbuf[i*nch+ch+1];
+          }
+      }
+      else {
+          for (int i = 0; i < b; i++) {
+              wre[b+i] = state->finbuf[i*nch+ch];
+          }
+      }
 
-	state->nbufsamples = 0;
-	for(i=0;i<state->tabsize*state->channels;i++) state->outbuf[i] = 0;
+      // newest spectrum goes into the delay line
+      REAL *fdl = state->fdl + pair*speclen*state->nparts;
+      REAL *x = fdl + state->fdlpos*speclen;
+      memcpy (x, wre, sizeof(REAL)*speclen);
+      fft_forward (x, x+n, n, state->twiddles);
+
+      // partition p of the filter applies to the block from p blocks ago
+      REAL *acc = state->work;
+      int pos = state->fdlpos;
+      for (int p = 0; p < state->nparts; p++) {
+          equ_spectrum_mul (acc, fdl + pos*speclen, state->ires + p*speclen, n, p > 0);
+          if (--pos < 0) {
+              pos = state->nparts-1;
+          }
+      }
+
+      fft_inverse (acc, acc+n, n, state->twiddles);
+
+      // 2nd half is the filtered block, 1st half is aliased
+      if (ch+1 < nch) {
+          for (int i = 0; i < b; i++) {
+              state->outbuf[i*nch+ch] = acc[b+i];
+              state->outbuf[i*nch+ch+1] = acc[n+b+i];
+          }
+      }
+      else {
+          for (int i = 0; i < b; i++) {
+              state->outbuf[i*nch+ch] = acc[b+i];
+          }
+      }
+  }
+
+  if (++state->fdlpos == state->nparts) {
+      state->fdlpos = 0;
+  }
 }
 
 extern "C" int equ_modifySamples_float (SuperEqState *state, char *buf,int nsamples,int nch)
 {
-  int i,p,ch;
-  REAL *ires;
+  float *samples = (float *)buf;
   float amax = 1.0f;
   float amin = -1.0f;
-  static float hm1 = 0, hm2 = 0;
+  int p = 0;
 
   if (state->chg_ires) {
 	  state->cur_ires = state->chg_ires;
-	  state->lires = state->cur_ires == 1 ? state->lires1 : state->lires2;
+	  state->ires = state->cur_ires == 1 ? state->ires1 : state->ires2;
 	  state->chg_ires = 0;
   }
 
-  p = 0;
-
-  while(state->nbufsamples+nsamples >= state->winlen)
-    {
-		for(i=0;i<(state->winlen-state->nbufsamples)*nch;i++)
-			{
-                state->finbuf[state->nbufsamples*nch+i] = ((float *)buf)[i+p*nch];
-				float s = state->outbuf[state->nbufsamples*nch+i];
-				//if (dither) s += ditherbuf[(ditherptr++) & (DITHERLEN-1)];
-				if (s < amin) s = amin;
-				if (amax < s) s = amax;
-				((float *)buf)[i+p*nch] = s;
-			}
-		for(i=state->winlen*nch;i<state->tabsize*nch;i++)
-			state->outbuf[i-state->winlen*nch] = state->outbuf[i];
-
-
-      p += state->winlen-state->nbufsamples;
-      nsamples -= state->winlen-state->nbufsamples;
-      state->nbufsamples = 0;
-
-      for(ch=0;ch<nch;ch++)
-		{
-            ires = state->lires + ch * state->tabsize;
-
-            for(i=0;i<state->winlen;i++)
-                state->fsamples[i] = state->finbuf[nch*i+ch];
-
-			for(i=state->winlen;i<state->tabsize;i++)
-				state->fsamples[i] = 0;
-
-			if (state->enable) {
-				rfft(state->fft_bits,1,state->fsamples);
-
-				state->fsamples[0] = ires[0]*state->fsamples[0];
-				state->fsamples[1] = ires[1]*state->fsamples[1]; 
-			
-				for(i=1;i<state->tabsize/2;i++)
-					{
-						REAL re,im;
-
-						re = ires[i*2  ]*state->fsamples[i*2] - ires[i*2+1]*state->fsamples[i*2+1];
-						im = ires[i*2+1]*state->fsamples[i*2] + ires[i*2  ]*state->fsamples[i*2+1];
-
-						state->fsamples[i*2  ] = re;
-						state->fsamples[i*2+1] = im;
-					}
-
-				rfft(state->fft_bits,-1,state->fsamples);
-			} else {
-				for(i=state->winlen-1+state->winlen/2;i>=state->winlen/2;i--) state->fsamples[i] = state->fsamples[i-state->winlen/2]*state->tabsize/2;
-				for(;i>=0;i--) state->fsamples[i] = 0;
-			}
-
-			for(i=0;i<state->winlen;i++) state->outbuf[i*nch+ch] += state->fsamples[i]/state->tabsize*2;
-
-			for(i=state->winlen;i<state->tabsize;i++) state->outbuf[i*nch+ch] = state->fsamples[i]/state->tabsize*2;
-		}
-    }
-
-		for(i=0;i<nsamples*nch;i++)
-			{
-				state->finbuf[state->nbufsamples*nch+i] = ((float *)buf)[i+p*nch];
-				float s = state->outbuf[state->nbufsamples*nch+i];
-				if (state->dither) {
-					float u;
-					s -= hm1;
-					u = s;
-//					s += ditherbuf[(ditherptr++) & (DITHERLEN-1)];
-					if (s < amin) s = amin;
-					if (amax < s) s = amax;
-					hm1 = s - u;
-					((float *)buf)[i+p*nch] = s;
-				} else {
-					if (s < amin) s = amin;
-					if (amax < s) s = amax;
-					((float *)buf)[i+p*nch] = s;
-				}
-			}
-
-  p += nsamples;
-  state->nbufsamples += nsamples;
+  // samples are delayed by one block: the input is collected in finbuf,
+  // while the output of the previous block is returned from outbuf
+  while (nsamples > 0) {
+      int n = state->blocklen - state->nbufsamples;
+      if (n > nsamples) {
+          n = nsamples;
+      }
+      float *in = samples + p*nch;
+      REAL *fin = state->finbuf + state->nbufsamples*nch;
+      REAL *fout = state->outbuf + state->nbufsamples*nch;
+      for (int i = 0; i < n*nch; i++) {
+          fin[i] = in[i];
+          float s = fout[i];
+          if (s < amin) s = amin;
+          if (amax < s) s = amax;
+          in[i] = s;
+      }
+      p += n;
+      nsamples -= n;
+      state->nbufsamples += n;
+      if (state->nbufsamples == state->blocklen) {
+          equ_process_block (state);
+          state->nbufsamples = 0;
+      }
+  }
 
   return p;
 }
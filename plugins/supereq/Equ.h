@@ -24,28 +24,43 @@ extern "C" {
 #endif
 
 typedef float REAL;
+
+// the filter is applied with uniformly partitioned convolution (overlap-save):
+// it's split into nparts partitions of blocklen taps, each of them is
+// transformed once by equ_makeTable, and every block of input is transformed
+// once and kept in a frequency domain delay line, so the cost per block is
+// one forward and one inverse fft plus nparts spectrum multiplications.
+// channels are filtered in pairs, as real and imaginary part of one complex
+// signal, which is possible because the filter is real and same for all
+// channels.
+// the latency is blocklen frames plus the group delay of the filter.
 typedef struct {
-    REAL *lires,*lires1,*lires2;
-    REAL *irest;
-    REAL *fsamples;
-    REAL *ditherbuf;
-    int ditherptr;
+    REAL *ires1,*ires2,*ires; // nparts filter spectra, 2*fftlen each
+    REAL *irest; // filter taps
+    REAL *twiddles; // per fft stage
+    REAL *window; // per pair: 2*fftlen, previous and current input block
+    REAL *fdl; // per pair: nparts input spectra
+    REAL *work; // 2*fftlen
+    REAL *finbuf; // interleaved input, blocklen*channels
+    REAL *outbuf; // interleaved output, blocklen*channels
     volatile int chg_ires,cur_ires;
-    int winlen,winlenbit,tabsize,nbufsamples;
-    REAL *finbuf;
-    REAL *outbuf;
-    int dither;
-    int channels;
-    int enable;
+    int winlen; // filter taps
     int fft_bits;
+    int fftlen; // complex points, 2*blocklen
+    int blocklen;
+    int nparts;
+    int fdlpos;
+    int nbufsamples;
+    int channels;
+    int npairs;
 } SuperEqState;
 
 void *paramlist_alloc (void);
 void paramlist_free (void *);
 void equ_makeTable(SuperEqState *state, float *lbc,void *param,float fs);
-int equ_modifySamples(SuperEqState *state, char *buf,int nsamples,int nch,int bps);
 int equ_modifySamples_float (SuperEqState *state, char *buf,int nsamples,int nch);
 void equ_clearbuf(SuperEqState *state);
+// filter length is (1<<(wb-1))-1 taps
 void equ_init(SuperEqState *state, int wb, int channels);
 void equ_quit(SuperEqState *state);
 
@@ -26,6 +26,9 @@
 static DB_functions_t *deadbeef;
 static DB_dsp_t plugin;
 
+// 1023 taps, filtered in blocks of 256 frames
+#define SUPEREQ_FILTER_BITS 11
+
 typedef struct {
     ddb_dsp_context_t ctx;
     float last_srate;
@@ -95,9 +98,12 @@ supereq_process (ddb_dsp_context_t *ctx, float *samples, int frames, int maxfram
     }
 	if (supereq->last_srate != fmt->samplerate || supereq->last_nch != fmt->channels) {
         deadbeef->mutex_lock (supereq->mutex);
+        // buffers only depend on channel count, the samplerate only needs new filter
+        if (supereq->last_nch != fmt->channels) {
+            equ_init (&supereq->state, SUPEREQ_FILTER_BITS, fmt->channels);
+        }
 		supereq->last_srate = fmt->samplerate;
 		supereq->last_nch = fmt->channels;
-        equ_init (&supereq->state, 10, fmt->channels);
         recalc_table (supereq);
 		equ_clearbuf(&supereq->state);
         deadbeef->mutex_unlock (supereq->mutex);
@@ -222,7 +228,7 @@ supereq_open (void) {
     ddb_supereq_ctx_t *supereq = malloc (sizeof (ddb_supereq_ctx_t));
     DDB_INIT_DSP_CONTEXT (supereq,ddb_supereq_ctx_t,&plugin);
 
-    equ_init (&supereq->state, 10, 2);
+    equ_init (&supereq->state, SUPEREQ_FILTER_BITS, 2);
     supereq->paramsroot = paramlist_alloc ();
     supereq->last_srate = 44100;
     supereq->last_nch = 2;
@@ -286,7 +292,6 @@ static DB_dsp_t plugin = {
         "Copyright (C) 2009-2014 Alexey Yakovenko <waker@users.sourceforge.net>\n"
         "\n"
         "Uses supereq library by Naoki Shibata, http://shibatch.sourceforge.net\n"
-        "Uses FFT library by Takuya Ooura, http://www.kurims.kyoto-u.ac.jp/~ooura/\n"
         "\n"
         "This program is free software; you can redistribute it and/or\n"
         "modify it under the terms of the GNU General Public License\n"
@@ -454,6 +454,452 @@ remap_fn_t remappers[8][8] = {
     }
 };
 
+// Converters for the case when input and output have the same channel layout.
+// They treat the buffer as a flat array of n = nsamples*channels values, so
+// there are no per-channel channelmap lookups, and are used by pcm_convert
+// instead of the remappers above whenever the channelmap is identity.
+typedef void (*convert_fn_t) (const char * restrict input, char * restrict output, int n);
+
+static void
+pcm_convert_16_to_32 (const char * restrict input, char * restrict output, int n) {
+    const int16_t *in = (const int16_t *)input;
+    int32_t *out = (int32_t *)output;
+    for (int i = 0; i < n; i++) {
+        out[i] = (int32_t)in[i] << 16;
+    }
+}
+
+static void
+pcm_convert_16_to_float (const char * restrict input, char * restrict output, int n) {
+    const int16_t *in = (const int16_t *)input;
+    float *out = (float *)output;
+    for (int i = 0; i < n; i++) {
+        out[i] = in[i] / (float)0x7fff;
+    }
+}
+
+static void
+pcm_convert_24_to_16 (const char * restrict input, char * restrict output, int n) {
+    for (int i = 0; i < n; i++) {
+        output[0] = input[1];
+        output[1] = input[2];
+        input += 3;
+        output += 2;
+    }
+}
+
+static void
+pcm_convert_24_to_32 (const char * restrict input, char * restrict output, int n) {
+    for (int i = 0; i < n; i++) {
+        output[0] = 0;
+        output[1] = input[0];
+        output[2] = input[1];
+        output[3] = input[2];
+        input += 3;
+        output += 4;
+    }
+}
+
+static void
+pcm_convert_24_to_float (const char * restrict input, char * restrict output, int n) {
+    const unsigned char *in = (const unsigned char *)input;
+    float *out = (float *)output;
+    for (int i = 0; i < n; i++) {
+        int32_t sample = in[0] | (in[1]<<8) | ((int32_t)(int8_t)in[2]<<16);
+        out[i] = sample / (float)0x7fffff;
+        in += 3;
+    }
+}
+
+static void
+pcm_convert_32_to_16 (const char * restrict input, char * restrict output, int n) {
+    const int32_t *in = (const int32_t *)input;
+    int16_t *out = (int16_t *)output;
+    for (int i = 0; i < n; i++) {
+        out[i] = (int16_t)(in[i]>>16);
+    }
+}
+
+static void
+pcm_convert_32_to_float (const char * restrict input, char * restrict output, int n) {
+    const int32_t *in = (const int32_t *)input;
+    float *out = (float *)output;
+    for (int i = 0; i < n; i++) {
+        out[i] = in[i] / (float)0x7fffffff;
+    }
+}
+
+static void
+pcm_convert_float_to_16 (const char * restrict input, char * restrict output, int n) {
+    const float *in = (const float *)input;
+    int16_t *out = (int16_t *)output;
+    fpu_control ctl;
+    fpu_setround (&ctl);
+    for (int i = 0; i < n; i++) {
+        float sample = in[i];
+        if (sample > 1) {
+            sample = 1;
+        }
+        if (sample < -1) {
+            sample = -1;
+        }
+        out[i] = (int16_t)ftoi (sample*0x7fff);
+    }
+    fpu_restore (ctl);
+}
+
+static void
+pcm_convert_float_to_24 (const char * restrict input, char * restrict output, int n) {
+    const float *in = (const float *)input;
+    fpu_control ctl;
+    fpu_setround (&ctl);
+    for (int i = 0; i < n; i++) {
+        float sample = in[i];
+        if (sample > 1) {
+            sample = 1;
+        }
+        if (sample < -1) {
+            sample = -1;
+        }
+        int32_t outsample = (int32_t)ftoi (sample * 0x7fffff);
+        output[0] = (outsample&0x0000ff);
+        output[1] = (outsample&0x00ff00)>>8;
+        output[2] = (outsample&0xff0000)>>16;
+        output += 3;
+    }
+    fpu_restore (ctl);
+}
+
+static void
+pcm_convert_float_to_32 (const char * restrict input, char * restrict output, int n) {
+    const float *in = (const float *)input;
+    int32_t *out = (int32_t *)output;
+    for (int i = 0; i < n; i++) {
+        float fsample = in[i];
+        if (fsample > 0.999f) {
+            fsample = 0.999f;
+        }
+        else if (fsample < -0.999f) {
+            fsample = -0.999f;
+        }
+        out[i] = fsample * (float)0x7fffffff;
+    }
+}
+
+// multiplies n float samples in place by a constant gain.
+// no clamping here: the float samples are allowed to exceed [-1, 1], the
+// conversion to the output format saturates them.
+typedef void (*gain_fn_t) (float *samples, int n, float gain);
+
+static void
+pcm_gain_float (float *samples, int n, float gain) {
+    for (int i = 0; i < n; i++) {
+        samples[i] *= gain;
+    }
+}
+
+// SIMD versions produce the same results as the scalar code above, except
+// for the ARMv7 NEON paths noted below.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PCM_X86_SIMD 1
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static void
+pcm_convert_16_to_32_sse2 (const char * restrict input, char * restrict output, int n) {
+    const __m128i zero = _mm_setzero_si128 ();
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m128i s = _mm_loadu_si128 ((const __m128i *)(input + i * 2));
+        _mm_storeu_si128 ((__m128i *)(output + i * 4), _mm_unpacklo_epi16 (zero, s));
+        _mm_storeu_si128 ((__m128i *)(output + i * 4 + 16), _mm_unpackhi_epi16 (zero, s));
+    }
+    pcm_convert_16_to_32 (input + i * 2, output + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+pcm_convert_16_to_float_sse2 (const char * restrict input, char * restrict output, int n) {
+    const __m128 div = _mm_set1_ps ((float)0x7fff);
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m128i s = _mm_loadu_si128 ((const __m128i *)(input + i * 2));
+        __m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (s, s), 16);
+        __m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (s, s), 16);
+        _mm_storeu_ps ((float *)(output + i * 4), _mm_div_ps (_mm_cvtepi32_ps (lo), div));
+        _mm_storeu_ps ((float *)(output + i * 4 + 16), _mm_div_ps (_mm_cvtepi32_ps (hi), div));
+    }
+    pcm_convert_16_to_float (input + i * 2, output + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+pcm_convert_32_to_16_sse2 (const char * restrict input, char * restrict output, int n) {
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m128i lo = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(input + i * 4)), 16);
+        __m128i hi = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(input + i * 4 + 16)), 16);
+        _mm_storeu_si128 ((__m128i *)(output + i * 2), _mm_packs_epi32 (lo, hi));
+    }
+    pcm_convert_32_to_16 (input + i * 4, output + i * 2, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+pcm_convert_32_to_float_sse2 (const char * restrict input, char * restrict output, int n) {
+    // 1/0x7fffffff as float is exactly 2^-31, so multiplying is the same as dividing
+    const __m128 mul = _mm_set1_ps (1.f / (float)0x7fffffff);
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        __m128i s = _mm_loadu_si128 ((const __m128i *)(input + i * 4));
+        _mm_storeu_ps ((float *)(output + i * 4), _mm_mul_ps (_mm_cvtepi32_ps (s), mul));
+    }
+    pcm_convert_32_to_float (input + i * 4, output + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+pcm_convert_float_to_16_sse2 (const char * restrict input, char * restrict output, int n) {
+    const __m128 lim = _mm_set1_ps (1.f);
+    const __m128 nlim = _mm_set1_ps (-1.f);
+    const __m128 mul = _mm_set1_ps ((float)0x7fff);
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m128 a = _mm_loadu_ps ((const float *)(input + i * 4));
+        __m128 b = _mm_loadu_ps ((const float *)(input + i * 4 + 16));
+        a = _mm_mul_ps (_mm_max_ps (_mm_min_ps (a, lim), nlim), mul);
+        b = _mm_mul_ps (_mm_max_ps (_mm_min_ps (b, lim), nlim), mul);
+        _mm_storeu_si128 ((__m128i *)(output + i * 2), _mm_packs_epi32 (_mm_cvtps_epi32 (a), _mm_cvtps_epi32 (b)));
+    }
+    pcm_convert_float_to_16 (input + i * 4, output + i * 2, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+pcm_convert_float_to_32_sse2 (const char * restrict input, char * restrict output, int n) {
+    const __m128 lim = _mm_set1_ps (0.999f);
+    const __m128 nlim = _mm_set1_ps (-0.999f);
+    const __m128 mul = _mm_set1_ps ((float)0x7fffffff);
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        __m128 a = _mm_loadu_ps ((const float *)(input + i * 4));
+        a = _mm_mul_ps (_mm_max_ps (_mm_min_ps (a, lim), nlim), mul);
+        _mm_storeu_si128 ((__m128i *)(output + i * 4), _mm_cvttps_epi32 (a));
+    }
+    pcm_convert_float_to_32 (input + i * 4, output + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+pcm_gain_float_sse2 (float *samples, int n, float gain) {
+    const __m128 g = _mm_set1_ps (gain);
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        _mm_storeu_ps (samples + i, _mm_mul_ps (_mm_loadu_ps (samples + i), g));
+    }
+    pcm_gain_float (samples + i, n - i, gain);
+}
+
+__attribute__((target("avx2"))) static void
+pcm_convert_16_to_float_avx2 (const char * restrict input, char * restrict output, int n) {
+    const __m256 div = _mm256_set1_ps ((float)0x7fff);
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m256i s = _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *)(input + i * 2)));
+        _mm256_storeu_ps ((float *)(output + i * 4), _mm256_div_ps (_mm256_cvtepi32_ps (s), div));
+    }
+    pcm_convert_16_to_float (input + i * 2, output + i * 4, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+pcm_convert_32_to_float_avx2 (const char * restrict input, char * restrict output, int n) {
+    const __m256 mul = _mm256_set1_ps (1.f / (float)0x7fffffff);
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m256i s = _mm256_loadu_si256 ((const __m256i *)(input + i * 4));
+        _mm256_storeu_ps ((float *)(output + i * 4), _mm256_mul_ps (_mm256_cvtepi32_ps (s), mul));
+    }
+    pcm_convert_32_to_float (input + i * 4, output + i * 4, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+pcm_convert_float_to_16_avx2 (const char * restrict input, char * restrict output, int n) {
+    const __m256 lim = _mm256_set1_ps (1.f);
+    const __m256 nlim = _mm256_set1_ps (-1.f);
+    const __m256 mul = _mm256_set1_ps ((float)0x7fff);
+    int i = 0;
+    for (; i <= n - 16; i += 16) {
+        __m256 a = _mm256_loadu_ps ((const float *)(input + i * 4));
+        __m256 b = _mm256_loadu_ps ((const float *)(input + i * 4 + 32));
+        a = _mm256_mul_ps (_mm256_max_ps (_mm256_min_ps (a, lim), nlim), mul);
+        b = _mm256_mul_ps (_mm256_max_ps (_mm256_min_ps (b, lim), nlim), mul);
+        // packs works within 128-bit lanes, put the quadwords back in order
+        __m256i s = _mm256_packs_epi32 (_mm256_cvtps_epi32 (a), _mm256_cvtps_epi32 (b));
+        _mm256_storeu_si256 ((__m256i *)(output + i * 2), _mm256_permute4x64_epi64 (s, 0xd8));
+    }
+    pcm_convert_float_to_16 (input + i * 4, output + i * 2, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+pcm_convert_float_to_32_avx2 (const char * restrict input, char * restrict output, int n) {
+    const __m256 lim = _mm256_set1_ps (0.999f);
+    const __m256 nlim = _mm256_set1_ps (-0.999f);
+    const __m256 mul = _mm256_set1_ps ((float)0x7fffffff);
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m256 a = _mm256_loadu_ps ((const float *)(input + i * 4));
+        a = _mm256_mul_ps (_mm256_max_ps (_mm256_min_ps (a, lim), nlim), mul);
+        _mm256_storeu_si256 ((__m256i *)(output + i * 4), _mm256_cvttps_epi32 (a));
+    }
+    pcm_convert_float_to_32 (input + i * 4, output + i * 4, n - i);
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PCM_NEON_SIMD 1
+#include <arm_neon.h>
+
+static void
+pcm_convert_16_to_32_neon (const char * restrict input, char * restrict output, int n) {
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        int16x4_t s = vld1_s16 ((const int16_t *)(input + i * 2));
+        vst1q_s32 ((int32_t *)(output + i * 4), vshll_n_s16 (s, 16));
+    }
+    pcm_convert_16_to_32 (input + i * 2, output + i * 4, n - i);
+}
+
+static void
+pcm_convert_16_to_float_neon (const char * restrict input, char * restrict output, int n) {
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        int16x8_t s = vld1q_s16 ((const int16_t *)(input + i * 2));
+        float32x4_t lo = vcvtq_f32_s32 (vmovl_s16 (vget_low_s16 (s)));
+        float32x4_t hi = vcvtq_f32_s32 (vmovl_s16 (vget_high_s16 (s)));
+#ifdef __aarch64__
+        const float32x4_t div = vdupq_n_f32 ((float)0x7fff);
+        lo = vdivq_f32 (lo, div);
+        hi = vdivq_f32 (hi, div);
+#else
+        // no vector division on ARMv7, may differ from scalar code by 1ulp
+        lo = vmulq_n_f32 (lo, 1.f / (float)0x7fff);
+        hi = vmulq_n_f32 (hi, 1.f / (float)0x7fff);
+#endif
+        vst1q_f32 ((float *)(output + i * 4), lo);
+        vst1q_f32 ((float *)(output + i * 4 + 16), hi);
+    }
+    pcm_convert_16_to_float (input + i * 2, output + i * 4, n - i);
+}
+
+static void
+pcm_convert_32_to_16_neon (const char * restrict input, char * restrict output, int n) {
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        int32x4_t s = vld1q_s32 ((const int32_t *)(input + i * 4));
+        vst1_s16 ((int16_t *)(output + i * 2), vshrn_n_s32 (s, 16));
+    }
+    pcm_convert_32_to_16 (input + i * 4, output + i * 2, n - i);
+}
+
+static void
+pcm_convert_32_to_float_neon (const char * restrict input, char * restrict output, int n) {
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        int32x4_t s = vld1q_s32 ((const int32_t *)(input + i * 4));
+        vst1q_f32 ((float *)(output + i * 4), vmulq_n_f32 (vcvtq_f32_s32 (s), 1.f / (float)0x7fffffff));
+    }
+    pcm_convert_32_to_float (input + i * 4, output + i * 4, n - i);
+}
+
+static void
+pcm_convert_float_to_16_neon (const char * restrict input, char * restrict output, int n) {
+    const float32x4_t lim = vdupq_n_f32 (1.f);
+    const float32x4_t nlim = vdupq_n_f32 (-1.f);
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        float32x4_t a = vld1q_f32 ((const float *)(input + i * 4));
+        a = vmulq_n_f32 (vmaxq_f32 (vminq_f32 (a, lim), nlim), (float)0x7fff);
+#ifdef __aarch64__
+        int32x4_t s = vcvtnq_s32_f32 (a);
+#else
+        // ARMv7 only truncates; rounds halves away from zero instead of to even
+        float32x4_t half = vbslq_f32 (vcltq_f32 (a, vdupq_n_f32 (0)), vdupq_n_f32 (-0.5f), vdupq_n_f32 (0.5f));
+        int32x4_t s = vcvtq_s32_f32 (vaddq_f32 (a, half));
+#endif
+        vst1_s16 ((int16_t *)(output + i * 2), vqmovn_s32 (s));
+    }
+    pcm_convert_float_to_16 (input + i * 4, output + i * 2, n - i);
+}
+
+static void
+pcm_convert_float_to_32_neon (const char * restrict input, char * restrict output, int n) {
+    const float32x4_t lim = vdupq_n_f32 (0.999f);
+    const float32x4_t nlim = vdupq_n_f32 (-0.999f);
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        float32x4_t a = vld1q_f32 ((const float *)(input + i * 4));
+        a = vmulq_n_f32 (vmaxq_f32 (vminq_f32 (a, lim), nlim), (float)0x7fffffff);
+        vst1q_s32 ((int32_t *)(output + i * 4), vcvtq_s32_f32 (a));
+    }
+    pcm_convert_float_to_32 (input + i * 4, output + i * 4, n - i);
+}
+
+static void
+pcm_gain_float_neon (float *samples, int n, float gain) {
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        vst1q_f32 (samples + i, vmulq_n_f32 (vld1q_f32 (samples + i), gain));
+    }
+    pcm_gain_float (samples + i, n - i, gain);
+}
+#endif
+
+// indexed the same way as remappers; same-format conversions are memcpy
+static convert_fn_t converters[8][8] = {
+    [1] = {
+        [3] = pcm_convert_16_to_32,
+        [7] = pcm_convert_16_to_float,
+    },
+    [2] = {
+        [1] = pcm_convert_24_to_16,
+        [3] = pcm_convert_24_to_32,
+        [7] = pcm_convert_24_to_float,
+    },
+    [3] = {
+        [1] = pcm_convert_32_to_16,
+        [7] = pcm_convert_32_to_float,
+    },
+    [7] = {
+        [1] = pcm_convert_float_to_16,
+        [2] = pcm_convert_float_to_24,
+        [3] = pcm_convert_float_to_32,
+    },
+};
+
+static gain_fn_t gainer = pcm_gain_float;
+
+void
+pcm_init (void) {
+#if PCM_X86_SIMD
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2")) {
+        converters[1][3] = pcm_convert_16_to_32_sse2;
+        converters[1][7] = pcm_convert_16_to_float_sse2;
+        converters[3][1] = pcm_convert_32_to_16_sse2;
+        converters[3][7] = pcm_convert_32_to_float_sse2;
+        converters[7][1] = pcm_convert_float_to_16_sse2;
+        converters[7][3] = pcm_convert_float_to_32_sse2;
+        gainer = pcm_gain_float_sse2;
+    }
+    if (__builtin_cpu_supports ("avx2")) {
+        converters[1][7] = pcm_convert_16_to_float_avx2;
+        converters[3][7] = pcm_convert_32_to_float_avx2;
+        converters[7][1] = pcm_convert_float_to_16_avx2;
+        converters[7][3] = pcm_convert_float_to_32_avx2;
+    }
+#elif PCM_NEON_SIMD
+    converters[1][3] = pcm_convert_16_to_32_neon;
+    converters[1][7] = pcm_convert_16_to_float_neon;
+    converters[3][1] = pcm_convert_32_to_16_neon;
+    converters[3][7] = pcm_convert_32_to_float_neon;
+    converters[7][1] = pcm_convert_float_to_16_neon;
+    converters[7][3] = pcm_convert_float_to_32_neon;
+    gainer = pcm_gain_float_neon;
+#endif
+}
+
 int
 pcm_convert (const ddb_waveformat_t * restrict inputfmt, const char * restrict input, const ddb_waveformat_t * restrict outputfmt, char * restrict output, int inputsize) {
     // calculate output size
@@ -501,7 +947,20 @@ pcm_convert (const ddb_waveformat_t * restrict inputfmt, const char * restrict i
 
         int outidx = ((outputfmt->bps >> 3) - 1) | (outputfmt->is_float << 2);
         int inidx = ((inputfmt->bps >> 3) - 1) | (inputfmt->is_float << 2);
-        if (remappers[inidx][outidx]) {
+
+        int identity = inputfmt->channels == outputfmt->channels && outchannels == outputfmt->channelmask;
+        for (int i = 0; identity && i < inputfmt->channels; i++) {
+            if (channelmap[i] != i) {
+                identity = 0;
+            }
+        }
+        if (identity && inidx == outidx) {
+            memcpy (output, input, nsamples * outputsamplesize);
+        }
+        else if (identity && converters[inidx][outidx]) {
+            converters[inidx][outidx] (input, output, nsamples * outputfmt->channels);
+        }
+        else if (remappers[inidx][outidx]) {
             remappers[inidx][outidx] (inputfmt, input, outputfmt, output, nsamples, channelmap, outputsamplesize);
         }
         else {
@@ -511,3 +970,23 @@ pcm_convert (const ddb_waveformat_t * restrict inputfmt, const char * restrict i
     return nsamples * outputsamplesize;
 }
 
+// the gain is changed in steps of this many frames when ramping
+#define GAIN_RAMP_STEP 32
+
+void
+pcm_apply_gain (float *samples, int nframes, int channels, float from, float to) {
+    if (from == to) {
+        gainer (samples, nframes * channels, to);
+        return;
+    }
+    // ramp over the whole block, to avoid clicks on volume changes
+    int nsteps = (nframes + GAIN_RAMP_STEP - 1) / GAIN_RAMP_STEP;
+    for (int i = 0; i < nsteps; i++) {
+        int n = nframes - i * GAIN_RAMP_STEP;
+        if (n > GAIN_RAMP_STEP) {
+            n = GAIN_RAMP_STEP;
+        }
+        float gain = from + (to - from) * (i + 1) / nsteps;
+        gainer (samples + i * GAIN_RAMP_STEP * channels, n * channels, gain);
+    }
+}
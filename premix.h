@@ -28,8 +28,17 @@
 #ifndef __PREMIX_H
 #define __PREMIX_H
 
+// selects the best sample format converters for the CPU
+void
+pcm_init (void);
+
 // @returns number of output bytes
 int
 pcm_convert (const ddb_waveformat_t * restrict inputfmt, const char * restrict input, const ddb_waveformat_t * restrict outputfmt, char * restrict output, int inputsize);
 
+// multiplies interleaved float samples by gain, which changes linearly from
+// `from` to `to` over the block. the result is not clamped.
+void
+pcm_apply_gain (float *samples, int nframes, int channels, float from, float to);
+
 #endif
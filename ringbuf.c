@@ -28,66 +28,127 @@
 #include <string.h>
 #include "ringbuf.h"
 
+static inline size_t
+ringbuf_load (volatile size_t *ptr) {
+    return __atomic_load_n (ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+ringbuf_store (volatile size_t *ptr, size_t val) {
+    __atomic_store_n (ptr, val, __ATOMIC_RELEASE);
+}
+
+static inline size_t
+ringbuf_advance (ringbuf_t *p, size_t cursor, size_t n) {
+    cursor += n;
+    if (cursor >= p->size * 2) {
+        cursor -= p->size * 2;
+    }
+    return cursor;
+}
+
+static inline size_t
+ringbuf_distance (ringbuf_t *p, size_t from, size_t to) {
+    return to >= from ? to - from : to + p->size * 2 - from;
+}
+
 void
 ringbuf_init (ringbuf_t *p, char *buffer, size_t size) {
     memset (p, 0, sizeof (ringbuf_t));
     p->bytes = buffer;
-    p->cursor = 0;
     p->size = size;
-    p->remaining = 0;
+    ringbuf_store (&p->wcursor, 0);
+    ringbuf_store (&p->rcursor, 0);
+}
+
+size_t
+ringbuf_get_remaining (ringbuf_t *p) {
+    size_t w = ringbuf_load (&p->wcursor);
+    size_t r = ringbuf_load (&p->rcursor);
+    return ringbuf_distance (p, r, w);
+}
+
+size_t
+ringbuf_get_free (ringbuf_t *p) {
+    return p->size - ringbuf_get_remaining (p);
 }
 
 int
 ringbuf_write (ringbuf_t *p, char *bytes, size_t size) {
-    if (p->size - p->remaining < size) {
+    size_t w = p->wcursor;
+    size_t r = ringbuf_load (&p->rcursor);
+    if (p->size - ringbuf_distance (p, r, w) < size) {
         return -1;
     }
 
-    size_t cursor = p->cursor + p->remaining;
-    cursor %= p->size;
+    size_t cursor = w % p->size;
 
-    if (p->size - cursor >= size) { // split
+    if (p->size - cursor >= size) {
         memcpy (p->bytes + cursor, bytes, size);
-        p->remaining += size;
     }
-    else {
+    else { // split
         size_t n = p->size - cursor;
-        if (n > 0) {
-            memcpy (p->bytes + cursor, bytes, n);
-            p->remaining += n;
-            size -= n;
-            bytes += n;
-        }
-        memcpy (p->bytes, bytes, size);
-        p->remaining += size;
+        memcpy (p->bytes + cursor, bytes, n);
+        memcpy (p->bytes, bytes + n, size - n);
     }
+
+    // publish the data only after it was copied
+    ringbuf_store (&p->wcursor, ringbuf_advance (p, w, size));
     return 0;
 }
 
 int
 ringbuf_read (ringbuf_t *p, char *bytes, size_t size) {
-    if (p->remaining < size) {
-        size = p->remaining;
-    }
-    int rb = size;
+    for (;;) {
+        size_t r = ringbuf_load (&p->rcursor);
+        size_t w = ringbuf_load (&p->wcursor);
+        size_t n = ringbuf_distance (p, r, w);
+        if (n > size) {
+            n = size;
+        }
 
-    if (p->size - p->cursor >= size) {
-        memcpy (bytes, p->bytes + p->cursor, size);
-        p->cursor += size;
-        p->remaining -= size;
+        size_t cursor = r % p->size;
+
+        if (p->size - cursor >= n) {
+            memcpy (bytes, p->bytes + cursor, n);
+        }
+        else {
+            size_t part = p->size - cursor;
+            memcpy (bytes, p->bytes + cursor, part);
+            memcpy (bytes + part, p->bytes, n - part);
+        }
+
+        // ringbuf_flush hands the space over to the writer at once, so if it
+        // moved rcursor while we were copying, the data may have been
+        // overwritten: discard it, and read what was written after the flush
+        size_t expected = r;
+        if (__atomic_compare_exchange_n (&p->rcursor, &expected, ringbuf_advance (p, r, n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return n;
+        }
     }
-    else {
-        size_t n = p->size - p->cursor;
-        if (n > 0) {
-            memcpy (bytes, p->bytes + p->cursor, n);
-            p->cursor += n;
-            p->remaining -= n;
-            bytes += n;
-            size -= n;
+}
+
+void
+ringbuf_flush (ringbuf_t *p) {
+    size_t r = ringbuf_load (&p->rcursor);
+    for (;;) {
+        size_t w = ringbuf_load (&p->wcursor);
+        if (__atomic_compare_exchange_n (&p->rcursor, &r, w, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            break;
         }
-        memcpy (bytes, p->bytes, size);
-        p->cursor = size;
-        p->remaining -= size;
     }
-    return rb;
+}
+
+int
+ringbuf_resize (ringbuf_t *p, char *buffer, size_t size) {
+    size_t remaining = ringbuf_get_remaining (p);
+    if (remaining > size) {
+        return -1;
+    }
+    ringbuf_read (p, buffer, remaining);
+    p->bytes = buffer;
+    p->size = size;
+    ringbuf_store (&p->rcursor, 0);
+    ringbuf_store (&p->wcursor, remaining);
+    return 0;
 }
@@ -29,20 +29,55 @@
 
 #include <sys/types.h>
 
+#define RINGBUF_CACHELINE_SIZE 64
+
+// single-producer/single-consumer ring buffer.
+// ringbuf_write may only be called from one thread, and ringbuf_read from
+// another one; neither of them ever blocks or takes a lock.
+// the cursors count bytes modulo 2*size, which allows to tell full buffer
+// from empty one without a separate counter shared by both sides.
+// they are kept on separate cache lines, to avoid false sharing between
+// producer and consumer.
 typedef struct {
     char *bytes;
     size_t size;
-    size_t cursor;
-    size_t remaining;
+    char pad0[RINGBUF_CACHELINE_SIZE];
+    volatile size_t wcursor; // modified by producer
+    char pad1[RINGBUF_CACHELINE_SIZE - sizeof (size_t)];
+    volatile size_t rcursor; // modified by consumer, and by ringbuf_flush
+    char pad2[RINGBUF_CACHELINE_SIZE - sizeof (size_t)];
 } ringbuf_t;
 
 void
 ringbuf_init (ringbuf_t *p, char *buffer, size_t size);
 
+// returns -1 if there's not enough free space for the whole block
 int
 ringbuf_write (ringbuf_t *p, char *bytes, size_t size);
 
+// returns number of bytes read, which can be less than requested.
+// never returns data which was dropped by a concurrent ringbuf_flush
 int
 ringbuf_read (ringbuf_t *p, char *bytes, size_t size);
 
+// number of bytes available for reading
+size_t
+ringbuf_get_remaining (ringbuf_t *p);
+
+// number of bytes available for writing
+size_t
+ringbuf_get_free (ringbuf_t *p);
+
+// drop all buffered data; safe to call from any thread
+void
+ringbuf_flush (ringbuf_t *p);
+
+// move buffered data into a new buffer of different size.
+// not thread-safe: neither producer nor consumer may access the ringbuf
+// while this is running.
+// returns -1 if the buffered data doesn't fit into the new buffer,
+// in which case nothing is changed
+int
+ringbuf_resize (ringbuf_t *p, char *buffer, size_t size);
+
 #endif
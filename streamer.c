@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 #include <unistd.h>
 #ifdef __linux__
 #include <sys/prctl.h>
@@ -90,8 +91,21 @@ static int stop_after_album = 0;
 
 static int streaming_terminate;
 
-// buffer up to 3 seconds at 44100Hz stereo
-#define STREAM_BUFFER_SIZE 0x80000 // slightly more than 3 seconds of 44100 stereo
+// stream buffer size is configured in milliseconds of the current output
+// format, and the buffer is reallocated when the output format changes
+#define DEFAULT_BUFFER_MS 3000
+#define MIN_BUFFER_MS 200
+#define MAX_BUFFER_MS 60000
+
+// how much to buffer before the track starts playing
+#define DEFAULT_PREBUFFER_MS 750
+
+// when the buffer is full, streamer thread sleeps until the output drains it
+// below this mark
+#define DEFAULT_LOWWATER_MS 1500
+
+// used until the first output format is known
+#define STREAM_BUFFER_INITIAL_SIZE 0x80000 // slightly more than 3 seconds of 44100 stereo
 
 // how much bigger should read-buffer be to allow upsampling.
 // e.g. 8000Hz -> 192000Hz upsampling requires 24x buffer size,
@@ -104,13 +118,100 @@ static int streaming_terminate;
 #define READBUFFER_SIZE (MAX_BLOCK_SIZE * MAX_DSP_RATIO)
 static char readbuffer[READBUFFER_SIZE];
 
+// scratch memory for the dsp path of streamer_read_async: decoded input,
+// followed by the MAX_DSP_RATIO sized float buffer that the dsp plugins work on.
+// only grows, protected by decodemutex
+static char *dsp_arena;
+static size_t dsp_arena_size;
+
+// pipelined dsp: when "streamer.dsp_pipeline" is on, every enabled plugin of
+// the dsp chain runs on its own thread, and the blocks travel between them
+// through single-producer/single-consumer queues.
+// the streamer thread decodes into the first queue and takes the processed
+// blocks from the last one, so a block comes out nstages+1 reads after it went
+// in. the audio that is in flight is reported by streamer_get_dsp_latency.
+// the plugin api is unchanged: each context is still only called from one
+// thread at a time, and the stages keep the order of the chain.
+#define DSP_PIPE_MAX_STAGES 16
+#define DSP_PIPE_QUEUE_SIZE 32 // must be a power of 2, more than DSP_PIPE_MAX_STAGES+1
+
+typedef struct {
+    ddb_waveformat_t srcfmt; // format the block was decoded from
+    ddb_waveformat_t fmt; // format of the data after the stages it went through
+    char *data; // aligned float samples
+    int size; // allocated bytes
+    int nframes;
+    int maxframes;
+    float ratio;
+    float duration; // seconds of the source audio
+    int eof;
+} dsp_block_t;
+
+typedef struct {
+    dsp_block_t *blocks[DSP_PIPE_QUEUE_SIZE];
+    unsigned head; // written by producer
+    unsigned tail; // written by consumer
+    int waiting; // consumer is about to sleep on cond
+    uintptr_t cond;
+} dsp_queue_t;
+
+typedef struct {
+    ddb_dsp_context_t *dsp;
+    dsp_queue_t *in;
+    dsp_queue_t *out;
+    intptr_t tid;
+} dsp_stage_t;
+
+static int conf_dsp_pipeline = 0;
+static volatile int dsp_pipe_stopping;
+static uintptr_t dsp_pipe_mutex;
+static int dsp_pipe_nstages;
+static dsp_stage_t dsp_pipe_stages[DSP_PIPE_MAX_STAGES];
+static dsp_queue_t dsp_pipe_queues[DSP_PIPE_MAX_STAGES+1];
+static dsp_block_t dsp_pipe_blocks[DSP_PIPE_MAX_STAGES+1];
+static dsp_block_t *dsp_pipe_free[DSP_PIPE_MAX_STAGES+1];
+static int dsp_pipe_nfree;
+static int dsp_pipe_inflight;
+static int dsp_pipe_draining; // decoder reached eof, no more blocks are fed until it comes out
+static float dsp_pipe_latency; // seconds of audio inside the pipeline
+
+static void
+streamer_dsp_pipe_stop (void);
+
 static ringbuf_t streamer_ringbuf;
-static char streambuffer[STREAM_BUFFER_SIZE];
+static char *streambuffer;
+
+static int conf_buffer_ms = DEFAULT_BUFFER_MS;
+static int conf_prebuffer_ms = DEFAULT_PREBUFFER_MS;
+static int conf_lowwater_ms = DEFAULT_LOWWATER_MS;
+
+// all in bytes of the current output format
+static int streamer_buffer_size;
+static int streamer_prebuffer_size;
+static int streamer_lowwater_size;
+
+// handshake between streamer_resize_buffer and streamer_read,
+// which allows to swap the buffer without making the reader wait
+static volatile int streamer_buffer_swapping;
+static volatile int streamer_buffer_reading;
+
+static volatile int bytes_until_next_song = 0;
+
+// replaygain scale of the track which ends at the bytes_until_next_song
+// boundary, while the new track's scale is already set.
+// written by streamer_next before the boundary is published, so readers
+// must load it after bytes_until_next_song
+static volatile float prev_replaygain_scale = 1;
+// gain applied to the end of the last block in streamer_read,
+// negative after flushing the buffer, when there's nothing to ramp from
+static volatile float applied_gain = -1;
+// float scratch for the gain stage, only used by streamer_read
+#define GAIN_BUFFER_SAMPLES 4096
+static float gain_buffer[GAIN_BUFFER_SAMPLES];
 
-static int bytes_until_next_song = 0;
 static uintptr_t mutex;
 static uintptr_t decodemutex;
-static uintptr_t wdl_mutex; // wavedata listener
+static uintptr_t wdl_mutex; // waveform listeners
 
 static int nextsong = -1;
 static int nextsong_pstate = -1;
@@ -140,14 +241,93 @@ static DB_FILE *new_fileinfo_file;
 
 static int streamer_buffering;
 
+// next track is opened, initialized and partially decoded by preloader
+// thread, when the current one is this many seconds from the end
+#define PRELOAD_AHEAD_SEC 10
+#define PRELOAD_MS 300
+// how long the streamer waits for the preloader before it gives up, and
+// opens the track itself
+#define PRELOAD_TAKE_TIMEOUT_MS 500
+
+enum {
+    PRELOAD_NONE,
+    PRELOAD_BUSY,
+    PRELOAD_READY,
+};
+
+// the preloaded track, owned by the preloader thread while BUSY
+typedef struct {
+    int state;
+    playItem_t *track;
+    DB_fileinfo_t *fileinfo;
+    char *data;
+    int size;
+} preload_slot_t;
+
+static int conf_preload_next = 1;
+static intptr_t preload_tid;
+static volatile int preload_terminate;
+static struct handler_s *preload_handler;
+static uintptr_t preload_mutex;
+static uintptr_t preload_cond;
+static preload_slot_t preload_slot;
+static DB_FILE *preload_file; // set and cleared under preload_mutex, for fabort
+static int preload_requested;
+
+// data decoded by preloader, which is played before reading from fileinfo
+static char *predecoded_data;
+static int predecoded_size;
+static int predecoded_pos;
+
+// set by streamer thread when it waits for the buffer to drain
+static volatile int streamer_wait_lowwater;
+
 // to allow interruption of stall file requests
 static DB_FILE *streamer_file;
 
 // for vis plugins
-static float freq_data[DDB_FREQ_BANDS * DDB_FREQ_MAX_CHANNELS];
-static float audio_data[DDB_FREQ_BANDS * 2 * DDB_FREQ_MAX_CHANNELS];
-static int audio_data_fill = 0;
-static int audio_data_channels = 0;
+// streamer_read converts the output samples once into vis_ring, which is
+// a broadcast ring: the writer never waits, every reader (ddb_vis_tap_t) has
+// its own cursor, and skips the oldest frames if it falls too far behind.
+// the callback listeners are served from vis_thread's own tap, so neither the
+// listeners nor the fft can delay the output
+#define VIS_RING_SAMPLES (1<<17)
+#define VIS_TAP_CHUNK_FRAMES 1024
+#define VIS_FFT_MIN_SIZE (DDB_FREQ_BANDS * 2)
+#define VIS_FFT_MAX_SIZE 8192
+#define VIS_WAKEUP_POLL_MS 50
+
+struct ddb_vis_tap_s {
+    int mode;
+    int decimate;
+    unsigned cursor; // next frame to read
+    unsigned fmt_seq; // vis_ring_fmt_seq of fmt
+    ddb_waveformat_t fmt;
+    unsigned frames; // vis_ring_frames for fmt
+    int acc_count; // input frames accumulated for the next decimated frame
+    float acc[DDB_FREQ_MAX_CHANNELS];
+    float chunk[VIS_TAP_CHUNK_FRAMES * DDB_FREQ_MAX_CHANNELS];
+};
+
+// cursors count frames, and wrap around; vis_ring_fmt, vis_ring_fmt_start
+// and vis_ring_frames are only changed while vis_ring_fmt_seq is odd
+static float *vis_ring;
+static ddb_waveformat_t vis_ring_fmt;
+static unsigned vis_ring_fmt_start; // first frame in vis_ring_fmt
+static unsigned vis_ring_frames; // ring size in frames of vis_ring_fmt, power of 2
+static volatile unsigned vis_ring_fmt_seq;
+static volatile unsigned vis_ring_wbegin; // end of the frames being written
+static volatile unsigned vis_ring_wcursor; // end of the written frames
+static volatile int vis_ntaps; // taps opened by plugins
+static volatile int vis_waiting; // vis_thread is about to sleep on vis_cond
+static uintptr_t vis_mutex;
+static uintptr_t vis_cond;
+static intptr_t vis_tid;
+static volatile int vis_terminate;
+static volatile int conf_vis_fft_size = VIS_FFT_MIN_SIZE;
+static volatile int conf_vis_fft_window = FFT_WINDOW_DEFAULT;
+static uintptr_t spectrum_mutex; // spectrum listeners, held while calling them
+static float freq_data[DDB_FREQ_BANDS * DDB_FREQ_MAX_CHANNELS]; // vis_thread only
 
 // message queue
 static struct handler_s *handler;
@@ -221,6 +401,12 @@ streamer_abort_files (void) {
     if (strfile) {
         deadbeef->fabort (strfile);
     }
+    // under the mutex, so that the preloader can't free the file meanwhile
+    mutex_lock (preload_mutex);
+    if (preload_file) {
+        deadbeef->fabort (preload_file);
+    }
+    mutex_unlock (preload_mutex);
 
 }
 
@@ -354,17 +540,7 @@ str_get_for_idx (int idx) {
     if (!streamer_playlist) {
         streamer_playlist = plt_get_curr ();
     }
-    playItem_t *it = streamer_playlist->head[PL_MAIN];
-    while (idx--) {
-        if (!it) {
-            pl_unlock ();
-            return NULL;
-        }
-        it = it->next[PL_MAIN];
-    }
-    if (it) {
-        pl_item_ref (it);
-    }
+    playItem_t *it = plt_get_item_for_idx (streamer_playlist, idx, PL_MAIN);
     pl_unlock ();
     return it;
 }
@@ -525,16 +701,7 @@ streamer_move_to_nextsong_real (int reason) {
     if (pl_order == PLAYBACK_ORDER_SHUFFLE_TRACKS || pl_order == PLAYBACK_ORDER_SHUFFLE_ALBUMS) { // shuffle
         if (!curr || pl_order == PLAYBACK_ORDER_SHUFFLE_TRACKS) {
             // find minimal notplayed
-            playItem_t *pmin = NULL; // notplayed minimum
-            for (playItem_t *i = plt->head[PL_MAIN]; i; i = i->next[PL_MAIN]) {
-                if (i->played) {
-                    continue;
-                }
-                if (!pmin || i->shufflerating < pmin->shufflerating) {
-                    pmin = i;
-                }
-            }
-            playItem_t *it = pmin;
+            playItem_t *it = plt_shuffle_next (plt, NULL);
             // although it is possible that, although it == NULL, reshuffling the playlist
             // will result in the next track belonging to the same album as this one, this
             // is most likely not what the user wants.
@@ -565,17 +732,7 @@ streamer_move_to_nextsong_real (int reason) {
         else {
             trace ("pl_next_song: reason=%d, loop=%d\n", reason, pl_loop_mode);
             // find minimal notplayed above current
-            int rating = curr->shufflerating;
-            playItem_t *pmin = NULL; // notplayed minimum
-            for (playItem_t *i = plt->head[PL_MAIN]; i; i = i->next[PL_MAIN]) {
-                if (i->played || i->shufflerating < rating) {
-                    continue;
-                }
-                if (!pmin || i->shufflerating < pmin->shufflerating) {
-                    pmin = i;
-                }
-            }
-            playItem_t *it = pmin;
+            playItem_t *it = plt_shuffle_next (plt, curr);
             if (stop_after_album_check(curr, it)) {
                 pl_unlock ();
                 return -1;
@@ -688,22 +845,10 @@ streamer_move_to_prevsong_real (int r) {
             return streamer_move_to_nextsong_real (0);
         }
         else {
-            playlist_track->played = 0;
+            plt_shuffle_unplayed (plt, playlist_track);
             // find already played song with maximum shuffle rating below prev song
-            int rating = playlist_track->shufflerating;
-            playItem_t *pmax = NULL; // played maximum
-            playItem_t *amax = NULL; // absolute maximum
-            for (playItem_t *i = plt->head[PL_MAIN]; i; i = i->next[PL_MAIN]) {
-                if (i != playlist_track && i->played && (!amax || i->shufflerating > amax->shufflerating)) {
-                    amax = i;
-                }
-                if (i == playlist_track || i->shufflerating > rating || !i->played) {
-                    continue;
-                }
-                if (!pmax || i->shufflerating > pmax->shufflerating) {
-                    pmax = i;
-                }
-            }
+            playItem_t *amax = NULL; // absolute maximum, if there's no pmax
+            playItem_t *pmax = plt_shuffle_prev (plt, playlist_track, &amax); // played maximum
 
             if (pmax && pl_order == PLAYBACK_ORDER_SHUFFLE_ALBUMS) {
                 while (pmax && pmax->next[PL_MAIN] && pmax->next[PL_MAIN]->played && pmax->shufflerating == pmax->next[PL_MAIN]->shufflerating) {
@@ -956,6 +1101,245 @@ static DB_fileinfo_t *dec_open (DB_decoder_t *dec, uint32_t hints, playItem_t *i
     return dec->open (hints);
 }
 
+// must be called with preload_mutex locked
+static void
+preload_slot_reset (void) {
+    if (preload_slot.state == PRELOAD_READY && preload_slot.fileinfo) {
+        preload_slot.fileinfo->plugin->free (preload_slot.fileinfo);
+    }
+    if (preload_slot.state != PRELOAD_BUSY) {
+        // if busy, the preloader thread will notice that the track
+        // was replaced, and free everything itself
+        if (preload_slot.data) {
+            free (preload_slot.data);
+        }
+    }
+    if (preload_slot.track) {
+        pl_item_unref (preload_slot.track);
+    }
+    memset (&preload_slot, 0, sizeof (preload_slot));
+}
+
+static void
+preload_track (playItem_t *it) {
+    DB_decoder_t *dec = NULL;
+    pl_lock ();
+    const char *decoder_id = pl_find_meta (it, ":DECODER");
+    if (decoder_id) {
+        dec = plug_get_decoder_for_id (decoder_id);
+    }
+    pl_unlock ();
+
+    DB_fileinfo_t *fi = NULL;
+    char *data = NULL;
+    int size = 0;
+    if (dec) {
+        fi = dec_open (dec, 0, it);
+    }
+    if (fi) {
+        mutex_lock (preload_mutex);
+        preload_file = fi->file;
+        mutex_unlock (preload_mutex);
+        if (dec->init (fi, DB_PLAYITEM (it)) != 0) {
+            trace ("preload: failed to init decoder %s\n", dec->plugin.id);
+            // nobody can fabort the file after this, so it can be freed
+            mutex_lock (preload_mutex);
+            preload_file = NULL;
+            mutex_unlock (preload_mutex);
+            dec->free (fi);
+            fi = NULL;
+        }
+    }
+    if (fi && fi->fmt.samplerate > 0 && fi->fmt.channels > 0 && fi->fmt.bps > 0) {
+        int samplesize = fi->fmt.channels * fi->fmt.bps / 8;
+        size = fi->fmt.samplerate / 1000 * PRELOAD_MS * samplesize;
+        data = malloc (size);
+        if (data) {
+            size = fi->plugin->read (fi, data, size);
+            if (size < 0) {
+                size = 0;
+            }
+        }
+        else {
+            size = 0;
+        }
+    }
+    mutex_lock (preload_mutex);
+    preload_file = NULL;
+    if (preload_slot.track == it && preload_slot.state == PRELOAD_BUSY) {
+        preload_slot.fileinfo = fi;
+        preload_slot.data = data;
+        preload_slot.size = size;
+        preload_slot.state = PRELOAD_READY;
+        fi = NULL;
+        data = NULL;
+    }
+    cond_broadcast (preload_cond);
+    mutex_unlock (preload_mutex);
+
+    // track was replaced while preloading
+    if (fi) {
+        fi->plugin->free (fi);
+    }
+    if (data) {
+        free (data);
+    }
+}
+
+static void
+preload_thread (void *ctx) {
+#ifdef __linux__
+    prctl (PR_SET_NAME, "deadbeef-preload", 0, 0, 0, 0);
+#endif
+    while (!preload_terminate) {
+        uint32_t id;
+        uintptr_t ctx;
+        uint32_t p1, p2;
+        if (handler_pop (preload_handler, &id, &ctx, &p1, &p2)) {
+            handler_wait_timeout (preload_handler, -1);
+            continue;
+        }
+        playItem_t *it = (playItem_t *)ctx;
+        if (!preload_terminate) {
+            trace ("preload: %s\n", pl_find_meta (it, ":URI"));
+            preload_track (it);
+        }
+        pl_item_unref (it);
+    }
+}
+
+// returns the track which will be played after the current one,
+// if it can be predicted without side effects; NULL otherwise
+static playItem_t *
+streamer_predict_next_track (void) {
+    if (stop_after_current || stop_after_album || nextsong != -1 || !playlist_track) {
+        return NULL;
+    }
+    playItem_t *next = NULL;
+    pl_lock ();
+    if (pl_playqueue_getcount ()) {
+        next = pl_playqueue_getnext ();
+    }
+    else if (pl_get_order () == PLAYBACK_ORDER_LINEAR && streamer_playlist) {
+        int pl_loop_mode = conf_get_int ("playback.loop", 0);
+        if (pl_loop_mode != PLAYBACK_MODE_LOOP_SINGLE) {
+            next = playlist_track->next[PL_MAIN];
+            if (!next && pl_loop_mode == PLAYBACK_MODE_LOOP_ALL) {
+                next = streamer_playlist->head[PL_MAIN];
+            }
+            if (next) {
+                pl_item_ref (next);
+            }
+        }
+    }
+    pl_unlock ();
+    if (next && is_remote_stream (next)) {
+        // don't keep network connections open in advance
+        pl_item_unref (next);
+        next = NULL;
+    }
+    return next;
+}
+
+static void
+streamer_preload_next (void) {
+    playItem_t *next = streamer_predict_next_track ();
+    if (!next) {
+        return;
+    }
+    mutex_lock (preload_mutex);
+    if (preload_slot.track == next) {
+        mutex_unlock (preload_mutex);
+        pl_item_unref (next);
+        return;
+    }
+    preload_slot_reset ();
+    preload_slot.track = next;
+    pl_item_ref (next);
+    preload_slot.state = PRELOAD_BUSY;
+    mutex_unlock (preload_mutex);
+    // the message holds the reference
+    if (handler_push (preload_handler, 0, (uintptr_t)next, 0, 0) < 0) {
+        mutex_lock (preload_mutex);
+        preload_slot_reset ();
+        mutex_unlock (preload_mutex);
+        pl_item_unref (next);
+    }
+}
+
+// returns preloaded fileinfo for the track, if any, and discards the
+// preloaded track otherwise.
+// waits up to PRELOAD_TAKE_TIMEOUT_MS if the track is still being opened by
+// preloader; after that, the preloader's file is aborted, and NULL is
+// returned, so that the caller opens the track itself
+static DB_fileinfo_t *
+streamer_preload_take (playItem_t *it, char **data, int *size) {
+    DB_fileinfo_t *fi = NULL;
+    mutex_lock (preload_mutex);
+    if (preload_slot.track == it && preload_slot.state == PRELOAD_BUSY) {
+        struct timeval tm1, tm2;
+        gettimeofday (&tm1, NULL);
+        for (;;) {
+            gettimeofday (&tm2, NULL);
+            int ms = (tm2.tv_sec*1000+tm2.tv_usec/1000) - (tm1.tv_sec*1000+tm1.tv_usec/1000);
+            if (ms >= PRELOAD_TAKE_TIMEOUT_MS) {
+                trace ("preload: timed out waiting for %s\n", pl_find_meta (it, ":URI"));
+                DB_FILE *file = preload_file;
+                if (file) {
+                    deadbeef->fabort (file);
+                }
+                break;
+            }
+            cond_timedwait (preload_cond, preload_mutex, PRELOAD_TAKE_TIMEOUT_MS - ms);
+            if (preload_slot.state != PRELOAD_BUSY) {
+                break;
+            }
+        }
+    }
+    if (preload_slot.track == it && preload_slot.state == PRELOAD_READY && preload_slot.fileinfo) {
+        fi = preload_slot.fileinfo;
+        *data = preload_slot.data;
+        *size = preload_slot.size;
+        preload_slot.fileinfo = NULL;
+        preload_slot.data = NULL;
+    }
+    preload_slot_reset ();
+    mutex_unlock (preload_mutex);
+    return fi;
+}
+
+// must be called with decodemutex locked
+static void
+streamer_free_predecoded (void) {
+    if (predecoded_data) {
+        free (predecoded_data);
+        predecoded_data = NULL;
+    }
+    predecoded_size = predecoded_pos = 0;
+}
+
+// must be called with decodemutex locked
+static int
+streamer_decoder_read (char *bytes, int size) {
+    int n = 0;
+    if (predecoded_data) {
+        n = min (size, predecoded_size - predecoded_pos);
+        memcpy (bytes, predecoded_data + predecoded_pos, n);
+        predecoded_pos += n;
+        if (predecoded_pos >= predecoded_size) {
+            streamer_free_predecoded ();
+        }
+        if (n == size) {
+            return n;
+        }
+    }
+    int rb = fileinfo->plugin->read (fileinfo, bytes + n, size - n);
+    if (rb > 0) {
+        n += rb;
+    }
+    return n;
+}
+
 // that must be called after last sample from str_playing_song was done reading
 static int
 streamer_set_current (playItem_t *it) {
@@ -963,6 +1347,8 @@ streamer_set_current (playItem_t *it) {
     DB_output_t *output = plug_get_output ();
     int err = 0;
     int do_songstarted = 0;
+    char *preloaded_data = NULL;
+    int preloaded_size = 0;
     playItem_t *from, *to;
     // need to add refs here, because streamer_start_playback can destroy items
     from = playing_track;
@@ -1007,6 +1393,21 @@ streamer_set_current (playItem_t *it) {
     if (from) {
         send_trackinfochanged (from);
     }
+
+    DB_fileinfo_t *preloaded = streamer_preload_take (it, &preloaded_data, &preloaded_size);
+    if (preloaded) {
+        trace ("using preloaded decoder for %s\n", pl_find_meta (it, ":URI"));
+        playlist_track = it;
+        mutex_lock (decodemutex);
+        new_fileinfo = preloaded;
+        new_fileinfo_file = new_fileinfo->file;
+        streaming_track = it;
+        pl_item_ref (streaming_track);
+        streamer_set_replaygain (streaming_track);
+        mutex_unlock (decodemutex);
+        goto success;
+    }
+
     char decoder_id[100] = "";
     char filetype[100] = "";
     pl_lock ();
@@ -1308,12 +1709,20 @@ success:
         fileinfo = NULL;
         fileinfo_file = NULL;
     }
+    streamer_free_predecoded ();
     if (new_fileinfo) {
         fileinfo = new_fileinfo;
         new_fileinfo = NULL;
         new_fileinfo_file = NULL;
+        predecoded_data = preloaded_data;
+        predecoded_size = preloaded_size;
+        preloaded_data = NULL;
     }
+    preload_requested = 0;
     mutex_unlock (decodemutex);
+    if (preloaded_data) {
+        free (preloaded_data);
+    }
     if (do_songstarted && playing_track) {
         trace ("songstarted %s\n", playing_track ? pl_find_meta (playing_track, ":URI") : "null");
         playtime = 0;
@@ -1467,7 +1876,7 @@ streamer_start_new_song (void) {
         if (nextsong == -1) {
             trace ("streamer_move_to_nextsong after skip\n");
             streamer_move_to_nextsong_real (1);
-            usleep (50000);
+            handler_wait_timeout (handler, 50);
         }
         else {
             trace ("nextsong changed from %d to %d by another thread, reinit\n", initsng, nextsong);
@@ -1529,7 +1938,9 @@ streamer_start_new_song (void) {
 static void
 streamer_next (int bytesread) {
     streamer_lock ();
-    bytes_until_next_song = streamer_ringbuf.remaining + bytesread;
+    prev_replaygain_scale = replaygain_get_scale ();
+    __sync_synchronize ();
+    bytes_until_next_song = ringbuf_get_remaining (&streamer_ringbuf) + bytesread;
     streamer_unlock ();
     if (stop_after_current) {
         streamer_buffering = 0;
@@ -1546,6 +1957,59 @@ streamer_next (int bytesread) {
     }
 }
 
+// must be called from the streamer thread
+static void
+streamer_resize_buffer (int size) {
+    char *buffer = malloc (size);
+    if (!buffer) {
+        fprintf (stderr, "streamer: failed to allocate %d bytes for stream buffer\n", size);
+        return;
+    }
+
+    streamer_lock ();
+    // streamer_read never blocks, it just returns 0 bytes until the swap is done
+    __atomic_store_n (&streamer_buffer_swapping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (&streamer_buffer_reading, __ATOMIC_SEQ_CST)) {
+        usleep (100);
+    }
+
+    if (ringbuf_resize (&streamer_ringbuf, buffer, size) < 0) {
+        trace ("streamer: buffered data doesn't fit into new buffer, dropped\n");
+        int dropped = (int)ringbuf_get_remaining (&streamer_ringbuf);
+        ringbuf_flush (&streamer_ringbuf);
+        ringbuf_resize (&streamer_ringbuf, buffer, size);
+        // the track boundary may have been in the dropped data;
+        // streamer_read is not running, so it can't change it meanwhile
+        int buns = bytes_until_next_song;
+        if (buns > 0) {
+            bytes_until_next_song = max (0, buns - dropped);
+            if (bytes_until_next_song == 0) {
+                handler_wakeup (handler);
+            }
+        }
+    }
+    free (streambuffer);
+    streambuffer = buffer;
+    streamer_buffer_size = size;
+
+    __atomic_store_n (&streamer_buffer_swapping, 0, __ATOMIC_SEQ_CST);
+    streamer_unlock ();
+}
+
+static void
+streamer_update_buffer_size (int bytes_in_one_second, int blocksize) {
+    // add space for the largest block which can come out of DSP chain,
+    // so that buffer_ms of data always fits
+    int64_t size = (int64_t)bytes_in_one_second * conf_buffer_ms / 1000 + blocksize * MAX_DSP_RATIO;
+    size &= ~3;
+    if (size != streamer_buffer_size) {
+        trace ("streamer: resizing buffer from %d to %d bytes\n", streamer_buffer_size, (int)size);
+        streamer_resize_buffer ((int)size);
+    }
+    streamer_prebuffer_size = (int64_t)bytes_in_one_second * conf_prebuffer_ms / 1000;
+    streamer_lowwater_size = (int64_t)bytes_in_one_second * conf_lowwater_ms / 1000;
+}
+
 void
 streamer_thread (void *ctx) {
 #ifdef __linux__
@@ -1630,7 +2094,8 @@ streamer_thread (void *ctx) {
             continue;
         }
         else if (output->state () == OUTPUT_STATE_STOPPED) {
-            usleep (50000);
+            // nothing to do until someone sends a command
+            handler_wait_timeout (handler, -1);
             continue;
         }
 
@@ -1697,11 +2162,14 @@ streamer_thread (void *ctx) {
                     pl_item_unref (streaming_track);
                     streaming_track = NULL;
                 }
+                streamer_free_predecoded ();
                 streaming_track = playing_track;
                 if (streaming_track) {
                     pl_item_ref (streaming_track);
                     streamer_set_replaygain (streaming_track);
                 }
+                // next track must be picked relative to the restarted one
+                playlist_track = playing_track;
                 mutex_unlock (decodemutex);
 
                 bytes_until_next_song = -1;
@@ -1743,7 +2211,7 @@ streamer_thread (void *ctx) {
                     trace ("failed to restart prev track on seek, trying to jump to next track\n");
                     trace ("streamer_move_to_nextsong from seek\n");
                     streamer_move_to_nextsong (0);
-                    usleep (50000);
+                    handler_wait_timeout (handler, 50);
                     continue;
                 }
             }
@@ -1762,6 +2230,9 @@ streamer_thread (void *ctx) {
                 }
                 streamer_lock ();
                 streamer_reset (1);
+                mutex_lock (decodemutex);
+                streamer_free_predecoded ();
+                mutex_unlock (decodemutex);
                 if (fileinfo->plugin->seek (fileinfo, pos) >= 0) {
                     playpos = fileinfo->readpos;
                 }
@@ -1783,7 +2254,7 @@ streamer_thread (void *ctx) {
         int rate = output->fmt.samplerate;
         if (!rate) {
             trace ("str: got 0 output samplerate\n");
-            usleep(20000);
+            handler_wait_timeout (handler, 20);
             continue;
         }
         int channels = output->fmt.channels;
@@ -1801,6 +2272,8 @@ streamer_thread (void *ctx) {
 
         int alloc_time = 1000 / (bytes_in_one_second / blocksize);
 
+        streamer_update_buffer_size (bytes_in_one_second, blocksize);
+
         int skip = 0;
         if (bytes_until_next_song >= 0) {
             // check if streaming format differs from output
@@ -1811,12 +2284,19 @@ streamer_thread (void *ctx) {
         }
         streamer_lock ();
 
-        if (!formatchanged && !skip && streamer_ringbuf.remaining < (STREAM_BUFFER_SIZE-blocksize * MAX_DSP_RATIO)) {
-            int sz = STREAM_BUFFER_SIZE - streamer_ringbuf.remaining;
+        int bytesread = 0;
+        int full = 0;
+        int remaining = ringbuf_get_remaining (&streamer_ringbuf);
+        int highwater = streamer_buffer_size - blocksize * MAX_DSP_RATIO;
+        if (remaining >= highwater) {
+            full = 1;
+        }
+        else if (!formatchanged && !skip) {
+            int sz = streamer_buffer_size - remaining;
             int minsize = blocksize;
 
             // speed up buffering when empty
-            if (streamer_ringbuf.remaining < MAX_BLOCK_SIZE) {
+            if (remaining < MAX_BLOCK_SIZE) {
                 minsize *= 4;
                 alloc_time *= 4;
             }
@@ -1831,7 +2311,6 @@ streamer_thread (void *ctx) {
             if (sz % samplesize) {
                 sz -= (sz % samplesize);
             }
-            int bytesread = 0;
             do {
                 int prev_buns = bytes_until_next_song;
                 int nb = streamer_read_async (readbuffer+bytesread,sz-bytesread);
@@ -1851,47 +2330,61 @@ streamer_thread (void *ctx) {
             } while (bytesread < sz-100);
             streamer_lock ();
 
+            // the ring buffer is lock-free for the reader,
+            // so this never blocks the output thread
             if (bytesread > 0) {
                 ringbuf_write (&streamer_ringbuf, readbuffer, bytesread);
             }
 
             if (trace_bufferfill >= 1) {
-                fprintf (stderr, "fill: %d, read: %d, size=%d, blocksize=%d\n", (int)streamer_ringbuf.remaining, (int)bytesread, (int)STREAM_BUFFER_SIZE, (int)blocksize);
+                fprintf (stderr, "fill: %d, read: %d, size=%d, blocksize=%d, dsp latency=%.1fms\n", (int)ringbuf_get_remaining (&streamer_ringbuf), (int)bytesread, streamer_buffer_size, (int)blocksize, dsp_pipe_latency * 1000);
             }
         }
         streamer_unlock ();
-        if ((streamer_ringbuf.remaining > 128000 && streamer_buffering) || !streaming_track) {
+        remaining = ringbuf_get_remaining (&streamer_ringbuf);
+        if ((streamer_buffering && (remaining >= streamer_prebuffer_size || full)) || !streaming_track) {
             streamer_buffering = 0;
             if (streaming_track) {
                 send_trackinfochanged (streaming_track);
             }
         }
-        struct timeval tm2;
-        gettimeofday (&tm2, NULL);
 
-        int ms = (tm2.tv_sec*1000+tm2.tv_usec/1000) - (tm1.tv_sec*1000+tm1.tv_usec/1000);
-        if (trace_bufferfill >= 2) {
-            fprintf (stderr, "slept %dms (alloc=%dms, bytespersec=%d, chan=%d, blocksize=%d), fill: %d/%d (cursor=%d)\n", (int)(alloc_time-ms), (int)alloc_time, (int)bytes_in_one_second, output->fmt.channels, blocksize, (int)streamer_ringbuf.remaining, STREAM_BUFFER_SIZE, (int)streamer_ringbuf.cursor);
+        // open the next track in background, so that the switch
+        // doesn't have to wait for slow decoder init
+        if (conf_preload_next && !preload_requested && fileinfo && streaming_track && nextsong == -1 && bytes_until_next_song < 0) {
+            float dur = pl_get_item_duration (streaming_track);
+            if (dur > 0 && dur - fileinfo->readpos < PRELOAD_AHEAD_SEC) {
+                preload_requested = 1;
+                streamer_preload_next ();
+            }
         }
 
-        // add 1ms here to compensate the rounding error
-        // and another 1ms to buffer slightly faster then playing
-        alloc_time -= ms+2;
-        if (streamer_buffering) {
-            alloc_time = 0;
-        }
-        else if (streamer_ringbuf.remaining < STREAM_BUFFER_SIZE / 2) {
-            alloc_time >>= 2; // speed-up loading a little
+        if (bytesread > 0 && !full) {
+            // keep decoding until the buffer reaches high watermark
+            continue;
         }
 
-        //printf ("sleep: %d, buffering: %d, buffer_starving: %d (%d/%d)\n", alloc_time, streamer_buffering, streamer_ringbuf.remaining < STREAM_BUFFER_SIZE / 2, streamer_ringbuf.remaining, STREAM_BUFFER_SIZE / 2);
-
-        if (alloc_time > 0) {
-            usleep (alloc_time * 1000);
+        // sleep until a command arrives, or output thread reports that
+        // the buffer drained to the low watermark, or that the current
+        // track finished playing.
+        // the timeout is only a safety net for missed wakeups, and is
+        // calculated as the time it takes to play the buffered data.
+        int wait_ms;
+        if (full) {
+            streamer_wait_lowwater = 1;
+            wait_ms = (int)((int64_t)(remaining - streamer_lowwater_size) * 1000 / bytes_in_one_second);
+        }
+        else {
+            wait_ms = (int)((int64_t)remaining * 1000 / bytes_in_one_second);
+        }
+        if (wait_ms < 20) {
+            wait_ms = 20;
         }
-        else if (bytes_until_next_song > 0) {
-            usleep (20000);
+        if (trace_bufferfill >= 2) {
+            fprintf (stderr, "waiting up to %dms (bytespersec=%d, chan=%d, blocksize=%d), fill: %d/%d (cursor=%d)\n", wait_ms, (int)bytes_in_one_second, output->fmt.channels, blocksize, remaining, streamer_buffer_size, (int)(streamer_ringbuf.rcursor % streamer_buffer_size));
         }
+        handler_wait_timeout (handler, wait_ms);
+        streamer_wait_lowwater = 0;
     }
 
     // stop streaming song
@@ -1901,6 +2394,7 @@ streamer_thread (void *ctx) {
         fileinfo = NULL;
         fileinfo_file = NULL;
     }
+    streamer_free_predecoded ();
     if (streaming_track) {
         pl_item_unref (streaming_track);
         streaming_track = NULL;
@@ -2155,6 +2649,400 @@ streamer_dsp_init (void) {
     }
 }
 
+static void
+streamer_read_buffer_config (void) {
+    int buffer_ms = conf_get_int ("streamer.buffer_ms", DEFAULT_BUFFER_MS);
+    if (buffer_ms < MIN_BUFFER_MS) {
+        buffer_ms = MIN_BUFFER_MS;
+    }
+    else if (buffer_ms > MAX_BUFFER_MS) {
+        buffer_ms = MAX_BUFFER_MS;
+    }
+    int prebuffer_ms = conf_get_int ("streamer.prebuffer_ms", DEFAULT_PREBUFFER_MS);
+    if (prebuffer_ms > buffer_ms) {
+        prebuffer_ms = buffer_ms;
+    }
+    int lowwater_ms = conf_get_int ("streamer.lowwater_ms", DEFAULT_LOWWATER_MS);
+    if (lowwater_ms > buffer_ms * 3 / 4) {
+        lowwater_ms = buffer_ms * 3 / 4;
+    }
+    conf_buffer_ms = buffer_ms;
+    conf_prebuffer_ms = prebuffer_ms;
+    conf_lowwater_ms = lowwater_ms;
+    conf_preload_next = conf_get_int ("streamer.preload_next", 1);
+    conf_dsp_pipeline = conf_get_int ("streamer.dsp_pipeline", 0);
+
+    int fft_size = conf_get_int ("vis.spectrum_fft_size", VIS_FFT_MIN_SIZE);
+    int size = VIS_FFT_MIN_SIZE;
+    while (size < fft_size && size < VIS_FFT_MAX_SIZE) {
+        size <<= 1;
+    }
+    conf_vis_fft_size = size;
+    conf_vis_fft_window = conf_get_int ("vis.spectrum_window", FFT_WINDOW_DEFAULT);
+}
+
+// called from streamer_read, so it never waits for vis_mutex. a wakeup
+// which finds the mutex busy is picked up on the next VIS_WAKEUP_POLL_MS
+static void
+vis_wakeup (void) {
+    if (__atomic_load_n (&vis_waiting, __ATOMIC_SEQ_CST) && !mutex_trylock (vis_mutex)) {
+        cond_signal (vis_cond);
+        mutex_unlock (vis_mutex);
+    }
+}
+
+// called from streamer_read only
+static void
+vis_ring_write (const ddb_waveformat_t *infmt, const char *bytes, int size) {
+    if (infmt->channels < 1 || infmt->channels > DDB_FREQ_MAX_CHANNELS) {
+        return;
+    }
+    unsigned w = vis_ring_wcursor;
+    if (infmt->channels != vis_ring_fmt.channels
+            || infmt->samplerate != vis_ring_fmt.samplerate
+            || infmt->channelmask != vis_ring_fmt.channelmask) {
+        __atomic_store_n (&vis_ring_fmt_seq, vis_ring_fmt_seq + 1, __ATOMIC_SEQ_CST);
+        vis_ring_fmt = (ddb_waveformat_t){
+            .bps = 32,
+            .channels = infmt->channels,
+            .samplerate = infmt->samplerate,
+            .channelmask = infmt->channelmask,
+            .is_float = 1,
+        };
+        vis_ring_fmt_start = w;
+        vis_ring_frames = 1;
+        while (vis_ring_frames * 2 * infmt->channels <= VIS_RING_SAMPLES) {
+            vis_ring_frames <<= 1;
+        }
+        __atomic_store_n (&vis_ring_fmt_seq, vis_ring_fmt_seq + 1, __ATOMIC_SEQ_CST);
+    }
+
+    int in_frame_size = (infmt->bps >> 3) * infmt->channels;
+    unsigned nframes = size / in_frame_size;
+    if (nframes > vis_ring_frames) {
+        bytes += (nframes - vis_ring_frames) * in_frame_size;
+        nframes = vis_ring_frames;
+    }
+    // readers check vis_ring_wbegin after copying, to find out if the frames
+    // they've got were overwritten meanwhile
+    __atomic_store_n (&vis_ring_wbegin, w + nframes, __ATOMIC_SEQ_CST);
+    unsigned pos = w & (vis_ring_frames - 1);
+    unsigned n = min (nframes, vis_ring_frames - pos);
+    pcm_convert (infmt, bytes, &vis_ring_fmt, (char *)(vis_ring + pos * infmt->channels), n * in_frame_size);
+    if (n < nframes) {
+        pcm_convert (infmt, bytes + n * in_frame_size, &vis_ring_fmt, (char *)vis_ring, (nframes - n) * in_frame_size);
+    }
+    // seq_cst, to be ordered with the vis_waiting check in vis_wakeup
+    __atomic_store_n (&vis_ring_wcursor, w + nframes, __ATOMIC_SEQ_CST);
+}
+
+static ddb_vis_tap_t *
+vis_tap_alloc (int mode, int decimate) {
+    if (mode < DDB_VIS_TAP_RAW || mode > DDB_VIS_TAP_RMS) {
+        return NULL;
+    }
+    ddb_vis_tap_t *tap = calloc (1, sizeof (ddb_vis_tap_t));
+    tap->mode = mode;
+    tap->decimate = mode == DDB_VIS_TAP_RAW ? 1 : max (decimate, 1);
+    tap->cursor = __atomic_load_n (&vis_ring_wcursor, __ATOMIC_ACQUIRE);
+    tap->fmt_seq = 1; // never a valid seq, so the format is read on first use
+    return tap;
+}
+
+ddb_vis_tap_t *
+vis_tap_open (int mode, int decimate) {
+    ddb_vis_tap_t *tap = vis_tap_alloc (mode, decimate);
+    if (tap) {
+        __atomic_add_fetch (&vis_ntaps, 1, __ATOMIC_SEQ_CST);
+    }
+    return tap;
+}
+
+void
+vis_tap_close (ddb_vis_tap_t *tap) {
+    __atomic_sub_fetch (&vis_ntaps, 1, __ATOMIC_SEQ_CST);
+    free (tap);
+}
+
+// converts n frames from tap->chunk, returns the number of frames written to out
+static int
+vis_tap_process (ddb_vis_tap_t *tap, float *out, int n) {
+    int ch = tap->fmt.channels;
+    const float *in = tap->chunk;
+    if (tap->mode == DDB_VIS_TAP_RAW) {
+        memcpy (out, in, n * ch * sizeof (float));
+        return n;
+    }
+
+    int produced = 0;
+    for (int i = 0; i < n; i++, in += ch) {
+        switch (tap->mode) {
+        case DDB_VIS_TAP_MONO:
+            if (tap->acc_count == 0) {
+                float sum = 0;
+                for (int c = 0; c < ch; c++) {
+                    sum += in[c];
+                }
+                tap->acc[0] = sum / ch;
+            }
+            break;
+        case DDB_VIS_TAP_PEAK:
+            for (int c = 0; c < ch; c++) {
+                tap->acc[c] = max (tap->acc[c], fabsf (in[c]));
+            }
+            break;
+        case DDB_VIS_TAP_RMS:
+            for (int c = 0; c < ch; c++) {
+                tap->acc[c] += in[c] * in[c];
+            }
+            break;
+        }
+        if (++tap->acc_count < tap->decimate) {
+            continue;
+        }
+        if (tap->mode == DDB_VIS_TAP_MONO) {
+            out[produced] = tap->acc[0];
+        }
+        else {
+            for (int c = 0; c < ch; c++) {
+                out[produced * ch + c] = tap->mode == DDB_VIS_TAP_RMS ? sqrtf (tap->acc[c] / tap->decimate) : tap->acc[c];
+                tap->acc[c] = 0;
+            }
+        }
+        tap->acc_count = 0;
+        produced++;
+    }
+    return produced;
+}
+
+static void
+vis_tap_skip (ddb_vis_tap_t *tap, unsigned cursor) {
+    tap->cursor = cursor;
+    tap->acc_count = 0;
+    memset (tap->acc, 0, sizeof (tap->acc));
+}
+
+int
+vis_tap_read (ddb_vis_tap_t *tap, float *data, int maxframes, ddb_waveformat_t *fmt) {
+    unsigned seq = __atomic_load_n (&vis_ring_fmt_seq, __ATOMIC_SEQ_CST);
+    if (seq & 1) {
+        return 0;
+    }
+    if (seq != tap->fmt_seq) {
+        ddb_waveformat_t ring_fmt = vis_ring_fmt;
+        unsigned start = vis_ring_fmt_start;
+        unsigned frames = vis_ring_frames;
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&vis_ring_fmt_seq, __ATOMIC_SEQ_CST) != seq) {
+            return 0;
+        }
+        tap->fmt = ring_fmt;
+        tap->frames = frames;
+        tap->fmt_seq = seq;
+        vis_tap_skip (tap, (int)(tap->cursor - start) < 0 ? start : tap->cursor);
+    }
+    int ch = tap->fmt.channels;
+    if (!ch) {
+        return 0;
+    }
+
+    int out = 0;
+    int out_ch = tap->mode == DDB_VIS_TAP_MONO ? 1 : ch;
+    while (out < maxframes) {
+        unsigned w = __atomic_load_n (&vis_ring_wcursor, __ATOMIC_ACQUIRE);
+        unsigned avail = w - tap->cursor;
+        if (!avail) {
+            break;
+        }
+        if (avail > tap->frames) {
+            // fell behind, continue from the middle of the ring, to have
+            // some time before the writer gets there
+            vis_tap_skip (tap, w - tap->frames / 2);
+            avail = tap->frames / 2;
+        }
+        unsigned need = (maxframes - out) * tap->decimate - tap->acc_count;
+        unsigned n = min (min (avail, need), VIS_TAP_CHUNK_FRAMES);
+        unsigned pos = tap->cursor & (tap->frames - 1);
+        unsigned n1 = min (n, tap->frames - pos);
+        memcpy (tap->chunk, vis_ring + pos * ch, n1 * ch * sizeof (float));
+        if (n1 < n) {
+            memcpy (tap->chunk + n1 * ch, vis_ring, (n - n1) * ch * sizeof (float));
+        }
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&vis_ring_fmt_seq, __ATOMIC_SEQ_CST) != seq) {
+            // the rest is in another format, will be read by the next call
+            break;
+        }
+        unsigned wbegin = __atomic_load_n (&vis_ring_wbegin, __ATOMIC_SEQ_CST);
+        if (wbegin - tap->cursor > tap->frames) {
+            // the writer has overwritten some of the copied frames
+            vis_tap_skip (tap, wbegin - tap->frames / 2);
+            continue;
+        }
+        tap->cursor += n;
+        out += vis_tap_process (tap, data + out * out_ch, n);
+    }
+
+    *fmt = tap->fmt;
+    if (tap->mode == DDB_VIS_TAP_MONO) {
+        fmt->channels = 1;
+        fmt->channelmask = DDB_SPEAKER_FRONT_LEFT;
+    }
+    fmt->samplerate /= tap->decimate;
+    return out;
+}
+
+static void
+vis_thread (void *ctx) {
+#ifdef __linux__
+    prctl (PR_SET_NAME, "deadbeef-vis", 0, 0, 0, 0);
+#endif
+    ddb_vis_tap_t *tap = vis_tap_alloc (DDB_VIS_TAP_RAW, 1);
+    fft_t *fft = NULL;
+    int fft_size = 0;
+    int fft_window = -1;
+    float *audio_data = NULL; // fft_size frames per channel
+    float *freq = NULL;
+    int audio_data_fill = 0;
+    ddb_waveformat_t fmt = {0};
+    float *samples = malloc (VIS_TAP_CHUNK_FRAMES * DDB_FREQ_MAX_CHANNELS * sizeof (float));
+
+    while (!vis_terminate) {
+        // the thread is not woken up while there are no listeners, don't
+        // deliver what was played back then
+        unsigned w = __atomic_load_n (&vis_ring_wcursor, __ATOMIC_ACQUIRE);
+        if (tap->fmt.samplerate > 0 && w - tap->cursor > (unsigned)tap->fmt.samplerate / 2) {
+            vis_tap_skip (tap, w);
+            audio_data_fill = 0;
+        }
+
+        ddb_waveformat_t hdr;
+        int nframes = vis_tap_read (tap, samples, VIS_TAP_CHUNK_FRAMES, &hdr);
+        if (!nframes) {
+            mutex_lock (vis_mutex);
+            __atomic_store_n (&vis_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n (&vis_ring_wcursor, __ATOMIC_SEQ_CST) == tap->cursor && !vis_terminate) {
+                cond_timedwait (vis_cond, vis_mutex, VIS_WAKEUP_POLL_MS);
+            }
+            __atomic_store_n (&vis_waiting, 0, __ATOMIC_SEQ_CST);
+            mutex_unlock (vis_mutex);
+            continue;
+        }
+
+        ddb_audio_data_t data;
+        data.fmt = &hdr;
+        data.data = samples;
+        data.nframes = nframes;
+        mutex_lock (wdl_mutex);
+        for (wavedata_listener_t *l = waveform_listeners; l; l = l->next) {
+            l->callback (l->ctx, &data);
+        }
+        mutex_unlock (wdl_mutex);
+
+        if (!spectrum_listeners) {
+            audio_data_fill = 0;
+            continue;
+        }
+
+        if (!fft || fft_size != conf_vis_fft_size || fft_window != conf_vis_fft_window) {
+            if (fft) {
+                fft_free (fft);
+            }
+            fft_size = conf_vis_fft_size;
+            fft_window = conf_vis_fft_window;
+            fft = fft_alloc (fft_size, fft_window);
+            free (audio_data);
+            audio_data = malloc (fft_size * DDB_FREQ_MAX_CHANNELS * sizeof (float));
+            free (freq);
+            freq = malloc (fft_size / 2 * sizeof (float));
+            audio_data_fill = 0;
+        }
+
+        if (hdr.channels != fmt.channels || hdr.samplerate != fmt.samplerate) {
+            audio_data_fill = 0;
+        }
+        fmt = hdr;
+
+        int remaining = nframes;
+        while (remaining > 0) {
+            int sz = min (fft_size - audio_data_fill, remaining);
+            const float *in = samples + (nframes - remaining) * hdr.channels;
+            for (int c = 0; c < hdr.channels; c++) {
+                float *out = &audio_data[fft_size * c + audio_data_fill];
+                for (int s = 0; s < sz; s++) {
+                    out[s] = in[s * hdr.channels + c];
+                }
+            }
+            audio_data_fill += sz;
+            remaining -= sz;
+            if (audio_data_fill < fft_size) {
+                break;
+            }
+            audio_data_fill = 0;
+
+            // listeners always get DDB_FREQ_BANDS bands, with larger ffts
+            // each band is the peak of the bins it covers
+            int group = fft_size / 2 / DDB_FREQ_BANDS;
+            for (int c = 0; c < hdr.channels; c++) {
+                fft_calc_freq (fft, &audio_data[fft_size * c], freq);
+                float *bands = &freq_data[DDB_FREQ_BANDS * c];
+                for (int b = 0; b < DDB_FREQ_BANDS; b++) {
+                    float peak = freq[b * group];
+                    for (int i = 1; i < group; i++) {
+                        peak = max (peak, freq[b * group + i]);
+                    }
+                    bands[b] = peak;
+                }
+            }
+
+            data.data = freq_data;
+            data.nframes = DDB_FREQ_BANDS;
+            mutex_lock (spectrum_mutex);
+            for (wavedata_listener_t *l = spectrum_listeners; l; l = l->next) {
+                l->callback (l->ctx, &data);
+            }
+            mutex_unlock (spectrum_mutex);
+        }
+    }
+
+    if (fft) {
+        fft_free (fft);
+    }
+    free (audio_data);
+    free (freq);
+    free (samples);
+    free (tap);
+}
+
+static void
+vis_init (void) {
+    spectrum_mutex = mutex_create ();
+    vis_mutex = mutex_create ();
+    vis_cond = cond_create ();
+    vis_ring = malloc (VIS_RING_SAMPLES * sizeof (float));
+    vis_terminate = 0;
+    vis_tid = thread_start (vis_thread, NULL);
+}
+
+static void
+vis_free (void) {
+    mutex_lock (vis_mutex);
+    vis_terminate = 1;
+    cond_signal (vis_cond);
+    mutex_unlock (vis_mutex);
+    thread_join (vis_tid);
+    vis_tid = 0;
+
+    cond_free (vis_cond);
+    vis_cond = 0;
+    mutex_free (vis_mutex);
+    vis_mutex = 0;
+    mutex_free (spectrum_mutex);
+    spectrum_mutex = 0;
+    free (vis_ring);
+    vis_ring = NULL;
+}
+
 int
 streamer_init (void) {
     streaming_terminate = 0;
@@ -2166,7 +3054,14 @@ streamer_init (void) {
     decodemutex = mutex_create ();
     wdl_mutex = mutex_create ();
 
-    ringbuf_init (&streamer_ringbuf, streambuffer, STREAM_BUFFER_SIZE);
+    streamer_buffer_size = STREAM_BUFFER_INITIAL_SIZE;
+    streambuffer = malloc (streamer_buffer_size);
+    if (!streambuffer) {
+        fprintf (stderr, "streamer: failed to allocate %d bytes for stream buffer\n", streamer_buffer_size);
+        return -1;
+    }
+    ringbuf_init (&streamer_ringbuf, streambuffer, streamer_buffer_size);
+    streamer_read_buffer_config ();
 
     pl_set_order (conf_get_int ("playback.order", 0));
 
@@ -2178,6 +3073,14 @@ streamer_init (void) {
     deadbeef->conf_get_str ("network.ctmapping", DDB_DEFAULT_CTMAPPING, conf_network_ctmapping, sizeof (conf_network_ctmapping));
     ctmap_init ();
 
+    preload_mutex = mutex_create ();
+    preload_cond = cond_create ();
+    preload_handler = handler_alloc (10);
+    preload_terminate = 0;
+    preload_tid = thread_start (preload_thread, NULL);
+
+    vis_init ();
+
     streamer_tid = thread_start (streamer_thread, NULL);
     return 0;
 }
@@ -2193,8 +3096,28 @@ streamer_free (void) {
     }
     streamer_abort_files ();
     streaming_terminate = 1;
+    handler_wakeup (handler);
     thread_join (streamer_tid);
 
+    preload_terminate = 1;
+    handler_wakeup (preload_handler);
+    thread_join (preload_tid);
+    uint32_t id;
+    uintptr_t ctx;
+    uint32_t p1, p2;
+    while (!handler_pop (preload_handler, &id, &ctx, &p1, &p2)) {
+        pl_item_unref ((playItem_t *)ctx);
+    }
+    handler_free (preload_handler);
+    preload_handler = NULL;
+    mutex_lock (preload_mutex);
+    preload_slot_reset ();
+    mutex_unlock (preload_mutex);
+    mutex_free (preload_mutex);
+    preload_mutex = 0;
+    cond_free (preload_cond);
+    preload_cond = 0;
+
     if (streaming_track) {
         pl_item_unref (streaming_track);
         streaming_track = NULL;
@@ -2218,9 +3141,28 @@ streamer_free (void) {
     decodemutex = 0;
     mutex_free (mutex);
     mutex = 0;
+    vis_free ();
     mutex_free (wdl_mutex);
     wdl_mutex = 0;
 
+    free (streambuffer);
+    streambuffer = NULL;
+
+    free (dsp_arena);
+    dsp_arena = NULL;
+    dsp_arena_size = 0;
+
+    streamer_dsp_pipe_stop ();
+    for (int i = 0; i <= DSP_PIPE_MAX_STAGES; i++) {
+        free (dsp_pipe_blocks[i].data);
+        dsp_pipe_blocks[i].data = NULL;
+        dsp_pipe_blocks[i].size = 0;
+    }
+    if (dsp_pipe_mutex) {
+        mutex_free (dsp_pipe_mutex);
+        dsp_pipe_mutex = 0;
+    }
+
     streamer_dsp_chain_save();
 
     streamer_dsp_chain_free (dsp_chain);
@@ -2243,10 +3185,16 @@ streamer_reset (int full) { // must be called when current song changes by exter
     }
     if (full) {
         streamer_lock ();
-        streamer_ringbuf.remaining = 0;
+        ringbuf_flush (&streamer_ringbuf);
+        applied_gain = -1;
         streamer_unlock ();
     }
 
+    // the blocks in the dsp pipeline belong to the old position, and the
+    // workers must be out of process() before the contexts are reset
+    mutex_lock (decodemutex);
+    streamer_dsp_pipe_stop ();
+
     // reset dsp
     ddb_dsp_context_t *dsp = dsp_chain;
     while (dsp) {
@@ -2255,6 +3203,7 @@ streamer_reset (int full) { // must be called when current song changes by exter
         }
         dsp = dsp->next;
     }
+    mutex_unlock (decodemutex);
 }
 
 static int
@@ -2262,7 +3211,7 @@ streamer_set_output_format (void) {
     DB_output_t *output = plug_get_output ();
     int playing = (output->state () == OUTPUT_STATE_PLAYING);
 
-    trace ("streamer_set_output_format %dbit %s %dch %dHz channelmask=%X, bufferfill: %d\n", output_format.bps, output_format.is_float ? "float" : "int", output_format.channels, output_format.samplerate, output_format.channelmask, streamer_ringbuf.remaining);
+    trace ("streamer_set_output_format %dbit %s %dch %dHz channelmask=%X, bufferfill: %d\n", output_format.bps, output_format.is_float ? "float" : "int", output_format.channels, output_format.samplerate, output_format.channelmask, (int)ringbuf_get_remaining (&streamer_ringbuf));
     ddb_waveformat_t fmt;
     memcpy (&fmt, &output_format, sizeof (ddb_waveformat_t));
     if (autoconv_8_to_16) {
@@ -2288,6 +3237,261 @@ streamer_set_output_format (void) {
     return 0;
 }
 
+static char *
+streamer_dsp_arena_reserve (size_t size) {
+    if (size > dsp_arena_size) {
+        free (dsp_arena);
+        dsp_arena = NULL;
+        dsp_arena_size = 0;
+        void *mem;
+        if (posix_memalign (&mem, 16, size)) {
+            fprintf (stderr, "streamer: failed to allocate %d bytes for dsp\n", (int)size);
+            return NULL;
+        }
+        dsp_arena = mem;
+        dsp_arena_size = size;
+    }
+    return dsp_arena;
+}
+
+static void
+dsp_queue_push (dsp_queue_t *q, dsp_block_t *b) {
+    unsigned head = q->head;
+    q->blocks[head & (DSP_PIPE_QUEUE_SIZE-1)] = b;
+    __atomic_store_n (&q->head, head+1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&q->waiting, __ATOMIC_SEQ_CST)) {
+        mutex_lock (dsp_pipe_mutex);
+        cond_signal (q->cond);
+        mutex_unlock (dsp_pipe_mutex);
+    }
+}
+
+// waits until there's a block in the queue, returns NULL when the pipeline is stopping
+static dsp_block_t *
+dsp_queue_pop (dsp_queue_t *q) {
+    for (;;) {
+        if (dsp_pipe_stopping) {
+            return NULL;
+        }
+        unsigned tail = q->tail;
+        if (__atomic_load_n (&q->head, __ATOMIC_ACQUIRE) != tail) {
+            dsp_block_t *b = q->blocks[tail & (DSP_PIPE_QUEUE_SIZE-1)];
+            __atomic_store_n (&q->tail, tail+1, __ATOMIC_RELEASE);
+            return b;
+        }
+        mutex_lock (dsp_pipe_mutex);
+        __atomic_store_n (&q->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&q->head, __ATOMIC_SEQ_CST) == tail && !dsp_pipe_stopping) {
+            cond_timedwait (q->cond, dsp_pipe_mutex, -1);
+        }
+        __atomic_store_n (&q->waiting, 0, __ATOMIC_SEQ_CST);
+        mutex_unlock (dsp_pipe_mutex);
+    }
+}
+
+static void
+dsp_pipe_worker (void *ctx) {
+#ifdef __linux__
+    prctl (PR_SET_NAME, "deadbeef-dsp", 0, 0, 0, 0);
+#endif
+    dsp_stage_t *stage = ctx;
+    dsp_block_t *b;
+    while ((b = dsp_queue_pop (stage->in))) {
+        if (b->nframes > 0) {
+            float r = 1;
+            b->nframes = stage->dsp->plugin->process (stage->dsp, (float *)b->data, b->nframes, b->maxframes, &b->fmt, &r);
+            b->ratio *= r;
+        }
+        dsp_queue_push (stage->out, b);
+    }
+}
+
+// returns 1 if the running pipeline has the same stages as the enabled part of dsp chain
+static int
+dsp_pipe_matches_chain (void) {
+    int n = 0;
+    for (ddb_dsp_context_t *dsp = dsp_chain; dsp; dsp = dsp->next) {
+        if (dsp->enabled) {
+            if (n >= dsp_pipe_nstages || dsp_pipe_stages[n].dsp != dsp) {
+                return 0;
+            }
+            n++;
+        }
+    }
+    return n == dsp_pipe_nstages;
+}
+
+// must be called with decodemutex locked; drops the blocks in flight
+static void
+streamer_dsp_pipe_stop (void) {
+    if (!dsp_pipe_nstages) {
+        return;
+    }
+    mutex_lock (dsp_pipe_mutex);
+    dsp_pipe_stopping = 1;
+    for (int i = 0; i <= dsp_pipe_nstages; i++) {
+        cond_signal (dsp_pipe_queues[i].cond);
+    }
+    mutex_unlock (dsp_pipe_mutex);
+    for (int i = 0; i < dsp_pipe_nstages; i++) {
+        thread_join (dsp_pipe_stages[i].tid);
+    }
+    for (int i = 0; i <= dsp_pipe_nstages; i++) {
+        cond_free (dsp_pipe_queues[i].cond);
+    }
+    dsp_pipe_stopping = 0;
+    dsp_pipe_nstages = 0;
+    dsp_pipe_inflight = 0;
+    dsp_pipe_draining = 0;
+    dsp_pipe_latency = 0;
+}
+
+// must be called with decodemutex locked
+static int
+streamer_dsp_pipe_start (void) {
+    int n = 0;
+    for (ddb_dsp_context_t *dsp = dsp_chain; dsp; dsp = dsp->next) {
+        if (dsp->enabled) {
+            if (n == DSP_PIPE_MAX_STAGES) {
+                return -1;
+            }
+            dsp_pipe_stages[n++].dsp = dsp;
+        }
+    }
+    if (!n) {
+        return -1;
+    }
+    if (!dsp_pipe_mutex) {
+        dsp_pipe_mutex = mutex_create_nonrecursive ();
+    }
+    memset (dsp_pipe_queues, 0, sizeof (dsp_pipe_queues));
+    for (int i = 0; i <= n; i++) {
+        dsp_pipe_queues[i].cond = cond_create ();
+    }
+    dsp_pipe_nfree = 0;
+    for (int i = 0; i <= n; i++) {
+        dsp_pipe_free[dsp_pipe_nfree++] = &dsp_pipe_blocks[i];
+    }
+    dsp_pipe_nstages = n;
+    for (int i = 0; i < n; i++) {
+        dsp_pipe_stages[i].in = &dsp_pipe_queues[i];
+        dsp_pipe_stages[i].out = &dsp_pipe_queues[i+1];
+        dsp_pipe_stages[i].tid = thread_start (dsp_pipe_worker, &dsp_pipe_stages[i]);
+    }
+    trace ("streamer: started dsp pipeline with %d stages\n", n);
+    return 0;
+}
+
+// decodes one block from fileinfo, and feeds it into the pipeline.
+// returns 1 if the decoder reached eof, or -1 if the buffers couldn't be
+// allocated, in which case nothing is decoded
+static int
+streamer_dsp_pipe_feed (int nframes) {
+    int inputsamplesize = fileinfo->fmt.channels * fileinfo->fmt.bps / 8;
+    int dspsamplesize = fileinfo->fmt.channels * sizeof (float);
+    int inputsize = nframes * inputsamplesize;
+    dsp_block_t *b = dsp_pipe_free[--dsp_pipe_nfree];
+
+    int need = nframes * dspsamplesize * MAX_DSP_RATIO;
+    if (b->size < need) {
+        void *mem;
+        free (b->data);
+        b->data = NULL;
+        b->size = 0;
+        if (!posix_memalign (&mem, 16, need)) {
+            b->data = mem;
+            b->size = need;
+        }
+    }
+    char *input = b->data ? streamer_dsp_arena_reserve (inputsize) : NULL;
+    if (!input) {
+        dsp_pipe_nfree++;
+        return -1;
+    }
+    int nb = streamer_decoder_read (input, inputsize);
+
+    memcpy (&b->srcfmt, &fileinfo->fmt, sizeof (ddb_waveformat_t));
+    memcpy (&b->fmt, &fileinfo->fmt, sizeof (ddb_waveformat_t));
+    b->fmt.bps = 32;
+    b->fmt.is_float = 1;
+    b->nframes = nb > 0 ? nb / inputsamplesize : 0;
+    b->maxframes = b->nframes * MAX_DSP_RATIO;
+    b->ratio = 1;
+    b->duration = fileinfo->fmt.samplerate > 0 ? (float)b->nframes / fileinfo->fmt.samplerate : 0;
+    b->eof = nb != inputsize;
+    if (b->nframes > 0) {
+        pcm_convert (&fileinfo->fmt, input, &b->fmt, b->data, b->nframes * inputsamplesize);
+    }
+
+    dsp_pipe_inflight++;
+    dsp_pipe_latency += b->duration;
+    dsp_queue_push (&dsp_pipe_queues[0], b);
+    return b->eof;
+}
+
+// pipelined counterpart of the dsp branch in streamer_read_async.
+// keeps nstages+1 blocks in flight, and returns the oldest one converted to
+// output format. when feed is 0, only drains the blocks which are in flight.
+static int
+streamer_dsp_pipe_read (char *bytes, int size, int feed, int *is_eof) {
+    DB_output_t *output = plug_get_output ();
+    if (feed && !dsp_pipe_draining) {
+        int nframes = size / (output->fmt.channels * output->fmt.bps / 8);
+        if (nframes > 0) {
+            do {
+                int res = streamer_dsp_pipe_feed (nframes);
+                if (res < 0) {
+                    // out of memory, retry on the next read
+                    break;
+                }
+                if (res) {
+                    dsp_pipe_draining = 1;
+                }
+            } while (!dsp_pipe_draining && dsp_pipe_inflight <= dsp_pipe_nstages);
+        }
+    }
+    if (!dsp_pipe_inflight) {
+        return 0;
+    }
+
+    dsp_block_t *b = dsp_queue_pop (&dsp_pipe_queues[dsp_pipe_nstages]);
+    dsp_pipe_inflight--;
+    dsp_pipe_latency -= b->duration;
+    if (dsp_pipe_inflight == 0) {
+        dsp_pipe_latency = 0;
+    }
+    dsp_pipe_free[dsp_pipe_nfree++] = b;
+    if (b->eof) {
+        dsp_pipe_draining = 0;
+        *is_eof = 1;
+    }
+    if (b->nframes <= 0) {
+        return 0;
+    }
+    dsp_ratio = b->ratio;
+
+    ddb_waveformat_t outfmt;
+    // preserve sampleformat, but take channels, samplerate
+    outfmt.bps = b->srcfmt.bps;
+    outfmt.is_float = b->srcfmt.is_float;
+    // channelmask from dsp chain
+    outfmt.channels = b->fmt.channels;
+    outfmt.samplerate = b->fmt.samplerate;
+    outfmt.channelmask = b->fmt.channelmask;
+    outfmt.is_bigendian = b->srcfmt.is_bigendian;
+    if (memcmp (&output_format, &outfmt, sizeof (ddb_waveformat_t)) && bytes_until_next_song <= 0) {
+        memcpy (&output_format, &outfmt, sizeof (ddb_waveformat_t));
+        streamer_set_output_format ();
+    }
+
+    return pcm_convert (&b->fmt, b->data, &output->fmt, bytes, b->nframes * b->fmt.channels * sizeof (float));
+}
+
+float
+streamer_get_dsp_latency (void) {
+    return dsp_pipe_latency;
+}
+
 // decodes data and converts to current output format
 // returns number of bytes been read
 static int
@@ -2333,9 +3537,30 @@ streamer_read_async (char *bytes, int size) {
             }
         }
 
-        if (!memcmp (&fileinfo->fmt, &output->fmt, sizeof (ddb_waveformat_t)) && (!dsp_on || can_bypass)) {
+        // blocks which are still in the dsp pipeline must come out before anything else
+        int pipelined = dsp_pipe_inflight > 0;
+        if (dsp_on && !can_bypass && conf_dsp_pipeline) {
+            if (dsp_pipe_nstages && !dsp_pipe_matches_chain () && !dsp_pipe_inflight) {
+                streamer_dsp_pipe_stop ();
+            }
+            if (!dsp_pipe_nstages) {
+                streamer_dsp_pipe_start ();
+            }
+            if (dsp_pipe_nstages) {
+                pipelined = 1;
+            }
+        }
+        else if (dsp_pipe_nstages && !dsp_pipe_inflight) {
+            streamer_dsp_pipe_stop ();
+        }
+
+        if (pipelined) {
+            int feed = dsp_on && !can_bypass && conf_dsp_pipeline && dsp_pipe_matches_chain ();
+            bytesread = streamer_dsp_pipe_read (bytes, size, feed, &is_eof);
+        }
+        else if (!memcmp (&fileinfo->fmt, &output->fmt, sizeof (ddb_waveformat_t)) && (!dsp_on || can_bypass)) {
             // pass through from input to output
-            bytesread = fileinfo->plugin->read (fileinfo, bytes, size);
+            bytesread = streamer_decoder_read (bytes, size);
 
             if (bytesread != size) {
                 is_eof = 1;
@@ -2346,28 +3571,33 @@ streamer_read_async (char *bytes, int size) {
             int dspsamplesize = fileinfo->fmt.channels * sizeof (float);
             int dsp_num_frames = size / (output->fmt.channels * output->fmt.bps / 8);
 
-            char outbuf[dsp_num_frames * dspsamplesize];
-
             int inputsize = dsp_num_frames * inputsamplesize;
-            char input[inputsize];
+            // input goes first, the *MAX_DSP_RATIO sized buffer for float data after it
+            size_t inputspace = (inputsize + 15) & ~15;
+            char *input = streamer_dsp_arena_reserve (inputspace + (size_t)dsp_num_frames * dspsamplesize * MAX_DSP_RATIO);
+            char *tempbuf = input + inputspace;
 
             // decode pcm
-            int nb = fileinfo->plugin->read (fileinfo, input, inputsize);
-            if (nb != inputsize) {
-                is_eof = 1;
+            if (!input) {
+                // out of memory: nothing is decoded, and the streamer retries
+                // on its next iteration, instead of skipping the rest of the track
+                inputsize = 0;
+            }
+            else {
+                int nb = streamer_decoder_read (input, inputsize);
+                if (nb != inputsize) {
+                    is_eof = 1;
+                }
+                inputsize = nb;
             }
-            inputsize = nb;
 
             if (inputsize > 0) {
-                // make *MAX_DSP_RATIO sized buffer for float data
-                char tempbuf[inputsize/inputsamplesize * dspsamplesize * MAX_DSP_RATIO];
-
                 // convert to float
                 int tempsize = pcm_convert (&fileinfo->fmt, input, &dspfmt, tempbuf, inputsize);
                 int nframes = inputsize / inputsamplesize;
                 ddb_dsp_context_t *dsp = dsp_chain;
                 float ratio = 1.f;
-                int maxframes = sizeof (tempbuf) / dspsamplesize;
+                int maxframes = nframes * MAX_DSP_RATIO;
                 while (dsp) {
                     if (dsp->enabled) {
                         float r = 1;
@@ -2414,7 +3644,7 @@ streamer_read_async (char *bytes, int size) {
             // convert from input fmt to output fmt
             int inputsize = size/outputsamplesize*inputsamplesize;
             char input[inputsize];
-            int nb = fileinfo->plugin->read (fileinfo, input, inputsize);
+            int nb = streamer_decoder_read (input, inputsize);
             if (nb != inputsize) {
                 bytesread = nb;
                 is_eof = 1;
@@ -2479,8 +3709,6 @@ streamer_read_async (char *bytes, int size) {
             fwrite (bytes, 1, bytesread, out);
         }
 #endif
-
-        replaygain_apply (&output->fmt, streaming_track, bytes, bytesread);
     }
     mutex_unlock (decodemutex);
     if (!is_eof) {
@@ -2488,7 +3716,7 @@ streamer_read_async (char *bytes, int size) {
     }
     else  {
         // that means EOF
-        // trace ("streamer: EOF! buns: %d, bytesread: %d, buffering: %d, bufferfill: %d\n", bytes_until_next_song, bytesread, streamer_buffering, streamer_ringbuf.remaining);
+        // trace ("streamer: EOF! buns: %d, bytesread: %d, buffering: %d, bufferfill: %d\n", bytes_until_next_song, bytesread, streamer_buffering, (int)ringbuf_get_remaining (&streamer_ringbuf));
 
         // EOF or error while buffering -- stop buffering
         if (bytesread <= 0 && bytes_until_next_song >= 0 && streamer_buffering) {
@@ -2504,6 +3732,47 @@ streamer_read_async (char *bytes, int size) {
     return bytesread;
 }
 
+// converts the block to float, applies the gain ramping from the previously
+// applied one, feeds the result to the vis ring, and converts it back.
+// the conversion back saturates, so the gain is never clamped in float.
+static void
+streamer_apply_gain (ddb_waveformat_t *fmt, char *bytes, int size, float gain, int vis) {
+    int framesize = (fmt->bps >> 3) * fmt->channels;
+    int nframes = framesize > 0 ? size / framesize : 0;
+    if (nframes <= 0 || fmt->channels > GAIN_BUFFER_SAMPLES) {
+        return;
+    }
+    float from = applied_gain < 0 ? gain : applied_gain;
+    applied_gain = gain;
+    if (gain == 1.f && from == 1.f) {
+        if (vis) {
+            vis_ring_write (fmt, bytes, size);
+        }
+        return;
+    }
+
+    ddb_waveformat_t floatfmt = *fmt;
+    floatfmt.bps = 32;
+    floatfmt.is_float = 1;
+    int inplace = fmt->bps == 32 && fmt->is_float;
+    int chunk = GAIN_BUFFER_SAMPLES / fmt->channels;
+    for (int i = 0; i < nframes; i += chunk) {
+        int n = min (chunk, nframes - i);
+        char *p = bytes + i * framesize;
+        float *samples = inplace ? (float *)p : gain_buffer;
+        if (!inplace) {
+            pcm_convert (fmt, p, &floatfmt, (char *)gain_buffer, n * framesize);
+        }
+        pcm_apply_gain (samples, n, fmt->channels, from + (gain - from) * i / nframes, from + (gain - from) * (i + n) / nframes);
+        if (vis) {
+            vis_ring_write (&floatfmt, (char *)samples, n * fmt->channels * sizeof (float));
+        }
+        if (!inplace) {
+            pcm_convert (&floatfmt, (char *)gain_buffer, fmt, p, n * fmt->channels * sizeof (float));
+        }
+    }
+}
+
 int
 streamer_read (char *bytes, int size) {
 #if 0
@@ -2517,21 +3786,52 @@ streamer_read (char *bytes, int size) {
     if (formatchanged && bytes_until_next_song <= 0) {
         streamer_set_output_format ();
         formatchanged = 0;
-    }
-    streamer_lock ();
-    int sz = min (size, streamer_ringbuf.remaining);
+        handler_wakeup (handler);
+    }
+    // this is called from the output thread, and must never block:
+    // streamer_ringbuf is a SPSC buffer, so no streamer_lock here
+    int sz = 0;
+    int prevbytes = 0; // bytes which belong to the track before the switch
+    float prev_scale = 1; // replaygain of the prevbytes
+    float scale = 1; // replaygain of the rest of the block
+    __atomic_store_n (&streamer_buffer_reading, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n (&streamer_buffer_swapping, __ATOMIC_SEQ_CST)) {
+        sz = ringbuf_read (&streamer_ringbuf, bytes, size);
+    }
+    __atomic_store_n (&streamer_buffer_reading, 0, __ATOMIC_SEQ_CST);
     if (sz) {
-        ringbuf_read (&streamer_ringbuf, bytes, sz);
         playpos += (float)sz/output->fmt.samplerate/((output->fmt.bps>>3)*output->fmt.channels) * dsp_ratio;
         playtime += (float)sz/output->fmt.samplerate/((output->fmt.bps>>3)*output->fmt.channels);
-        if (bytes_until_next_song > 0) {
-            bytes_until_next_song -= sz;
-            if (bytes_until_next_song < 0) {
-                bytes_until_next_song = 0;
+        // the replaygain scales are sampled together with the boundary:
+        // once it's consumed, the streamer may move on to the next tracks
+        // and change them, while this block still has to be processed
+        for (;;) {
+            int buns = __atomic_load_n (&bytes_until_next_song, __ATOMIC_ACQUIRE);
+            prev_scale = prev_replaygain_scale;
+            scale = replaygain_get_scale ();
+            if (buns <= 0) {
+                if (buns == __atomic_load_n (&bytes_until_next_song, __ATOMIC_ACQUIRE)) {
+                    break;
+                }
+                continue;
+            }
+            int newbuns = buns - sz;
+            if (newbuns < 0) {
+                newbuns = 0;
+            }
+            if (__sync_bool_compare_and_swap (&bytes_until_next_song, buns, newbuns)) {
+                prevbytes = buns - newbuns;
+                if (newbuns == 0) {
+                    // let the streamer switch to the next track
+                    handler_wakeup (handler);
+                }
+                break;
             }
         }
+        if (streamer_wait_lowwater && ringbuf_get_remaining (&streamer_ringbuf) < streamer_lowwater_size) {
+            handler_wakeup (handler);
+        }
     }
-    streamer_unlock ();
 
     // approximate bitrate
     if (last_bitrate != -1) {
@@ -2566,117 +3866,15 @@ streamer_read (char *bytes, int size) {
     printf ("streamer_read took %d ms\n", ms);
 #endif
 
-    if (waveform_listeners || spectrum_listeners) {
-        int in_frame_size = (output->fmt.bps >> 3) * output->fmt.channels;
-        int in_frames = sz / in_frame_size;
-        ddb_waveformat_t out_fmt = {
-            .bps = 32,
-            .channels = output->fmt.channels,
-            .samplerate = output->fmt.samplerate,
-            .channelmask = output->fmt.channelmask,
-            .is_float = 1,
-            .is_bigendian = 0
-        };
-
-        float temp_audio_data[in_frames * out_fmt.channels];
-        pcm_convert (&output->fmt, bytes, &out_fmt, (char *)temp_audio_data, sz);
-        ddb_audio_data_t data;
-        data.fmt = &out_fmt;
-        data.data = temp_audio_data;
-        data.nframes = in_frames;
-        mutex_lock (wdl_mutex);
-        for (wavedata_listener_t *l = waveform_listeners; l; l = l->next) {
-            l->callback (l->ctx, &data);
-        }
-        mutex_unlock (wdl_mutex);
-
-        if (out_fmt.channels != audio_data_channels || !spectrum_listeners) {
-            audio_data_fill = 0;
-            audio_data_channels = out_fmt.channels;
-        }
-
-        if (spectrum_listeners) {
-            int remaining = in_frames;
-            do {
-                int sz = DDB_FREQ_BANDS * 2 -audio_data_fill;
-                sz = min (sz, remaining);
-                for (int c = 0; c < audio_data_channels; c++) {
-                    for (int s = 0; s < sz; s++) {
-                        audio_data[DDB_FREQ_BANDS * 2 * c + audio_data_fill + s] = temp_audio_data[(in_frames-remaining + s) * audio_data_channels + c];
-                    }
-                }
-                //            memcpy (&audio_data[audio_data_fill], &temp_audio_data[in_frames-remaining], sz * sizeof (float));
-                audio_data_fill += sz;
-                remaining -= sz;
-                if (audio_data_fill == DDB_FREQ_BANDS * 2) {
-                    for (int c = 0; c < audio_data_channels; c++) {
-                        calc_freq (&audio_data[DDB_FREQ_BANDS * 2 * c], &freq_data[DDB_FREQ_BANDS * c]);
-                    }
-                    ddb_audio_data_t data;
-                    data.fmt = &out_fmt;
-                    data.data = freq_data;
-                    data.nframes = DDB_FREQ_BANDS;
-                    mutex_lock (wdl_mutex);
-                    for (wavedata_listener_t *l = spectrum_listeners; l; l = l->next) {
-                        l->callback (l->ctx, &data);
-                    }
-                    mutex_unlock (wdl_mutex);
-                    audio_data_fill = 0;
-                }
-            } while (remaining > 0);
-        }
+    // software volume and replaygain, in one pass; vis gets the result
+    int vis = waveform_listeners || spectrum_listeners || vis_ntaps;
+    float volume = output->has_volume ? 1.f : volume_get_amp () * (1-audio_is_mute ());
+    if (prevbytes > 0) {
+        streamer_apply_gain (&output->fmt, bytes, prevbytes, volume * prev_scale, vis);
     }
-
-    if (!output->has_volume) {
-        int mult = 1-audio_is_mute ();
-        char *stream = bytes;
-        int bytesread = sz;
-        if (output->fmt.bps == 16) {
-            mult *= 1000;
-            int16_t ivolume = volume_get_amp () * mult;
-            for (int i = 0; i < bytesread/2; i++) {
-                int16_t sample = *((int16_t*)stream);
-                *((int16_t*)stream) = (int16_t)(((int32_t)sample) * ivolume / 1000);
-                stream += 2;
-            }
-        }
-        else if (output->fmt.bps == 8) {
-            mult *= 255;
-            int16_t ivolume = volume_get_amp () * mult;
-            for (int i = 0; i < bytesread; i++) {
-                *stream = (int8_t)(((int32_t)(*stream)) * ivolume / 1000);
-                stream++;
-            }
-        }
-        else if (output->fmt.bps == 24) {
-            mult *= 1000;
-            int16_t ivolume = volume_get_amp () * mult;
-            for (int i = 0; i < bytesread/3; i++) {
-                int32_t sample = ((unsigned char)stream[0]) | ((unsigned char)stream[1]<<8) | (stream[2]<<16);
-                int32_t newsample = (int64_t)sample * ivolume / 1000;
-                stream[0] = (newsample&0x0000ff);
-                stream[1] = (newsample&0x00ff00)>>8;
-                stream[2] = (newsample&0xff0000)>>16;
-                stream += 3;
-            }
-        }
-        else if (output->fmt.bps == 32 && !output->fmt.is_float) {
-            mult *= 1000;
-            int16_t ivolume = volume_get_amp () * mult;
-            for (int i = 0; i < bytesread/4; i++) {
-                int32_t sample = *((int32_t*)stream);
-                int32_t newsample = (int64_t)sample * ivolume / 1000;
-                *((int32_t*)stream) = newsample;
-                stream += 4;
-            }
-        }
-        else if (output->fmt.bps == 32 && output->fmt.is_float) {
-            float fvolume = volume_get_amp () * (1-audio_is_mute ());
-            for (int i = 0; i < bytesread/4; i++) {
-                *((float*)stream) = (*((float*)stream)) * fvolume;
-                stream += 4;
-            }
-        }
+    streamer_apply_gain (&output->fmt, bytes + prevbytes, sz - prevbytes, volume * scale, vis);
+    if (waveform_listeners || spectrum_listeners) {
+        vis_wakeup ();
     }
 
     return sz;
@@ -2684,7 +3882,7 @@ streamer_read (char *bytes, int size) {
 
 static int
 streamer_get_fill (void) {
-    return streamer_ringbuf.remaining;
+    return ringbuf_get_remaining (&streamer_ringbuf);
 }
 
 int
@@ -2693,8 +3891,9 @@ streamer_ok_to_read (int len) {
     if (formatchanged && bytes_until_next_song <= 0) {
         streamer_set_output_format ();
         formatchanged = 0;
+        handler_wakeup (handler);
     }
-    if (len >= 0 && (bytes_until_next_song > 0 || streamer_ringbuf.remaining >= (len*2))) {
+    if (len >= 0 && (bytes_until_next_song > 0 || ringbuf_get_remaining (&streamer_ringbuf) >= (len*2))) {
         return 1;
     }
     else {
@@ -2725,6 +3924,8 @@ streamer_configchanged (void) {
 
     trace_bufferfill = conf_get_int ("streamer.trace_buffer_fill",0);
 
+    streamer_read_buffer_config ();
+
     stop_after_current = conf_get_int ("playlist.stop_after_current", 0);
     stop_after_album = conf_get_int ("playlist.stop_after_album", 0);
 
@@ -2855,6 +4056,7 @@ dsp_clone (ddb_dsp_context_t *from) {
 void
 streamer_set_dsp_chain (ddb_dsp_context_t *chain) {
     mutex_lock (decodemutex);
+    streamer_dsp_pipe_stop ();
     streamer_dsp_chain_free (dsp_chain);
 
     dsp_chain = NULL;
@@ -2955,19 +4157,19 @@ vis_waveform_unlisten (void *ctx) {
 
 void
 vis_spectrum_listen (void *ctx, void (*callback)(void *ctx, ddb_audio_data_t *data)) {
-    mutex_lock (wdl_mutex);
+    mutex_lock (spectrum_mutex);
     wavedata_listener_t *l = malloc (sizeof (wavedata_listener_t));
     memset (l, 0, sizeof (wavedata_listener_t));
     l->ctx = ctx;
     l->callback = callback;
     l->next = spectrum_listeners;
     spectrum_listeners = l;
-    mutex_unlock (wdl_mutex);
+    mutex_unlock (spectrum_mutex);
 }
 
 void
 vis_spectrum_unlisten (void *ctx) {
-    mutex_lock (wdl_mutex);
+    mutex_lock (spectrum_mutex);
     wavedata_listener_t *l, *prev = NULL;
     for (l = spectrum_listeners; l; prev = l, l = l->next) {
         if (l->ctx == ctx) {
@@ -2981,7 +4183,7 @@ vis_spectrum_unlisten (void *ctx) {
             break;
         }
     }
-    mutex_unlock (wdl_mutex);
+    mutex_unlock (spectrum_mutex);
 }
 
 void
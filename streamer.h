@@ -142,6 +142,11 @@ streamer_dsp_refresh (void);
 void
 streamer_get_output_format (ddb_waveformat_t *fmt);
 
+// seconds of audio held in the pipelined dsp chain ("streamer.dsp_pipeline"),
+// on top of the stream buffer
+float
+streamer_get_dsp_latency (void);
+
 int
 streamer_dsp_chain_save (void);
 
@@ -169,4 +174,13 @@ vis_spectrum_listen (void *ctx, void (*callback)(void *ctx, ddb_audio_data_t *da
 void
 vis_spectrum_unlisten (void *ctx);
 
+ddb_vis_tap_t *
+vis_tap_open (int mode, int decimate);
+
+void
+vis_tap_close (ddb_vis_tap_t *tap);
+
+int
+vis_tap_read (ddb_vis_tap_t *tap, float *data, int maxframes, ddb_waveformat_t *fmt);
+
 #endif // __STREAMER_H
@@ -59,6 +59,10 @@ mutex_lock (uintptr_t mtx);
 int
 mutex_unlock (uintptr_t mtx);
 
+// returns 0 if the mutex was locked, EBUSY if it's held by another thread
+int
+mutex_trylock (uintptr_t mtx);
+
 uintptr_t
 cond_create (void);
 
@@ -68,6 +72,12 @@ cond_free (uintptr_t cond);
 int
 cond_wait (uintptr_t cond, uintptr_t mutex);
 
+// unlike cond_wait, expects the mutex to be locked by the caller,
+// and returns with the mutex still locked.
+// timeout_ms < 0 means wait forever; returns ETIMEDOUT on timeout
+int
+cond_timedwait (uintptr_t cond, uintptr_t mutex, int timeout_ms);
+
 int
 cond_signal (uintptr_t cond);
 
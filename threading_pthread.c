@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/time.h>
 #include "threading.h"
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -186,6 +187,16 @@ mutex_unlock (uintptr_t _mtx) {
     return err;
 }
 
+int
+mutex_trylock (uintptr_t _mtx) {
+    pthread_mutex_t *mtx = (pthread_mutex_t *)_mtx;
+    int err = pthread_mutex_trylock (mtx);
+    if (err != 0 && err != EBUSY) {
+        fprintf (stderr, "pthread_mutex_trylock failed: %s\n", strerror (err));
+    }
+    return err;
+}
+
 uintptr_t
 cond_create (void) {
     pthread_cond_t *cond = malloc (sizeof (pthread_cond_t));
@@ -221,6 +232,29 @@ cond_wait (uintptr_t c, uintptr_t m) {
     return err;
 }
 
+int
+cond_timedwait (uintptr_t c, uintptr_t m, int timeout_ms) {
+    pthread_cond_t *cond = (pthread_cond_t *)c;
+    pthread_mutex_t *mutex = (pthread_mutex_t *)m;
+    int err;
+    if (timeout_ms < 0) {
+        err = pthread_cond_wait (cond, mutex);
+    }
+    else {
+        struct timeval tv;
+        gettimeofday (&tv, NULL);
+        struct timespec ts;
+        int64_t nsec = (int64_t)tv.tv_usec * 1000 + (int64_t)(timeout_ms % 1000) * 1000000;
+        ts.tv_sec = tv.tv_sec + timeout_ms / 1000 + nsec / 1000000000;
+        ts.tv_nsec = nsec % 1000000000;
+        err = pthread_cond_timedwait (cond, mutex, &ts);
+    }
+    if (err != 0 && err != ETIMEDOUT) {
+        fprintf (stderr, "pthread_cond_timedwait failed: %s\n", strerror (err));
+    }
+    return err;
+}
+
 int
 cond_signal (uintptr_t c) {
     pthread_cond_t *cond = (pthread_cond_t *)c;